@@ -0,0 +1,150 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+// Castor Only
+#include <syscall.h>
+
+#define MAX_CTRLS	8
+#define MAX_DISKS	32
+
+static const char *opNames[DISKSTAT_OP_MAX] = { "read", "write", "flush" };
+
+static DiskStats stats;
+
+static void
+Usage()
+{
+    fputs("Usage: iostat [-h] [-t]\n", stdout);
+    fputs("    -h    Show latency histograms\n", stdout);
+    fputs("    -t    Show recent requests (sysctl disk_trace 1)\n", stdout);
+}
+
+static uint64_t
+AvgLatency(DiskOpStats *os)
+{
+    if (os->ops == 0)
+	return 0;
+
+    return os->latencyTotal / os->ops / 1000;
+}
+
+static void
+PrintSummary(DiskStats *ds)
+{
+    printf("disk%lld.%lld %8lld %8lld %8lld %8lld %8lld %6lld %8lld %8lld\n",
+	   ds->ctrlNo, ds->diskNo,
+	   ds->op[DISKSTAT_OP_READ].ops,
+	   ds->op[DISKSTAT_OP_READ].bytes / 1024,
+	   ds->op[DISKSTAT_OP_WRITE].ops,
+	   ds->op[DISKSTAT_OP_WRITE].bytes / 1024,
+	   ds->op[DISKSTAT_OP_FLUSH].ops,
+	   ds->merges,
+	   AvgLatency(&ds->op[DISKSTAT_OP_READ]),
+	   AvgLatency(&ds->op[DISKSTAT_OP_WRITE]));
+    printf("    queued %lld, inflight %lld (max %lld), dispatches %lld, "
+	   "expired %lld, errors %lld\n",
+	   ds->queued, ds->inflight, ds->maxInflight, ds->dispatches,
+	   ds->expired,
+	   ds->op[DISKSTAT_OP_READ].errors + ds->op[DISKSTAT_OP_WRITE].errors +
+	   ds->op[DISKSTAT_OP_FLUSH].errors);
+}
+
+static void
+PrintHistograms(DiskStats *ds)
+{
+    int op, b, last;
+
+    for (op = 0; op < DISKSTAT_OP_MAX; op++) {
+	DiskOpStats *os = &ds->op[op];
+
+	if (os->ops == 0)
+	    continue;
+
+	printf("    %s latency (max %lldus):\n", opNames[op],
+	       os->latencyMax / 1000);
+
+	last = 0;
+	for (b = 0; b < DISKSTAT_HIST_BUCKETS; b++) {
+	    if (os->hist[b] != 0)
+		last = b;
+	}
+
+	for (b = 0; b <= last; b++) {
+	    if (b == 0)
+		printf("    %10s %8lld\n", "<1us", os->hist[b]);
+	    else
+		printf("    <%8lldus %8lld\n", 1ULL << b, os->hist[b]);
+	}
+    }
+}
+
+static void
+PrintTrace(DiskStats *ds)
+{
+    uint64_t i, first;
+
+    if (ds->traceNext == 0)
+	return;
+
+    first = 0;
+    if (ds->traceNext > DISKSTAT_TRACE_ENTRIES)
+	first = ds->traceNext - DISKSTAT_TRACE_ENTRIES;
+
+    printf("    %16s %-5s %12s %8s %8s %6s %16s\n",
+	   "time (ns)", "op", "offset", "length", "us", "status", "caller");
+    for (i = first; i < ds->traceNext; i++) {
+	DiskTraceEntry *te = &ds->trace[i % DISKSTAT_TRACE_ENTRIES];
+
+	printf("    %16lld %-5s %12lld %8d %8lld %6d %16llx\n",
+	       te->time, opNames[te->op], te->offset, te->length,
+	       te->latency / 1000, te->status, te->caller);
+    }
+}
+
+int
+main(int argc, const char *argv[])
+{
+    int i, ctrlNo, diskNo;
+    int histograms = 0;
+    int trace = 0;
+    uint64_t status;
+
+    for (i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "-h") == 0) {
+	    histograms = 1;
+	} else if (strcmp(argv[i], "-t") == 0) {
+	    trace = 1;
+	} else {
+	    Usage();
+	    return 1;
+	}
+    }
+
+    printf("disk      %8s %8s %8s %8s %8s %6s %8s %8s\n",
+	   "reads", "read KB", "writes", "write KB", "flushes", "merges",
+	   "rd us", "wr us");
+
+    for (ctrlNo = 0; ctrlNo < MAX_CTRLS; ctrlNo++) {
+	for (diskNo = 0; diskNo < MAX_DISKS; diskNo++) {
+	    status = OSDiskStat(ctrlNo, diskNo, &stats);
+	    if (status == ENOENT)
+		continue;
+	    if (status != 0) {
+		printf("iostat: Cannot read disk%d.%d\n", ctrlNo, diskNo);
+		return 1;
+	    }
+
+	    PrintSummary(&stats);
+	    if (histograms)
+		PrintHistograms(&stats);
+	    if (trace)
+		PrintTrace(&stats);
+	}
+    }
+
+    return 0;
+}
+
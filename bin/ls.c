@@ -9,28 +9,55 @@
 #include <sys/syscall.h>
 #include <sys/dirent.h>
 
+// Directory entries read per call
+#define LS_BATCH	16
+
+static struct dirent entries[LS_BATCH];
+
+static char
+TypeChar(uint8_t type)
+{
+    switch (type) {
+	case DT_REG:
+	    return '-';
+	case DT_DIR:
+	    return 'd';
+	case DT_LNK:
+	    return 'l';
+	case DT_FIFO:
+	    return 'p';
+	default:
+	    return '?';
+    }
+}
+
 int
 main(int argc, const char *argv[])
 {
-    int fd;
+    int fd, i;
     int status;
+    int longFormat = 0;
     uintptr_t offset = 0;
+    const char *path;
 
-    if (argc != 2) {
-	fputs("Requires an argument\n", stdout);
+    if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+	longFormat = 1;
+	path = argv[2];
+    } else if (argc == 2) {
+	path = argv[1];
+    } else {
+	fputs("Usage: ls [-l] directory\n", stdout);
 	return 1;
     }
 
-    fd = OSOpen(argv[1], 0);
+    fd = OSOpen(path, 0);
     if (fd < 0) {
 	fputs("Cannot open directory\n", stdout);
 	return 1;
     }
 
     while (1) {
-	struct dirent de;
-
-	status = OSReadDir(fd, (char *)&de, sizeof(de), &offset);
+	status = OSReadDir(fd, (char *)entries, sizeof(entries), &offset);
 	if (status == 0) {
 	    break;
 	}
@@ -39,7 +66,15 @@ main(int argc, const char *argv[])
 	    return 1;
 	}
 
-	printf("%s\n", de.d_name);
+	for (i = 0; i < status; i++) {
+	    struct dirent *de = &entries[i];
+
+	    if (longFormat)
+		printf("%c %10lld %10lld %s\n", TypeChar(de->d_type),
+		       de->d_ino, de->d_size, de->d_name);
+	    else
+		printf("%s\n", de->d_name);
+	}
     }
 
     return 0;
@@ -3,6 +3,7 @@
 #define __SYSCALL_H__
 
 #include <sys/stat.h>
+#include <sys/diskstat.h>
 #include <sys/nic.h>
 #include <sys/mbuf.h>
 #include <sys/mount.h>
@@ -46,6 +47,7 @@ int OSSysCtl(const char *node, void *oldval, void *newval);
 int OSFSMount(const char *mntpt, const char *device, uint64_t flags);
 int OSFSUnmount(const char *mntpt);
 int OSFSInfo(struct statfs *info, uint64_t max);
+int OSDiskStat(uint64_t ctrlNo, uint64_t diskNo, DiskStats *stats);
 
 #endif /* __SYSCALL_H__ */
 
@@ -175,3 +175,9 @@ OSFSInfo(struct statfs *info, uint64_t max)
     return syscall(SYSCALL_FSINFO, info, max);
 }
 
+
+int
+OSDiskStat(uint64_t ctrlNo, uint64_t diskNo, DiskStats *stats)
+{
+    return syscall(SYSCALL_DISKSTAT, ctrlNo, diskNo, stats);
+}
@@ -25,13 +25,21 @@ char zerobuf[MAXBLOCKSIZE];
 
 bool verbose = false;
 bool hasManifest = false;
+bool inlineData = true;
+bool checksums = false;
+const char *corruptName = NULL;
 uint64_t diskSize = 0;
 uint64_t diskOffset = 0;
 uint64_t blockSize = 16*1024;
 uint64_t bitmapSize;
+int64_t journalSize = -1;
+uint64_t journalOffset;
 int diskfd;
 struct stat diskstat;
 
+/* Checksums of the blocks of each extent of the BNode being built */
+uint8_t *extentSums;
+
 #define TOKEN_EOF   0
 #define TOKEN_DIR   1
 #define TOKEN_END   2
@@ -146,14 +154,143 @@ AppendEmpty(void)
     return AppendBlock(NULL, 0);
 }
 
-ObjID *AddFile(const char *file)
+/*
+ * Hash a block as it is written, padded with zeros to the block size.
+ */
+void
+HashBlock(const void *buf, size_t len, uint8_t *hash)
+{
+    O2FSHashState st;
+    uint8_t last[O2FS_HASH_SIZE];
+    size_t full = len - len % O2FS_HASH_SIZE;
+
+    O2FSHashInit(&st);
+    O2FSHashUpdate(&st, buf, full);
+    if (full != len) {
+        memset(last, 0, sizeof(last));
+        memcpy(last, (const char *)buf + full, len - full);
+        O2FSHashUpdate(&st, last, sizeof(last));
+        full += sizeof(last);
+    }
+    O2FSHashUpdate(&st, zerobuf, blockSize - full);
+    O2FSHashFinal(&st, hash);
+}
+
+/*
+ * Append a data block to a BNode's extents, extending the last extent when 
+ * the block follows it on disk.  With checksums extents are limited to the 
+ * blocks one checksum block covers.
+ */
+void
+AddExtent(BNode *node, const void *buf, size_t len)
+{
+    uint64_t offset = AppendBlock(buf, len);
+    uint64_t maxLen = checksums ? O2FS_HASH_PER_BLOCK(blockSize) : UINT64_MAX;
+    BExtent *ext = NULL;
+    int i;
+
+    for (i = 0; i < O2FS_EXTENT_MAX && node->extents[i].length != 0; i++)
+        ;
+
+    if (i > 0) {
+        BExtent *last = &node->extents[i - 1];
+
+        if (last->offset + last->length * blockSize == offset &&
+            last->length < maxLen) {
+            ext = last;
+            i--;
+        }
+    }
+
+    if (ext == NULL) {
+        if (i == O2FS_EXTENT_MAX) {
+            fprintf(stderr, "Too many extents\n");
+            exit(EXIT_FAILURE);
+        }
+
+        ext = &node->extents[i];
+        ext->device = 0;
+        ext->offset = offset;
+        ext->length = 0;
+        ext->sums = 0;
+    }
+
+    if (checksums)
+        HashBlock(buf, len, extentSums + i * blockSize +
+                  ext->length * O2FS_HASH_SIZE);
+    ext->length++;
+}
+
+/*
+ * Append the checksum block of each of a BNode's extents.
+ */
+void
+FinishExtents(BNode *node)
+{
+    if (!checksums)
+        return;
+
+    for (int i = 0; i < O2FS_EXTENT_MAX && node->extents[i].length != 0; i++) {
+        node->extents[i].sums = AppendBlock(extentSums + i * blockSize,
+                                            blockSize);
+        memset(extentSums + i * blockSize, 0, blockSize);
+    }
+}
+
+/*
+ * Append a BNode block and set the ObjID that refers to it.
+ */
+void
+AppendBNode(ObjID *obj, const void *buf, size_t len)
+{
+    memset(obj, 0, sizeof(*obj));
+    if (checksums)
+        HashBlock(buf, len, obj->hash);
+    obj->device = 0;
+    obj->offset = AppendBlock(buf, len);
+}
+
+/*
+ * Write a BNode with its data inline in the same block.
+ */
+void
+AppendInline(ObjID *obj, BNode *node, const void *data, size_t len)
+{
+    assert(len <= O2FS_INLINE_MAX(blockSize));
+
+    node->flags = BNODE_FLAG_INLINE;
+    node->size = len;
+    memmove(tempbuf + sizeof(*node), data, len);
+    memcpy(tempbuf, node, sizeof(*node));
+
+    AppendBNode(obj, tempbuf, sizeof(*node) + len);
+}
+
+/*
+ * Flip a byte of a file's first data block after its checksum is computed, 
+ * so that tests can check that reading it fails.
+ */
+void
+CorruptFile(BNode *node)
+{
+    uint8_t b;
+
+    if (node->extents[0].length == 0) {
+        fprintf(stderr, "Cannot corrupt a file without data blocks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pread(diskfd, &b, 1, node->extents[0].offset);
+    b ^= 0xFF;
+    pwrite(diskfd, &b, 1, node->extents[0].offset);
+}
+
+ObjID *AddFile(const char *file, bool corrupt)
 {
-    int dIdx = 0;
-    int iIdx = 0;
     int fd;
     ObjID *obj = malloc(sizeof(ObjID));
     BNode node;
-    BInd indBlock = {0};
+    struct stat filestat;
     
     memset(obj, 0, sizeof(*obj));
     memset(&node, 0, sizeof(node));
@@ -161,13 +298,31 @@ ObjID *AddFile(const char *file)
     memcpy(node.magic, BNODE_MAGIC, 8);
     node.versionMajor = O2FS_VERSION_MAJOR;
     node.versionMinor = O2FS_VERSION_MINOR;
+    node.flags = BNODE_FLAG_EXTENTS;
     
     fd = open(file, O_RDONLY);
     if (fd < 0) {
         perror("File open failed");
         exit(EXIT_FAILURE);
     }
+    fstat(fd, &filestat);
     
+    if (inlineData && filestat.st_size <= O2FS_INLINE_MAX(blockSize) &&
+        !corrupt) {
+        int len = ReadBlock(fd, tempbuf, filestat.st_size);
+        if (len < 0) {
+            perror("Read error");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        
+        AppendInline(obj, &node, tempbuf, len);
+        
+        return obj;
+    }
+    
+    /* Data blocks are appended back to back so files are one extent */
     while (1) {
         int chunk = ReadBlock(fd, tempbuf, blockSize);
         if (chunk < 0) {
@@ -180,46 +335,81 @@ ObjID *AddFile(const char *file)
         }
         
         node.size += (uint64_t)chunk;
-        
-        indBlock.direct[iIdx].device = 0;
-        indBlock.direct[iIdx].offset = AppendBlock(tempbuf, chunk);
-        iIdx++;
-        
-        if (iIdx >= O2FS_INDIRECT_PTR) {
-            uint64_t blkOffset = AppendBlock(&indBlock, sizeof(indBlock));
-            node.indirect[dIdx].device = 0;
-            node.indirect[dIdx].offset = blkOffset;
-            memset(&indBlock, 0, sizeof(indBlock));
-            dIdx++;
-            iIdx = 0;
-        }
-    }
-    
-    if (iIdx > 0) {
-        uint64_t finalOffset = AppendBlock(&indBlock, sizeof(indBlock));
-        node.indirect[dIdx].offset = finalOffset;
+        AddExtent(&node, tempbuf, chunk);
     }
     
     close(fd);
     
-    uint64_t nodeOffset = AppendBlock(&node, sizeof(node));
+    if (corrupt)
+        CorruptFile(&node);
     
-    obj->device = 0;
-    obj->offset = nodeOffset;
+    FinishExtents(&node);
+    AppendBNode(obj, &node, sizeof(node));
     
     return obj;
 }
 
+/*
+ * Append a directory's hash index after its entries.  The table is sized to
+ * be at most half full.
+ */
+void
+AppendDirIndex(BNode *dirNode, BDirEntry *entries, int entryCount)
+{
+    uint64_t slots = 64;
+    uint64_t indexSize;
+    uint8_t *index;
+    BDirIndex *hdr;
+    BDirSlot *table;
+
+    while (slots < 2 * (uint64_t)entryCount)
+        slots *= 2;
+
+    indexSize = sizeof(BDirIndex) + slots * sizeof(BDirSlot);
+    index = calloc(1, ROUND_UP(indexSize, blockSize) * blockSize);
+    hdr = (BDirIndex *)index;
+    table = (BDirSlot *)(index + sizeof(BDirIndex));
+
+    memcpy(hdr->magic, BDIRINDEX_MAGIC, 8);
+    hdr->slots = slots;
+    hdr->entries = entryCount;
+
+    for (int e = 0; e < entryCount; e++) {
+        uint32_t hash = O2FSDirHash((char *)entries[e].name);
+        uint64_t i = hash & (slots - 1);
+
+        while (table[i].entry != 0)
+            i = (i + 1) & (slots - 1);
+
+        table[i].hash = hash;
+        table[i].entry = e + 1;
+    }
+
+    for (uint64_t off = 0; off < indexSize; off += blockSize) {
+        uint64_t len = indexSize - off < blockSize ? indexSize - off : blockSize;
+
+        AddExtent(dirNode, index + off, len);
+    }
+
+    dirNode->flags |= BNODE_FLAG_DIRINDEX;
+    free(index);
+}
+
 ObjID *AddDirectory()
 {
     int token;
-    BDirEntry *entries = malloc(128 * sizeof(BDirEntry));
+    int entryMax = 128;
+    BDirEntry *entries = malloc(entryMax * sizeof(BDirEntry));
     int entryCount = 0;
     ObjID *dirID = malloc(sizeof(ObjID));
     BNode dirNode;
 
     while (1)
     {
+        if (entryCount == entryMax) {
+            entryMax *= 2;
+            entries = realloc(entries, entryMax * sizeof(BDirEntry));
+        }
         memset(&entries[entryCount], 0, sizeof(BDirEntry));
         token = GetToken();
 
@@ -228,9 +418,12 @@ ObjID *AddDirectory()
             {
                 token = GetToken();
                 strncpy((char *)entries[entryCount].name, tokenString, MAXNAMELEN);
+                bool corrupt = corruptName != NULL &&
+                    strcmp(tokenString, corruptName) == 0;
                 token = GetToken();
-                ObjID *fileID = AddFile(tokenString);
+                ObjID *fileID = AddFile(tokenString, corrupt);
                 memcpy(&entries[entryCount].objId, fileID, sizeof(ObjID));
+                entries[entryCount].flags = BDIR_FLAG_FILE;
                 free(fileID);
                 break;
             }
@@ -240,6 +433,7 @@ ObjID *AddDirectory()
                 strncpy((char *)entries[entryCount].name, tokenString, MAXNAMELEN);
                 ObjID *subDirID = AddDirectory();
                 memcpy(&entries[entryCount].objId, subDirID, sizeof(ObjID));
+                entries[entryCount].flags = BDIR_FLAG_DIR;
                 free(subDirID);
                 break;
             }
@@ -254,7 +448,6 @@ ObjID *AddDirectory()
         }
 
         memcpy(entries[entryCount].magic, BDIR_MAGIC, 8);
-        entries[entryCount].flags = 0;
         entries[entryCount].ctime = (uint64_t)time(NULL);
         entries[entryCount].mtime = (uint64_t)time(NULL);
         strncpy((char *)entries[entryCount].user, "admin", MAXUSERNAMELEN);
@@ -266,31 +459,29 @@ ObjID *AddDirectory()
 ProcessComplete:
 
     uint64_t entryDataSize = entryCount * sizeof(BDirEntry);
-    assert(entryDataSize < blockSize);
-
-    uint64_t entryDataOffset = AppendBlock(entries, entryDataSize);
-    free(entries);
 
     memset(&dirNode, 0, sizeof(dirNode));
     memcpy(dirNode.magic, BNODE_MAGIC, 8);
     dirNode.versionMajor = O2FS_VERSION_MAJOR;
     dirNode.versionMinor = O2FS_VERSION_MINOR;
-    dirNode.size = entryDataSize;
-
-    //dirNode.direct[0].device = 0;
-
-    BInd linkBlock = {0};
-    linkBlock.direct[0].offset = entryDataOffset;
 
-    uint64_t linkOffset = AppendBlock(&linkBlock, sizeof(linkBlock));
-    dirNode.indirect[0].device = 0;
-    dirNode.indirect[0].offset = linkOffset;
-
-    uint64_t nodeOffset = AppendBlock(&dirNode, sizeof(dirNode));
+    if (inlineData && entryDataSize <= O2FS_INLINE_MAX(blockSize)) {
+        AppendInline(dirID, &dirNode, entries, entryDataSize);
+    } else {
+        dirNode.flags = BNODE_FLAG_EXTENTS;
+        dirNode.size = entryDataSize;
+        for (uint64_t off = 0; off < entryDataSize; off += blockSize) {
+            uint64_t len = entryDataSize - off < blockSize ?
+                entryDataSize - off : blockSize;
 
-    memset(dirID, 0, sizeof(*dirID));
-    dirID->device = 0;
-    dirID->offset = nodeOffset;
+            AddExtent(&dirNode, (char *)entries + off, len);
+        }
+        if (entryCount > 0)
+            AppendDirIndex(&dirNode, entries, entryCount);
+        FinishExtents(&dirNode);
+        AppendBNode(dirID, &dirNode, sizeof(dirNode));
+    }
+    free(entries);
 
     return dirID;
 }
@@ -329,20 +520,50 @@ void Superblock(ObjID *objid)
     sb.blockSize = blockSize;
     sb.bitmapSize = bitmapSize;
     sb.bitmapOffset = blockSize;
+    if (journalSize > 0) {
+    sb.features |= O2FS_FEATURE_JOURNAL;
+    sb.journalOffset = journalOffset;
+    sb.journalSize = journalSize;
+    }
+
+    if (checksums)
+    sb.features |= O2FS_FEATURE_CHECKSUM;
 
     if (objid)
     memcpy(&sb.root, objid, sizeof(ObjID));
 
+    /* The superblock is hashed with its hash field zeroed */
+    if (checksums)
+    HashBlock(&sb, sizeof(sb), sb.hash);
+
     FlushBlock(0, &sb, sizeof(sb));
 }
 
+void Journal()
+{
+    JHeader hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+    hdr.seq = 1;
+
+    /* An empty log starts with a zeroed block */
+    journalOffset = AppendBlock(&hdr, sizeof(hdr));
+    for (int64_t i = 1; i < journalSize; i++)
+    AppendBlock(zerobuf, blockSize);
+}
+
 void usage()
 {
     printf("Usage: newfs_o2fs [OPTIONS] special-device\n");
     printf("Options:\n");
+    printf("    -c, --checksum  Checksum blocks\n");
+    printf("    -j, --journal   Journal size in blocks (0 disables the journal)\n");
     printf("    -m, --manifest  Manifest of files to copy to file system\n");
+    printf("    -n, --no-inline Do not store small files in their BNode\n");
     printf("    -s, --size      Size in megabytes of device or disk image\n");
     printf("    -v, --verbose   Verbose logging\n");
+    printf("    -x, --corrupt   Corrupt files with this name (for testing checksums)\n");
     printf("    -h, --help      Print help message\n");
 }
 
@@ -355,26 +576,42 @@ int main(int argc, char * const *argv)
     assert(sizeof(BDirEntry) == 512);
 
     struct option longopts[] = {
+    { "checksum",       no_argument,        NULL,   'c' },
+    { "journal",        required_argument,  NULL,   'j' },
     { "manifest",       required_argument,  NULL,   'm' },
+    { "no-inline",      no_argument,        NULL,   'n' },
     { "size",       required_argument,  NULL,   's' },
     { "verbose",        no_argument,        NULL,   'v' },
+    { "corrupt",        required_argument,  NULL,   'x' },
     { "help",       no_argument,        NULL,   'h' },
     { NULL,         0,          NULL,   0   }
     };
 
-    while ((ch = getopt_long(argc, argv, "m:s:vh", longopts, NULL)) != -1)
+    while ((ch = getopt_long(argc, argv, "cj:m:ns:vx:h", longopts, NULL)) != -1)
     {
     switch (ch) {
+        case 'c':
+        checksums = true;
+        break;
+        case 'j':
+        journalSize = atol(optarg);
+        break;
         case 'm':
         hasManifest = true;
         LoadManifest(optarg);
         break;
+        case 'n':
+        inlineData = false;
+        break;
         case 's':
         diskSize = atol(optarg) * 1024 * 1024;
         break;
         case 'v':
         verbose = true;
         break;
+        case 'x':
+        corruptName = optarg;
+        break;
         case 'h':
         usage();
         return 0;
@@ -392,6 +629,12 @@ int main(int argc, char * const *argv)
     return 1;
     }
 
+    if (corruptName != NULL && !checksums) {
+    printf("Error: Corrupting files requires checksums\n");
+    usage();
+    return 1;
+    }
+
     diskfd = open(argv[0], O_RDWR | O_CREAT, 0660);
     if (diskfd < 0) {
     perror("Cannot open special device or disk image");
@@ -423,6 +666,22 @@ int main(int argc, char * const *argv)
     for (int i = 0; i < bitmapSize; i++)
     AppendBlock(zerobuf, blockSize);
 
+    /* Place the journal after the bitmap */
+    if (journalSize < 0) {
+    journalSize = diskSize / blockSize / 32;
+    if (journalSize < O2FS_JOURNAL_MIN)
+        journalSize = O2FS_JOURNAL_MIN;
+    }
+    if (journalSize > 0 && journalSize < O2FS_JOURNAL_MIN) {
+    printf("Error: Journal must be at least %d blocks\n", O2FS_JOURNAL_MIN);
+    return 1;
+    }
+    if (journalSize > 0)
+    Journal();
+
+    if (checksums)
+    extentSums = calloc(O2FS_EXTENT_MAX, blockSize);
+
     ObjID *root = NULL;
     if (hasManifest) {
     int tok;
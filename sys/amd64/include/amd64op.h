@@ -482,5 +482,21 @@ static INLINE uint32_t inl(uint16_t port)
     return data;
 }
 
+static INLINE void insw(uint16_t port, void *buf, int cnt)
+{
+    asm volatile("cld\n\trep insw"
+	: "+D" (buf), "+c" (cnt)
+	: "d" (port)
+	: "memory", "cc");
+}
+
+static INLINE void outsw(uint16_t port, const void *buf, int cnt)
+{
+    asm volatile("cld\n\trep outsw"
+	: "+S" (buf), "+c" (cnt)
+	: "d" (port)
+	: "cc");
+}
+
 #endif /* __AMD64OP_H__ */
 
@@ -47,6 +47,9 @@
 #define DMVA2PA(dmva)		((dmva) - MEM_DIRECTMAP_BASE)
 #define DMPA2VA(pa)		((pa) + MEM_DIRECTMAP_BASE)
 #define VA2PA(va)		PMap_Translate(PMap_CurrentAS(), va)
+#define KVA2PA(va)		(((va) >= MEM_DIRECTMAP_BASE && \
+				  (va) < MEM_DIRECTMAP_BASE + MEM_DIRECTMAP_LEN) ? \
+				 DMVA2PA(va) : VA2PA(va))
 
 typedef struct AS
 {
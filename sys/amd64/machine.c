@@ -7,6 +7,7 @@
 #include <sys/mp.h>
 #include <sys/irq.h>
 #include <sys/spinlock.h>
+#include <sys/sysctl.h>
 
 #include <machine/amd64.h>
 #include <machine/ioapic.h>
@@ -29,6 +30,7 @@ extern void RTC_Init();
 extern void PS2_Init();
 extern void PCI_Init();
 extern void IDE_Init();
+extern void RAMDisk_Init();
 extern void MachineBoot_AddMem();
 extern void Loader_LoadInit();
 extern void PAlloc_LateInit();
@@ -212,16 +214,20 @@ void Machine_Init()
      * Initialize Basic Devices
      */
     PS2_Init(); // PS2 Keyboard
+    Disk_Init(); // Block Layer
     PCI_Init(); // PCI BUS
     IDE_Init(); // IDE Disk Controller
+    RAMDisk_Init(); // RAM Disks and Boot Images
     BufCache_Init();
 
     /*
      * Open the primary disk and mount the root file system
      */
-    Disk *root = Disk_GetByID(0, 0);
-    if (!root)
+    Disk *root = Disk_GetByName(SYSCTL_GETSTR(kern_rootdisk));
+    if (!root) {
+	kprintf("Root disk %s not found\n", SYSCTL_GETSTR(kern_rootdisk));
 	Panic("No boot disk!");
+    }
     VFS_MountRoot(root);
 
     Critical_Exit();
@@ -4,9 +4,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <sys/kassert.h>
 #include <sys/cdefs.h>
+#include <sys/sysctl.h>
 
 #include "../dev/console.h"
 
@@ -77,6 +79,19 @@ static uintptr_t memRegionStart[MAX_REGIONS];
 static uintptr_t memRegionLen[MAX_REGIONS];
 static int memRegionIdx;
 
+/*
+ * Boot modules are kept out of the page allocator so that drivers such as the 
+ * RAM disk can copy them after memory is initialized.
+ */
+#define MAX_MODULES 8
+#define MODULE_CMDLINE_LEN 64
+
+static uintptr_t modStart[MAX_MODULES];
+static uintptr_t modLen[MAX_MODULES];
+static char modCmdline[MAX_MODULES][MODULE_CMDLINE_LEN];
+static int modIdx;
+static uintptr_t modEnd;
+
 void
 MachineBoot_Entry(unsigned long magic, unsigned long addr)
 {
@@ -104,8 +119,10 @@ MachineBoot_Entry(unsigned long magic, unsigned long addr)
         kprintf("boot_device = 0x%x\n", (unsigned) mbi->boot_device);
   
     /* @r{Is the command line passed?} */
-    if (CHECK_FLAG (mbi->flags, 2))
+    if (CHECK_FLAG (mbi->flags, 2)) {
         kprintf("cmdline = %s\n", (char *)(uintptr_t)mbi->cmdline);
+        SysCtl_BootOptions((char *)(uintptr_t)mbi->cmdline);
+    }
 
     /* @r{Are mods_* valid?} */
     if (CHECK_FLAG (mbi->flags, 3))
@@ -117,11 +134,28 @@ MachineBoot_Entry(unsigned long magic, unsigned long addr)
                 (int) mbi->mods_count, (int) mbi->mods_addr);
         for (i = 0, mod = (multiboot_module_t *)(uintptr_t)mbi->mods_addr;
              i < mbi->mods_count;
-             i++, mod++)
+             i++, mod++) {
             kprintf(" mod_start = 0x%x, mod_end = 0x%x, cmdline = %s\n",
                     (unsigned) mod->mod_start,
                     (unsigned) mod->mod_end,
                     (char *)(uintptr_t) mod->cmdline);
+
+            // The second 16MB are handed to the allocator during boot
+            if (mod->mod_end > 16*1024*1024 && mod->mod_start < 32*1024*1024) {
+                kprintf(" module overlaps boot memory, ignored\n");
+                continue;
+            }
+            if (mod->mod_end > modEnd)
+                modEnd = mod->mod_end;
+            if (modIdx == MAX_MODULES)
+                continue;
+            modStart[modIdx] = mod->mod_start;
+            modLen[modIdx] = mod->mod_end - mod->mod_start;
+            if (mod->cmdline != 0)
+                strncpy(modCmdline[modIdx], (char *)(uintptr_t)mod->cmdline,
+                        MODULE_CMDLINE_LEN - 1);
+            modIdx++;
+        }
     }
 
     /* @r{Bits 4 and 5 are mutually exclusive!} */
@@ -194,6 +228,10 @@ MachineBoot_AddMem()
     int i;
     uintptr_t initRamEnd = 32*1024*1024;
 
+    // Keep boot modules loaded above the initial memory
+    if (modEnd > initRamEnd)
+	initRamEnd = ROUNDUP(modEnd, PGSIZE);
+
     for (i = 0; i < memRegionIdx; i++)
     {
 	uintptr_t start = memRegionStart[i];
@@ -203,7 +241,7 @@ MachineBoot_AddMem()
 	    continue;
 
 	if (start < initRamEnd) {
-	    len = initRamEnd - start;
+	    len -= initRamEnd - start;
 	    start = initRamEnd;
 	}
 
@@ -212,3 +250,29 @@ MachineBoot_AddMem()
     }
 }
 
+/**
+ * MachineBoot_GetModule --
+ *
+ * Returns a module loaded by the boot loader.
+ *
+ * @param [in] idx Module index.
+ * @param [out] start Physical address of the module.
+ * @param [out] len Length of the module in bytes.
+ * @param [out] cmdline Module command line.
+ *
+ * @retval true if the module exists.
+ */
+bool
+MachineBoot_GetModule(int idx, uintptr_t *start, uintptr_t *len,
+		      const char **cmdline)
+{
+    if (idx < 0 || idx >= modIdx)
+	return false;
+
+    *start = modStart[idx];
+    *len = modLen[idx];
+    *cmdline = modCmdline[idx];
+
+    return true;
+}
+
@@ -5,9 +5,21 @@
 
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
+#include <sys/disk.h>
+#include <sys/irq.h>
 #include <sys/kmem.h>
+#include <sys/ktime.h>
+#include <sys/ktimer.h>
 #include <sys/pci.h>
+#include <sys/queue.h>
 #include <sys/sga.h>
+#include <sys/spinlock.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
+#include <errno.h>
+
+#include <machine/amd64.h>
+#include <machine/pmap.h>
 
 #include "ata.h"
 #include "sata.h"
@@ -40,6 +52,7 @@ typedef struct AHCIHostControl
 
 #define AHCI_CAP_S64A		0x80000000  /* Supports 64-bit Addressing */
 #define AHCI_CAP_SNCQ		0x40000000  /* Supports NCQ */
+#define AHCI_CAP_NCS(_cap)	((((_cap) >> 8) & 0x1F) + 1) /* Command Slots */
 
 #define AHCI_GHC_AE		0x80000000
 #define AHCI_GHC_IE		0x00000002
@@ -86,6 +99,19 @@ typedef struct AHCIPort
 #define AHCIPORT_CMD_SUD	0x00000002 /* Spin-Up Device */
 #define AHCIPORT_CMD_ST		0x00000001 /* Start */
 
+#define AHCIPORT_IS_DHRS	0x00000001 /* Device to Host Register FIS */
+#define AHCIPORT_IS_PSS		0x00000002 /* PIO Setup FIS */
+#define AHCIPORT_IS_DSS		0x00000004 /* DMA Setup FIS */
+#define AHCIPORT_IS_SDBS	0x00000008 /* Set Device Bits FIS */
+#define AHCIPORT_IS_TFES	0x40000000 /* Task File Error */
+#define AHCIPORT_IS_HBFS	0x20000000 /* Host Bus Fatal Error */
+#define AHCIPORT_IS_HBDS	0x10000000 /* Host Bus Data Error */
+#define AHCIPORT_IS_IFS		0x08000000 /* Interface Fatal Error */
+#define AHCIPORT_IS_ERROR	(AHCIPORT_IS_TFES | AHCIPORT_IS_HBFS | \
+				 AHCIPORT_IS_HBDS | AHCIPORT_IS_IFS)
+#define AHCIPORT_IS_COMPLETE	(AHCIPORT_IS_DHRS | AHCIPORT_IS_PSS | \
+				 AHCIPORT_IS_DSS | AHCIPORT_IS_SDBS)
+
 #define AHCIPORT_TFD_BSY	0x00000080 /* Port Busy */
 #define AHCIPORT_TFD_DRQ	0x00000004 /* Data Transfer Requested */
 #define AHCIPORT_TFD_ERR	0x00000001 /* Error during Transfer */
@@ -96,11 +122,19 @@ typedef struct AHCIPort
 #define AHCIPORT_SSTS_DETPE	0x00000003 /* DET: Present and Established */
 #define AHCIPORT_SSTS_DETNE	0x00000004 /* DET: Not Enabled or in BIST mode */
 
+#define AHCIPORT_SCTL_DETMASK	0x0000000F /* Device Detection Initialization */
+#define AHCIPORT_SCTL_DETINIT	0x00000001 /* DET: Perform COMRESET */
+
 #define AHCI_ABAR		5
 #define AHCI_PORT_OFFSET	0x100
 #define AHCI_PORT_LENGTH	0x80
 #define AHCI_MAX_PORTS		8
 #define AHCI_MAX_CMDS		32
+#define AHCI_MAX_PRDT		248
+#define AHCI_MAX_PRDBYTES	(4*1024*1024)
+#define AHCI_SECTOR_SIZE	512
+#define AHCI_MAX_XFER		(512*1024)  /* Largest transfer per command */
+#define AHCI_TIMEOUT		5	    /* Command timeout in seconds */
 
 /*
  * Request Structures
@@ -115,6 +149,10 @@ typedef struct AHCICommandHeader
     uint64_t		_rsvd[2];
 } AHCICommandHeader;
 
+#define AHCICMD_FLAG_CFLMASK	0x001F	/* Command FIS Length in DWORDs */
+#define AHCICMD_FLAG_WRITE	0x0040	/* Write to Device */
+#define AHCICMD_FLAG_PREFETCH	0x0080	/* Prefetchable */
+
 typedef struct AHCICommandList
 {
     AHCICommandHeader	cmds[AHCI_MAX_CMDS];
@@ -130,6 +168,9 @@ typedef struct AHCIPRDT
     uint32_t		descInfo;	// Description Information
 } AHCIPRDT;
 
+#define AHCIPRDT_DESC_IOC	0x80000000  /* Interrupt on Completion */
+#define AHCIPRDT_DESC_DBCMASK	0x003FFFFF  /* Byte Count - 1 */
+
 /*
  * AHCICommandTable
  * 	This structure is exactly one machine page in size, we fill up the page 
@@ -141,7 +182,7 @@ typedef struct AHCICommandTable
     uint8_t		cfis[64];	// Command FIS
     uint8_t		acmd[32];	// ATAPI Command
     uint8_t		_rsvd[32];
-    AHCIPRDT		prdt[248];	// Physical Region Descriptor Table
+    AHCIPRDT		prdt[AHCI_MAX_PRDT]; // Physical Region Descriptor Table
 } AHCICommandTable;
 
 /*
@@ -161,13 +202,81 @@ typedef struct AHCIRecvFIS
     uint8_t		_rsvd3[0x60];
 } AHCIRecvFIS;
 
+/*
+ * AHCISlot
+ * 	Completion state of a command slot.
+ */
+typedef struct AHCISlot
+{
+    volatile bool	done;
+    bool		exclusive;	// Holds all slots
+    int			status;
+    uint64_t		deadline;	// Timeout in nanoseconds
+    DiskRequest		*req;		// Asynchronous request or NULL
+} AHCISlot;
+
+typedef struct AHCI AHCI;
+
+/*
+ * AHCIDrive
+ * 	Per port driver state.  Command slots are allocated from the slotsFree 
+ * 	bitmap and tracked in slotsIssued until the device clears them from 
+ * 	both PxCI and PxSACT.  Devices supporting NCQ accept up to queueDepth 
+ * 	queued commands at once, otherwise only a single command is issued at 
+ * 	a time.
+ *
+ * 	Completions are normally found by the interrupt handler, which wakes 
+ * 	threads sleeping on the drive's wait channel.  Commands issued before 
+ * 	interrupts are enabled are polled.  Commands that do not complete 
+ * 	within AHCI_TIMEOUT seconds are failed and the port is reset.  When 
+ * 	the port reports an error the outstanding commands are failed and the 
+ * 	command engine is restarted.  Both are left to the service thread, 
+ * 	since they wait on the device.
+ *
+ * 	Asynchronous requests from the block layer wait in reqQueue until 
+ * 	slots are available.  The request at the head of the queue may be 
+ * 	partially issued, reqIdx and reqOff track the next SGArray entry and 
+ * 	offset to issue.  A request completes once it has been fully issued 
+ * 	and no slot refers to it.
+ */
+typedef struct AHCIDrive
+{
+    AHCI		*ahci;
+    int			port;
+    bool		present;
+    bool		ncq;		// Native Command Queuing
+    uint32_t		queueDepth;
+    uint32_t		slotMask;	// Usable command slots
+    uint64_t		sectors;
+    Spinlock		lock;
+    uint32_t		slotsFree;	// Free command slots
+    uint32_t		slotsIssued;	// Slots issued to the device
+    AHCISlot		slot[AHCI_MAX_CMDS];
+    WaitChannel		wait;		// Waiters for completions
+    volatile bool	resetPending;	// Port needs to be recovered
+    bool		comreset;	// Recovery must also reset the link
+    bool		resetting;	// Port reset in progress
+    // Asynchronous requests
+    Spinlock		reqLock;
+    TAILQ_HEAD(AHCIReqQueue, DiskRequest) reqQueue;
+    int			reqIdx;		// Next SGArray entry of the head
+    uint64_t		reqOff;		// Offset within the entry
+    Disk		disk;
+} AHCIDrive;
+
 /*
  * AHCI
  * 	Exceeds a single page need to use heap
  */
-typedef struct AHCI
+struct AHCI
 {
     PCIDevice		dev;
+    IRQHandler		irqHandle;
+    uint32_t		cmdSlots;	// Command slots supported by the HBA
+    // Service thread
+    WaitChannel		svcWait;
+    volatile bool	svcPending;	// Service thread has work
+    volatile bool	watchdogArmed;	// Watchdog timer armed or requested
     // Device Space
     AHCIHostControl	*hc;
     AHCIPort		*port[AHCI_MAX_PORTS];
@@ -175,7 +284,17 @@ typedef struct AHCI
     AHCICommandList	*clst[AHCI_MAX_PORTS];
     AHCICommandTable	*ctbl[AHCI_MAX_PORTS][AHCI_MAX_CMDS];
     AHCIRecvFIS		*rfis[AHCI_MAX_PORTS];
-} AHCI;
+    AHCIDrive		*drive[AHCI_MAX_PORTS];
+};
+
+int AHCI_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int AHCI_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int AHCI_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int AHCI_Submit(Disk *disk, DiskRequest *req);
+static void AHCIReap(AHCIDrive *drv);
+static void AHCIDispatch(AHCIDrive *drv);
+
+static uint64_t ahciDiskNo;
 
 void AHCI_Configure(PCIDevice dev);
 
@@ -199,10 +318,10 @@ AHCI_Init(uint32_t bus, uint32_t slot, uint32_t func)
 	return;
     }
 
-    // XXX: Temporary until we have a slab allocator
-#define PGSIZE	4096
     ASSERT(sizeof(AHCI) <= PGSIZE);
+    ASSERT(sizeof(AHCIDrive) <= PGSIZE);
     ASSERT(sizeof(AHCICommandList) <= PGSIZE);
+    ASSERT(sizeof(AHCICommandTable) <= PGSIZE);
     ASSERT(sizeof(AHCIRecvFIS) <= PGSIZE);
     ASSERT(sizeof(ATAIdentifyDevice) == 512);
 
@@ -250,116 +369,1075 @@ AHCI_DumpPort(AHCI *ahci, int port)
     kprintf("CI: 0x%08x\n", p->ci);
 }
 
-uint64_t
-AHCI_IssueCommand(AHCI *ahci, int port, SGArray *sga, void *cfis, int len)
+/**
+ * AHCIWaitReg --
+ *
+ * Polls a port register until the masked bits equal value.
+ *
+ * @param [in] reg Register to poll.
+ * @param [in] mask Bits to compare.
+ * @param [in] value Expected value of the masked bits.
+ * @param [in] timeout Timeout in milliseconds.
+ *
+ * @retval true if the register reached the expected value.
+ * @retval false on timeout.
+ */
+static bool
+AHCIWaitReg(volatile uint32_t *reg, uint32_t mask, uint32_t value,
+	    uint64_t timeout)
 {
-    // XXX: support multiple commands
+    uint64_t deadline = KTime_GetEpochNS() + timeout * 1000000ULL;
+
+    while ((*reg & mask) != value) {
+	if (KTime_GetEpochNS() > deadline)
+	    return false;
+    }
+
+    return true;
+}
+
+/**
+ * AHCIAllocSlot --
+ *
+ * Allocates a command slot.  Commands that cannot be queued, such as 
+ * IDENTIFY, must not be issued while NCQ commands are outstanding, so an 
+ * exclusive allocation only succeeds when every slot is free and holds all of 
+ * them until it is freed.
+ *
+ * @param [in] drv Drive
+ * @param [in] exclusive Allocate all slots for a non-queued command.
+ *
+ * @return Slot number or -1 if no slot is available.
+ */
+static int
+AHCIAllocSlot(AHCIDrive *drv, bool exclusive)
+{
+    int slot = -1;
+
+    Spinlock_Lock(&drv->lock);
+    if (exclusive) {
+	if (drv->slotsFree == drv->slotMask) {
+	    drv->slotsFree = 0;
+	    slot = 0;
+	}
+    } else if (drv->slotsFree != 0) {
+	slot = __builtin_ctz(drv->slotsFree);
+	drv->slotsFree &= ~(1U << slot);
+    }
+    if (slot != -1) {
+	drv->slot[slot].done = false;
+	drv->slot[slot].exclusive = exclusive;
+	drv->slot[slot].status = 0;
+    }
+    Spinlock_Unlock(&drv->lock);
+
+    return slot;
+}
+
+static void
+AHCIFreeSlot(AHCIDrive *drv, int slot)
+{
+    Spinlock_Lock(&drv->lock);
+    if (drv->slot[slot].exclusive)
+	drv->slotsFree = drv->slotMask;
+    else
+	drv->slotsFree |= (1U << slot);
+    Spinlock_Unlock(&drv->lock);
+
+    WaitChannel_WakeAll(&drv->wait);
+}
+
+/**
+ * AHCIBuildPRDT --
+ *
+ * Converts a kernel buffer into a PRDT.  The buffer is walked page by page 
+ * and physically contiguous pages are merged into a single entry.
+ *
+ * @return Number of PRDT entries or -EINVAL if the buffer is too fragmented.
+ */
+static int
+AHCIBuildPRDT(volatile AHCICommandTable *ct, void *buf, uint64_t len)
+{
+    uintptr_t va = (uintptr_t)buf;
+    uint64_t pa, chunk, prevLen;
+    int n = 0;
+
+    // Must be a multiple of word size
+    ASSERT(len % 2 == 0);
+
+    while (len > 0) {
+	pa = KVA2PA(va);
+	chunk = PGSIZE - (va % PGSIZE);
+	if (chunk > len)
+	    chunk = len;
+
+	prevLen = (n > 0) ? (ct->prdt[n - 1].descInfo &
+			     AHCIPRDT_DESC_DBCMASK) + 1 : 0;
+	if (n > 0 && ct->prdt[n - 1].dba + prevLen == pa &&
+	    prevLen + chunk <= AHCI_MAX_PRDBYTES) {
+	    ct->prdt[n - 1].descInfo += chunk;
+	} else {
+	    if (n == AHCI_MAX_PRDT)
+		return -EINVAL;
+	    ct->prdt[n].dba = pa;
+	    ct->prdt[n].descInfo = chunk - 1;
+	    n++;
+	}
+
+	va += chunk;
+	len -= chunk;
+    }
+
+    return n;
+}
+
+/**
+ * AHCIKickService --
+ *
+ * Wakes the service thread, which arms the watchdog and recovers ports.
+ */
+static void
+AHCIKickService(AHCI *ahci)
+{
+    ahci->svcPending = true;
+    WaitChannel_Wake(&ahci->svcWait);
+}
+
+/**
+ * AHCIIssueCommand --
+ *
+ * Fills in a command slot and issues it to the device.
+ *
+ * @param [in] drv Drive
+ * @param [in] slot Allocated command slot.
+ * @param [in] cfis Command FIS
+ * @param [in] len Command FIS length
+ * @param [in] buf Data buffer or NULL.
+ * @param [in] bufLen Data buffer length.
+ * @param [in] write True if data is written to the device.
+ * @param [in] ncq True for FPDMA QUEUED commands.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+AHCIIssueCommand(AHCIDrive *drv, int slot, void *cfis, int len, void *buf,
+		 uint64_t bufLen, bool write, bool ncq)
+{
+    AHCI *ahci = drv->ahci;
+    int port = drv->port;
     volatile AHCICommandList *cl = ahci->clst[port];
-    volatile AHCICommandTable *ct = ahci->ctbl[port][0];
+    volatile AHCICommandTable *ct = ahci->ctbl[port][slot];
     volatile AHCIPort *p = ahci->port[port];
+    int prdtl = 0;
 
     // Copy Command FIS
     memcpy((void *)&ct->cfis[0], cfis, len);
 
-    // Convert SGArray into PRDT
+    if (buf != NULL) {
+	prdtl = AHCIBuildPRDT(ct, buf, bufLen);
+	if (prdtl < 0)
+	    return prdtl;
+    }
+
+    // Specify cfis length and prdt entries
+    cl->cmds[slot].prdtl = prdtl;
+    cl->cmds[slot].flag = ((len >> 2) & AHCICMD_FLAG_CFLMASK) |
+			  (write ? AHCICMD_FLAG_WRITE : AHCICMD_FLAG_PREFETCH);
+    cl->cmds[slot].cmdStatus = 0;
+
+    Spinlock_Lock(&drv->lock);
+    if (drv->resetting || drv->resetPending) {
+	Spinlock_Unlock(&drv->lock);
+	return -EIO;
+    }
+    drv->slot[slot].deadline = KTime_GetEpochNS() +
+			       AHCI_TIMEOUT * 1000000000ULL;
+    drv->slotsIssued |= (1U << slot);
+    // PxSACT must be set before PxCI for queued commands
+    if (ncq)
+	p->sact = (1U << slot);
+    p->ci = (1U << slot);
+    Spinlock_Unlock(&drv->lock);
+
+    // Ask the service thread to arm the watchdog
+    if (!ahci->watchdogArmed &&
+	__sync_bool_compare_and_swap(&ahci->watchdogArmed, false, true))
+	AHCIKickService(ahci);
+
+    return 0;
+}
+
+/**
+ * AHCIPortComplete --
+ *
+ * Completes the commands the device has finished.  A slot is finished once 
+ * it has been cleared from both PxCI and PxSACT, which allows queued 
+ * commands to complete in any order.  If the port reports an error all 
+ * outstanding commands are failed and the service thread is asked to 
+ * restart the port.  This may be called from the interrupt handler.
+ *
+ * @return Bitmap of the slots that completed.
+ */
+static uint32_t
+AHCIPortComplete(AHCIDrive *drv)
+{
+    volatile AHCIPort *p = drv->ahci->port[drv->port];
+    uint32_t is, done;
+    int slot;
+    int status = 0;
+    bool recover = false;
+
+    Spinlock_Lock(&drv->lock);
+    is = p->is;
+    p->is = is;
+
+    if (is & AHCIPORT_IS_ERROR) {
+	kprintf("AHCI: Port %d error IS=%08x TFD=%08x SERR=%08x\n",
+		drv->port, is, p->tfd, p->serr);
+	done = drv->slotsIssued;
+	status = -EIO;
+	recover = !drv->resetPending;
+	drv->resetPending = true;
+    } else {
+	done = drv->slotsIssued & ~(p->ci | p->sact);
+    }
+
+    drv->slotsIssued &= ~done;
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	if (done & (1U << slot)) {
+	    drv->slot[slot].status = status;
+	    drv->slot[slot].done = true;
+	}
+    }
+    Spinlock_Unlock(&drv->lock);
+
+    if (recover)
+	AHCIKickService(drv->ahci);
+
+    return done;
+}
+
+/**
+ * AHCICheckTimeout --
+ *
+ * Fails all outstanding commands if any of them has been outstanding for 
+ * longer than AHCI_TIMEOUT seconds.  The port is reset later by AHCIRecover 
+ * in thread context since a reset may take a while.
+ *
+ * @retval true if commands were timed out.
+ */
+static bool
+AHCICheckTimeout(AHCIDrive *drv)
+{
+    uint64_t now = KTime_GetEpochNS();
+    bool expired = false;
+    int slot;
+
+    Spinlock_Lock(&drv->lock);
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	if ((drv->slotsIssued & (1U << slot)) &&
+	    now > drv->slot[slot].deadline)
+	    expired = true;
+    }
+
+    if (expired) {
+	kprintf("AHCI: Port %d command timeout (CI=%08x SACT=%08x)\n",
+		drv->port, drv->ahci->port[drv->port]->ci,
+		drv->ahci->port[drv->port]->sact);
+	for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	    if (drv->slotsIssued & (1U << slot)) {
+		drv->slot[slot].status = -ETIMEDOUT;
+		drv->slot[slot].done = true;
+	    }
+	}
+	drv->slotsIssued = 0;
+	drv->resetPending = true;
+	drv->comreset = true;
+    }
+    Spinlock_Unlock(&drv->lock);
+
+    return expired;
+}
+
+/**
+ * AHCIRecover --
+ *
+ * Stops the command engine of a port whose commands have been failed, which 
+ * clears PxCI and PxSACT, and restarts it.  After a command timeout the link 
+ * is also reset with a COMRESET.  This waits on the device, so it is called 
+ * from the service thread or by callers that are polling anyway.
+ */
+static void
+AHCIRecover(AHCIDrive *drv)
+{
+    volatile AHCIPort *p = drv->ahci->port[drv->port];
+    uint64_t deadline;
+    bool comreset;
+
+    Spinlock_Lock(&drv->lock);
+    if (!drv->resetPending || drv->resetting) {
+	Spinlock_Unlock(&drv->lock);
+	return;
+    }
+    drv->resetting = true;
+    comreset = drv->comreset;
+    Spinlock_Unlock(&drv->lock);
+
+    p->cmd &= ~AHCIPORT_CMD_ST;
+    if (!AHCIWaitReg(&p->cmd, AHCIPORT_CMD_CR, 0, 500))
+	kprintf("AHCI: Port %d command engine did not stop\n", drv->port);
+
+    if (comreset) {
+	kprintf("AHCI: Resetting port %d\n", drv->port);
+
+	// COMRESET must be held for at least 1ms
+	p->sctl = (p->sctl & ~AHCIPORT_SCTL_DETMASK) | AHCIPORT_SCTL_DETINIT;
+	deadline = KTime_GetEpochNS() + 2000000ULL;
+	while (KTime_GetEpochNS() < deadline)
+	    pause();
+	p->sctl = p->sctl & ~AHCIPORT_SCTL_DETMASK;
+
+	if (!AHCIWaitReg(&p->ssts, AHCIPORT_SSTS_DETMASK, AHCIPORT_SSTS_DETPE,
+			 1000))
+	    kprintf("AHCI: Port %d link did not come back\n", drv->port);
+    }
+
+    p->serr = 0xFFFFFFFF;
+    p->is = 0xFFFFFFFF;
+
+    if (comreset &&
+	!AHCIWaitReg(&p->tfd, AHCIPORT_TFD_BSY | AHCIPORT_TFD_DRQ, 0, 1000))
+	kprintf("AHCI: Port %d device is not ready\n", drv->port);
+
+    p->cmd |= AHCIPORT_CMD_ST;
+
+    Spinlock_Lock(&drv->lock);
+    drv->resetting = false;
+    drv->resetPending = false;
+    drv->comreset = false;
+    Spinlock_Unlock(&drv->lock);
+}
+
+/**
+ * AHCIWatchdog --
+ *
+ * Timer callback that times out commands on every port.  Requests cannot be 
+ * completed from a timer callback, so the service thread is woken to reset 
+ * ports, complete requests and rearm the watchdog.
+ */
+static void
+AHCIWatchdog(void *arg)
+{
+    AHCI *ahci = (AHCI *)arg;
+    int port;
+
+    for (port = 0; port < AHCI_MAX_PORTS; port++) {
+	AHCIDrive *drv = ahci->drive[port];
+
+	if (drv == NULL || !drv->present)
+	    continue;
+
+	if (AHCICheckTimeout(drv))
+	    WaitChannel_WakeAll(&drv->wait);
+    }
+
+    AHCIKickService(ahci);
+}
+
+/**
+ * AHCISlotsDone --
+ *
+ * @return Bitmap of the pending slots that have completed.
+ */
+static inline uint32_t
+AHCISlotsDone(AHCIDrive *drv, uint32_t pending)
+{
+    uint32_t done = 0;
+    int slot;
+
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	if ((pending & (1U << slot)) && drv->slot[slot].done)
+	    done |= (1U << slot);
+    }
+
+    return done;
+}
+
+/**
+ * AHCIWaitSlots --
+ *
+ * Waits for commands issued by the caller to complete and frees their slots.  
+ * The caller sleeps until the interrupt handler completes a command, unless 
+ * it cannot sleep in which case the port is polled.
+ *
+ * @param [in] drv Drive
+ * @param [inout] pending Bitmap of slots issued by the caller.  Completed 
+ * slots are cleared.
+ * @param [in] all Wait for all pending slots rather than at least one.
+ *
+ * @retval 0 if successful
+ * @return Otherwise the error code of a failed command.
+ */
+static int
+AHCIWaitSlots(AHCIDrive *drv, uint32_t *pending, bool all)
+{
+    int slot;
+    int status = 0;
+    uint32_t done;
+    bool progress = false;
+    bool poll = (Critical_Level() != 0);
+
+    while (*pending != 0) {
+	if (poll) {
+	    AHCIPortComplete(drv);
+	    AHCICheckTimeout(drv);
+	    if (drv->resetPending)
+		AHCIRecover(drv);
+	} else {
+	    WaitChannel_Lock(&drv->wait);
+	    if (AHCISlotsDone(drv, *pending) == 0) {
+		WaitChannel_Sleep(&drv->wait);
+	    } else {
+		Spinlock_Unlock(&drv->wait.lock);
+	    }
+	}
+
+	done = AHCISlotsDone(drv, *pending);
+	for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	    if ((done & (1U << slot)) == 0)
+		continue;
+
+	    if (drv->slot[slot].status != 0)
+		status = drv->slot[slot].status;
+	    *pending &= ~(1U << slot);
+	    AHCIFreeSlot(drv, slot);
+	    progress = true;
+	}
+
+	if (progress && !all)
+	    break;
+    }
+
+    // Freed slots may be used by queued requests
+    if (progress && !TAILQ_EMPTY(&drv->reqQueue))
+	AHCIDispatch(drv);
+
+    return status;
+}
+
+/**
+ * AHCIWaitFreeSlot --
+ *
+ * Waits for another thread to free a command slot.
+ *
+ * @param [in] drv Drive
+ * @param [in] all Wait for every slot to be free, for exclusive commands.
+ */
+static void
+AHCIWaitFreeSlot(AHCIDrive *drv, bool all)
+{
+    if (Critical_Level() != 0) {
+	AHCIPortComplete(drv);
+	AHCICheckTimeout(drv);
+	if (drv->resetPending)
+	    AHCIRecover(drv);
+	return;
+    }
+
+    WaitChannel_Lock(&drv->wait);
+    if (drv->slotsFree == 0 || (all && drv->slotsFree != drv->slotMask)) {
+	WaitChannel_Sleep(&drv->wait);
+    } else {
+	Spinlock_Unlock(&drv->wait.lock);
+    }
+}
+
+/**
+ * AHCI_Interrupt --
+ *
+ * Interrupt handler that completes finished commands on every port with a 
+ * pending interrupt, wakes up the threads waiting on them and completes 
+ * asynchronous requests.
+ */
+static void
+AHCI_Interrupt(void *arg)
+{
+    AHCI *ahci = (AHCI *)arg;
+    volatile AHCIHostControl *hc = ahci->hc;
+    uint32_t is = hc->is;
+    int port;
+
+    for (port = 0; port < AHCI_MAX_PORTS; port++) {
+	AHCIDrive *drv = ahci->drive[port];
+
+	if ((is & (1U << port)) == 0 || drv == NULL)
+	    continue;
+
+	if (AHCIPortComplete(drv) != 0) {
+	    WaitChannel_WakeAll(&drv->wait);
+	    AHCIReap(drv);
+	    AHCIDispatch(drv);
+	}
+    }
+
+    // Port status must be cleared before the HBA status
+    hc->is = is;
+}
+
+/**
+ * AHCIStartIO --
+ *
+ * Issues a single read or write command in an allocated slot.  Devices with 
+ * NCQ use READ/WRITE FPDMA QUEUED with the slot number as the tag.
+ */
+static int
+AHCIStartIO(AHCIDrive *drv, int slot, void *buf, uint64_t lba,
+	    uint64_t sectors, bool write)
+{
+    SATAFIS_REG_H2D fis;
+
+    memset(&fis, 0, sizeof(fis));
+    fis.type = SATAFIS_TYPE_REG_H2D;
+    fis.flag = SATAFIS_REG_H2D_FLAG_COMMAND;
+    fis.device = SATAFIS_DEVICE_LBA;
+    fis.lba0 = lba & 0xFF;
+    fis.lba1 = (lba >> 8) & 0xFF;
+    fis.lba2 = (lba >> 16) & 0xFF;
+    fis.lba3 = (lba >> 24) & 0xFF;
+    fis.lba4 = (lba >> 32) & 0xFF;
+    fis.lba5 = (lba >> 40) & 0xFF;
+
+    if (drv->ncq) {
+	fis.command = write ? SATAFIS_CMD_WRITE_FPDMA_QUEUED :
+			      SATAFIS_CMD_READ_FPDMA_QUEUED;
+	// Sector count goes in the feature registers and the tag in count
+	fis.feature0 = sectors & 0xFF;
+	fis.feature1 = (sectors >> 8) & 0xFF;
+	fis.count0 = slot << 3;
+    } else {
+	fis.command = write ? SATAFIS_CMD_WRITE_DMA_EXT :
+			      SATAFIS_CMD_READ_DMA_EXT;
+	fis.count0 = sectors & 0xFF;
+	fis.count1 = (sectors >> 8) & 0xFF;
+    }
+
+    return AHCIIssueCommand(drv, slot, &fis, sizeof(fis), buf,
+			    sectors * AHCI_SECTOR_SIZE, write, drv->ncq);
+}
+
+/**
+ * AHCIIO --
+ *
+ * Reads or writes the disk ranges in an SGArray to or from a contiguous 
+ * kernel buffer.  Every range is split into commands of at most 
+ * AHCI_MAX_XFER bytes and all commands are queued at once, up to the drive's 
+ * queue depth.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+AHCIIO(AHCIDrive *drv, void *buf, SGArray *sga, bool write)
+{
+    uint8_t *va = (uint8_t *)buf;
+    uint32_t pending = 0;
+    int i, slot, err;
+    int status = 0;
+
+    for (i = 0; i < sga->len && status == 0; i++) {
+	uint64_t off = sga->entries[i].offset;
+	uint64_t len = sga->entries[i].length;
+
+	if ((off % AHCI_SECTOR_SIZE) != 0 || (len % AHCI_SECTOR_SIZE) != 0 ||
+	    (off + len) / AHCI_SECTOR_SIZE > drv->sectors) {
+	    status = -EINVAL;
+	    break;
+	}
+
+	while (len > 0) {
+	    uint64_t chunk = (len > AHCI_MAX_XFER) ? AHCI_MAX_XFER : len;
+
+	    while ((slot = AHCIAllocSlot(drv, !drv->ncq)) == -1) {
+		if (pending == 0) {
+		    // Other threads hold every slot
+		    AHCIWaitFreeSlot(drv, !drv->ncq);
+		    continue;
+		}
+		err = AHCIWaitSlots(drv, &pending, false);
+		if (err != 0)
+		    status = err;
+	    }
+
+	    err = AHCIStartIO(drv, slot, va, off / AHCI_SECTOR_SIZE,
+			      chunk / AHCI_SECTOR_SIZE, write);
+	    if (err != 0) {
+		AHCIFreeSlot(drv, slot);
+		status = err;
+		break;
+	    }
+	    pending |= (1U << slot);
+
+	    va += chunk;
+	    off += chunk;
+	    len -= chunk;
+	}
+    }
+
+    err = AHCIWaitSlots(drv, &pending, true);
+    if (err != 0)
+	status = err;
+
+    return status;
+}
+
+/**
+ * AHCIStartFlush --
+ *
+ * Issues a FLUSH CACHE EXT command in an exclusively allocated slot.
+ */
+static int
+AHCIStartFlush(AHCIDrive *drv, int slot)
+{
+    SATAFIS_REG_H2D fis;
+
+    memset(&fis, 0, sizeof(fis));
+    fis.type = SATAFIS_TYPE_REG_H2D;
+    fis.flag = SATAFIS_REG_H2D_FLAG_COMMAND;
+    fis.command = SATAFIS_CMD_FLUSH_CACHE_EXT;
+    fis.device = SATAFIS_DEVICE_LBA;
+
+    return AHCIIssueCommand(drv, slot, &fis, sizeof(fis), NULL, 0, false,
+			    false);
+}
+
+/**
+ * AHCIReqBusy --
+ *
+ * @return True if a command slot still refers to the request.  The caller 
+ * must hold the drive lock.
+ */
+static bool
+AHCIReqBusy(AHCIDrive *drv, DiskRequest *req)
+{
+    int slot;
+
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	if (drv->slot[slot].req == req)
+	    return true;
+    }
+
+    return false;
+}
+
+/**
+ * AHCICompleteList --
+ *
+ * Completes requests collected while holding the drive locks.  Callbacks may 
+ * submit new requests so they must not be called with the locks held.
+ */
+static void
+AHCICompleteList(struct AHCIReqQueue *list)
+{
+    DiskRequest *req;
+
+    while ((req = TAILQ_FIRST(list)) != NULL) {
+	TAILQ_REMOVE(list, req, entries);
+	Disk_Complete(req, req->status);
+    }
+}
+
+/**
+ * AHCIReap --
+ *
+ * Frees the slots of completed asynchronous commands and completes the 
+ * requests that have no more commands outstanding.
+ */
+static void
+AHCIReap(AHCIDrive *drv)
+{
+    struct AHCIReqQueue done;
+    DiskRequest *req;
+    uint32_t freed = 0;
+    int slot;
+
+    TAILQ_INIT(&done);
+
+    Spinlock_Lock(&drv->reqLock);
+    Spinlock_Lock(&drv->lock);
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	AHCISlot *s = &drv->slot[slot];
+
+	if (s->req == NULL || !s->done)
+	    continue;
+
+	req = s->req;
+	s->req = NULL;
+	if (s->status != 0)
+	    req->status = s->status;
+	freed |= (1U << slot);
+
+	// The head of the queue may not be fully issued yet
+	if (req != TAILQ_FIRST(&drv->reqQueue) && !AHCIReqBusy(drv, req))
+	    TAILQ_INSERT_TAIL(&done, req, entries);
+    }
+    Spinlock_Unlock(&drv->lock);
+    Spinlock_Unlock(&drv->reqLock);
+
+    for (slot = 0; slot < AHCI_MAX_CMDS; slot++) {
+	if (freed & (1U << slot))
+	    AHCIFreeSlot(drv, slot);
+    }
+
+    AHCICompleteList(&done);
+}
+
+/**
+ * AHCIDispatch --
+ *
+ * Issues commands for queued asynchronous requests until the queue is empty, 
+ * the drive runs out of command slots or the port needs recovery.  Large 
+ * requests are split into commands of at most AHCI_MAX_XFER bytes as in 
+ * AHCIIO.
+ */
+static void
+AHCIDispatch(AHCIDrive *drv)
+{
+    struct AHCIReqQueue done;
+    DiskRequest *req;
+    bool finished;
+    int slot, err;
+
+    TAILQ_INIT(&done);
+
+    Spinlock_Lock(&drv->reqLock);
+    while ((req = TAILQ_FIRST(&drv->reqQueue)) != NULL) {
+	uint64_t chunk = 0;
+
+	// Requests wait for the service thread to recover the port
+	if (drv->resetPending)
+	    break;
+
+	if (req->op == DISKREQ_OP_FLUSH) {
+	    slot = AHCIAllocSlot(drv, true);
+	    if (slot == -1)
+		break;
+	    drv->slot[slot].req = req;
+	    err = AHCIStartFlush(drv, slot);
+	} else if (drv->reqIdx < req->sga.len) {
+	    SGEntry *e = &req->sga.entries[drv->reqIdx];
+
+	    slot = AHCIAllocSlot(drv, !drv->ncq);
+	    if (slot == -1)
+		break;
+	    chunk = e->length - drv->reqOff;
+	    if (chunk > AHCI_MAX_XFER)
+		chunk = AHCI_MAX_XFER;
+	    drv->slot[slot].req = req;
+	    err = AHCIStartIO(drv, slot, (uint8_t *)req->bufs[drv->reqIdx] + drv->reqOff,
+			      (e->offset + drv->reqOff) / AHCI_SECTOR_SIZE,
+			      chunk / AHCI_SECTOR_SIZE,
+			      req->op == DISKREQ_OP_WRITE);
+	} else {
+	    // Empty request
+	    slot = -1;
+	    err = 0;
+	}
+
+	if (err != 0) {
+	    drv->slot[slot].req = NULL;
+	    AHCIFreeSlot(drv, slot);
+	    req->status = err;
+	    finished = true;
+	} else if (req->op == DISKREQ_OP_FLUSH || slot == -1) {
+	    finished = true;
+	} else {
+	    drv->reqOff += chunk;
+	    if (drv->reqOff == req->sga.entries[drv->reqIdx].length) {
+		drv->reqIdx++;
+		drv->reqOff = 0;
+	    }
+	    finished = (drv->reqIdx == req->sga.len);
+	}
+
+	if (!finished)
+	    continue;
+
+	TAILQ_REMOVE(&drv->reqQueue, req, entries);
+	drv->reqIdx = 0;
+	drv->reqOff = 0;
+
+	Spinlock_Lock(&drv->lock);
+	if (!AHCIReqBusy(drv, req))
+	    TAILQ_INSERT_TAIL(&done, req, entries);
+	Spinlock_Unlock(&drv->lock);
+    }
+    Spinlock_Unlock(&drv->reqLock);
+
+    AHCICompleteList(&done);
+}
+
+/**
+ * AHCICheckSGA --
+ *
+ * Checks that the ranges in an SGArray are sector aligned and on the disk.
+ */
+static int
+AHCICheckSGA(AHCIDrive *drv, SGArray *sga)
+{
     int i;
-    for (i = 0; i < sga->len; i++)
-    {
-	ct->prdt[i].dba = sga->entries[i].offset;
-	ct->prdt[i].descInfo = sga->entries[i].length - 1;
-	// Must be a multiple of word size
-	ASSERT(sga->entries[i].length % 2 == 0);
+
+    for (i = 0; i < sga->len; i++) {
+	uint64_t off = sga->entries[i].offset;
+	uint64_t len = sga->entries[i].length;
+
+	if ((off % AHCI_SECTOR_SIZE) != 0 || (len % AHCI_SECTOR_SIZE) != 0 ||
+	    (off + len) / AHCI_SECTOR_SIZE > drv->sectors)
+	    return -EINVAL;
+    }
+
+    return 0;
+}
+
+int
+AHCI_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return AHCIIO((AHCIDrive *)disk->handle, buf, sga, false);
+}
+
+int
+AHCI_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return AHCIIO((AHCIDrive *)disk->handle, buf, sga, true);
+}
+
+int
+AHCI_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    AHCIDrive *drv = (AHCIDrive *)disk->handle;
+    uint32_t pending;
+    int slot, status;
+
+    while ((slot = AHCIAllocSlot(drv, true)) == -1)
+	AHCIWaitFreeSlot(drv, true);
+
+    status = AHCIStartFlush(drv, slot);
+    if (status != 0) {
+	AHCIFreeSlot(drv, slot);
+	return status;
+    }
+
+    pending = 1U << slot;
+    return AHCIWaitSlots(drv, &pending, true);
+}
+
+/**
+ * AHCI_Submit --
+ *
+ * Queues an asynchronous request and issues as much of it as the free 
+ * command slots allow.  The request is completed from the interrupt handler.
+ */
+int
+AHCI_Submit(Disk *disk, DiskRequest *req)
+{
+    AHCIDrive *drv = (AHCIDrive *)disk->handle;
+    int status;
+
+    if (req->op != DISKREQ_OP_FLUSH) {
+	status = AHCICheckSGA(drv, &req->sga);
+	if (status != 0)
+	    return status;
     }
 
-    // Specify cfis length and prdt entries;
-    // XXX: support multiple commands
-    cl->cmds[0].prdtl = sga->len;
-    cl->cmds[0].flag = len >> 2;
+    Spinlock_Lock(&drv->reqLock);
+    TAILQ_INSERT_TAIL(&drv->reqQueue, req, entries);
+    Spinlock_Unlock(&drv->reqLock);
 
-    p->ci = 1;
+    AHCIDispatch(drv);
 
     return 0;
 }
 
-void
-AHCI_WaitPort(AHCI *ahci, int port)
+/**
+ * AHCIService --
+ *
+ * Per controller thread that recovers ports after errors and timeouts, 
+ * completes failed requests and keeps the watchdog armed while commands are 
+ * outstanding.
+ */
+static void
+AHCIService(void *arg)
 {
-    volatile AHCIPort *p = ahci->port[port];
+    AHCI *ahci = (AHCI *)arg;
+    bool busy;
+    int port;
+
     while (1) {
-	uint32_t tfd = p->tfd & AHCIPORT_TFD_BSY;
-	if ((tfd == 0) && (p->ci == 0)) {
-	    return;
+	WaitChannel_Lock(&ahci->svcWait);
+	if (!ahci->svcPending) {
+	    WaitChannel_Sleep(&ahci->svcWait);
+	    continue;
+	}
+	ahci->svcPending = false;
+	Spinlock_Unlock(&ahci->svcWait.lock);
+
+	busy = false;
+	for (port = 0; port < AHCI_MAX_PORTS; port++) {
+	    AHCIDrive *drv = ahci->drive[port];
+
+	    if (drv == NULL || !drv->present)
+		continue;
+
+	    if (drv->resetPending)
+		AHCIRecover(drv);
+	    AHCIReap(drv);
+	    AHCIDispatch(drv);
+	    if (drv->slotsIssued != 0)
+		busy = true;
+	}
+
+	if (!busy) {
+	    ahci->watchdogArmed = false;
+	    __sync_synchronize();
+
+	    // Recheck for commands issued before the flag was cleared
+	    for (port = 0; port < AHCI_MAX_PORTS; port++) {
+		AHCIDrive *drv = ahci->drive[port];
+		if (drv != NULL && drv->slotsIssued != 0)
+		    busy = true;
+	    }
+	    if (!busy || !__sync_bool_compare_and_swap(&ahci->watchdogArmed,
+						       false, true))
+		continue;
 	}
 
-	// implement timeouts
+	KTimer_Release(KTimer_Create(1, AHCIWatchdog, ahci));
     }
 }
 
+/**
+ * AHCIAddDisk --
+ *
+ * Registers the drive attached to a port with the block layer.
+ */
+static void
+AHCIAddDisk(AHCIDrive *drv)
+{
+    Disk *disk = &drv->disk;
+
+    disk->handle = drv;
+    disk->ctrlNo = DISK_CTRL_AHCI;
+    disk->diskNo = ahciDiskNo++;
+    disk->sectorSize = AHCI_SECTOR_SIZE;
+    disk->sectorCount = drv->sectors;
+    disk->diskSize = AHCI_SECTOR_SIZE * drv->sectors;
+    disk->read = AHCI_Read;
+    disk->write = AHCI_Write;
+    disk->flush = AHCI_Flush;
+    disk->submit = AHCI_Submit;
+
+    kprintf("AHCI: Port %d is disk%lld.%lld\n", drv->port,
+	    disk->ctrlNo, disk->diskNo);
+
+    Disk_AddDisk(disk);
+}
+
+/**
+ * AHCI_IdentifyPort --
+ *
+ * Identifies the device attached to a port and determines its size and 
+ * whether it supports native command queuing.
+ */
 void
 AHCI_IdentifyPort(AHCI *ahci, int port)
 {
     volatile AHCIPort *p = ahci->port[port];
-    SGArray sga;
+    AHCIDrive *drv = ahci->drive[port];
     SATAFIS_REG_H2D fis;
-    ATAIdentifyDevice ident;
+    ATAIdentifyDevice *ident;
+    uint32_t pending;
+    int slot, status;
 
     kprintf("AHCI: Signature %08x\n", p->sig);
 
+    ident = (ATAIdentifyDevice *)PAlloc_AllocPage();
+
     memset(&fis, 0, sizeof(fis));
     fis.type = SATAFIS_TYPE_REG_H2D;
     fis.flag = SATAFIS_REG_H2D_FLAG_COMMAND;
     fis.command = SATAFIS_CMD_IDENTIFY;
 
-    sga.len = 1;
-    // VA2PA
-    sga.entries[0].offset = (uintptr_t)&ident;
-    sga.entries[0].length = 512;
+    slot = AHCIAllocSlot(drv, true);
+    ASSERT(slot != -1);
+    status = AHCIIssueCommand(drv, slot, &fis, sizeof(fis), ident,
+			      sizeof(*ident), false, false);
+    if (status == 0) {
+	pending = 1U << slot;
+	status = AHCIWaitSlots(drv, &pending, true);
+    } else {
+	AHCIFreeSlot(drv, slot);
+    }
+    if (status != 0) {
+	kprintf("AHCI: Identify failed on port %d (%d)\n", port, status);
+	PAlloc_Release(ident);
+	return;
+    }
 
-    AHCI_IssueCommand(ahci, port, &sga, &fis, sizeof(fis));
-    kprintf("AHCI: Identify Issued Port %d\n", port);
-    AHCI_WaitPort(ahci, port);
+    drv->sectors = ident->lbaSectors & 0x0000FFFFFFFFFFFFULL;
+    if ((ahci->hc->cap & AHCI_CAP_SNCQ) &&
+	(ident->sataCap & ATA_SATACAP_NCQ)) {
+	drv->ncq = true;
+	drv->queueDepth = (ident->queueDepth & ATA_QUEUEDEPTH_MASK) + 1;
+	if (drv->queueDepth > ahci->cmdSlots)
+	    drv->queueDepth = ahci->cmdSlots;
+    } else {
+	drv->ncq = false;
+	drv->queueDepth = 1;
+    }
 
-    kprintf("AHCI: Identify Succeeded Port %d\n", port);
-    Debug_PrintHex((const char *)&ident, 512, 0, 512);
-    AHCI_DumpPort(ahci, port);
-    uint64_t val = (uint64_t)&ident;
-    Debug_PrintHex((const char *)&val, 8, 0, 8);
+    Spinlock_Lock(&drv->lock);
+    drv->slotMask = (drv->queueDepth == 32) ? 0xFFFFFFFF :
+		    ((1U << drv->queueDepth) - 1);
+    drv->slotsFree = drv->slotMask;
+    Spinlock_Unlock(&drv->lock);
+    drv->present = true;
 
-    return;
+    kprintf("AHCI: Port %d %lld sectors, %s queue depth %d\n", port,
+	    drv->sectors, drv->ncq ? "NCQ" : "no NCQ", drv->queueDepth);
+
+    PAlloc_Release(ident);
 }
 
+/**
+ * AHCI_ResetPort --
+ *
+ * Stops the port, programs the command list and received FIS addresses, 
+ * starts it again and identifies the attached device.
+ */
 void
 AHCI_ResetPort(AHCI *ahci, int port)
 {
     volatile AHCIPort *p = ahci->port[port];
-    uint32_t cmd = p->cmd;
-    uint32_t cmd_mask = AHCIPORT_CMD_ST | AHCIPORT_CMD_CR |
-			AHCIPORT_CMD_FRE | AHCIPORT_CMD_FR;
-
-    // Wait for controller to be idle
-    if ((cmd & cmd_mask) != 0) {
-	int tries;
-	for (tries = 0; tries < 2; tries++) {
-	    cmd = cmd & ~(AHCIPORT_CMD_ST | AHCIPORT_CMD_FRE);
-	    p->cmd = cmd;
-	    // sleep 500ms
-	    cmd = p->cmd;
-	    if ((cmd & cmd_mask) != 0) {
-		kprintf("AHCI: failed to reset port %d\n", port);
-	    }
-	}
-    }
+
+    // Wait for the command engine and FIS receive to stop
+    p->cmd &= ~AHCIPORT_CMD_ST;
+    if (!AHCIWaitReg(&p->cmd, AHCIPORT_CMD_CR, 0, 500))
+	kprintf("AHCI: failed to reset port %d\n", port);
+    p->cmd &= ~AHCIPORT_CMD_FRE;
+    if (!AHCIWaitReg(&p->cmd, AHCIPORT_CMD_FR, 0, 500))
+	kprintf("AHCI: failed to reset port %d\n", port);
+
+    p->clba = DMVA2PA((uintptr_t)ahci->clst[port]);
+    p->fb = DMVA2PA((uintptr_t)ahci->rfis[port]);
 
     // Reset interrupts
     p->is = 0xFFFFFFFF;
-    p->is = 0x00000000;
 
     // Reset error
     p->serr = 0xFFFFFFFF;
-    p->serr = 0x00000000;
 
-    p->cmd |= AHCIPORT_CMD_FRE | AHCIPORT_CMD_ST | AHCIPORT_CMD_SUD |
-	      AHCIPORT_CMD_POD | AHCIPORT_CMD_ICCACTIVE;
+    p->cmd |= AHCIPORT_CMD_FRE | AHCIPORT_CMD_SUD | AHCIPORT_CMD_POD |
+	      AHCIPORT_CMD_ICCACTIVE;
 
     // Check port
     uint32_t ssts = p->ssts;
@@ -371,11 +1449,21 @@ AHCI_ResetPort(AHCI *ahci, int port)
 	kprintf("AHCI: Phys communication not established on port %d\n", port);
 	return;
     }
-    if ((ssts & AHCIPORT_SSTS_DETNE) == AHCIPORT_SSTS_DETNOTEST) {
+    if ((ssts & AHCIPORT_SSTS_DETMASK) == AHCIPORT_SSTS_DETNE) {
 	kprintf("AHCI: Port %d not enabled\n", port);
 	return;
     }
 
+    // Wait for the device to become ready before starting the port
+    if (!AHCIWaitReg(&p->tfd, AHCIPORT_TFD_BSY | AHCIPORT_TFD_DRQ, 0, 1000)) {
+	kprintf("AHCI: Device on port %d is not ready\n", port);
+	return;
+    }
+    p->cmd |= AHCIPORT_CMD_ST;
+
+    // Interrupt on command completion and errors
+    p->ie = AHCIPORT_IS_COMPLETE | AHCIPORT_IS_ERROR;
+
     AHCI_IdentifyPort(ahci, port);
 }
 
@@ -387,10 +1475,6 @@ AHCI_Reset(AHCI *ahci)
 
     AHCI_Dump(ahci);
 
-    // Reset controller
-    //uint32_t caps = hc->cap;
-    //uint32_t pi = hc->pi;
-
     hc->ghc |= AHCI_GHC_AE;
     hc->ghc |= AHCI_GHC_HR;
     while (1) {
@@ -409,10 +1493,11 @@ AHCI_Reset(AHCI *ahci)
 	}
     }
 
-    // XXX: Clear interrupts
+    // Clear interrupts
+    hc->is = hc->is;
 
     // Enable Interrupts
-    hc->ghc = AHCI_GHC_IE;
+    hc->ghc |= AHCI_GHC_IE;
 }
 
 void
@@ -431,7 +1516,7 @@ AHCI_Configure(PCIDevice dev)
 	if (dev.bars[bar].size == 0)
 	    continue;
 
-	kprintf("AHCI: BAR%d base=%08x size=%08x %s\n",
+	kprintf("AHCI: BAR%d base=%08llx size=%08llx %s\n",
 		bar, dev.bars[bar].base, dev.bars[bar].size,
 		dev.bars[bar].type == PCIBAR_TYPE_IO ? "IO" : "Mem");
     }
@@ -439,10 +1524,15 @@ AHCI_Configure(PCIDevice dev)
     // Copy PCIDevice structure
     memcpy(&ahci->dev, &dev, sizeof(dev));
 
-    // XXX: Register IRQ
+    // Register IRQ
+    ahci->irqHandle.irq = dev.irq;
+    ahci->irqHandle.cb = &AHCI_Interrupt;
+    ahci->irqHandle.arg = ahci;
+    IRQ_Register(dev.irq, &ahci->irqHandle);
 
     // Setup
-    hc = (volatile AHCIHostControl *)(uintptr_t)dev.bars[AHCI_ABAR].base;
+    uintptr_t abar = DMPA2VA((uintptr_t)dev.bars[AHCI_ABAR].base);
+    hc = (volatile AHCIHostControl *)abar;
     ahci->hc = (AHCIHostControl *)hc;
 
     uint32_t caps = hc->cap;
@@ -466,6 +1556,9 @@ AHCI_Configure(PCIDevice dev)
     if (caps & AHCI_CAP_SNCQ)
 	kprintf("AHCI: Supports NCQ\n");
 
+    ahci->cmdSlots = AHCI_CAP_NCS(caps);
+    kprintf("AHCI: %d command slots\n", ahci->cmdSlots);
+
     // Disable Interrupts
     hc->ghc &= ~AHCI_GHC_IE;
 
@@ -477,8 +1570,8 @@ AHCI_Configure(PCIDevice dev)
     {
 	if (ports & (1 << p))
 	{
-	    ahci->port[p] = (AHCIPort *)(uintptr_t)(dev.bars[AHCI_ABAR].base +
-				AHCI_PORT_OFFSET + AHCI_PORT_LENGTH * p);
+	    ahci->port[p] = (AHCIPort *)(abar + AHCI_PORT_OFFSET +
+					 AHCI_PORT_LENGTH * p);
 	} else {
 	    ahci->port[p] = 0;
 	}
@@ -490,27 +1583,49 @@ AHCI_Configure(PCIDevice dev)
 	volatile AHCIPort *port = ahci->port[p];
 	if (port != 0) {
 	    int c;
+
+	    ahci->clst[p] = (AHCICommandList *)PAlloc_AllocPage();
+	    memset(ahci->clst[p], 0, sizeof(AHCICommandList));
+
 	    for (c = 0; c < AHCI_MAX_CMDS; c++)
 	    {
 		ahci->ctbl[p][c] = (AHCICommandTable *)PAlloc_AllocPage();
 		memset(ahci->ctbl[p][c], 0, sizeof(AHCICommandTable));
-		// XXX: VA2PA
-		ahci->clst[p]->cmds[c].ctba = (uint64_t)ahci->ctbl[p][c];
+		ahci->clst[p]->cmds[c].ctba =
+		    DMVA2PA((uintptr_t)ahci->ctbl[p][c]);
 	    }
 
-	    ahci->clst[p] = (AHCICommandList *)PAlloc_AllocPage();
-	    memset(ahci->clst[p], 0, sizeof(AHCICommandList));
-	    // XXX: VA2PA
-	    port->clba = (uint64_t)ahci->clst[p];
-
 	    ahci->rfis[p] = (AHCIRecvFIS *)PAlloc_AllocPage();
 	    memset(ahci->rfis[p], 0, sizeof(AHCIRecvFIS));
-	    // XXX: VA2PA
-	    port->fb = (uint64_t)ahci->rfis[p];
+
+	    AHCIDrive *drv = (AHCIDrive *)PAlloc_AllocPage();
+	    drv->ahci = ahci;
+	    drv->port = p;
+	    drv->present = false;
+	    drv->queueDepth = 1;
+	    drv->slotMask = 1;
+	    drv->slotsFree = 1;
+	    drv->slotsIssued = 0;
+	    Spinlock_Init(&drv->lock, "AHCI Drive Lock", SPINLOCK_TYPE_NORMAL);
+	    WaitChannel_Init(&drv->wait, "AHCI Drive");
+	    Spinlock_Init(&drv->reqLock, "AHCI Request Lock",
+			  SPINLOCK_TYPE_NORMAL);
+	    TAILQ_INIT(&drv->reqQueue);
+	    ahci->drive[p] = drv;
 	}
     }
 
+    WaitChannel_Init(&ahci->svcWait, "AHCI Service");
+    Thread *thr = Thread_KThreadCreate(&AHCIService, ahci);
+    if (thr == NULL)
+	Panic("AHCI: Cannot create service thread\n");
+    Sched_SetRunnable(thr);
+
     // Reset controller and ports
     AHCI_Reset(ahci);
-}
 
+    for (p = 0; p < AHCI_MAX_PORTS; p++) {
+	if (ahci->drive[p] != NULL && ahci->drive[p]->present)
+	    AHCIAddDisk(ahci->drive[p]);
+    }
+}
@@ -30,5 +30,11 @@ typedef struct ATAIdentifyDevice
     uint16_t	chksum;		// 255	    - Checksum
 } ATAIdentifyDevice;
 
+#define ATA_DMAMODE_MASK	0x0007	/* Multiword DMA modes supported */
+#define ATA_UDMAMODE_MASK	0x007F	/* Ultra DMA modes supported */
+#define ATA_DEVFLAGS_LBA48	0x0400	/* 48-bit Addressing enabled */
+#define ATA_QUEUEDEPTH_MASK	0x001F	/* Maximum Queue Depth - 1 */
+#define ATA_SATACAP_NCQ		0x0100	/* Supports NCQ */
+
 #endif /* __ATA_H__ */
 
@@ -460,7 +460,7 @@ E1000_Configure(PCIDevice dev)
 	if (dev.bars[bar].size == 0)
 	    continue;
 
-	kprintf("E1000: BAR%d base=%08x size=%08x %s\n",
+	kprintf("E1000: BAR%d base=%08llx size=%08llx %s\n",
 		bar, dev.bars[bar].base, dev.bars[bar].size,
 		dev.bars[bar].type == PCIBAR_TYPE_IO ? "IO" : "Mem");
     }
@@ -0,0 +1,971 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/kconfig.h>
+#include <sys/disk.h>
+#include <sys/irq.h>
+#include <sys/kmem.h>
+#include <sys/ktime.h>
+#include <sys/mp.h>
+#include <sys/pci.h>
+#include <sys/queue.h>
+#include <sys/sga.h>
+#include <sys/spinlock.h>
+#include <errno.h>
+
+#include <machine/amd64.h>
+#include <machine/mp.h>
+#include <machine/pmap.h>
+
+#include "nvme.h"
+
+/*
+ * NVMe Driver
+ *
+ * Creates one I/O submission and completion queue pair per CPU and submits
+ * requests on the queue of the current CPU, so CPUs never contend for a
+ * queue lock on the submission path.  Commands are written to the
+ * submission queue in batches with a single tail doorbell write, and each
+ * pass over a completion queue writes the head doorbell once.
+ *
+ * Command identifiers index a per-queue command table, each entry owns a
+ * preallocated PRP list used for transfers spanning more than two pages.
+ * All completion queues share the pin based interrupt.
+ */
+
+#define NVME_ADMIN_ENTRIES	16
+#define NVME_IO_ENTRIES		64	/* Limited by the command bitmap */
+#define NVME_MAX_QUEUES		MAX_CPUS
+#define NVME_MAX_NAMESPACES	8
+#define NVME_MAX_XFER		(256*1024)
+#define NVME_PRPLIST_ENTRIES	(NVME_MAX_XFER / PGSIZE)
+#define NVME_PRPLIST_SIZE	(NVME_PRPLIST_ENTRIES * sizeof(uint64_t))
+#define NVME_ADMIN_TIMEOUT	5000	/* ms */
+
+typedef struct NVMe NVMe;
+
+typedef struct NVMeNS
+{
+    NVMe		*ctrl;
+    uint32_t		nsid;
+    uint64_t		sectorSize;
+    uint64_t		sectors;
+    Disk		disk;
+} NVMeNS;
+
+typedef struct NVMeCmd
+{
+    DiskRequest		*req;
+    uint64_t		*prpList;
+    uint64_t		prpListPA;
+} NVMeCmd;
+
+/*
+ * NVMeQueue
+ * 	An I/O queue pair.  Requests wait in reqQueue until a command is
+ * 	free, the head may be partially issued with reqIdx and reqOff
+ * 	tracking the next SGArray entry and offset to issue.  There are
+ * 	fewer commands than submission queue entries so the submission queue
+ * 	can never overflow.
+ */
+typedef struct NVMeQueue
+{
+    NVMe		*ctrl;
+    uint16_t		qid;
+    uint16_t		entries;
+    uint16_t		sqTail;
+    uint16_t		cqHead;
+    uint16_t		phase;		// Expected CQE phase
+    Spinlock		lock;
+    NVMeSQE		*sq;
+    volatile NVMeCQE	*cq;
+    volatile uint32_t	*sqDoorbell;
+    volatile uint32_t	*cqDoorbell;
+    uint64_t		cmdsFree;	// Free command bitmap
+    NVMeCmd		*cmds;
+    TAILQ_HEAD(NVMeReqQueue, DiskRequest) reqQueue;
+    int			reqIdx;		// Next SGArray entry of the head
+    uint64_t		reqOff;		// Offset within the entry
+} NVMeQueue;
+
+struct NVMe
+{
+    PCIDevice		dev;
+    IRQHandler		irqHandle;
+    volatile uint8_t	*regs;
+    uint64_t		cap;
+    uint64_t		maxXfer;
+    bool		vwc;		// Volatile write cache present
+    NVMeQueue		admin;
+    int			numQueues;
+    NVMeQueue		*queue;		// I/O queues, one page
+    int			numNS;
+    NVMeNS		ns[NVME_MAX_NAMESPACES];
+};
+
+int NVMe_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int NVMe_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int NVMe_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int NVMe_Submit(Disk *disk, DiskRequest *req);
+void NVMe_Configure(PCIDevice dev);
+
+static uint64_t nvmeDiskNo;
+
+void
+NVMe_Init(uint32_t bus, uint32_t slot, uint32_t func)
+{
+    PCIDevice dev;
+
+    dev.bus = bus;
+    dev.slot = slot;
+    dev.func = func;
+    dev.vendor = PCI_GetVendorID(&dev);
+    dev.device = PCI_GetDeviceID(&dev);
+
+    ASSERT(sizeof(NVMe) <= PGSIZE);
+    ASSERT(NVME_MAX_QUEUES * sizeof(NVMeQueue) <= PGSIZE);
+    ASSERT(sizeof(NVMeSQE) == 64);
+    ASSERT(sizeof(NVMeCQE) == 16);
+
+    kprintf("NVMe: Found controller (%04x:%04x)\n", dev.vendor, dev.device);
+    NVMe_Configure(dev);
+}
+
+static inline uint32_t
+NVMeRead32(NVMe *ctrl, uint32_t reg)
+{
+    return *(volatile uint32_t *)(ctrl->regs + reg);
+}
+
+static inline void
+NVMeWrite32(NVMe *ctrl, uint32_t reg, uint32_t val)
+{
+    *(volatile uint32_t *)(ctrl->regs + reg) = val;
+}
+
+static inline void
+NVMeWrite64(NVMe *ctrl, uint32_t reg, uint64_t val)
+{
+    *(volatile uint64_t *)(ctrl->regs + reg) = val;
+}
+
+/**
+ * NVMeWaitReady --
+ *
+ * Waits for CSTS.RDY to reach the given value for up to the controller's
+ * reported timeout.
+ *
+ * @retval true if the controller reached the state.
+ * @retval false on timeout or a controller fatal error.
+ */
+static bool
+NVMeWaitReady(NVMe *ctrl, bool ready)
+{
+    uint64_t timeout = NVME_CAP_TO(ctrl->cap) * 500ULL + 500ULL;
+    uint64_t deadline = KTime_GetEpochNS() + timeout * 1000000ULL;
+    uint32_t csts;
+
+    while (1) {
+	csts = NVMeRead32(ctrl, NVME_REG_CSTS);
+	if (csts & NVME_CSTS_CFS)
+	    return false;
+	if (((csts & NVME_CSTS_RDY) != 0) == ready)
+	    return true;
+	if (KTime_GetEpochNS() > deadline)
+	    return false;
+	pause();
+    }
+}
+
+/**
+ * NVMeInitQueue --
+ *
+ * Allocates the rings of a queue pair and computes its doorbell addresses.
+ * I/O queues also get a command table with one PRP list per command.
+ *
+ * @retval false if memory is exhausted.
+ */
+static bool
+NVMeInitQueue(NVMe *ctrl, NVMeQueue *q, uint16_t qid, uint16_t entries)
+{
+    uint32_t stride = 4 << NVME_CAP_DSTRD(ctrl->cap);
+    uint64_t sqBytes = ROUNDUP(entries * sizeof(NVMeSQE), PGSIZE);
+    uint64_t cqBytes = ROUNDUP(entries * sizeof(NVMeCQE), PGSIZE);
+    uint8_t *pg = NULL;
+    int i, cmds;
+
+    q->ctrl = ctrl;
+    q->qid = qid;
+    q->entries = entries;
+    q->sqTail = 0;
+    q->cqHead = 0;
+    q->phase = NVME_CQE_PHASE;
+    q->sq = PAlloc_AllocContig(sqBytes / PGSIZE);
+    q->cq = PAlloc_AllocContig(cqBytes / PGSIZE);
+    q->sqDoorbell = (volatile uint32_t *)(ctrl->regs + NVME_REG_DOORBELL +
+					  (2 * qid) * stride);
+    q->cqDoorbell = (volatile uint32_t *)(ctrl->regs + NVME_REG_DOORBELL +
+					  (2 * qid + 1) * stride);
+    Spinlock_Init(&q->lock, "NVMe Queue Lock", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&q->reqQueue);
+    q->reqIdx = 0;
+    q->reqOff = 0;
+    q->cmds = NULL;
+    q->cmdsFree = 0;
+
+    if (q->sq == NULL || q->cq == NULL)
+	return false;
+
+    if (qid == 0)
+	return true;
+
+    // One entry is left unused so a full queue is distinguishable
+    cmds = entries - 1;
+    q->cmds = PAlloc_AllocPage();
+    if (q->cmds == NULL)
+	return false;
+    ASSERT(cmds * sizeof(NVMeCmd) <= PGSIZE);
+
+    // Several PRP lists share each page
+    for (i = 0; i < cmds; i++) {
+	uint64_t off = (i % (PGSIZE / NVME_PRPLIST_SIZE)) * NVME_PRPLIST_SIZE;
+
+	if (off == 0) {
+	    pg = PAlloc_AllocPage();
+	    if (pg == NULL)
+		return false;
+	}
+
+	q->cmds[i].req = NULL;
+	q->cmds[i].prpList = (uint64_t *)(pg + off);
+	q->cmds[i].prpListPA = DMVA2PA((uintptr_t)q->cmds[i].prpList);
+    }
+    q->cmdsFree = (cmds == 64) ? ~0ULL : ((1ULL << cmds) - 1);
+
+    return true;
+}
+
+/**
+ * NVMeFreeQueue --
+ *
+ * Releases the memory of a queue, which may be partially initialized.  The 
+ * controller must be disabled or the queue deleted first.
+ */
+static void
+NVMeFreeQueue(NVMeQueue *q)
+{
+    uint64_t sqBytes = ROUNDUP(q->entries * sizeof(NVMeSQE), PGSIZE);
+    uint64_t cqBytes = ROUNDUP(q->entries * sizeof(NVMeCQE), PGSIZE);
+    uint64_t off;
+    int i;
+
+    for (off = 0; q->sq != NULL && off < sqBytes; off += PGSIZE)
+	PAlloc_Release((uint8_t *)q->sq + off);
+    for (off = 0; q->cq != NULL && off < cqBytes; off += PGSIZE)
+	PAlloc_Release((uint8_t *)q->cq + off);
+    q->sq = NULL;
+    q->cq = NULL;
+
+    if (q->cmds == NULL)
+	return;
+
+    // The first command of each PRP list page points at the page
+    for (i = 0; i < q->entries - 1; i += PGSIZE / NVME_PRPLIST_SIZE) {
+	if (q->cmds[i].prpList == NULL)
+	    break;
+	PAlloc_Release(q->cmds[i].prpList);
+    }
+    PAlloc_Release(q->cmds);
+    q->cmds = NULL;
+}
+
+/**
+ * NVMeAdminCmd --
+ *
+ * Issues an admin command and polls for its completion.  Admin commands are
+ * only issued while the controller is being configured.
+ *
+ * @param [in] ctrl Controller.
+ * @param [in] sqe Command, the command identifier is assigned here.
+ * @param [out] dw0 Command specific result or NULL.
+ *
+ * @retval 0 if successful
+ * @return Otherwise -EIO or -ETIMEDOUT.
+ */
+static int
+NVMeAdminCmd(NVMe *ctrl, NVMeSQE *sqe, uint32_t *dw0)
+{
+    NVMeQueue *q = &ctrl->admin;
+    volatile NVMeCQE *cqe;
+    uint64_t deadline;
+    uint16_t status;
+
+    sqe->cid = q->sqTail;
+    memcpy(&q->sq[q->sqTail], sqe, sizeof(*sqe));
+    q->sqTail = (q->sqTail + 1) % q->entries;
+    __sync_synchronize();
+    *q->sqDoorbell = q->sqTail;
+
+    deadline = KTime_GetEpochNS() + NVME_ADMIN_TIMEOUT * 1000000ULL;
+    cqe = &q->cq[q->cqHead];
+    while ((cqe->status & NVME_CQE_PHASE) != q->phase) {
+	if (KTime_GetEpochNS() > deadline) {
+	    kprintf("NVMe: Admin command %02x timed out\n", sqe->opcode);
+	    return -ETIMEDOUT;
+	}
+	pause();
+    }
+    __sync_synchronize();
+
+    status = cqe->status;
+    if (dw0 != NULL)
+	*dw0 = cqe->dw0;
+
+    q->cqHead++;
+    if (q->cqHead == q->entries) {
+	q->cqHead = 0;
+	q->phase ^= NVME_CQE_PHASE;
+    }
+    *q->cqDoorbell = q->cqHead;
+
+    if (NVME_CQE_STATUS(status) != 0) {
+	kprintf("NVMe: Admin command %02x failed (%03x)\n",
+		sqe->opcode, NVME_CQE_STATUS(status));
+	return -EIO;
+    }
+
+    return 0;
+}
+
+static int
+NVMeIdentify(NVMe *ctrl, uint32_t cns, uint32_t nsid, void *buf)
+{
+    NVMeSQE sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = NVME_ADMIN_IDENTIFY;
+    sqe.nsid = nsid;
+    sqe.prp1 = DMVA2PA((uintptr_t)buf);
+    sqe.cdw10 = cns;
+
+    return NVMeAdminCmd(ctrl, &sqe, NULL);
+}
+
+/**
+ * NVMeCreateQueuePair --
+ *
+ * Creates the completion and submission queues of an I/O queue pair.  All
+ * completion queues use interrupt vector 0.
+ */
+static int
+NVMeCreateQueuePair(NVMe *ctrl, NVMeQueue *q)
+{
+    NVMeSQE sqe;
+    int status;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = NVME_ADMIN_CREATE_CQ;
+    sqe.prp1 = DMVA2PA((uintptr_t)q->cq);
+    sqe.cdw10 = ((uint32_t)(q->entries - 1) << 16) | q->qid;
+    sqe.cdw11 = NVME_QUEUE_PC | NVME_QUEUE_IEN;
+    status = NVMeAdminCmd(ctrl, &sqe, NULL);
+    if (status != 0)
+	return status;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = NVME_ADMIN_CREATE_SQ;
+    sqe.prp1 = DMVA2PA((uintptr_t)q->sq);
+    sqe.cdw10 = ((uint32_t)(q->entries - 1) << 16) | q->qid;
+    sqe.cdw11 = ((uint32_t)q->qid << 16) | NVME_QUEUE_PC;
+
+    return NVMeAdminCmd(ctrl, &sqe, NULL);
+}
+
+/**
+ * NVMeBuildPRP --
+ *
+ * Describes a kernel buffer with PRP entries.  The first entry may start
+ * anywhere in a page, every following entry is a whole page.  Transfers
+ * spanning more than two pages use the command's PRP list.
+ */
+static void
+NVMeBuildPRP(NVMeCmd *cmd, NVMeSQE *sqe, uintptr_t va, uint64_t len)
+{
+    uint64_t first = PGSIZE - (va % PGSIZE);
+    int n = 0;
+
+    sqe->prp1 = KVA2PA(va);
+    sqe->prp2 = 0;
+    if (len <= first)
+	return;
+
+    va += first;
+    len -= first;
+    if (len <= PGSIZE) {
+	sqe->prp2 = KVA2PA(va);
+	return;
+    }
+
+    while (len > 0) {
+	uint64_t chunk = (len > PGSIZE) ? PGSIZE : len;
+
+	ASSERT(n < NVME_PRPLIST_ENTRIES);
+	cmd->prpList[n++] = KVA2PA(va);
+	va += PGSIZE;
+	len -= chunk;
+    }
+    sqe->prp2 = cmd->prpListPA;
+}
+
+/**
+ * NVMeReqBusy --
+ *
+ * @return True if a command still refers to the request.  The caller must
+ * hold the queue lock.
+ */
+static bool
+NVMeReqBusy(NVMeQueue *q, DiskRequest *req)
+{
+    int i;
+
+    for (i = 0; i < q->entries - 1; i++) {
+	if ((q->cmdsFree & (1ULL << i)) == 0 && q->cmds[i].req == req)
+	    return true;
+    }
+
+    return false;
+}
+
+/**
+ * NVMeDispatch --
+ *
+ * Writes commands for queued requests into the submission queue until the
+ * request queue is empty or no commands are free, then rings the tail
+ * doorbell once.  Requests that finish without issuing a command are added
+ * to the done list.  The caller must hold the queue lock.
+ */
+static void
+NVMeDispatch(NVMeQueue *q, struct NVMeReqQueue *done)
+{
+    NVMe *ctrl = q->ctrl;
+    DiskRequest *req;
+    NVMeCmd *cmd;
+    NVMeSQE *sqe;
+    NVMeNS *ns;
+    uint16_t tail = q->sqTail;
+    bool finished;
+    int slot;
+
+    while ((req = TAILQ_FIRST(&q->reqQueue)) != NULL) {
+	ns = (NVMeNS *)req->disk->handle;
+
+	if (req->op != DISKREQ_OP_FLUSH && q->reqIdx >= req->sga.len) {
+	    // Empty request
+	    TAILQ_REMOVE(&q->reqQueue, req, entries);
+	    if (!NVMeReqBusy(q, req))
+		TAILQ_INSERT_TAIL(done, req, entries);
+	    continue;
+	}
+
+	if (q->cmdsFree == 0)
+	    break;
+
+	slot = __builtin_ctzll(q->cmdsFree);
+	cmd = &q->cmds[slot];
+	cmd->req = req;
+
+	sqe = &q->sq[tail];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->cid = slot;
+	sqe->nsid = ns->nsid;
+
+	if (req->op == DISKREQ_OP_FLUSH) {
+	    sqe->opcode = NVME_CMD_FLUSH;
+	    finished = true;
+	} else {
+	    SGEntry *e = &req->sga.entries[q->reqIdx];
+	    uint64_t chunk = e->length - q->reqOff;
+	    uint64_t lba = (e->offset + q->reqOff) / ns->sectorSize;
+
+	    if (chunk > ctrl->maxXfer)
+		chunk = ctrl->maxXfer;
+
+	    sqe->opcode = (req->op == DISKREQ_OP_WRITE) ? NVME_CMD_WRITE
+							: NVME_CMD_READ;
+	    sqe->cdw10 = (uint32_t)lba;
+	    sqe->cdw11 = (uint32_t)(lba >> 32);
+	    sqe->cdw12 = (chunk / ns->sectorSize) - 1;
+	    NVMeBuildPRP(cmd, sqe, (uintptr_t)req->bufs[q->reqIdx] + q->reqOff,
+			 chunk);
+
+	    q->reqOff += chunk;
+	    if (q->reqOff == e->length) {
+		q->reqIdx++;
+		q->reqOff = 0;
+	    }
+	    finished = (q->reqIdx == req->sga.len);
+	}
+
+	q->cmdsFree &= ~(1ULL << slot);
+	tail = (tail + 1) % q->entries;
+
+	if (finished) {
+	    TAILQ_REMOVE(&q->reqQueue, req, entries);
+	    q->reqIdx = 0;
+	    q->reqOff = 0;
+	}
+    }
+
+    if (tail == q->sqTail)
+	return;
+
+    // Commands must be visible before the doorbell
+    __sync_synchronize();
+    q->sqTail = tail;
+    *q->sqDoorbell = tail;
+}
+
+/**
+ * NVMeReap --
+ *
+ * Processes new completion queue entries, frees their commands and adds
+ * requests with no more commands outstanding to the done list.  The head
+ * doorbell is written once.  The caller must hold the queue lock.
+ */
+static void
+NVMeReap(NVMeQueue *q, struct NVMeReqQueue *done)
+{
+    volatile NVMeCQE *cqe;
+    DiskRequest *req;
+    uint16_t head = q->cqHead;
+    uint16_t cid;
+
+    while (1) {
+	cqe = &q->cq[head];
+	if ((cqe->status & NVME_CQE_PHASE) != q->phase)
+	    break;
+	__sync_synchronize();
+
+	cid = cqe->cid;
+	ASSERT(cid < q->entries - 1);
+	req = q->cmds[cid].req;
+	if (NVME_CQE_STATUS(cqe->status) != 0)
+	    req->status = -EIO;
+
+	q->cmds[cid].req = NULL;
+	q->cmdsFree |= (1ULL << cid);
+
+	head++;
+	if (head == q->entries) {
+	    head = 0;
+	    q->phase ^= NVME_CQE_PHASE;
+	}
+
+	// The head of the queue may not be fully issued yet
+	if (req != TAILQ_FIRST(&q->reqQueue) && !NVMeReqBusy(q, req))
+	    TAILQ_INSERT_TAIL(done, req, entries);
+    }
+
+    if (head != q->cqHead) {
+	q->cqHead = head;
+	*q->cqDoorbell = head;
+    }
+}
+
+/**
+ * NVMeCompleteList --
+ *
+ * Completes requests collected while holding a queue lock.  Callbacks may
+ * submit new requests so they must not be called with the lock held.
+ */
+static void
+NVMeCompleteList(struct NVMeReqQueue *list)
+{
+    DiskRequest *req;
+
+    while ((req = TAILQ_FIRST(list)) != NULL) {
+	TAILQ_REMOVE(list, req, entries);
+	Disk_Complete(req, req->status);
+    }
+}
+
+/**
+ * NVMePoll --
+ *
+ * Completes finished requests on every I/O queue and issues waiting ones.
+ */
+static void
+NVMePoll(NVMe *ctrl)
+{
+    struct NVMeReqQueue done;
+    int i;
+
+    TAILQ_INIT(&done);
+
+    for (i = 0; i < ctrl->numQueues; i++) {
+	NVMeQueue *q = &ctrl->queue[i];
+
+	Spinlock_Lock(&q->lock);
+	NVMeReap(q, &done);
+	NVMeDispatch(q, &done);
+	Spinlock_Unlock(&q->lock);
+    }
+
+    NVMeCompleteList(&done);
+}
+
+static void
+NVMe_Interrupt(void *arg)
+{
+    // The interrupt deasserts once every completion queue head is updated
+    NVMePoll((NVMe *)arg);
+}
+
+/**
+ * NVMe_Submit --
+ *
+ * Queues a request on the current CPU's queue pair and issues as much of it
+ * as the free commands allow.  The request is completed from the interrupt
+ * handler.
+ */
+int
+NVMe_Submit(Disk *disk, DiskRequest *req)
+{
+    NVMeNS *ns = (NVMeNS *)disk->handle;
+    NVMe *ctrl = ns->ctrl;
+    NVMeQueue *q = &ctrl->queue[CPU() % ctrl->numQueues];
+    struct NVMeReqQueue done;
+    int i;
+
+    if (req->op == DISKREQ_OP_FLUSH) {
+	// Without a volatile write cache there is nothing to flush
+	if (!ctrl->vwc) {
+	    Disk_Complete(req, 0);
+	    return 0;
+	}
+    } else {
+	for (i = 0; i < req->sga.len; i++) {
+	    uint64_t off = req->sga.entries[i].offset;
+	    uint64_t len = req->sga.entries[i].length;
+
+	    // PRP entries must be dword aligned
+	    if (((uintptr_t)req->bufs[i] % 4) != 0 ||
+		(off % ns->sectorSize) != 0 || (len % ns->sectorSize) != 0 ||
+		(off + len) / ns->sectorSize > ns->sectors)
+		return -EINVAL;
+	}
+    }
+
+    TAILQ_INIT(&done);
+
+    Spinlock_Lock(&q->lock);
+    TAILQ_INSERT_TAIL(&q->reqQueue, req, entries);
+    NVMeDispatch(q, &done);
+    Spinlock_Unlock(&q->lock);
+
+    NVMeCompleteList(&done);
+
+    return 0;
+}
+
+/**
+ * NVMeIO --
+ *
+ * Performs a request synchronously by polling the completion queues, for
+ * callers that cannot sleep such as the root file system mount.
+ */
+static int
+NVMeIO(Disk *disk, int op, void *buf, SGArray *sga)
+{
+    NVMeNS *ns = (NVMeNS *)disk->handle;
+    DiskRequest *req;
+    int status;
+
+    req = DiskRequest_Alloc();
+    if (req == NULL)
+	return -ENOMEM;
+
+    Disk_InitRequest(req, disk, op, buf, sga, NULL, NULL);
+    status = NVMe_Submit(disk, req);
+    if (status == 0) {
+	while ((req->flags & DISKREQ_FLAG_DONE) == 0)
+	    NVMePoll(ns->ctrl);
+	status = req->status;
+    }
+
+    DiskRequest_Free(req);
+
+    return status;
+}
+
+int
+NVMe_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return NVMeIO(disk, DISKREQ_OP_READ, buf, sga);
+}
+
+int
+NVMe_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return NVMeIO(disk, DISKREQ_OP_WRITE, buf, sga);
+}
+
+int
+NVMe_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return NVMeIO(disk, DISKREQ_OP_FLUSH, NULL, NULL);
+}
+
+/**
+ * NVMeEnable --
+ *
+ * Resets the controller, configures the admin queues and enables it.
+ */
+static bool
+NVMeEnable(NVMe *ctrl)
+{
+    NVMeWrite32(ctrl, NVME_REG_CC, 0);
+    if (!NVMeWaitReady(ctrl, false)) {
+	kprintf("NVMe: Controller reset timed out\n");
+	return false;
+    }
+
+    if (!NVMeInitQueue(ctrl, &ctrl->admin, 0, NVME_ADMIN_ENTRIES))
+	return false;
+
+    NVMeWrite32(ctrl, NVME_REG_AQA, ((NVME_ADMIN_ENTRIES - 1) << 16) |
+		(NVME_ADMIN_ENTRIES - 1));
+    NVMeWrite64(ctrl, NVME_REG_ASQ, DMVA2PA((uintptr_t)ctrl->admin.sq));
+    NVMeWrite64(ctrl, NVME_REG_ACQ, DMVA2PA((uintptr_t)ctrl->admin.cq));
+
+    // Admin commands are polled, keep the interrupt masked until the I/O
+    // queues exist
+    NVMeWrite32(ctrl, NVME_REG_INTMS, 0xFFFFFFFF);
+
+    NVMeWrite32(ctrl, NVME_REG_CC, NVME_CC_EN | NVME_CC_CSS_NVM |
+		NVME_CC_MPS(0) | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4));
+    if (!NVMeWaitReady(ctrl, true)) {
+	kprintf("NVMe: Controller enable timed out\n");
+	return false;
+    }
+
+    return true;
+}
+
+/**
+ * NVMeCreateQueues --
+ *
+ * Requests one I/O queue pair per CPU and creates as many as the controller
+ * grants.
+ */
+static void
+NVMeCreateQueues(NVMe *ctrl)
+{
+    NVMeSQE sqe;
+    uint32_t dw0;
+    uint16_t entries;
+    int i, want;
+
+    want = MP_GetCPUs();
+    if (want > NVME_MAX_QUEUES)
+	want = NVME_MAX_QUEUES;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = NVME_ADMIN_SET_FEATURES;
+    sqe.cdw10 = NVME_FEAT_NUM_QUEUES;
+    sqe.cdw11 = ((uint32_t)(want - 1) << 16) | (want - 1);
+    if (NVMeAdminCmd(ctrl, &sqe, &dw0) == 0) {
+	// Allocated counts are zero based
+	if ((int)(dw0 & 0xFFFF) + 1 < want)
+	    want = (dw0 & 0xFFFF) + 1;
+	if ((int)(dw0 >> 16) + 1 < want)
+	    want = (dw0 >> 16) + 1;
+    } else {
+	want = 1;
+    }
+
+    ctrl->queue = PAlloc_AllocPage();
+    if (ctrl->queue == NULL) {
+	ctrl->numQueues = 0;
+	return;
+    }
+
+    entries = NVME_IO_ENTRIES;
+    if (NVME_CAP_MQES(ctrl->cap) + 1 < entries)
+	entries = NVME_CAP_MQES(ctrl->cap) + 1;
+
+    for (i = 0; i < want; i++) {
+	NVMeQueue *q = &ctrl->queue[i];
+
+	if (!NVMeInitQueue(ctrl, q, i + 1, entries)) {
+	    kprintf("NVMe: Cannot allocate queue %d\n", i + 1);
+	    break;
+	}
+	if (NVMeCreateQueuePair(ctrl, q) != 0)
+	    break;
+    }
+
+    ctrl->numQueues = i;
+}
+
+/**
+ * NVMeAddNamespaces --
+ *
+ * Identifies the active namespaces and registers each one as a disk.
+ */
+static void
+NVMeAddNamespaces(NVMe *ctrl, uint32_t nn, void *buf)
+{
+    NVMeIdentifyNS *id = (NVMeIdentifyNS *)buf;
+    uint32_t nsid;
+
+    for (nsid = 1; nsid <= nn && ctrl->numNS < NVME_MAX_NAMESPACES; nsid++) {
+	NVMeNS *ns = &ctrl->ns[ctrl->numNS];
+	Disk *disk = &ns->disk;
+	uint32_t lbads;
+
+	if (NVMeIdentify(ctrl, NVME_IDENTIFY_NS, nsid, buf) != 0)
+	    continue;
+	if (id->nsze == 0)
+	    continue;
+
+	lbads = NVME_LBAF_LBADS(id->lbaf[NVME_FLBAS_INDEX(id->flbas)]);
+	if (lbads < 9 || (1ULL << lbads) > PGSIZE) {
+	    kprintf("NVMe: Namespace %d has unsupported block size\n", nsid);
+	    continue;
+	}
+
+	ns->ctrl = ctrl;
+	ns->nsid = nsid;
+	ns->sectorSize = 1ULL << lbads;
+	ns->sectors = id->nsze;
+	ctrl->numNS++;
+
+	disk->handle = ns;
+	disk->ctrlNo = DISK_CTRL_NVME;
+	disk->diskNo = nvmeDiskNo++;
+	disk->sectorSize = ns->sectorSize;
+	disk->sectorCount = ns->sectors;
+	disk->diskSize = ns->sectorSize * ns->sectors;
+	disk->read = NVMe_Read;
+	disk->write = NVMe_Write;
+	disk->flush = NVMe_Flush;
+	disk->submit = NVMe_Submit;
+
+	kprintf("NVMe: Namespace %d: %lld sectors of %lld bytes, disk%lld.%lld\n",
+		nsid, ns->sectors, ns->sectorSize, disk->ctrlNo, disk->diskNo);
+
+	Disk_AddDisk(disk);
+    }
+}
+
+/**
+ * NVMeTeardown --
+ *
+ * Disables a controller that failed to configure and releases its queues 
+ * and the controller itself.  Disabling the controller deletes any I/O 
+ * queues it created.
+ */
+static void
+NVMeTeardown(NVMe *ctrl)
+{
+    int i;
+
+    NVMeWrite32(ctrl, NVME_REG_CC, 0);
+    if (!NVMeWaitReady(ctrl, false))
+	kprintf("NVMe: Controller disable timed out\n");
+
+    if (ctrl->queue != NULL) {
+	for (i = 0; i < NVME_MAX_QUEUES; i++)
+	    NVMeFreeQueue(&ctrl->queue[i]);
+	PAlloc_Release(ctrl->queue);
+    }
+    NVMeFreeQueue(&ctrl->admin);
+    PAlloc_Release(ctrl);
+}
+
+void
+NVMe_Configure(PCIDevice dev)
+{
+    NVMe *ctrl = (NVMe *)PAlloc_AllocPage();
+    uint8_t *buf;
+    uint32_t nn;
+    uint8_t mdts;
+
+    if (ctrl == NULL)
+	return;
+
+    PCI_Configure(&dev);
+
+    if (dev.bars[0].type != PCIBAR_TYPE_MEM) {
+	kprintf("NVMe: BAR0 is not a memory BAR\n");
+	PAlloc_Release(ctrl);
+	return;
+    }
+
+    kprintf("NVMe: BAR0 base=%08llx size=%08llx, IRQ %d\n",
+	    dev.bars[0].base, dev.bars[0].size, dev.irq);
+
+    memcpy(&ctrl->dev, &dev, sizeof(dev));
+    ctrl->regs = (volatile uint8_t *)DMPA2VA(dev.bars[0].base);
+    ctrl->cap = *(volatile uint64_t *)(ctrl->regs + NVME_REG_CAP);
+
+    if (NVME_CAP_MPSMIN(ctrl->cap) != 0) {
+	kprintf("NVMe: Controller does not support 4KB pages\n");
+	PAlloc_Release(ctrl);
+	return;
+    }
+
+    if (!NVMeEnable(ctrl)) {
+	NVMeTeardown(ctrl);
+	return;
+    }
+
+    buf = PAlloc_AllocPage();
+    if (buf == NULL) {
+	NVMeTeardown(ctrl);
+	return;
+    }
+    if (NVMeIdentify(ctrl, NVME_IDENTIFY_CTRL, 0, buf) != 0) {
+	kprintf("NVMe: Identify controller failed\n");
+	PAlloc_Release(buf);
+	NVMeTeardown(ctrl);
+	return;
+    }
+
+    mdts = buf[NVME_IDCTRL_MDTS];
+    ctrl->maxXfer = NVME_MAX_XFER;
+    if (mdts != 0 && mdts < 32 && ((uint64_t)PGSIZE << mdts) < ctrl->maxXfer)
+	ctrl->maxXfer = (uint64_t)PGSIZE << mdts;
+    ctrl->vwc = (buf[NVME_IDCTRL_VWC] & 0x1) != 0;
+    memcpy(&nn, &buf[NVME_IDCTRL_NN], sizeof(nn));
+
+    NVMeCreateQueues(ctrl);
+    if (ctrl->numQueues == 0) {
+	kprintf("NVMe: No I/O queues\n");
+	PAlloc_Release(buf);
+	NVMeTeardown(ctrl);
+	return;
+    }
+
+    kprintf("NVMe: %d queues, %d namespaces, max transfer %lldKB%s\n",
+	    ctrl->numQueues, nn, ctrl->maxXfer / 1024,
+	    ctrl->vwc ? ", write cache" : "");
+
+    // Register IRQ
+    ctrl->irqHandle.irq = dev.irq;
+    ctrl->irqHandle.cb = &NVMe_Interrupt;
+    ctrl->irqHandle.arg = ctrl;
+    IRQ_Register(dev.irq, &ctrl->irqHandle);
+    NVMeWrite32(ctrl, NVME_REG_INTMC, 0x1);
+
+    NVMeAddNamespaces(ctrl, nn, buf);
+
+    PAlloc_Release(buf);
+}
+
@@ -0,0 +1,118 @@
+/*
+ * NVMe Definitions
+ */
+
+#ifndef __NVME_H__
+#define __NVME_H__
+
+/*
+ * Controller Registers (BAR0)
+ */
+
+#define NVME_REG_CAP		0x0000	/* Capabilities (64-bit) */
+#define NVME_REG_VS		0x0008	/* Version */
+#define NVME_REG_INTMS		0x000C	/* Interrupt Mask Set */
+#define NVME_REG_INTMC		0x0010	/* Interrupt Mask Clear */
+#define NVME_REG_CC		0x0014	/* Controller Configuration */
+#define NVME_REG_CSTS		0x001C	/* Controller Status */
+#define NVME_REG_AQA		0x0024	/* Admin Queue Attributes */
+#define NVME_REG_ASQ		0x0028	/* Admin SQ Base (64-bit) */
+#define NVME_REG_ACQ		0x0030	/* Admin CQ Base (64-bit) */
+#define NVME_REG_DOORBELL	0x1000
+
+#define NVME_CAP_MQES(_c)	((_c) & 0xFFFF)		/* Max entries - 1 */
+#define NVME_CAP_TO(_c)		(((_c) >> 24) & 0xFF)	/* 500 ms units */
+#define NVME_CAP_DSTRD(_c)	(((_c) >> 32) & 0xF)	/* Doorbell stride */
+#define NVME_CAP_MPSMIN(_c)	(((_c) >> 48) & 0xF)
+
+#define NVME_CC_EN		0x00000001
+#define NVME_CC_CSS_NVM		0x00000000
+#define NVME_CC_MPS(_s)		((_s) << 7)		/* 4KB << s */
+#define NVME_CC_IOSQES(_s)	((_s) << 16)		/* log2 SQE size */
+#define NVME_CC_IOCQES(_s)	((_s) << 20)		/* log2 CQE size */
+
+#define NVME_CSTS_RDY		0x00000001
+#define NVME_CSTS_CFS		0x00000002		/* Fatal Status */
+
+/*
+ * Submission and Completion Queue Entries
+ */
+
+typedef struct NVMeSQE {
+    uint8_t	opcode;
+    uint8_t	flags;
+    uint16_t	cid;
+    uint32_t	nsid;
+    uint64_t	_rsvd;
+    uint64_t	mptr;
+    uint64_t	prp1;
+    uint64_t	prp2;
+    uint32_t	cdw10;
+    uint32_t	cdw11;
+    uint32_t	cdw12;
+    uint32_t	cdw13;
+    uint32_t	cdw14;
+    uint32_t	cdw15;
+} NVMeSQE;
+
+typedef struct NVMeCQE {
+    uint32_t	dw0;
+    uint32_t	_rsvd;
+    uint16_t	sqhd;
+    uint16_t	sqid;
+    uint16_t	cid;
+    uint16_t	status;
+} NVMeCQE;
+
+#define NVME_CQE_PHASE		0x0001
+#define NVME_CQE_STATUS(_s)	(((_s) >> 1) & 0x7FF)	/* Type and code */
+
+/*
+ * Admin Commands
+ */
+
+#define NVME_ADMIN_CREATE_SQ	0x01
+#define NVME_ADMIN_CREATE_CQ	0x05
+#define NVME_ADMIN_IDENTIFY	0x06
+#define NVME_ADMIN_SET_FEATURES	0x09
+
+#define NVME_IDENTIFY_NS	0x00
+#define NVME_IDENTIFY_CTRL	0x01
+
+#define NVME_FEAT_NUM_QUEUES	0x07
+
+#define NVME_QUEUE_PC		0x0001	/* Physically Contiguous */
+#define NVME_QUEUE_IEN		0x0002	/* Interrupts Enabled */
+
+/*
+ * I/O Commands
+ */
+
+#define NVME_CMD_FLUSH		0x00
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+
+/*
+ * Identify Data (only the fields used by the driver)
+ */
+
+#define NVME_IDCTRL_MDTS	77	/* Max transfer, 2^n min pages */
+#define NVME_IDCTRL_NN		516	/* Number of namespaces (32-bit) */
+#define NVME_IDCTRL_VWC		525	/* Volatile write cache */
+
+typedef struct NVMeIdentifyNS {
+    uint64_t	nsze;		// Size in blocks
+    uint64_t	ncap;
+    uint64_t	nuse;
+    uint8_t	nsfeat;
+    uint8_t	nlbaf;		// Number of LBA formats - 1
+    uint8_t	flbas;		// Formatted LBA size
+    uint8_t	_rsvd0[101];
+    uint32_t	lbaf[16];	// LBA formats
+} NVMeIdentifyNS;
+
+#define NVME_FLBAS_INDEX(_f)	((_f) & 0xF)
+#define NVME_LBAF_LBADS(_l)	(((_l) >> 16) & 0xFF)	/* log2 block size */
+
+#endif /* __NVME_H__ */
+
@@ -21,6 +21,9 @@ void PCICfgWrite32(uint32_t bus, uint32_t slot, uint32_t func,
 
 // Supported Devices
 void AHCI_Init(uint32_t bus, uint32_t device, uint32_t func);
+void IDE_PCIInit(uint32_t bus, uint32_t device, uint32_t func);
+void VTBlk_Init(uint32_t bus, uint32_t device, uint32_t func);
+void NVMe_Init(uint32_t bus, uint32_t device, uint32_t func);
 void E1000_Init(uint32_t bus, uint32_t device, uint32_t func);
 
 void
@@ -167,6 +170,18 @@ PCICheckFunction(uint32_t bus, uint32_t device, uint32_t func)
         } else if (subClass == PCI_SCLASS_STORAGE_IDE) {
             kprintf("PCI: (%d,%d,%d) IDE Controller (%04x:%04x)\n",
                     bus, device, func, vendorId, deviceId);
+
+            IDE_PCIInit(bus, device, func);
+        } else if (subClass == PCI_SCLASS_STORAGE_SCSI) {
+            kprintf("PCI: (%d,%d,%d) SCSI Controller (%04x:%04x)\n",
+                    bus, device, func, vendorId, deviceId);
+
+            VTBlk_Init(bus, device, func);
+        } else if (subClass == PCI_SCLASS_STORAGE_NVM) {
+            kprintf("PCI: (%d,%d,%d) NVMe Controller (%04x:%04x)\n",
+                    bus, device, func, vendorId, deviceId);
+
+            NVMe_Init(bus, device, func);
         }
     } else if ((baseClass == PCI_CLASS_NETWORK) && (subClass == 0x00)) {
         kprintf("PCI: (%d,%d,%d) Ethernet (%04x:%04x)\n",
@@ -265,7 +280,7 @@ PCI_Configure(PCIDevice *dev)
     for (bar = 0; bar < PCI_MAX_BARS; bar++)
     {
         uint32_t barReg = PCI_OFFSET_BARFIRST + 4 * bar;
-        uint32_t base, size;
+        uint64_t base, size;
         uint32_t origValue = PCI_CfgRead32(dev, barReg);
 
         PCI_CfgWrite32(dev, barReg, 0xFFFFFFFF);
@@ -279,19 +294,36 @@ PCI_Configure(PCIDevice *dev)
         {
             dev->bars[bar].type = PCIBAR_TYPE_IO;
             base = origValue & 0xFFFFFFFC;
-            size = size & 0xFFFFFFFC;
+            size = (uint32_t)~(size & 0xFFFFFFFC) + 1;
+        } else if ((origValue & PCIBAR_MEM_TYPEMASK) == PCIBAR_MEM_64) {
+            // The upper half of the address is in the next BAR
+            uint32_t origHigh = PCI_CfgRead32(dev, barReg + 4);
+            uint32_t sizeHigh;
+
+            ASSERT(bar + 1 < PCI_MAX_BARS);
+
+            PCI_CfgWrite32(dev, barReg + 4, 0xFFFFFFFF);
+            sizeHigh = PCI_CfgRead32(dev, barReg + 4);
+            PCI_CfgWrite32(dev, barReg + 4, origHigh);
+
+            dev->bars[bar].type = PCIBAR_TYPE_MEM;
+            base = ((uint64_t)origHigh << 32) | (origValue & 0xFFFFFFF0);
+            size = ((uint64_t)sizeHigh << 32) | (size & 0xFFFFFFF0);
             size = ~size + 1;
         } else {
             dev->bars[bar].type = PCIBAR_TYPE_MEM;
             base = origValue & 0xFFFFFFF0;
-            size = size & 0xFFFFFFF0;
-            size = ~size + 1;
-            // XXX: Support 64-bit
-            ASSERT((origValue & 0x06) == 0x00);
+            size = (uint32_t)~(size & 0xFFFFFFF0) + 1;
+            ASSERT((origValue & PCIBAR_MEM_TYPEMASK) == PCIBAR_MEM_32);
         }
 
         dev->bars[bar].base = base;
         dev->bars[bar].size = size;
+
+        // Skip the upper half of a 64-bit BAR
+        if ((origValue & 0x1) == 0 &&
+            (origValue & PCIBAR_MEM_TYPEMASK) == PCIBAR_MEM_64)
+            bar++;
     }
 }
 
@@ -328,6 +360,9 @@ DebugPCICheckFunction(uint32_t bus, uint32_t device, uint32_t func)
         } else if (subClass == PCI_SCLASS_STORAGE_IDE) {
             kprintf("PCI: (%d,%d,%d) IDE Controller (%04x:%04x)\n",
                     bus, device, func, vendorId, deviceId);
+        } else if (subClass == PCI_SCLASS_STORAGE_NVM) {
+            kprintf("PCI: (%d,%d,%d) NVMe Controller (%04x:%04x)\n",
+                    bus, device, func, vendorId, deviceId);
         }
     } else if ((baseClass == PCI_CLASS_NETWORK) && (subClass == 0x00)) {
         kprintf("PCI: (%d,%d,%d) Ethernet (%04x:%04x)\n",
@@ -0,0 +1,259 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/disk.h>
+#include <sys/kmem.h>
+#include <sys/sga.h>
+#include <sys/sysctl.h>
+#include <errno.h>
+
+#include <machine/pmap.h>
+
+/*
+ * RAM Disk
+ *
+ * Disks backed by an XMem region, which limits them to 128MB each.  A
+ * scratch disk of disk_ramdisksize MB is created at boot, and every boot
+ * module given the "ramdisk" option is copied into a disk of its own, so a
+ * newfs_o2fs image can be mounted as the root file system with
+ * kern_rootdisk.
+ *
+ * Requests are performed in the submit routine with one copy per SGArray
+ * entry directly between the caller's buffer and the backing memory, and
+ * complete before it returns.
+ */
+
+#define RAMDISK_SECTOR_SIZE	512
+
+typedef struct RAMDisk
+{
+    XMem		*xmem;
+    uint8_t		*base;
+    uint64_t		size;
+    Disk		disk;
+} RAMDisk;
+
+bool MachineBoot_GetModule(int idx, uintptr_t *start, uintptr_t *len,
+			   const char **cmdline);
+
+int RAMDisk_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int RAMDisk_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int RAMDisk_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int RAMDisk_Submit(Disk *disk, DiskRequest *req);
+
+static uint64_t ramdiskNo;
+
+/**
+ * RAMDiskCheckSGA --
+ *
+ * Checks that the ranges in an SGArray are sector aligned and on the disk.
+ */
+static int
+RAMDiskCheckSGA(RAMDisk *rd, SGArray *sga)
+{
+    int i;
+
+    for (i = 0; i < sga->len; i++) {
+	uint64_t off = sga->entries[i].offset;
+	uint64_t len = sga->entries[i].length;
+
+	if ((off % RAMDISK_SECTOR_SIZE) != 0 ||
+	    (len % RAMDISK_SECTOR_SIZE) != 0 || off + len > rd->size)
+	    return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * RAMDiskCopy --
+ *
+ * Copies each SGArray entry between its buffer and the backing memory.
+ *
+ * @param [in] rd RAM disk.
+ * @param [in] bufs Buffer of each entry.
+ * @param [in] sga Disk offsets and lengths.
+ * @param [in] write True to copy into the disk.
+ */
+static int
+RAMDiskCopy(RAMDisk *rd, void **bufs, SGArray *sga, bool write)
+{
+    int i, status;
+
+    status = RAMDiskCheckSGA(rd, sga);
+    if (status != 0)
+	return status;
+
+    for (i = 0; i < sga->len; i++) {
+	uint8_t *disk = rd->base + sga->entries[i].offset;
+
+	if (write)
+	    memcpy(disk, bufs[i], sga->entries[i].length);
+	else
+	    memcpy(bufs[i], disk, sga->entries[i].length);
+    }
+
+    return 0;
+}
+
+/**
+ * RAMDiskIO --
+ *
+ * Implements the polled read and write routines for a single buffer.
+ */
+static int
+RAMDiskIO(Disk *disk, void *buf, SGArray *sga, bool write)
+{
+    void *bufs[SGARRAY_MAX_ENTRIES];
+    uint8_t *p = (uint8_t *)buf;
+    int i;
+
+    for (i = 0; i < sga->len; i++) {
+	bufs[i] = p;
+	p += sga->entries[i].length;
+    }
+
+    return RAMDiskCopy((RAMDisk *)disk->handle, bufs, sga, write);
+}
+
+int
+RAMDisk_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return RAMDiskIO(disk, buf, sga, false);
+}
+
+int
+RAMDisk_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return RAMDiskIO(disk, buf, sga, true);
+}
+
+int
+RAMDisk_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return 0;
+}
+
+/**
+ * RAMDisk_Submit --
+ *
+ * Performs a request and completes it before returning.
+ */
+int
+RAMDisk_Submit(Disk *disk, DiskRequest *req)
+{
+    RAMDisk *rd = (RAMDisk *)disk->handle;
+    int status = 0;
+
+    if (req->op != DISKREQ_OP_FLUSH)
+	status = RAMDiskCopy(rd, req->bufs, &req->sga,
+			     req->op == DISKREQ_OP_WRITE);
+
+    Disk_Complete(req, status);
+
+    return 0;
+}
+
+/**
+ * RAMDiskCreate --
+ *
+ * Allocates and registers a RAM disk.
+ *
+ * @param [in] size Disk size in bytes, rounded up to a whole page.
+ *
+ * @return RAM disk or NULL if memory is exhausted.
+ */
+static RAMDisk *
+RAMDiskCreate(uint64_t size)
+{
+    RAMDisk *rd = (RAMDisk *)PAlloc_AllocPage();
+
+    if (rd == NULL)
+	return NULL;
+
+    size = ROUNDUP(size, PGSIZE);
+    rd->xmem = XMem_New();
+    if (rd->xmem == NULL || !XMem_Allocate(rd->xmem, size)) {
+	kprintf("RAMDisk: Cannot allocate %lld bytes\n", size);
+	PAlloc_Release(rd);
+	return NULL;
+    }
+    rd->base = (uint8_t *)XMem_GetBase(rd->xmem);
+    rd->size = size;
+
+    rd->disk.handle = rd;
+    rd->disk.ctrlNo = DISK_CTRL_RAMDISK;
+    rd->disk.diskNo = ramdiskNo++;
+    rd->disk.sectorSize = RAMDISK_SECTOR_SIZE;
+    rd->disk.sectorCount = size / RAMDISK_SECTOR_SIZE;
+    rd->disk.diskSize = size;
+    rd->disk.read = RAMDisk_Read;
+    rd->disk.write = RAMDisk_Write;
+    rd->disk.flush = RAMDisk_Flush;
+    rd->disk.submit = RAMDisk_Submit;
+
+    return rd;
+}
+
+/**
+ * RAMDiskIsImage --
+ *
+ * @return True if a module's options, which follow its file name, include
+ * "ramdisk".
+ */
+static bool
+RAMDiskIsImage(const char *cmdline)
+{
+    const char *p = cmdline;
+
+    while ((p = strchr(p, ' ')) != NULL) {
+	while (*p == ' ')
+	    p++;
+	if (strncmp(p, "ramdisk", 7) == 0 && (p[7] == ' ' || p[7] == '\0'))
+	    return true;
+    }
+
+    return false;
+}
+
+void
+RAMDisk_Init()
+{
+    RAMDisk *rd;
+    uintptr_t start, len;
+    const char *cmdline;
+    int i;
+
+    ASSERT(sizeof(RAMDisk) <= PGSIZE);
+
+    for (i = 0; MachineBoot_GetModule(i, &start, &len, &cmdline); i++) {
+	if (!RAMDiskIsImage(cmdline))
+	    continue;
+
+	rd = RAMDiskCreate(len);
+	if (rd == NULL)
+	    continue;
+
+	memcpy(rd->base, (void *)DMPA2VA(start), len);
+	kprintf("RAMDisk: Loaded %s (%lld bytes) as disk%lld.%lld\n",
+		cmdline, len, rd->disk.ctrlNo, rd->disk.diskNo);
+	Disk_AddDisk(&rd->disk);
+    }
+
+    if (SYSCTL_GETINT(disk_ramdisksize) > 0) {
+	rd = RAMDiskCreate(SYSCTL_GETINT(disk_ramdisksize) * 1024 * 1024);
+	if (rd == NULL)
+	    return;
+
+	kprintf("RAMDisk: %lldMB scratch disk as disk%lld.%lld\n",
+		SYSCTL_GETINT(disk_ramdisksize), rd->disk.ctrlNo,
+		rd->disk.diskNo);
+	Disk_AddDisk(&rd->disk);
+    }
+}
+
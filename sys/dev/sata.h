@@ -29,6 +29,13 @@ typedef struct SATAFIS_REG_H2D {
 
 #define SATAFIS_TYPE_REG_H2D	0x27
 
+#define SATAFIS_DEVICE_LBA	0x40	/* LBA Addressing */
+
+#define SATAFIS_CMD_READ_DMA_EXT	0x25
+#define SATAFIS_CMD_WRITE_DMA_EXT	0x35
+#define SATAFIS_CMD_READ_FPDMA_QUEUED	0x60
+#define SATAFIS_CMD_WRITE_FPDMA_QUEUED	0x61
+#define SATAFIS_CMD_FLUSH_CACHE_EXT	0xEA
 #define SATAFIS_CMD_IDENTIFY	0xEC
 
 #endif /* __SATA_H__ */
@@ -0,0 +1,120 @@
+/*
+ * VirtIO Definitions
+ */
+
+#ifndef __VIRTIO_H__
+#define __VIRTIO_H__
+
+/*
+ * Legacy PCI Interface (I/O BAR0)
+ */
+
+#define VIRTIO_PCI_VENDOR		0x1AF4
+
+#define VIRTIO_PCI_DEVFEATURES		0x00	/* 32-bit */
+#define VIRTIO_PCI_GUESTFEATURES	0x04	/* 32-bit */
+#define VIRTIO_PCI_QUEUEPFN		0x08	/* 32-bit */
+#define VIRTIO_PCI_QUEUESIZE		0x0C	/* 16-bit */
+#define VIRTIO_PCI_QUEUESEL		0x0E	/* 16-bit */
+#define VIRTIO_PCI_QUEUENOTIFY		0x10	/* 16-bit */
+#define VIRTIO_PCI_STATUS		0x12	/* 8-bit */
+#define VIRTIO_PCI_ISR			0x13	/* 8-bit, read clears */
+#define VIRTIO_PCI_CONFIG		0x14	/* Device config without MSI-X */
+
+#define VIRTIO_PCI_QUEUEALIGN		4096
+#define VIRTIO_PCI_QUEUEPFNSHIFT	12
+
+#define VIRTIO_STATUS_ACK		0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVEROK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VIRTIO_ISR_QUEUE		0x01	/* Used buffer notification */
+#define VIRTIO_ISR_CONFIG		0x02	/* Configuration change */
+
+#define VIRTIO_F_RING_INDIRECT_DESC	(1U << 28)
+
+/*
+ * Split Virtqueue
+ */
+
+typedef struct VirtqDesc {
+    uint64_t	addr;
+    uint32_t	len;
+    uint16_t	flags;
+    uint16_t	next;
+} VirtqDesc;
+
+#define VIRTQ_DESC_F_NEXT		0x0001
+#define VIRTQ_DESC_F_WRITE		0x0002	/* Device writes the buffer */
+#define VIRTQ_DESC_F_INDIRECT		0x0004	/* Buffer is a descriptor table */
+
+typedef struct VirtqAvail {
+    uint16_t	flags;
+    uint16_t	idx;
+    uint16_t	ring[];
+} VirtqAvail;
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT	0x0001
+
+typedef struct VirtqUsedElem {
+    uint32_t	id;
+    uint32_t	len;
+} VirtqUsedElem;
+
+typedef struct VirtqUsed {
+    uint16_t	flags;
+    uint16_t	idx;
+    VirtqUsedElem ring[];
+} VirtqUsed;
+
+#define VIRTQ_USED_F_NO_NOTIFY		0x0001
+
+/*
+ * Block Device
+ */
+
+#define VIRTIO_PCI_DEVICE_BLK		0x1001	/* Transitional block device */
+
+#define VIRTIO_BLK_F_SIZE_MAX		(1U << 1)
+#define VIRTIO_BLK_F_SEG_MAX		(1U << 2)
+#define VIRTIO_BLK_F_RO			(1U << 5)
+#define VIRTIO_BLK_F_BLK_SIZE		(1U << 6)
+#define VIRTIO_BLK_F_FLUSH		(1U << 9)
+#define VIRTIO_BLK_F_MQ			(1U << 12)
+
+typedef struct VirtioBlkConfig {
+    uint64_t	capacity;	// 512 byte sectors
+    uint32_t	sizeMax;
+    uint32_t	segMax;
+    uint16_t	cylinders;
+    uint8_t	heads;
+    uint8_t	sectors;
+    uint32_t	blkSize;
+    uint8_t	physBlockExp;
+    uint8_t	alignOffset;
+    uint16_t	minIOSize;
+    uint32_t	optIOSize;
+    uint8_t	writeback;
+    uint8_t	_rsvd0;
+    uint16_t	numQueues;
+} __attribute__((packed)) VirtioBlkConfig;
+
+typedef struct VirtioBlkHdr {
+    uint32_t	type;
+    uint32_t	_rsvd;
+    uint64_t	sector;
+} VirtioBlkHdr;
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define VIRTIO_BLK_SECTOR_SIZE		512
+
+#endif /* __VIRTIO_H__ */
+
@@ -0,0 +1,623 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/kconfig.h>
+#include <sys/disk.h>
+#include <sys/irq.h>
+#include <sys/kmem.h>
+#include <sys/mp.h>
+#include <sys/pci.h>
+#include <sys/queue.h>
+#include <sys/sga.h>
+#include <sys/spinlock.h>
+#include <errno.h>
+
+#include <machine/amd64.h>
+#include <machine/mp.h>
+#include <machine/pmap.h>
+
+#include "virtio.h"
+
+/*
+ * VirtIO Block Driver
+ *
+ * Uses the legacy PCI interface, which QEMU exposes for transitional
+ * devices.  Every request is a single descriptor in the ring that points to
+ * an indirect descriptor table holding the request header, the physical
+ * segments of the buffer and the status byte.  Descriptor i of a queue
+ * always refers to command i so the ring never needs a free list.
+ *
+ * Devices offering multiple queues get one queue per CPU, requests are
+ * submitted on the queue of the current CPU to avoid lock contention.  All
+ * queues share the legacy INTx interrupt.
+ */
+
+#define VTBLK_MAX_QUEUES	MAX_CPUS
+#define VTBLK_MAX_INFLIGHT	32	/* Commands per queue */
+#define VTBLK_MAX_XFER		(256*1024)
+#define VTBLK_MAX_SEGS		(VTBLK_MAX_XFER / PGSIZE + 1)
+
+/*
+ * VTBlkCmd
+ * 	A single virtio-blk request.  The indirect table, header and status
+ * 	byte are read and written by the device.
+ */
+typedef struct VTBlkCmd
+{
+    VirtqDesc		indirect[VTBLK_MAX_SEGS + 2];
+    VirtioBlkHdr	hdr;
+    volatile uint8_t	status;
+    DiskRequest		*req;
+} VTBlkCmd;
+
+typedef struct VTBlk VTBlk;
+
+/*
+ * VTBlkQueue
+ * 	Per queue state.  Requests wait in reqQueue until a command is free.
+ * 	The request at the head of the queue may be partially issued, reqIdx
+ * 	and reqOff track the next SGArray entry and offset to issue.  A
+ * 	request completes once it has been fully issued and no command refers
+ * 	to it.
+ */
+typedef struct VTBlkQueue
+{
+    VTBlk		*dev;
+    uint16_t		index;
+    uint16_t		size;		// Ring entries
+    uint16_t		lastUsed;	// Next used ring entry to process
+    Spinlock		lock;
+    VirtqDesc		*desc;
+    VirtqAvail		*avail;
+    VirtqUsed		*used;
+    uint32_t		cmdsFree;	// Free command bitmap
+    VTBlkCmd		*cmds;
+    TAILQ_HEAD(VTBlkReqQueue, DiskRequest) reqQueue;
+    int			reqIdx;		// Next SGArray entry of the head
+    uint64_t		reqOff;		// Offset within the entry
+} VTBlkQueue;
+
+struct VTBlk
+{
+    PCIDevice		dev;
+    IRQHandler		irqHandle;
+    uint16_t		iobase;
+    uint32_t		features;	// Negotiated features
+    uint64_t		sectors;
+    int			numQueues;
+    VTBlkQueue		queue[VTBLK_MAX_QUEUES];
+    Disk		disk;
+};
+
+int VTBlk_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int VTBlk_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int VTBlk_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg);
+int VTBlk_Submit(Disk *disk, DiskRequest *req);
+void VTBlk_Configure(PCIDevice dev);
+
+static uint64_t vtblkDiskNo;
+
+void
+VTBlk_Init(uint32_t bus, uint32_t slot, uint32_t func)
+{
+    PCIDevice dev;
+
+    dev.bus = bus;
+    dev.slot = slot;
+    dev.func = func;
+    dev.vendor = PCI_GetVendorID(&dev);
+    dev.device = PCI_GetDeviceID(&dev);
+
+    if (dev.vendor != VIRTIO_PCI_VENDOR ||
+	dev.device != VIRTIO_PCI_DEVICE_BLK)
+	return;
+
+    ASSERT(sizeof(VTBlk) <= PGSIZE);
+    ASSERT(sizeof(VirtioBlkHdr) == 16);
+
+    kprintf("VirtIO: Found block device\n");
+    VTBlk_Configure(dev);
+}
+
+/**
+ * VTBlkBuildSegs --
+ *
+ * Converts a kernel buffer into descriptors, merging physically contiguous
+ * pages.
+ *
+ * @return Number of descriptors used.
+ */
+static int
+VTBlkBuildSegs(VirtqDesc *desc, void *buf, uint64_t len, bool deviceWrites)
+{
+    uintptr_t va = (uintptr_t)buf;
+    uint64_t pa, chunk;
+    int n = 0;
+
+    while (len > 0) {
+	pa = KVA2PA(va);
+	chunk = PGSIZE - (va % PGSIZE);
+	if (chunk > len)
+	    chunk = len;
+
+	if (n > 0 && desc[n - 1].addr + desc[n - 1].len == pa) {
+	    desc[n - 1].len += chunk;
+	} else {
+	    ASSERT(n < VTBLK_MAX_SEGS);
+	    desc[n].addr = pa;
+	    desc[n].len = chunk;
+	    desc[n].flags = deviceWrites ? VIRTQ_DESC_F_WRITE : 0;
+	    n++;
+	}
+
+	va += chunk;
+	len -= chunk;
+    }
+
+    return n;
+}
+
+/**
+ * VTBlkReqBusy --
+ *
+ * @return True if a command still refers to the request.  The caller must
+ * hold the queue lock.
+ */
+static bool
+VTBlkReqBusy(VTBlkQueue *q, DiskRequest *req)
+{
+    int i;
+
+    for (i = 0; i < VTBLK_MAX_INFLIGHT; i++) {
+	if ((q->cmdsFree & (1U << i)) == 0 && q->cmds[i].req == req)
+	    return true;
+    }
+
+    return false;
+}
+
+/**
+ * VTBlkDispatch --
+ *
+ * Issues commands for queued requests until the queue is empty or no
+ * commands are free, then notifies the device once.  Requests that finish
+ * without issuing a command are added to the done list.  The caller must
+ * hold the queue lock.
+ */
+static void
+VTBlkDispatch(VTBlkQueue *q, struct VTBlkReqQueue *done)
+{
+    DiskRequest *req;
+    VTBlkCmd *cmd;
+    uint16_t added = 0;
+    bool finished;
+    int slot, n;
+
+    while ((req = TAILQ_FIRST(&q->reqQueue)) != NULL) {
+	if (req->op != DISKREQ_OP_FLUSH && q->reqIdx >= req->sga.len) {
+	    // Empty request
+	    TAILQ_REMOVE(&q->reqQueue, req, entries);
+	    if (!VTBlkReqBusy(q, req))
+		TAILQ_INSERT_TAIL(done, req, entries);
+	    continue;
+	}
+
+	if (q->cmdsFree == 0)
+	    break;
+
+	slot = __builtin_ctz(q->cmdsFree);
+	cmd = &q->cmds[slot];
+	cmd->req = req;
+	cmd->status = 0xFF;
+
+	if (req->op == DISKREQ_OP_FLUSH) {
+	    cmd->hdr.type = VIRTIO_BLK_T_FLUSH;
+	    cmd->hdr.sector = 0;
+	    n = 1;
+	    finished = true;
+	} else {
+	    SGEntry *e = &req->sga.entries[q->reqIdx];
+	    bool write = (req->op == DISKREQ_OP_WRITE);
+	    uint64_t chunk = e->length - q->reqOff;
+
+	    if (chunk > VTBLK_MAX_XFER)
+		chunk = VTBLK_MAX_XFER;
+
+	    cmd->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	    cmd->hdr.sector = (e->offset + q->reqOff) / VIRTIO_BLK_SECTOR_SIZE;
+	    n = 1 + VTBlkBuildSegs(&cmd->indirect[1],
+				   (uint8_t *)req->bufs[q->reqIdx] + q->reqOff,
+				   chunk, !write);
+
+	    q->reqOff += chunk;
+	    if (q->reqOff == e->length) {
+		q->reqIdx++;
+		q->reqOff = 0;
+	    }
+	    finished = (q->reqIdx == req->sga.len);
+	}
+
+	// Header, data segments and status
+	cmd->indirect[0].addr = DMVA2PA((uintptr_t)&cmd->hdr);
+	cmd->indirect[0].len = sizeof(cmd->hdr);
+	cmd->indirect[0].flags = 0;
+	cmd->indirect[n].addr = DMVA2PA((uintptr_t)&cmd->status);
+	cmd->indirect[n].len = 1;
+	cmd->indirect[n].flags = VIRTQ_DESC_F_WRITE;
+	for (int i = 0; i < n; i++) {
+	    cmd->indirect[i].flags |= VIRTQ_DESC_F_NEXT;
+	    cmd->indirect[i].next = i + 1;
+	}
+
+	q->desc[slot].len = (n + 1) * sizeof(VirtqDesc);
+	q->avail->ring[(q->avail->idx + added) % q->size] = slot;
+	q->cmdsFree &= ~(1U << slot);
+	added++;
+
+	if (finished) {
+	    TAILQ_REMOVE(&q->reqQueue, req, entries);
+	    q->reqIdx = 0;
+	    q->reqOff = 0;
+	}
+    }
+
+    if (added == 0)
+	return;
+
+    // Descriptors must be visible before the index and the index before
+    // the notification check
+    __sync_synchronize();
+    q->avail->idx += added;
+    __sync_synchronize();
+
+    if ((q->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0)
+	outw(q->dev->iobase + VIRTIO_PCI_QUEUENOTIFY, q->index);
+}
+
+/**
+ * VTBlkReap --
+ *
+ * Processes the used ring, frees finished commands and adds the requests
+ * that have no more commands outstanding to the done list.  The caller must
+ * hold the queue lock.
+ */
+static void
+VTBlkReap(VTBlkQueue *q, struct VTBlkReqQueue *done)
+{
+    VirtqUsedElem *e;
+    VTBlkCmd *cmd;
+    DiskRequest *req;
+
+    while (q->lastUsed != q->used->idx) {
+	__sync_synchronize();
+
+	e = &q->used->ring[q->lastUsed % q->size];
+	ASSERT(e->id < VTBLK_MAX_INFLIGHT);
+	cmd = &q->cmds[e->id];
+	req = cmd->req;
+
+	if (cmd->status == VIRTIO_BLK_S_UNSUPP)
+	    req->status = -EOPNOTSUPP;
+	else if (cmd->status != VIRTIO_BLK_S_OK)
+	    req->status = -EIO;
+
+	cmd->req = NULL;
+	q->cmdsFree |= (1U << e->id);
+	q->lastUsed++;
+
+	// The head of the queue may not be fully issued yet
+	if (req != TAILQ_FIRST(&q->reqQueue) && !VTBlkReqBusy(q, req))
+	    TAILQ_INSERT_TAIL(done, req, entries);
+    }
+}
+
+/**
+ * VTBlkCompleteList --
+ *
+ * Completes requests collected while holding a queue lock.  Callbacks may
+ * submit new requests so they must not be called with the lock held.
+ */
+static void
+VTBlkCompleteList(struct VTBlkReqQueue *list)
+{
+    DiskRequest *req;
+
+    while ((req = TAILQ_FIRST(list)) != NULL) {
+	TAILQ_REMOVE(list, req, entries);
+	Disk_Complete(req, req->status);
+    }
+}
+
+/**
+ * VTBlkPoll --
+ *
+ * Completes finished requests on every queue and issues waiting ones.
+ */
+static void
+VTBlkPoll(VTBlk *dev)
+{
+    struct VTBlkReqQueue done;
+    int i;
+
+    TAILQ_INIT(&done);
+
+    for (i = 0; i < dev->numQueues; i++) {
+	VTBlkQueue *q = &dev->queue[i];
+
+	Spinlock_Lock(&q->lock);
+	VTBlkReap(q, &done);
+	VTBlkDispatch(q, &done);
+	Spinlock_Unlock(&q->lock);
+    }
+
+    VTBlkCompleteList(&done);
+}
+
+static void
+VTBlk_Interrupt(void *arg)
+{
+    VTBlk *dev = (VTBlk *)arg;
+
+    // Reading the ISR acknowledges the interrupt
+    if (inb(dev->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)
+	VTBlkPoll(dev);
+}
+
+/**
+ * VTBlk_Submit --
+ *
+ * Queues a request on the current CPU's queue and issues as much of it as
+ * the free commands allow.  The request is completed from the interrupt
+ * handler.
+ */
+int
+VTBlk_Submit(Disk *disk, DiskRequest *req)
+{
+    VTBlk *dev = (VTBlk *)disk->handle;
+    VTBlkQueue *q = &dev->queue[CPU() % dev->numQueues];
+    struct VTBlkReqQueue done;
+    int i;
+
+    if (req->op == DISKREQ_OP_FLUSH) {
+	// Without a write cache there is nothing to flush
+	if ((dev->features & VIRTIO_BLK_F_FLUSH) == 0) {
+	    Disk_Complete(req, 0);
+	    return 0;
+	}
+    } else {
+	for (i = 0; i < req->sga.len; i++) {
+	    uint64_t off = req->sga.entries[i].offset;
+	    uint64_t len = req->sga.entries[i].length;
+
+	    if ((off % VIRTIO_BLK_SECTOR_SIZE) != 0 ||
+		(len % VIRTIO_BLK_SECTOR_SIZE) != 0 ||
+		(off + len) / VIRTIO_BLK_SECTOR_SIZE > dev->sectors)
+		return -EINVAL;
+	}
+    }
+
+    TAILQ_INIT(&done);
+
+    Spinlock_Lock(&q->lock);
+    TAILQ_INSERT_TAIL(&q->reqQueue, req, entries);
+    VTBlkDispatch(q, &done);
+    Spinlock_Unlock(&q->lock);
+
+    VTBlkCompleteList(&done);
+
+    return 0;
+}
+
+/**
+ * VTBlkIO --
+ *
+ * Performs a request synchronously by polling the device, for callers that
+ * cannot sleep such as the root file system mount.
+ */
+static int
+VTBlkIO(Disk *disk, int op, void *buf, SGArray *sga)
+{
+    DiskRequest *req;
+    int status;
+
+    req = DiskRequest_Alloc();
+    if (req == NULL)
+	return -ENOMEM;
+
+    Disk_InitRequest(req, disk, op, buf, sga, NULL, NULL);
+    status = VTBlk_Submit(disk, req);
+    if (status == 0) {
+	while ((req->flags & DISKREQ_FLAG_DONE) == 0)
+	    VTBlkPoll((VTBlk *)disk->handle);
+	status = req->status;
+    }
+
+    DiskRequest_Free(req);
+
+    return status;
+}
+
+int
+VTBlk_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return VTBlkIO(disk, DISKREQ_OP_READ, buf, sga);
+}
+
+int
+VTBlk_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    return VTBlkIO(disk, DISKREQ_OP_WRITE, buf, sga);
+}
+
+int
+VTBlk_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
+{
+    VTBlk *dev = (VTBlk *)disk->handle;
+
+    if ((dev->features & VIRTIO_BLK_F_FLUSH) == 0)
+	return 0;
+
+    return VTBlkIO(disk, DISKREQ_OP_FLUSH, NULL, NULL);
+}
+
+/**
+ * VTBlkInitQueue --
+ *
+ * Allocates the rings and commands of a virtqueue and hands the rings to the
+ * device.
+ *
+ * @retval false if the queue does not exist or memory is exhausted.
+ */
+static bool
+VTBlkInitQueue(VTBlk *dev, int index)
+{
+    VTBlkQueue *q = &dev->queue[index];
+    uint64_t usedOff, ringBytes, cmdBytes, off;
+    uint8_t *ring;
+    int i, inflight;
+
+    outw(dev->iobase + VIRTIO_PCI_QUEUESEL, index);
+    q->size = inw(dev->iobase + VIRTIO_PCI_QUEUESIZE);
+    if (q->size == 0)
+	return false;
+
+    // Legacy layout: descriptors and available ring, then the used ring
+    usedOff = ROUNDUP(sizeof(VirtqDesc) * q->size + 6 + 2 * q->size,
+		      VIRTIO_PCI_QUEUEALIGN);
+    ringBytes = usedOff + ROUNDUP(6 + sizeof(VirtqUsedElem) * q->size,
+				  VIRTIO_PCI_QUEUEALIGN);
+    ring = PAlloc_AllocContig(ringBytes / PGSIZE);
+
+    inflight = (q->size < VTBLK_MAX_INFLIGHT) ? q->size : VTBLK_MAX_INFLIGHT;
+    cmdBytes = ROUNDUP(sizeof(VTBlkCmd) * inflight, PGSIZE);
+    q->cmds = PAlloc_AllocContig(cmdBytes / PGSIZE);
+
+    if (ring == NULL || q->cmds == NULL) {
+	kprintf("VirtIO: Cannot allocate queue %d\n", index);
+	for (off = 0; ring != NULL && off < ringBytes; off += PGSIZE)
+	    PAlloc_Release(ring + off);
+	for (off = 0; q->cmds != NULL && off < cmdBytes; off += PGSIZE)
+	    PAlloc_Release((uint8_t *)q->cmds + off);
+	q->cmds = NULL;
+	return false;
+    }
+
+    q->dev = dev;
+    q->index = index;
+    q->desc = (VirtqDesc *)ring;
+    q->avail = (VirtqAvail *)(ring + sizeof(VirtqDesc) * q->size);
+    q->used = (VirtqUsed *)(ring + usedOff);
+    q->lastUsed = 0;
+    q->cmdsFree = (inflight == 32) ? 0xFFFFFFFF : ((1U << inflight) - 1);
+    Spinlock_Init(&q->lock, "VirtIO Queue Lock", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&q->reqQueue);
+    q->reqIdx = 0;
+    q->reqOff = 0;
+
+    for (i = 0; i < inflight; i++) {
+	q->desc[i].addr = DMVA2PA((uintptr_t)&q->cmds[i].indirect[0]);
+	q->desc[i].flags = VIRTQ_DESC_F_INDIRECT;
+    }
+
+    outl(dev->iobase + VIRTIO_PCI_QUEUEPFN,
+	 DMVA2PA((uintptr_t)ring) >> VIRTIO_PCI_QUEUEPFNSHIFT);
+
+    return true;
+}
+
+void
+VTBlk_Configure(PCIDevice dev)
+{
+    VTBlk *vtb = (VTBlk *)PAlloc_AllocPage();
+    uint16_t iobase;
+    uint32_t features;
+    int i, queues;
+
+    PCI_Configure(&dev);
+
+    if (dev.bars[0].type != PCIBAR_TYPE_IO) {
+	kprintf("VirtIO: Only the legacy interface is supported\n");
+	PAlloc_Release(vtb);
+	return;
+    }
+
+    memcpy(&vtb->dev, &dev, sizeof(dev));
+    iobase = dev.bars[0].base;
+    vtb->iobase = iobase;
+
+    // Reset and acknowledge the device
+    outb(iobase + VIRTIO_PCI_STATUS, 0);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    features = inl(iobase + VIRTIO_PCI_DEVFEATURES);
+    if ((features & VIRTIO_F_RING_INDIRECT_DESC) == 0) {
+	kprintf("VirtIO: Device does not support indirect descriptors\n");
+	outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	PAlloc_Release(vtb);
+	return;
+    }
+    vtb->features = features & (VIRTIO_F_RING_INDIRECT_DESC |
+				VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ);
+    outl(iobase + VIRTIO_PCI_GUESTFEATURES, vtb->features);
+
+    vtb->sectors = inl(iobase + VIRTIO_PCI_CONFIG) |
+		   ((uint64_t)inl(iobase + VIRTIO_PCI_CONFIG + 4) << 32);
+
+    queues = 1;
+    if (vtb->features & VIRTIO_BLK_F_MQ) {
+	queues = inw(iobase + VIRTIO_PCI_CONFIG +
+		     __builtin_offsetof(VirtioBlkConfig, numQueues));
+	if (queues > MP_GetCPUs())
+	    queues = MP_GetCPUs();
+	if (queues > VTBLK_MAX_QUEUES)
+	    queues = VTBLK_MAX_QUEUES;
+	if (queues < 1)
+	    queues = 1;
+    }
+
+    for (i = 0; i < queues; i++) {
+	if (!VTBlkInitQueue(vtb, i))
+	    break;
+    }
+    if (i == 0) {
+	outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	PAlloc_Release(vtb);
+	return;
+    }
+    vtb->numQueues = i;
+
+    // Register IRQ
+    kprintf("VirtIO: IRQ %d\n", dev.irq);
+    vtb->irqHandle.irq = dev.irq;
+    vtb->irqHandle.cb = &VTBlk_Interrupt;
+    vtb->irqHandle.arg = vtb;
+    IRQ_Register(dev.irq, &vtb->irqHandle);
+
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+	 VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVEROK);
+
+    vtb->disk.handle = vtb;
+    vtb->disk.ctrlNo = DISK_CTRL_VIRTIO;
+    vtb->disk.diskNo = vtblkDiskNo++;
+    vtb->disk.sectorSize = VIRTIO_BLK_SECTOR_SIZE;
+    vtb->disk.sectorCount = vtb->sectors;
+    vtb->disk.diskSize = VIRTIO_BLK_SECTOR_SIZE * vtb->sectors;
+    vtb->disk.read = VTBlk_Read;
+    vtb->disk.write = VTBlk_Write;
+    vtb->disk.flush = VTBlk_Flush;
+    vtb->disk.submit = VTBlk_Submit;
+
+    kprintf("VirtIO: %lld sectors, %d queues%s, disk%lld.%lld\n",
+	    vtb->sectors, vtb->numQueues,
+	    (vtb->features & VIRTIO_BLK_F_FLUSH) ? ", write cache" : "",
+	    vtb->disk.ctrlNo, vtb->disk.diskNo);
+
+    Disk_AddDisk(&vtb->disk);
+}
+
@@ -5,10 +5,16 @@
 
 #include <sys/kassert.h>
 #include <sys/kmem.h>
+#include <sys/irq.h>
+#include <sys/pci.h>
 #include <sys/spinlock.h>
+#include <sys/waitchannel.h>
 #include <sys/disk.h>
+#include <errno.h>
+
+#include <machine/amd64.h>
+#include <machine/pmap.h>
 
-#include "ioport.h"
 #include "../ata.h"
 
 /*
@@ -40,8 +46,15 @@
 #define IDE_CMD_WRITE		0x30
 #define IDE_CMD_WRITE_EXT	0x34
 #define IDE_CMD_FLUSH		0xE7
+#define IDE_CMD_FLUSH_EXT	0xEA
 #define IDE_CMD_IDENTIFY	0xEC
 
+// IDE Commands (DMA)
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_READ_DMA_EXT	0x25
+#define IDE_CMD_WRITE_DMA	0xCA
+#define IDE_CMD_WRITE_DMA_EXT	0x35
+
 // Status
 #define IDE_STATUS_ERR		0x01	/* Error */
 #define IDE_STATUS_DRQ		0x08	/* Data Ready */
@@ -53,13 +66,67 @@
 #define IDE_CONTROL_SRST	0x04	/* Software Reset */
 
 #define IDE_SECTOR_SIZE		512
+#define IDE_MAX_SECTORS		256	/* Sector count register is 8-bits */
+#define IDE_MAX_SECTORS48	2048	/* Limit LBA48 transfers to 1 MB */
+
+// Bus Master Port Offsets (Primary channel)
+#define IDE_BM_COMMAND		0
+#define IDE_BM_STATUS		2
+#define IDE_BM_PRDT		4
+
+#define IDE_BM_BAR		4
+
+#define IDE_BMCMD_START		0x01	/* Start/Stop Bus Master */
+#define IDE_BMCMD_READ		0x08	/* Bus master writes to memory */
+
+#define IDE_BMSTATUS_ACTIVE	0x01	/* Bus Master Active */
+#define IDE_BMSTATUS_ERR	0x02	/* DMA Error */
+#define IDE_BMSTATUS_IRQ	0x04	/* Interrupt */
+
+#define IDE_PROGIF_BUSMASTER	0x80	/* Supports Bus Mastering */
+
+/*
+ * Physical Region Descriptor.  Each region must be physically contiguous, 
+ * below 4 GB and must not cross a 64 KB boundary.  A count of zero means 
+ * 64 KB.
+ */
+typedef struct IDEPRD
+{
+    uint32_t	addr;
+    uint16_t	count;
+    uint16_t	flags;
+} IDEPRD;
 
+#define IDE_PRD_EOT		0x8000	/* End of Table */
+#define IDE_MAX_PRD		(PGSIZE / sizeof(IDEPRD))
+
+/*
+ * IDE
+ * 	A single command may be outstanding on a channel.  The channel is 
+ * 	owned by a thread for the duration of a command, which allows it to 
+ * 	sleep while a DMA transfer completes.  Commands issued from critical 
+ * 	sections fail with -EBUSY rather than wait for another owner.  The 
+ * 	spinlock protects the registers and the completion state shared with 
+ * 	the interrupt handler.
+ */
 typedef struct IDE
 {
     uint16_t	base;		// Base Port
     uint16_t	devctl;		// Device Control
     uint8_t	lastDriveCode;	// Last Drive Code
     Spinlock	lock;
+    // Channel ownership
+    bool	busy;		// Command in progress
+    WaitChannel	busyWait;
+    // Bus Master DMA
+    uint16_t	bmBase;		// Bus Master Base Port or 0 for PIO only
+    IDEPRD	*prdt;		// Physical Region Descriptor Table
+    IRQHandler	irqHandle;
+    WaitChannel	dmaWait;
+    bool	dmaActive;	// DMA transfer in progress
+    volatile bool dmaDone;	// DMA transfer completed
+    uint8_t	dmaStatus;	// Bus Master status at completion
+    uint8_t	ataStatus;	// Device status at completion
 } IDE;
 
 typedef struct IDEDrive
@@ -67,6 +134,7 @@ typedef struct IDEDrive
     IDE		*ide;		// IDE Controller
     int		drive;		// Drive Number
     bool	lba48;		// Supports 48-bit LBA
+    bool	dma;		// Supports DMA
     uint64_t	size;		// Size of Disk
 } IDEDrive;
 
@@ -82,21 +150,85 @@ int IDE_WriteOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len);
 IDE primary;
 IDEDrive primaryDrives[2];
 
+static void IDE_Interrupt(void *arg);
+
+/**
+ * IDE_PCIInit --
+ *
+ * Called by the PCI bus scan for IDE controllers, which is before IDE_Init.  
+ * If the controller supports bus mastering DMA is enabled on the primary 
+ * channel.  Only the legacy primary channel is supported.
+ */
+void
+IDE_PCIInit(uint32_t bus, uint32_t slot, uint32_t func)
+{
+    PCIDevice dev;
+    uint8_t progif;
+    uintptr_t prdtPA;
+
+    dev.bus = bus;
+    dev.slot = slot;
+    dev.func = func;
+    dev.vendor = PCI_GetVendorID(&dev);
+    dev.device = PCI_GetDeviceID(&dev);
+
+    progif = PCI_CfgRead8(&dev, PCI_OFFSET_PROGIF);
+    if ((progif & IDE_PROGIF_BUSMASTER) == 0) {
+	kprintf("IDE: Controller does not support bus mastering\n");
+	return;
+    }
+
+    PCI_Configure(&dev);
+    if (dev.bars[IDE_BM_BAR].type != PCIBAR_TYPE_IO) {
+	kprintf("IDE: No bus master registers\n");
+	return;
+    }
+
+    primary.prdt = (IDEPRD *)PAlloc_AllocPage();
+    if (primary.prdt == NULL)
+	return;
+    prdtPA = DMVA2PA((uintptr_t)primary.prdt);
+    if (prdtPA > 0xFFFFFFFFULL) {
+	PAlloc_Release(primary.prdt);
+	primary.prdt = NULL;
+	return;
+    }
+
+    primary.bmBase = dev.bars[IDE_BM_BAR].base;
+    kprintf("IDE: Bus master DMA at port %04x\n", primary.bmBase);
+}
+
 void
 IDE_Init()
 {
     ASSERT(sizeof(ATAIdentifyDevice) == 512);
+    ASSERT(sizeof(IDEPRD) == 8);
 
     primary.base = IDE_PRIMARY_BASE;
     primary.devctl = IDE_PRIMARY_DEVCTL;
     Spinlock_Init(&primary.lock, "IDE Primary Controller Lock",
 		  SPINLOCK_TYPE_NORMAL);
+    WaitChannel_Init(&primary.busyWait, "IDE Channel");
+    WaitChannel_Init(&primary.dmaWait, "IDE DMA");
 
     if (!IDE_HasController(&primary)) {
 	kprintf("IDE: No controller detected\n");
 	return;
     }
 
+    if (primary.bmBase != 0) {
+	outl(primary.bmBase + IDE_BM_PRDT,
+	     (uint32_t)DMVA2PA((uintptr_t)primary.prdt));
+	outb(primary.bmBase + IDE_BM_COMMAND, 0);
+	outb(primary.bmBase + IDE_BM_STATUS,
+	     IDE_BMSTATUS_ERR | IDE_BMSTATUS_IRQ);
+
+	primary.irqHandle.irq = IDE_PRIMARY_IRQ;
+	primary.irqHandle.cb = &IDE_Interrupt;
+	primary.irqHandle.arg = &primary;
+	IRQ_Register(IDE_PRIMARY_IRQ, &primary.irqHandle);
+    }
+
     Spinlock_Lock(&primary.lock);
     IDE_Reset(&primary);
     IDE_Identify(&primary, 0);
@@ -104,6 +236,51 @@ IDE_Init()
     Spinlock_Unlock(&primary.lock);
 }
 
+/**
+ * IDEAcquire --
+ *
+ * Takes ownership of the channel for a command, sleeping until it is free.  
+ * Callers that cannot sleep fail instead, since the owner may be a thread 
+ * that cannot run on this CPU until the caller leaves its critical section.
+ *
+ * @retval 0 if the channel is now owned by the caller.
+ * @retval -EBUSY if the channel is in use and the caller cannot sleep.
+ */
+static int
+IDEAcquire(IDE *ide)
+{
+    while (1) {
+	WaitChannel_Lock(&ide->busyWait);
+	if (!ide->busy) {
+	    ide->busy = true;
+	    Spinlock_Unlock(&ide->busyWait.lock);
+	    return 0;
+	}
+
+	if (Critical_Level() != 0) {
+	    Spinlock_Unlock(&ide->busyWait.lock);
+	    return -EBUSY;
+	}
+
+	WaitChannel_Sleep(&ide->busyWait);
+    }
+}
+
+/**
+ * IDERelease --
+ *
+ * Releases the channel and wakes up threads waiting for it.
+ */
+static void
+IDERelease(IDE *ide)
+{
+    WaitChannel_Lock(&ide->busyWait);
+    ide->busy = false;
+    Spinlock_Unlock(&ide->busyWait.lock);
+
+    WaitChannel_WakeAll(&ide->busyWait);
+}
+
 int
 IDEWaitForBusy(IDE *ide, bool wait)
 {
@@ -250,9 +427,16 @@ IDE_Identify(IDE *ide, int drive)
 
     primaryDrives[drive].ide = &primary;
     primaryDrives[drive].drive = drive;
-    primaryDrives[drive].lba48 = (ident.lbaSectors > (1 << 24));
+    primaryDrives[drive].lba48 = (ident.deviceFlags & ATA_DEVFLAGS_LBA48) != 0;
+    primaryDrives[drive].dma = (ide->bmBase != 0) &&
+			       ((ident.dmaMode & ATA_DMAMODE_MASK) != 0 ||
+				(ident.udmaMode & ATA_UDMAMODE_MASK) != 0);
     primaryDrives[drive].size = ident.lbaSectors;
 
+    Log(ide, "Drive %d %s, %s\n", drive,
+	primaryDrives[drive].lba48 ? "LBA48" : "LBA28",
+	primaryDrives[drive].dma ? "DMA" : "PIO");
+
     // Register Disk
     Disk *disk = PAlloc_AllocPage();
     if (!disk) {
@@ -260,7 +444,7 @@ IDE_Identify(IDE *ide, int drive)
     }
 
     disk->handle = &primaryDrives[drive];
-    disk->ctrlNo = 0;
+    disk->ctrlNo = DISK_CTRL_IDE;
     disk->diskNo = drive;
     disk->sectorSize = IDE_SECTOR_SIZE;
     disk->sectorCount = ident.lbaSectors;
@@ -277,18 +461,27 @@ IDE_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
 {
     int i;
     int status;
+    uint64_t maxSectors;
     IDEDrive *idedrive;
 
     idedrive = disk->handle;
+    maxSectors = idedrive->lba48 ? IDE_MAX_SECTORS48 : IDE_MAX_SECTORS;
 
     for (i = 0; i < sga->len; i++) {
-	status = IDE_ReadOne(idedrive,
-			     buf,
-			     sga->entries[i].offset / 512,
-			     sga->entries[i].length / 512);
-	buf += sga->entries[i].length;
-	if (status < 0)
-	    return status;
+	uint64_t off = sga->entries[i].offset / IDE_SECTOR_SIZE;
+	uint64_t len = sga->entries[i].length / IDE_SECTOR_SIZE;
+
+	while (len > 0) {
+	    uint64_t sectors = len > maxSectors ? maxSectors : len;
+
+	    status = IDE_ReadOne(idedrive, buf, off, sectors);
+	    if (status < 0)
+		return status;
+
+	    buf += sectors * IDE_SECTOR_SIZE;
+	    off += sectors;
+	    len -= sectors;
+	}
     }
 
     return 0;
@@ -299,18 +492,27 @@ IDE_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
 {
     int i;
     int status;
+    uint64_t maxSectors;
     IDEDrive *idedrive;
 
     idedrive = disk->handle;
+    maxSectors = idedrive->lba48 ? IDE_MAX_SECTORS48 : IDE_MAX_SECTORS;
 
     for (i = 0; i < sga->len; i++) {
-	status = IDE_WriteOne(idedrive,
-			      buf,
-			      sga->entries[i].offset / 512,
-			      sga->entries[i].length / 512);
-	buf += sga->entries[i].length;
-	if (status < 0)
-	    return status;
+	uint64_t off = sga->entries[i].offset / IDE_SECTOR_SIZE;
+	uint64_t len = sga->entries[i].length / IDE_SECTOR_SIZE;
+
+	while (len > 0) {
+	    uint64_t sectors = len > maxSectors ? maxSectors : len;
+
+	    status = IDE_WriteOne(idedrive, buf, off, sectors);
+	    if (status < 0)
+		return status;
+
+	    buf += sectors * IDE_SECTOR_SIZE;
+	    off += sectors;
+	    len -= sectors;
+	}
     }
 
     return 0;
@@ -331,26 +533,30 @@ IDE_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
     else
 	driveCode = 0xB0;
 
+    if (IDEAcquire(ide) != 0)
+	return -EBUSY;
     Spinlock_Lock(&ide->lock);
     outb(ide->base + IDE_DRIVE, driveCode);
-    outb(ide->base + IDE_COMMAND, IDE_CMD_FLUSH);
+    ide->lastDriveCode = driveCode;
+    IDEWaitForBusy(ide, true);
+    outb(ide->base + IDE_COMMAND,
+	 idedrive->lba48 ? IDE_CMD_FLUSH_EXT : IDE_CMD_FLUSH);
 
     IDEWaitForBusy(ide, false);
     Spinlock_Unlock(&ide->lock);
+    IDERelease(ide);
 
     return 0;
 }
 
-int
-IDE_ReadOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
+static int
+IDEPIORead(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
 {
-    bool lba48 = false;
+    bool lba48 = drive->lba48;
     uint8_t driveCode;
     uint8_t status;
     IDE *ide = drive->ide;
 
-    DLOG(ide, "read %llx %llx\n", off, len);
-
     ASSERT(drive->drive == 0 || drive->drive == 1);
 
     if (drive->drive == 0)
@@ -415,16 +621,14 @@ IDE_ReadOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
     return 0;
 }
 
-int
-IDE_WriteOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
+static int
+IDEPIOWrite(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
 {
-    bool lba48 = false;
+    bool lba48 = drive->lba48;
     uint8_t driveCode;
     uint8_t status;
     IDE *ide = drive->ide;
 
-    DLOG(ide, "read %llx %llx\n", off, len);
-
     ASSERT(drive->drive == 0 || drive->drive == 1);
 
     if (drive->drive == 0)
@@ -491,3 +695,245 @@ IDE_WriteOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
     return 0;
 }
 
+
+/**
+ * IDEBuildPRDT --
+ *
+ * Converts a kernel buffer into the channel's PRD table.  Physically 
+ * contiguous pages are merged as long as a region does not cross a 64 KB 
+ * boundary.
+ *
+ * @return Number of PRD entries or -EINVAL if the buffer cannot be used for 
+ * DMA, in which case the caller falls back to PIO.
+ */
+static int
+IDEBuildPRDT(IDE *ide, void *buf, uint64_t len)
+{
+    uintptr_t va = (uintptr_t)buf;
+    uint64_t pa, chunk;
+    uint64_t prevLen = 0;
+    int n = 0;
+
+    while (len > 0) {
+	pa = KVA2PA(va);
+	chunk = PGSIZE - (va % PGSIZE);
+	if (chunk > len)
+	    chunk = len;
+
+	if (pa + chunk > 0x100000000ULL)
+	    return -EINVAL;
+
+	if (n > 0 && ide->prdt[n - 1].addr + prevLen == pa &&
+	    (ide->prdt[n - 1].addr & ~0xFFFFULL) ==
+	    ((pa + chunk - 1) & ~0xFFFFULL)) {
+	    prevLen += chunk;
+	} else {
+	    if (n == IDE_MAX_PRD)
+		return -EINVAL;
+	    if (n > 0)
+		ide->prdt[n - 1].count = prevLen & 0xFFFF;
+	    ide->prdt[n].addr = pa;
+	    ide->prdt[n].flags = 0;
+	    prevLen = chunk;
+	    n++;
+	}
+
+	va += chunk;
+	len -= chunk;
+    }
+
+    ASSERT(n > 0);
+    ide->prdt[n - 1].count = prevLen & 0xFFFF;
+    ide->prdt[n - 1].flags = IDE_PRD_EOT;
+
+    return n;
+}
+
+/**
+ * IDEDMAComplete --
+ *
+ * Stops the bus master once the device has raised its interrupt and saves 
+ * the completion status.  The caller must hold the channel lock.
+ *
+ * @retval true if a DMA transfer completed.
+ */
+static bool
+IDEDMAComplete(IDE *ide)
+{
+    uint8_t bmStatus;
+
+    ASSERT(Spinlock_IsHeld(&ide->lock));
+
+    if (!ide->dmaActive)
+	return false;
+
+    bmStatus = inb(ide->bmBase + IDE_BM_STATUS);
+    if ((bmStatus & IDE_BMSTATUS_IRQ) == 0)
+	return false;
+
+    outb(ide->bmBase + IDE_BM_COMMAND, 0);
+    // Reading the status register acknowledges the device interrupt
+    ide->ataStatus = inb(ide->base + IDE_STATUS);
+    // Writing the IRQ and ERR bits back clears them
+    outb(ide->bmBase + IDE_BM_STATUS, bmStatus);
+
+    ide->dmaStatus = bmStatus;
+    ide->dmaActive = false;
+    ide->dmaDone = true;
+
+    return true;
+}
+
+static void
+IDE_Interrupt(void *arg)
+{
+    IDE *ide = (IDE *)arg;
+    bool done;
+
+    Spinlock_Lock(&ide->lock);
+    done = IDEDMAComplete(ide);
+    Spinlock_Unlock(&ide->lock);
+
+    if (done)
+	WaitChannel_WakeAll(&ide->dmaWait);
+}
+
+/**
+ * IDEDMA --
+ *
+ * Reads or writes sectors using bus master DMA.  The caller sleeps until the 
+ * interrupt handler completes the transfer, or polls the bus master status 
+ * if it cannot sleep.  The caller must own the channel.
+ *
+ * @retval 0 if successful
+ * @retval -EINVAL if the buffer cannot be used for DMA.
+ * @retval -EIO if the device or bus master reported an error.
+ */
+static int
+IDEDMA(IDEDrive *drive, void *buf, uint64_t off, uint64_t len, bool write)
+{
+    bool lba48 = drive->lba48;
+    uint8_t driveCode;
+    uint8_t status;
+    uint8_t cmd;
+    IDE *ide = drive->ide;
+
+    ASSERT(drive->drive == 0 || drive->drive == 1);
+    ASSERT(len <= (lba48 ? IDE_MAX_SECTORS48 : IDE_MAX_SECTORS));
+
+    if (IDEBuildPRDT(ide, buf, len * IDE_SECTOR_SIZE) < 0)
+	return -EINVAL;
+
+    if (lba48)
+	driveCode = 0x40;
+    else
+	driveCode = 0xE0 | ((off >> 24) & 0x0F);
+    if (drive->drive == 1)
+	driveCode |= 0x10;
+
+    if (write)
+	cmd = lba48 ? IDE_CMD_WRITE_DMA_EXT : IDE_CMD_WRITE_DMA;
+    else
+	cmd = lba48 ? IDE_CMD_READ_DMA_EXT : IDE_CMD_READ_DMA;
+
+    Spinlock_Lock(&ide->lock);
+    if (driveCode != ide->lastDriveCode) {
+	outb(ide->base + IDE_DRIVE, driveCode);
+
+	// Need to wait for select to complete
+	status = IDEWaitForBusy(ide, true);
+	if ((status & IDE_STATUS_ERR) != 0) {
+	    Spinlock_Unlock(&ide->lock);
+	    Log(ide, "Error selecting drive %d\n", drive->drive);
+	    return -EIO;
+	}
+	ide->lastDriveCode = driveCode;
+    }
+
+    // Program the bus master and clear any stale status
+    outb(ide->bmBase + IDE_BM_COMMAND, 0);
+    outl(ide->bmBase + IDE_BM_PRDT, (uint32_t)DMVA2PA((uintptr_t)ide->prdt));
+    outb(ide->bmBase + IDE_BM_STATUS, IDE_BMSTATUS_ERR | IDE_BMSTATUS_IRQ);
+    outb(ide->bmBase + IDE_BM_COMMAND, write ? 0 : IDE_BMCMD_READ);
+
+    if (lba48) {
+	outb(ide->base + IDE_SECTORCOUNT, (len >> 8) & 0xff);
+	outb(ide->base + IDE_LBALOW, (off >> 24) & 0xff);
+	outb(ide->base + IDE_LBAMID, (off >> 32) & 0xff);
+	outb(ide->base + IDE_LBAHIGH, (off >> 40) & 0xff);
+    }
+    outb(ide->base + IDE_SECTORCOUNT, len & 0xff);
+    outb(ide->base + IDE_LBALOW, off & 0xff);
+    outb(ide->base + IDE_LBAMID, (off >> 8) & 0xff);
+    outb(ide->base + IDE_LBAHIGH, (off >> 16) & 0xff);
+
+    ide->dmaActive = true;
+    ide->dmaDone = false;
+    outb(ide->base + IDE_COMMAND, cmd);
+    outb(ide->bmBase + IDE_BM_COMMAND,
+	 (write ? 0 : IDE_BMCMD_READ) | IDE_BMCMD_START);
+    Spinlock_Unlock(&ide->lock);
+
+    while (!ide->dmaDone) {
+	if (Critical_Level() != 0) {
+	    Spinlock_Lock(&ide->lock);
+	    IDEDMAComplete(ide);
+	    Spinlock_Unlock(&ide->lock);
+	    continue;
+	}
+
+	WaitChannel_Lock(&ide->dmaWait);
+	if (!ide->dmaDone) {
+	    WaitChannel_Sleep(&ide->dmaWait);
+	} else {
+	    Spinlock_Unlock(&ide->dmaWait.lock);
+	}
+    }
+
+    if ((ide->dmaStatus & IDE_BMSTATUS_ERR) != 0 ||
+	(ide->ataStatus & (IDE_STATUS_ERR | IDE_STATUS_DF)) != 0) {
+	Log(ide, "DMA error on drive %d (BM %02x ATA %02x)\n", drive->drive,
+	    ide->dmaStatus, ide->ataStatus);
+	return -EIO;
+    }
+
+    return 0;
+}
+
+int
+IDE_ReadOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
+{
+    IDE *ide = drive->ide;
+    int status = -EINVAL;
+
+    DLOG(ide, "read %llx %llx\n", off, len);
+
+    if (IDEAcquire(ide) != 0)
+	return -EBUSY;
+    if (drive->dma)
+	status = IDEDMA(drive, buf, off, len, false);
+    if (status == -EINVAL)
+	status = IDEPIORead(drive, buf, off, len);
+    IDERelease(ide);
+
+    return status;
+}
+
+int
+IDE_WriteOne(IDEDrive *drive, void *buf, uint64_t off, uint64_t len)
+{
+    IDE *ide = drive->ide;
+    int status = -EINVAL;
+
+    DLOG(ide, "write %llx %llx\n", off, len);
+
+    if (IDEAcquire(ide) != 0)
+	return -EBUSY;
+    if (drive->dma)
+	status = IDEDMA(drive, buf, off, len, true);
+    if (status == -EINVAL)
+	status = IDEPIOWrite(drive, buf, off, len);
+    IDERelease(ide);
+
+    return status;
+}
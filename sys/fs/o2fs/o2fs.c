@@ -11,10 +11,24 @@
 #include <sys/bufcache.h>
 #include <sys/vfs.h>
 #include <sys/dirent.h>
+#include <sys/sysctl.h>
 #include <sys/thread.h>
+#include <sys/waitchannel.h>
+#include <sys/mutex.h>
+
+#include <machine/pmap.h>
 
 #include "o2fs.h"
 
+// Initial read-ahead window in blocks
+#define O2FS_READAHEAD_MIN	2
+// Cache buffers mapped at once by a read
+#define O2FS_READ_BATCH		16
+// Disk requests a direct read keeps in flight
+#define O2FS_DIRECT_REQS	4
+// Blocks written per journal operation on checksummed file systems
+#define O2FS_WRITE_CHUNK	16
+
 VFS *O2FS_Mount(Disk *disk);
 int O2FS_Unmount(VFS *fs);
 int O2FS_GetRoot(VFS *fs, VNode **dn);
@@ -23,8 +37,31 @@ int O2FS_Open(VNode *fn);
 int O2FS_Close(VNode *fn);
 int O2FS_Stat(VNode *fn, struct stat *statinfo);
 int O2FS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len);
+int O2FS_ReadUser(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len);
 int O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len);
+int O2FS_Flush(VNode *fn);
 int O2FS_ReadDir(VNode *fn, void *buf, uint64_t len, uint64_t *off);
+int O2FS_Reclaim(VNode *fn);
+
+static void O2FSBitmapInit(VFS *fs);
+static void O2FSSuperBlockSum(SuperBlock *sb, uint64_t blksize, uint8_t *hash);
+
+// Metadata journal (o2fs_journal.c)
+int O2FSJournalOpen(VFS *fs, Disk *disk, SuperBlock *sb);
+int O2FSJournalBegin(VFS *fs);
+void O2FSJournalAccess(VFS *fs, BufCacheEntry *entry);
+bool O2FSJournalWritable(VFS *fs, BufCacheEntry *entry);
+void O2FSJournalDirty(VFS *fs, BufCacheEntry *entry);
+void O2FSJournalEnd(VFS *fs);
+int O2FSJournalSync(VFS *fs);
+
+// Block checksums (o2fs_hash.c)
+void O2FSHashUpdateFast(O2FSHashState *st, const void *buf, uint64_t len);
+void O2FSHashBlock(const void *buf, uint64_t len, uint8_t *hash);
+
+// Serializes updates to the checksums of BNodes, see O2FSSealVNode
+static Mutex sealLock;
+static bool sealLockInit;
 
 static VFSOp O2FSOperations = {
     .unmount = O2FS_Unmount,
@@ -34,8 +71,11 @@ static VFSOp O2FSOperations = {
     .close = O2FS_Close,
     .stat = O2FS_Stat,
     .read = O2FS_Read,
+    .readuser = O2FS_ReadUser,
     .write = O2FS_Write,
+    .flush = O2FS_Flush,
     .readdir = O2FS_ReadDir,
+    .reclaim = O2FS_Reclaim,
 };
 
 VFS *
@@ -45,6 +85,8 @@ O2FS_Mount(Disk *disk)
     VFS *fs = VFS_Alloc();
     BufCacheEntry *entry;
     SuperBlock *sb;
+    uint64_t blockSize;
+    uint8_t hash[O2FS_HASH_SIZE];
 
     ASSERT(sizeof(BDirEntry) == 512);
 
@@ -65,11 +107,56 @@ O2FS_Mount(Disk *disk)
 	return NULL;
     }
     if (sb->versionMajor != O2FS_VERSION_MAJOR ||
-	sb->versionMinor != O2FS_VERSION_MINOR) {
+	sb->versionMinor > O2FS_VERSION_MINOR) {
 	Alert(o2fs, "Unsupported file system version\n");
 	BufCache_Release(entry);
 	return NULL;
     }
+    if (sb->features & ~O2FS_FEATURE_ALL) {
+	Alert(o2fs, "Unsupported file system features %llx\n", sb->features);
+	BufCache_Release(entry);
+	return NULL;
+    }
+
+    // Cache the disk in file system blocks and reread the superblock
+    blockSize = sb->blockSize;
+    BufCache_Release(entry);
+    status = BufCache_SetBlockSize(disk, blockSize);
+    if (status < 0) {
+	Alert(o2fs, "Unsupported block size %lld (%d)\n", blockSize, status);
+	return NULL;
+    }
+    status = BufCache_Read(disk, 0, &entry);
+    if (status < 0) {
+	Alert(o2fs, "Disk cache read failed\n");
+	return NULL;
+    }
+    sb = entry->buffer;
+
+    if ((sb->features & O2FS_FEATURE_CHECKSUM) && !O2FSHashIsZero(sb->hash)) {
+	O2FSSuperBlockSum(sb, blockSize, hash);
+	if (memcmp(hash, sb->hash, O2FS_HASH_SIZE) != 0) {
+	    Alert(o2fs, "Superblock checksum mismatch\n");
+	    __sync_fetch_and_add(&SYSCTL_GETINT(o2fs_checksumerrors), 1);
+	    BufCache_Release(entry);
+	    return NULL;
+	}
+    }
+    if (!sealLockInit) {
+	Mutex_Init(&sealLock, "O2FS Seal Mutex");
+	sealLockInit = true;
+    }
+
+    // Recover the journal before any other metadata is read
+    fs->journal = NULL;
+    if (sb->features & O2FS_FEATURE_JOURNAL) {
+	status = O2FSJournalOpen(fs, disk, sb);
+	if (status < 0) {
+	    Alert(o2fs, "Journal recovery failed (%d)\n", status);
+	    BufCache_Release(entry);
+	    return NULL;
+	}
+    }
 
     // Read bitmap
     for (int i = 0; i < sb->bitmapSize; i++) {
@@ -95,6 +182,7 @@ O2FS_Mount(Disk *disk)
     fs->fsptr = entry;
     fs->fsval = sb->root.offset;
     fs->blksize = sb->blockSize;
+    O2FSBitmapInit(fs);
 
     // Setup VFS structure
     fs->op = &O2FSOperations;
@@ -120,6 +208,194 @@ O2FS_Unmount(VFS *fs)
     return -1;
 }
 
+/*
+ * Block Allocator
+ *
+ * The bitmap blocks stay in the buffer cache while the file system is 
+ * mounted and are scanned a 64-bit word at a time.  Bit j of word w in 
+ * bitmap block i describes block i*blksize*8 + w*64 + j.  Searches start at 
+ * the block after the last allocation so files grow contiguously, and the 
+ * free count lets a full disk fail without a scan.  Each bitmap block is 
+ * marked dirty once per allocation rather than once per block.
+ */
+
+/**
+ * O2FSBlockCount --
+ *
+ * @return Number of blocks on the disk that the bitmap describes.
+ */
+static uint64_t
+O2FSBlockCount(VFS *fs)
+{
+    SuperBlock *sb = ((BufCacheEntry *)fs->fsptr)->buffer;
+    uint64_t mapped = sb->bitmapSize * fs->blksize * 8;
+
+    return sb->blockCount < mapped ? sb->blockCount : mapped;
+}
+
+/**
+ * O2FSBitmapWord --
+ *
+ * @return Bitmap word describing the block.
+ */
+static inline uint64_t *
+O2FSBitmapWord(VFS *fs, uint64_t block)
+{
+    uint64_t perBlock = fs->blksize * 8;
+    BufCacheEntry *bentry = fs->bitmap[block / perBlock];
+    uint64_t *bitmap = bentry->buffer;
+
+    return &bitmap[(block % perBlock) / 64];
+}
+
+/**
+ * O2FSBitmapInit --
+ *
+ * Counts the free blocks when the file system is mounted.
+ *
+ * @param [in] fs VFS Instance.
+ */
+static void
+O2FSBitmapInit(VFS *fs)
+{
+    uint64_t count = O2FSBlockCount(fs);
+    uint64_t used = 0;
+    uint64_t block, word;
+
+    for (block = 0; block < count; block += 64) {
+	word = *O2FSBitmapWord(fs, block);
+	if (count - block < 64)
+	    word &= (1ULL << (count - block)) - 1;
+
+	// Clear the lowest set bit until none are left
+	while (word != 0) {
+	    word &= word - 1;
+	    used++;
+	}
+    }
+
+    fs->bitmapHint = 0;
+    fs->bitmapFree = count - used;
+
+    DLOG(o2fs, "%lld of %lld blocks free\n", fs->bitmapFree, count);
+}
+
+/**
+ * O2FSBitmapFind --
+ *
+ * Finds the first free block at or after a block.  The caller must hold the 
+ * VFS lock.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] start Block to start from.
+ * @param [in] count Number of blocks on the disk.
+ *
+ * @return Block number or count if there are no free blocks after start.
+ */
+static uint64_t
+O2FSBitmapFind(VFS *fs, uint64_t start, uint64_t count)
+{
+    uint64_t block = start & ~63ULL;
+    uint64_t word;
+
+    for (; block < count; block += 64) {
+	word = ~*O2FSBitmapWord(fs, block);
+	if (block < start)
+	    word &= ~0ULL << (start - block);
+	if (word != 0) {
+	    block += __builtin_ctzll(word);
+	    return block < count ? block : count;
+	}
+    }
+
+    return count;
+}
+
+/**
+ * O2FSBAllocExtent --
+ *
+ * Allocate up to len contiguous blocks.  Fewer blocks are returned when the 
+ * first free run after the allocation hint is shorter or crosses into the 
+ * next bitmap block, so callers that need more call again.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] len Number of blocks wanted.
+ * @param [out] start First block of the extent.
+ *
+ * @return Number of blocks allocated, 0 if the disk is full.
+ */
+uint64_t
+O2FSBAllocExtent(VFS *fs, uint64_t len, uint64_t *start)
+{
+    uint64_t count = O2FSBlockCount(fs);
+    uint64_t perBlock = fs->blksize * 8;
+    uint64_t first, end, block, bit, n, bits;
+    uint64_t *word;
+    BufCacheEntry *bmEntry;
+
+    ASSERT(len > 0);
+
+    while (1) {
+	Spinlock_Lock(&fs->lock);
+	if (fs->bitmapFree == 0) {
+	    Spinlock_Unlock(&fs->lock);
+	    Alert(o2fs, "Out of space!\n");
+	    return 0;
+	}
+
+	first = O2FSBitmapFind(fs, fs->bitmapHint, count);
+	if (first == count)
+	    first = O2FSBitmapFind(fs, 0, count);
+	ASSERT(first < count);
+
+	bmEntry = fs->bitmap[first / perBlock];
+	if (O2FSJournalWritable(fs, bmEntry))
+	    break;
+
+	// Add the bitmap block to the transaction, which may sleep
+	Spinlock_Unlock(&fs->lock);
+	O2FSJournalAccess(fs, bmEntry);
+    }
+
+    end = first + len;
+    if (end > (first / perBlock + 1) * perBlock)
+	end = (first / perBlock + 1) * perBlock;
+    if (end > count)
+	end = count;
+
+    // Claim free bits a word at a time until a used block or the end
+    block = first;
+    while (block < end) {
+	word = O2FSBitmapWord(fs, block);
+	bit = block % 64;
+	n = 64 - bit;
+	if (n > end - block)
+	    n = end - block;
+
+	bits = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+	if ((*word & bits) != 0) {
+	    n = __builtin_ctzll(*word & bits) - bit;
+	    bits = ((1ULL << n) - 1) << bit;
+	    end = block + n;
+	}
+	if (n == 0)
+	    break;
+
+	*word |= bits;
+	block += n;
+    }
+    O2FSJournalDirty(fs, bmEntry);
+
+    n = block - first;
+    fs->bitmapFree -= n;
+    fs->bitmapHint = block < count ? block : 0;
+    Spinlock_Unlock(&fs->lock);
+
+    DLOG(o2fs, "BAlloc %lld+%lld\n", first, n);
+
+    *start = first;
+    return n;
+}
 /**
  * O2FSBAlloc --
  *
@@ -132,41 +408,12 @@ O2FS_Unmount(VFS *fs)
 uint64_t
 O2FSBAlloc(VFS *fs)
 {
-    for (int i = 0; i < 16; i++) {
-	char *bitmap;
-	BufCacheEntry *bentry = fs->bitmap[i];
-
-	if (fs->bitmap[i] == NULL)
-	    break;
+    uint64_t blk;
 
-	bitmap = bentry->buffer;
-
-	// XXX: Check for end of disk
-	for (int b = 0; b < fs->blksize; b++) {
-	    for (int bi = 0; bi < 8; bi++) {
-		if (((bitmap[b] >> bi) & 0x1) == 0) {
-		    /* Set bit */
-		    bitmap[b] |= (1 << bi);
-
-		    /* Write bitmap */
-		    BufCache_Write(bentry);
-
-		    /*
-		     * Block index is the sum of:
-		     *   blksize*8 blocks per bitmap entry
-		     *   8 blocks per bitmap byte
-		     *   bit #
-		     */
-		    uint64_t blk = fs->blksize*8*i + 8*b + bi;
-		    DLOG(o2fs, "BAlloc %lu\n", blk);
-		    return blk;
-		}
-	    }
-	}
-    }
+    if (O2FSBAllocExtent(fs, 1, &blk) == 0)
+	return 0;
 
-    Alert(o2fs, "Out of space!\n");
-    return 0;
+    return blk;
 }
 
 /**
@@ -180,40 +427,206 @@ O2FSBAlloc(VFS *fs)
 void
 O2FSBFree(VFS *fs, uint64_t block)
 {
-    uint64_t bitoff = block & 0x7;
-    uint64_t bytoff = (block >> 8) % fs->blksize;
-    uint64_t bufoff = block / (fs->blksize*8);
+    uint64_t *word;
+    BufCacheEntry *bmEntry;
 
     DLOG(o2fs, "BFree %lu\n", block);
 
-    BufCacheEntry *bentry = fs->bitmap[bufoff];
-    ASSERT(bentry != NULL);
+    ASSERT(block < O2FSBlockCount(fs));
 
-    char *bitmap = bentry->buffer;
+    bmEntry = fs->bitmap[block / (fs->blksize * 8)];
+    O2FSJournalAccess(fs, bmEntry);
+
+    Spinlock_Lock(&fs->lock);
+    word = O2FSBitmapWord(fs, block);
+    ASSERT((*word & (1ULL << (block % 64))) != 0);
 
     /* Mask out the bit */
-    bitmap[bytoff] &= ~(1 << bitoff);
+    *word &= ~(1ULL << (block % 64));
+    fs->bitmapFree++;
 
     /* Write the bitmap */
-    BufCache_Write(bentry);
+    O2FSJournalDirty(fs, bmEntry);
+    Spinlock_Unlock(&fs->lock);
+}
+
+/*
+ * Checksums
+ *
+ * Blocks are verified when they are first used after being read into the 
+ * buffer cache and marked BUFCACHE_FLAG_CHECKED, so cached blocks are only 
+ * hashed again when they change.  A block whose checksum does not match 
+ * fails with -EIO and is counted in o2fs_checksumerrors.  The checksum of 
+ * a block is updated whenever the block is changed, except for BNodes, 
+ * whose checksums are stored in their directory entries and are updated 
+ * once at the end of each operation by O2FSSealVNode.
+ */
+
+/**
+ * O2FSChecksums --
+ *
+ * @return True if the file system has block checksums.
+ */
+static inline bool
+O2FSChecksums(VFS *fs)
+{
+    SuperBlock *sb = ((BufCacheEntry *)fs->fsptr)->buffer;
+
+    return (sb->features & O2FS_FEATURE_CHECKSUM) != 0;
+}
+
+/**
+ * O2FSSuperBlockSum --
+ *
+ * Hash the superblock block with its hash field zeroed.
+ *
+ * @param [in] sb Superblock buffer.
+ * @param [in] blksize File system block size.
+ * @param [out] hash Hash of the block.
+ */
+static void
+O2FSSuperBlockSum(SuperBlock *sb, uint64_t blksize, uint8_t *hash)
+{
+    uint8_t saved[O2FS_HASH_SIZE];
+
+    memcpy(saved, sb->hash, O2FS_HASH_SIZE);
+    memset(sb->hash, 0, O2FS_HASH_SIZE);
+    O2FSHashBlock(sb, blksize, hash);
+    memcpy(sb->hash, saved, O2FS_HASH_SIZE);
+}
+
+/**
+ * O2FSCheckSum --
+ *
+ * Compare the hash of a block with its checksum and report a mismatch.
+ *
+ * @return 0 if they match, otherwise -EIO.
+ */
+static int
+O2FSCheckSum(uint64_t diskOffset, const uint8_t *hash, const uint8_t *sum)
+{
+    if (memcmp(hash, sum, O2FS_HASH_SIZE) == 0)
+	return 0;
+
+    Alert(o2fs, "Checksum mismatch in block @ 0x%llx\n", diskOffset);
+    __sync_fetch_and_add(&SYSCTL_GETINT(o2fs_checksumerrors), 1);
+
+    return -EIO;
+}
+
+/**
+ * O2FSVerify --
+ *
+ * Verify a cached block against its checksum unless it has been verified 
+ * since it was read.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] entry Buffer cache entry of the block.
+ * @param [in] sum Checksum of the block, not checked if zero.
+ *
+ * @return 0 on success, otherwise -EIO.
+ */
+static int
+O2FSVerify(VFS *fs, BufCacheEntry *entry, const uint8_t *sum)
+{
+    uint8_t hash[O2FS_HASH_SIZE];
+
+    if (!O2FSChecksums(fs) || (entry->flags & BUFCACHE_FLAG_CHECKED) ||
+	O2FSHashIsZero(sum))
+	return 0;
+
+    O2FSHashBlock(entry->buffer, fs->blksize, hash);
+    if (O2FSCheckSum(entry->diskOffset, hash, sum) != 0)
+	return -EIO;
+
+    __sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_CHECKED);
+
+    return 0;
+}
+
+/**
+ * O2FSReadInd --
+ *
+ * Read and verify an indirect block of a VNode.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] pos Index of the indirect pointer.
+ * @param [out] entry Buffer cache entry of the indirect block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSReadInd(VNode *vn, uint64_t pos, BufCacheEntry **entry)
+{
+    BNode *bn = ((BufCacheEntry *)vn->fsptr)->buffer;
+    int status;
+
+    if (pos >= O2FS_INDIRECT_PTR || bn->indirect[pos].offset == 0)
+	return -EINVAL;
+
+    status = BufCache_Read(vn->disk, bn->indirect[pos].offset, entry);
+    if (status < 0)
+	return status;
+
+    status = O2FSVerify(vn->vfs, *entry, bn->indirect[pos].hash);
+    if (status < 0) {
+	BufCache_Release(*entry);
+	return status;
+    }
+
+    return 0;
+}
+
+/**
+ * O2FSSealInd --
+ *
+ * Update the checksum of a changed indirect block in the BNode.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] pos Index of the indirect pointer.
+ * @param [in] entry Buffer cache entry of the indirect block.
+ */
+static void
+O2FSSealInd(VNode *vn, uint64_t pos, BufCacheEntry *entry)
+{
+    BufCacheEntry *bnEntry = (BufCacheEntry *)vn->fsptr;
+    BNode *bn = bnEntry->buffer;
+
+    if (!O2FSChecksums(vn->vfs))
+	return;
+
+    O2FSJournalAccess(vn->vfs, bnEntry);
+    O2FSHashBlock(entry->buffer, vn->vfs->blksize, bn->indirect[pos].hash);
+    __sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_CHECKED);
+    O2FSJournalDirty(vn->vfs, bnEntry);
 }
 
 /**
  * O2FSLoadVNode --
  *
- * Load a VNode from the disk given an ObjID.
+ * Load a VNode from the disk given an ObjID, or return the cached VNode if
+ * the object is already loaded.  The VNode keeps a reference to its 
+ * directory and the offset of its entry so that O2FSSealVNode can update 
+ * the checksum in the entry.
  *
- * @param [in] vfs VFS Instance.
+ * @param [in] dn VNode of the directory.
  * @param [in] oobjid Object ID.
+ * @param [in] entryOff Offset of the directory entry within the directory.
  */
 VNode *
-O2FSLoadVNode(VFS *fs, ObjID *objid)
+O2FSLoadVNode(VNode *dn, ObjID *objid, uint64_t entryOff)
 {
     int status;
+    VFS *fs = dn->vfs;
     VNode *vn;
+    VNode *cached;
     BNode *bn;
     BufCacheEntry *entry;
 
+    vn = VFS_FindVNode(fs, objid->offset);
+    if (vn != NULL)
+	return vn;
+
     status = BufCache_Read(fs->disk, objid->offset, &entry);
     if (status < 0) {
 	Alert(o2fs, "disk read error\n");
@@ -227,25 +640,125 @@ O2FSLoadVNode(VFS *fs, ObjID *objid)
 	return NULL;
     }
     if (bn->versionMajor != O2FS_VERSION_MAJOR ||
-	bn->versionMinor != O2FS_VERSION_MINOR) {
+	bn->versionMinor > O2FS_VERSION_MINOR) {
 	Alert(o2fs, "unsupported BNode version\n");
 	BufCache_Release(entry);
 	return NULL;
     }
+    if (O2FSVerify(fs, entry, objid->hash) < 0) {
+	BufCache_Release(entry);
+	return NULL;
+    }
 
     vn = VNode_Alloc();
     if (!vn) {
+	BufCache_Release(entry);
 	return NULL;
     }
 
     vn->op = &O2FSOperations;
     vn->disk = fs->disk;
     Spinlock_Init(&vn->lock, "VNode Lock", SPINLOCK_TYPE_NORMAL);
-    vn->refCount = 1;
+    // VFS_AddVNode takes the first reference
+    vn->refCount = 0;
+    vn->id = DCache_NewID();
     vn->fsptr = entry;
     vn->vfs = fs;
+    vn->raNext = 0;
+    vn->raIssued = 0;
+    vn->raWindow = 0;
+    vn->key = objid->offset;
+    vn->fsval = entryOff;
+    vn->parent = dn;
+    VFS_Retain(dn);
+
+    // Another thread may have loaded the object while we read the BNode
+    cached = VFS_AddVNode(vn);
+    if (cached != vn)
+	O2FS_Reclaim(vn);
+
+    return cached;
+}
+
+/**
+ * O2FSInlineData --
+ *
+ * @return Data stored in the BNode block, or NULL if the file is stored in 
+ * blocks of its own.
+ */
+static inline uint8_t *
+O2FSInlineData(BNode *bn)
+{
+    if ((bn->flags & BNODE_FLAG_INLINE) == 0)
+	return NULL;
+
+    return (uint8_t *)(bn + 1);
+}
+
+/**
+ * O2FSGrowExtents --
+ *
+ * Grow a VNode that is mapped by extents.  New blocks are allocated as 
+ * extents and appended to the last one when they are contiguous with it.  
+ * With checksums an extent is limited to the blocks that one checksum block 
+ * covers.  The checksum block is allocated when the extent is first 
+ * written, see O2FSSetBlockSum.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] bn BNode of the file.
+ * @param [in] filesz New file size.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSGrowExtents(VNode *vn, BNode *bn, uint64_t filesz)
+{
+    VFS *fs = vn->vfs;
+    uint64_t requiredBlocks = (filesz + fs->blksize - 1) / fs->blksize;
+    uint64_t blocks = 0;
+    uint64_t extStart, extLen, extMax;
+    BExtent *last = NULL;
+    int i;
+
+    extMax = ~0ULL;
+    if (O2FSChecksums(fs))
+	extMax = O2FS_HASH_PER_BLOCK(fs->blksize);
+
+    // Count the allocated blocks, which may exceed the file size
+    for (i = 0; i < O2FS_EXTENT_MAX && bn->extents[i].length != 0; i++) {
+	last = &bn->extents[i];
+	blocks += last->length;
+    }
+
+    while (blocks < requiredBlocks) {
+	extLen = requiredBlocks - blocks;
+	if (extLen > extMax)
+	    extLen = extMax;
+	extLen = O2FSBAllocExtent(fs, extLen, &extStart);
+	if (extLen == 0)
+	    return -ENOSPC;
+
+	if (last != NULL &&
+	    last->offset + last->length * fs->blksize == extStart * fs->blksize &&
+	    last->length + extLen <= extMax) {
+	    last->length += extLen;
+	} else if (i < O2FS_EXTENT_MAX) {
+	    last = &bn->extents[i++];
+	    last->device = 0;
+	    last->offset = extStart * fs->blksize;
+	    last->length = extLen;
+	    last->sums = 0;
+	} else {
+	    // Out of extent records
+	    while (extLen-- > 0)
+		O2FSBFree(fs, extStart++);
+	    return -EINVAL;
+	}
+
+	blocks += extLen;
+    }
 
-    return vn;
+    return 0;
 }
 
 /**
@@ -266,130 +779,507 @@ O2FSGrowVNode(VNode *vn, uint64_t filesz)
     BufCacheEntry *bufEntry = (BufCacheEntry *)vn->fsptr;
     BNode *node = bufEntry->buffer;
     uint64_t startBlock = (node->size + fs->blksize - 1) / fs->blksize;
-
-    if (filesz > (fs->blksize * O2FS_DIRECT_PTR * O2FS_INDIRECT_PTR))
-        return -EINVAL;
-
-    BufCacheEntry *indirectCache = NULL;
     uint64_t requiredBlocks = (filesz + fs->blksize - 1) / fs->blksize;
+    BufCacheEntry *indirectCache;
+    BInd *indirectPtr;
+    uint64_t blkIdx, indirectPos, directPos;
+    uint64_t extStart, extLen;
+    int status;
+
+    O2FSJournalAccess(fs, bufEntry);
 
-    for (uint64_t blkIdx = startBlock; blkIdx < requiredBlocks; blkIdx++) {
-        
-        uint64_t indirectPos = blkIdx / O2FS_INDIRECT_PTR;
-        uint64_t directPos = blkIdx % O2FS_INDIRECT_PTR;
+    if (node->flags & BNODE_FLAG_EXTENTS) {
+	// Extents allocated before a failure are kept for the next attempt
+	status = O2FSGrowExtents(vn, node, filesz);
+	if (status == 0)
+	    node->size = filesz;
+	O2FSJournalDirty(fs, bufEntry);
+	return status;
+    }
 
-        if (node->indirect[indirectPos].offset == 0) {
-            uint64_t newBlock = O2FSBAlloc(fs);
-            if (newBlock == 0) {
-                return -ENOSPC;
-            }
+    if (filesz > (fs->blksize * O2FS_DIRECT_PTR * O2FS_INDIRECT_PTR))
+        return -EINVAL;
 
-            node->indirect[indirectPos].device = 0;
-            node->indirect[indirectPos].offset = newBlock * fs->blksize;
+    // Allocate indirect blocks first so the data blocks can be contiguous
+    for (indirectPos = startBlock / O2FS_DIRECT_PTR;
+	 indirectPos * O2FS_DIRECT_PTR < requiredBlocks;
+	 indirectPos++) {
+	if (node->indirect[indirectPos].offset != 0)
+	    continue;
 
-            BufCache_Read(vn->disk, node->indirect[indirectPos].offset, &indirectCache);
-            memset(indirectCache->buffer, 0, fs->blksize);
-            BufCache_Write(indirectCache);
-        } else {
-            BufCache_Read(vn->disk, node->indirect[indirectPos].offset, &indirectCache);
-        }
+	uint64_t newBlock = O2FSBAlloc(fs);
+	if (newBlock == 0)
+	    return -ENOSPC;
 
-        BInd *indirectPtr = (BInd *)indirectCache->buffer;
+	node->indirect[indirectPos].device = 0;
+	node->indirect[indirectPos].offset = newBlock * fs->blksize;
 
-        if (indirectPtr->direct[directPos].offset != 0) {
-            BufCache_Release(indirectCache);
-            continue;
-        }
+	status = BufCache_Alloc(vn->disk, node->indirect[indirectPos].offset,
+				&indirectCache);
+	if (status < 0)
+	    return status;
+	O2FSJournalAccess(fs, indirectCache);
+	memset(indirectCache->buffer, 0, fs->blksize);
+	O2FSJournalDirty(fs, indirectCache);
+	O2FSSealInd(vn, indirectPos, indirectCache);
+	BufCache_Release(indirectCache);
+    }
 
-        uint64_t newDirectBlock = O2FSBAlloc(fs);
-        if (newDirectBlock == 0) {
-            BufCache_Release(indirectCache);
-            return -ENOSPC;
-        }
+    // Allocate the data blocks as few extents as possible
+    blkIdx = startBlock;
+    while (blkIdx < requiredBlocks) {
+	extLen = O2FSBAllocExtent(fs, requiredBlocks - blkIdx, &extStart);
+	if (extLen == 0)
+	    return -ENOSPC;
+
+	while (extLen > 0) {
+	    indirectPos = blkIdx / O2FS_DIRECT_PTR;
+	    status = O2FSReadInd(vn, indirectPos, &indirectCache);
+	    if (status < 0)
+		return status;
 
-        indirectPtr->direct[directPos].device = 0;
-        indirectPtr->direct[directPos].offset = newDirectBlock * fs->blksize;
+	    O2FSJournalAccess(fs, indirectCache);
+	    indirectPtr = (BInd *)indirectCache->buffer;
+	    for (directPos = blkIdx % O2FS_DIRECT_PTR;
+		 directPos < O2FS_DIRECT_PTR && extLen > 0;
+		 directPos++) {
+		// Left behind by an earlier grow that ran out of space
+		if (indirectPtr->direct[directPos].offset != 0)
+		    O2FSBFree(fs, indirectPtr->direct[directPos].offset /
+			      fs->blksize);
+		memset(indirectPtr->direct[directPos].hash, 0, O2FS_HASH_SIZE);
+		indirectPtr->direct[directPos].device = 0;
+		indirectPtr->direct[directPos].offset = extStart * fs->blksize;
+		extStart++;
+		extLen--;
+		blkIdx++;
+	    }
 
-        BufCache_Write(indirectCache);
-        BufCache_Release(indirectCache);
+	    O2FSJournalDirty(fs, indirectCache);
+	    O2FSSealInd(vn, indirectPos, indirectCache);
+	    BufCache_Release(indirectCache);
+	}
     }
 
     node->size = filesz;
-    BufCache_Write(bufEntry);
+    O2FSJournalDirty(fs, bufEntry);
 
     return 0;
 }
 
 
 /**
- * O2FSRetainVNode --
+ * O2FS_Reclaim --
  *
- * Increment VNode reference count.
+ * Free an unreferenced VNode and release its BNode buffer and directory.  
+ * Called by the VFS when the VNode is evicted from the VNode cache.
  *
  * @param [in] vn VNode.
  */
-void
-O2FSRetainVNode(VNode *vn)
+int
+O2FS_Reclaim(VNode *vn)
 {
-    vn->refCount++;
+    ASSERT(vn->refCount <= 1);
+
+    if (vn->parent != NULL)
+	VFS_Release(vn->parent);
+    BufCache_Release(vn->fsptr);
+    Spinlock_Destroy(&vn->lock);
+    vn->refCount = 0;
+    VNode_Free(vn);
+
+    return 0;
 }
 
 /**
- * O2FSReleaseVNode --
+ * O2FSResolveExtent --
  *
- * Decrement VNode reference count and release it if reaches zero.
+ * Translate a file block number into a disk offset using a BNode's extents.
  *
- * @param [in] vn VNode.
+ * @param [in] bn BNode of the file.
+ * @param [in] blksize File system block size.
+ * @param [in] blkNum Block number within the file.
+ * @param [out] diskOffset Disk offset of the block.
+ * @param [out] run If not NULL, the number of contiguous blocks from blkNum 
+ * to the end of the extent.
+ *
+ * @return 0 on success, otherwise error code.
  */
-void
-O2FSReleaseVNode(VNode *vn)
+static int
+O2FSResolveExtent(BNode *bn, uint64_t blksize, uint64_t blkNum,
+		  uint64_t *diskOffset, uint64_t *run)
 {
-    vn->refCount--;
-    if (vn->refCount == 0) {
-	BufCache_Release(vn->fsptr);
-	Spinlock_Destroy(&vn->lock);
-	VNode_Free(vn);
+    BExtent *ext;
+    int i;
+
+    for (i = 0; i < O2FS_EXTENT_MAX; i++) {
+	ext = &bn->extents[i];
+	if (ext->length == 0)
+	    break;
+
+	if (blkNum < ext->length) {
+	    *diskOffset = ext->offset + blkNum * blksize;
+	    if (run != NULL)
+		*run = ext->length - blkNum;
+	    return 0;
+	}
+	blkNum -= ext->length;
     }
+
+    return -EINVAL;
 }
 
+/**
+ * O2FSResolveBlock --
+ *
+ * Translate a file block number into a disk offset.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] blkNum Block number within the file.
+ * @param [out] diskOffset Disk offset of the block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
 int
-O2FSResolveBuf(VNode *vnode, uint64_t blkNum, BufCacheEntry **resolvedEntry)
+O2FSResolveBlock(VNode *vn, uint64_t blkNum, uint64_t *diskOffset)
 {
-    BufCacheEntry *vnodeCache = (BufCacheEntry *)vnode->fsptr;
-    BufCacheEntry *blockCache;
-    BNode *nodeData = vnodeCache->buffer;
-    int result;
+    BufCacheEntry *vnEntry = (BufCacheEntry *)vn->fsptr;
+    BNode *bn = vnEntry->buffer;
+    BufCacheEntry *indEntry;
+    BInd *ind;
+    int status;
 
-    uint64_t indirectPos = blkNum / O2FS_INDIRECT_PTR;
+    uint64_t indirectPos = blkNum / O2FS_DIRECT_PTR;
     uint64_t directPos = blkNum % O2FS_DIRECT_PTR;
 
-    BufCacheEntry *indirectBlockCache;
-    
-    result = BufCache_Read(vnode->disk, nodeData->indirect[indirectPos].offset, &indirectBlockCache);
-    if (result < 0) {
-        BufCache_Release(indirectBlockCache);
-        return result;
-    }
-
-    BInd *indirectBlockData = indirectBlockCache->buffer;
+    if (bn->flags & BNODE_FLAG_EXTENTS)
+	return O2FSResolveExtent(bn, vn->vfs->blksize, blkNum, diskOffset,
+				 NULL);
 
-    result = BufCache_Read(vnode->disk, indirectBlockData->direct[directPos].offset, &blockCache);
-    if (result < 0) {
-        BufCache_Release(indirectBlockCache);
-        return result;
-    }
+    status = O2FSReadInd(vn, indirectPos, &indEntry);
+    if (status < 0)
+	return status;
 
-    BufCache_Release(indirectBlockCache);
+    ind = indEntry->buffer;
+    *diskOffset = ind->direct[directPos].offset;
+    BufCache_Release(indEntry);
 
-    *resolvedEntry = blockCache;
+    if (*diskOffset == 0)
+	return -EINVAL;
 
-    return result;
+    return 0;
 }
 
+/**
+ * O2FSBlockSum --
+ *
+ * Find the checksum of a file block, which is in the checksum block of its 
+ * extent or in its indirect block.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] blkNum Block number within the file.
+ * @param [in] alloc Allocate a checksum block if the extent has none.
+ * @param [out] sumEntry Buffer cache entry holding the checksum, or NULL if 
+ * the block has no checksum.
+ * @param [out] sum Checksum within sumEntry.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSBlockSum(VNode *vn, uint64_t blkNum, bool alloc, BufCacheEntry **sumEntry,
+	     uint8_t **sum)
+{
+    VFS *fs = vn->vfs;
+    BufCacheEntry *bnEntry = (BufCacheEntry *)vn->fsptr;
+    BNode *bn = bnEntry->buffer;
+    BExtent *ext = NULL;
+    BInd *ind;
+    uint64_t newBlock;
+    int i, status;
+
+    *sumEntry = NULL;
+
+    if ((bn->flags & BNODE_FLAG_EXTENTS) == 0) {
+	status = O2FSReadInd(vn, blkNum / O2FS_DIRECT_PTR, sumEntry);
+	if (status < 0) {
+	    *sumEntry = NULL;
+	    return status;
+	}
+	ind = (*sumEntry)->buffer;
+	*sum = ind->direct[blkNum % O2FS_DIRECT_PTR].hash;
+	return 0;
+    }
 
+    for (i = 0; i < O2FS_EXTENT_MAX && bn->extents[i].length != 0; i++) {
+	if (blkNum < bn->extents[i].length) {
+	    ext = &bn->extents[i];
+	    break;
+	}
+	blkNum -= bn->extents[i].length;
+    }
+    if (ext == NULL || blkNum >= O2FS_HASH_PER_BLOCK(fs->blksize))
+	return -EINVAL;
+
+    if (ext->sums != 0) {
+	status = BufCache_Read(vn->disk, ext->sums, sumEntry);
+    } else {
+	if (!alloc)
+	    return 0;
+
+	newBlock = O2FSBAlloc(fs);
+	if (newBlock == 0)
+	    return -ENOSPC;
+
+	status = BufCache_Alloc(vn->disk, newBlock * fs->blksize, sumEntry);
+	if (status < 0) {
+	    O2FSBFree(fs, newBlock);
+	} else {
+	    O2FSJournalAccess(fs, *sumEntry);
+	    O2FSJournalAccess(fs, bnEntry);
+	    memset((*sumEntry)->buffer, 0, fs->blksize);
+	    ext->sums = newBlock * fs->blksize;
+	    O2FSJournalDirty(fs, bnEntry);
+	}
+    }
+    if (status < 0) {
+	*sumEntry = NULL;
+	return status;
+    }
+
+    *sum = (uint8_t *)(*sumEntry)->buffer + blkNum * O2FS_HASH_SIZE;
+
+    return 0;
+}
+
+/**
+ * O2FSVerifyBlock --
+ *
+ * Verify a cached file block against its checksum.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] blkNum Block number within the file.
+ * @param [in] entry Buffer cache entry of the block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSVerifyBlock(VNode *vn, uint64_t blkNum, BufCacheEntry *entry)
+{
+    BufCacheEntry *sumEntry;
+    uint8_t *sum;
+    int status;
+
+    if (!O2FSChecksums(vn->vfs) || (entry->flags & BUFCACHE_FLAG_CHECKED))
+	return 0;
+
+    status = O2FSBlockSum(vn, blkNum, false, &sumEntry, &sum);
+    if (status < 0 || sumEntry == NULL)
+	return status;
+
+    status = O2FSVerify(vn->vfs, entry, sum);
+    BufCache_Release(sumEntry);
+
+    return status;
+}
+
+/**
+ * O2FSSetBlockSum --
+ *
+ * Update the checksum of a changed file block.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] blkNum Block number within the file.
+ * @param [in] entry Buffer cache entry of the block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSSetBlockSum(VNode *vn, uint64_t blkNum, BufCacheEntry *entry)
+{
+    BNode *bn = ((BufCacheEntry *)vn->fsptr)->buffer;
+    BufCacheEntry *sumEntry;
+    uint8_t *sum;
+    int status;
+
+    if (!O2FSChecksums(vn->vfs))
+	return 0;
+
+    status = O2FSBlockSum(vn, blkNum, true, &sumEntry, &sum);
+    if (status < 0)
+	return status;
+
+    O2FSJournalAccess(vn->vfs, sumEntry);
+    O2FSHashBlock(entry->buffer, vn->vfs->blksize, sum);
+    __sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_CHECKED);
+    O2FSJournalDirty(vn->vfs, sumEntry);
+    if ((bn->flags & BNODE_FLAG_EXTENTS) == 0)
+	O2FSSealInd(vn, blkNum / O2FS_DIRECT_PTR, sumEntry);
+    BufCache_Release(sumEntry);
+
+    return 0;
+}
+
+/**
+ * O2FSResolveBuf --
+ *
+ * Read a file block into the buffer cache and verify it.
+ *
+ * @param [in] vnode VNode of the file.
+ * @param [in] blkNum Block number within the file.
+ * @param [out] resolvedEntry Buffer cache entry of the block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+int
+O2FSResolveBuf(VNode *vnode, uint64_t blkNum, BufCacheEntry **resolvedEntry)
+{
+    uint64_t diskOffset;
+    int status;
+
+    status = O2FSResolveBlock(vnode, blkNum, &diskOffset);
+    if (status < 0)
+	return status;
+
+    status = BufCache_Read(vnode->disk, diskOffset, resolvedEntry);
+    if (status < 0)
+	return status;
+
+    status = O2FSVerifyBlock(vnode, blkNum, *resolvedEntry);
+    if (status < 0) {
+	BufCache_Release(*resolvedEntry);
+	return status;
+    }
+
+    return 0;
+}
+
+/**
+ * O2FSPromoteInline --
+ *
+ * Moves the inline data of a file that is growing past O2FS_INLINE_MAX into 
+ * a data block and switches the file to extents.
+ *
+ * @param [in] vn VNode of the file.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSPromoteInline(VNode *vn)
+{
+    VFS *fs = vn->vfs;
+    BufCacheEntry *nodeEntry = (BufCacheEntry *)vn->fsptr;
+    BNode *bn = nodeEntry->buffer;
+    uint8_t *data = O2FSInlineData(bn);
+    uint64_t size = bn->size;
+    uint64_t diskOffset, b;
+    BufCacheEntry *entry;
+    int i, status;
+
+    O2FSJournalAccess(fs, nodeEntry);
+    bn->flags = (bn->flags & ~BNODE_FLAG_INLINE) | BNODE_FLAG_EXTENTS;
+    bn->size = 0;
+    memset(bn->extents, 0, sizeof(bn->extents));
+
+    status = O2FSGrowVNode(vn, size);
+    if (status == 0 && size != 0) {
+	status = O2FSResolveBlock(vn, 0, &diskOffset);
+	if (status == 0)
+	    status = BufCache_Alloc(vn->disk, diskOffset, &entry);
+	if (status == 0) {
+	    memcpy(entry->buffer, data, size);
+	    memset(entry->buffer + size, 0, fs->blksize - size);
+	    BufCache_Write(entry);
+	    status = O2FSSetBlockSum(vn, 0, entry);
+	    BufCache_Release(entry);
+	}
+    }
+
+    if (status < 0) {
+	// Return any blocks that were allocated and keep the data inline
+	for (i = 0; i < O2FS_EXTENT_MAX && bn->extents[i].length != 0; i++) {
+	    for (b = 0; b < bn->extents[i].length; b++)
+		O2FSBFree(fs, bn->extents[i].offset / fs->blksize + b);
+	    if (bn->extents[i].sums != 0)
+		O2FSBFree(fs, bn->extents[i].sums / fs->blksize);
+	}
+	memset(bn->extents, 0, sizeof(bn->extents));
+	bn->flags = (bn->flags & ~BNODE_FLAG_EXTENTS) | BNODE_FLAG_INLINE;
+	bn->size = size;
+	O2FSJournalDirty(fs, nodeEntry);
+	return status;
+    }
+
+    memset(data, 0, O2FS_INLINE_MAX(fs->blksize));
+    O2FSJournalDirty(fs, nodeEntry);
+
+    return 0;
+}
+
+/**
+ * O2FSReadAhead --
+ *
+ * Detects sequential access and prefetches blocks past the end of the 
+ * current read.  The window starts at O2FS_READAHEAD_MIN blocks and doubles 
+ * each time the reader moves on to the next block, up to the o2fs_readahead 
+ * sysctl.  A non-sequential read resets the window.  The state is updated 
+ * under the VNode lock and the blocks to prefetch are claimed before the 
+ * lock is dropped to issue them, so concurrent readers of a file do not 
+ * prefetch the same blocks twice.
+ *
+ * @param [in] vn VNode of the file.
+ * @param [in] first First block of the current read.
+ * @param [in] last Last block of the current read.
+ * @param [in] blocks Number of blocks in the file.
+ */
+static void
+O2FSReadAhead(VNode *vn, uint64_t first, uint64_t last, uint64_t blocks)
+{
+    uint64_t maxWindow = SYSCTL_GETINT(o2fs_readahead);
+    uint64_t b, start, end;
+    uint64_t diskOffset;
+
+    Spinlock_Lock(&vn->lock);
+    if (first == vn->raNext) {
+	// Moved on to the next block
+	if (vn->raWindow == 0)
+	    vn->raWindow = O2FS_READAHEAD_MIN;
+	else
+	    vn->raWindow *= 2;
+    } else if (first + 1 != vn->raNext) {
+	// Random access
+	vn->raWindow = 0;
+	vn->raIssued = 0;
+    }
+
+    if (vn->raWindow > maxWindow)
+	vn->raWindow = maxWindow;
+    vn->raNext = last + 1;
+
+    if (vn->raWindow == 0) {
+	Spinlock_Unlock(&vn->lock);
+	return;
+    }
+
+    start = first + 1;
+    if (start <= vn->raIssued)
+	start = vn->raIssued + 1;
+    end = last + vn->raWindow;
+    if (end >= blocks)
+	end = blocks - 1;
+    if (start <= end)
+	vn->raIssued = end;
+    Spinlock_Unlock(&vn->lock);
+
+    // Hold the reads back so the disk queue can merge them
+    Disk_Plug(vn->disk);
+    for (b = start; b <= end; b++) {
+	if (O2FSResolveBlock(vn, b, &diskOffset) < 0)
+	    break;
+	BufCache_Prefetch(vn->disk, diskOffset);
+    }
+    Disk_Unplug(vn->disk);
+}
 
-   
-
 /**
  * O2FS_GetRoot --
  *
@@ -406,10 +1296,11 @@ O2FS_GetRoot(VFS *fs, VNode **dn)
     int status;
     VNode *vn;
     BufCacheEntry *entry;
+    SuperBlock *sb = ((BufCacheEntry *)fs->fsptr)->buffer;
     BNode *bn;
 
     if (fs->root) {
-	fs->root->refCount++;
+	VFS_Retain(fs->root);
 	*dn = fs->root;
 	return 0;
     }
@@ -427,21 +1318,39 @@ O2FS_GetRoot(VFS *fs, VNode **dn)
 	return -1;
     }
     if (bn->versionMajor != O2FS_VERSION_MAJOR ||
-	bn->versionMinor != O2FS_VERSION_MINOR) {
+	bn->versionMinor > O2FS_VERSION_MINOR) {
 	Alert(o2fs, "unsupported BNode version\n");
 	BufCache_Release(entry);
 	return -1;
     }
+    status = O2FSVerify(fs, entry, sb->root.hash);
+    if (status < 0) {
+	BufCache_Release(entry);
+	return status;
+    }
 
     vn = VNode_Alloc();
+    if (!vn) {
+	BufCache_Release(entry);
+	return -ENOMEM;
+    }
     vn->op = &O2FSOperations;
     vn->disk = fs->disk;
     Spinlock_Init(&vn->lock, "VNode Lock", SPINLOCK_TYPE_NORMAL);
-    vn->refCount = 1;
+    // VFS_AddVNode takes the first reference
+    vn->refCount = 0;
+    vn->id = DCache_NewID();
     vn->fsptr = entry;
     vn->vfs = fs;
+    vn->raNext = 0;
+    vn->raIssued = 0;
+    vn->raWindow = 0;
+    vn->key = fs->fsval;
+    vn->parent = NULL;
 
-    *dn = vn;
+    *dn = VFS_AddVNode(vn);
+    if (*dn != vn)
+	O2FS_Reclaim(vn);
 
     return 0;
 }
@@ -452,6 +1361,169 @@ O2FSDumpDirEntry(BDirEntry *entry)
     VLOG(o2fs, "%16s %08llx %08llx\n", entry->name, entry->objId.offset, entry->size);
 }
 
+/**
+ * O2FSLookupEntries --
+ *
+ * Search an array of directory entries for a name.
+ *
+ * @param [in] dn VNode of the directory.
+ * @param [in] dir Directory entries.
+ * @param [in] count Number of entries.
+ * @param [in] base Offset of the first entry within the directory.
+ * @param [out] fn VNode of the entry if found.
+ * @param [in] name Name of the file.
+ *
+ * @return True if the name was found.
+ */
+static bool
+O2FSLookupEntries(VNode *dn, BDirEntry *dir, int count, uint64_t base,
+		  VNode **fn, const char *name)
+{
+    int e;
+
+    for (e = 0; e < count; e++) {
+	if (strcmp((char *)dir[e].magic, BDIR_MAGIC) == 0) {
+	    O2FSDumpDirEntry(&dir[e]);
+
+	    if (strcmp((char *)dir[e].name, name) == 0) {
+		*fn = O2FSLoadVNode(dn, &dir[e].objId,
+				    base + e * sizeof(BDirEntry));
+		return true;
+	    }
+	}
+    }
+
+    return false;
+}
+
+/**
+ * O2FSIndexRead --
+ *
+ * Copies part of a directory's data from its blocks, keeping the last block 
+ * referenced between calls.  Reads never cross a block boundary.
+ *
+ * @param [in] dn VNode of the directory.
+ * @param [in] off Offset within the directory's blocks.
+ * @param [out] buf Buffer to copy into.
+ * @param [in] len Length to copy.
+ * @param [inout] entry Buffer cache entry of the last block or NULL.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSIndexRead(VNode *dn, uint64_t off, void *buf, uint64_t len,
+	      BufCacheEntry **entry)
+{
+    uint64_t blksize = dn->vfs->blksize;
+    uint64_t diskOffset;
+    int status;
+
+    ASSERT(off % blksize + len <= blksize);
+
+    status = O2FSResolveBlock(dn, off / blksize, &diskOffset);
+    if (status < 0)
+	return status;
+
+    if (*entry == NULL || (*entry)->diskOffset != diskOffset) {
+	if (*entry != NULL)
+	    BufCache_Release(*entry);
+	*entry = NULL;
+
+	status = BufCache_Read(dn->disk, diskOffset, entry);
+	if (status < 0) {
+	    *entry = NULL;
+	    return status;
+	}
+
+	status = O2FSVerifyBlock(dn, off / blksize, *entry);
+	if (status < 0) {
+	    BufCache_Release(*entry);
+	    *entry = NULL;
+	    return status;
+	}
+    }
+
+    memcpy(buf, (*entry)->buffer + off % blksize, len);
+
+    return 0;
+}
+
+/**
+ * O2FSLookupIndex --
+ *
+ * Lookup a name through a directory's hash index.  Only the slots probed 
+ * and the entries whose hash matches are read.
+ *
+ * @param [in] dn VNode of the directory.
+ * @param [in] dirBN BNode of the directory.
+ * @param [out] fn VNode of the entry if found.
+ * @param [in] name Name of the file.
+ *
+ * @retval 0 if found
+ * @retval -ENOENT if the name is not in the directory
+ * @return Otherwise the index is unusable and an error code is returned.
+ */
+static int
+O2FSLookupIndex(VNode *dn, BNode *dirBN, VNode **fn, const char *name)
+{
+    VFS *vfs = dn->vfs;
+    uint64_t base = ROUNDUP(dirBN->size, vfs->blksize);
+    uint64_t entries = dirBN->size / sizeof(BDirEntry);
+    uint32_t hash = O2FSDirHash(name);
+    BufCacheEntry *entry = NULL;
+    BDirIndex hdr;
+    BDirSlot slot;
+    BDirEntry de;
+    uint64_t i, n;
+    int status;
+
+    status = O2FSIndexRead(dn, base, &hdr, sizeof(hdr), &entry);
+    if (status < 0)
+	goto done;
+    if (memcmp(hdr.magic, BDIRINDEX_MAGIC, 8) != 0 || hdr.slots == 0 ||
+	(hdr.slots & (hdr.slots - 1)) != 0 || hdr.entries != entries) {
+	Alert(o2fs, "bad directory index\n");
+	status = -EINVAL;
+	goto done;
+    }
+
+    status = -ENOENT;
+    i = hash & (hdr.slots - 1);
+    for (n = 0; n < hdr.slots; n++) {
+	if (O2FSIndexRead(dn, base + sizeof(hdr) + i * sizeof(slot), &slot,
+			  sizeof(slot), &entry) < 0 ||
+	    slot.entry > entries) {
+	    status = -EINVAL;
+	    break;
+	}
+	if (slot.entry == 0)
+	    break;
+
+	if (slot.hash == hash) {
+	    if (O2FSIndexRead(dn, (slot.entry - 1) * sizeof(de), &de,
+			      sizeof(de), &entry) < 0 ||
+		memcmp(de.magic, BDIR_MAGIC, 8) != 0) {
+		status = -EINVAL;
+		break;
+	    }
+	    if (strcmp((char *)de.name, name) == 0) {
+		*fn = O2FSLoadVNode(dn, &de.objId,
+				    (slot.entry - 1) * sizeof(de));
+		status = *fn != NULL ? 0 : -EIO;
+		break;
+	    }
+	}
+
+	i = (i + 1) & (hdr.slots - 1);
+    }
+
+done:
+    if (entry != NULL)
+	BufCache_Release(entry);
+
+    return status;
+}
+
 /**
  * O2FS_Lookup --
  *
@@ -461,7 +1533,7 @@ O2FSDumpDirEntry(BDirEntry *entry)
  * @param [out] fn VNode of the entry if found.
  * @param [in] name Name of the file.
  *
- * @return 0 on success, otherwise error.
+ * @return 0 on success, -ENOENT if the name does not exist, otherwise error.
  */
 int
 O2FS_Lookup(VNode *dn, VNode **fn, const char *name)
@@ -477,33 +1549,40 @@ O2FS_Lookup(VNode *dn, VNode **fn, const char *name)
 
     DLOG(o2fs, "Lookup %lld %d\n", dirBN->size, blocks);
 
+    if (dirBN->flags & BNODE_FLAG_INLINE) {
+	if (O2FSLookupEntries(dn, (BDirEntry *)O2FSInlineData(dirBN),
+			      dirBN->size / sizeof(BDirEntry), 0, fn, name))
+	    return *fn != NULL ? 0 : -EIO;
+	return -ENOENT;
+    }
+
+    if (dirBN->flags & BNODE_FLAG_DIRINDEX) {
+	status = O2FSLookupIndex(dn, dirBN, fn, name);
+	if (status == 0)
+	    return 0;
+	if (status == -ENOENT)
+	    return status;
+	// Fall back to scanning the entries
+    }
+
     for (b = 0; b < blocks; b++) {
 	// Read block
-	int e;
 	int entryPerBlock = sb->blockSize / sizeof(BDirEntry);
 	BufCacheEntry *entry;
-	BDirEntry *dir;
+	bool found;
 
 	status = O2FSResolveBuf(dn, b, &entry);
 	if (status != 0)
 		return status;
 
-	dir = (BDirEntry *)entry->buffer;
-	for (e = 0; e < entryPerBlock; e++) {
-	    if (strcmp((char *)dir[e].magic, BDIR_MAGIC) == 0) {
-		O2FSDumpDirEntry(&dir[e]);
-
-		if (strcmp((char *)dir[e].name, name) == 0) {
-		    *fn = O2FSLoadVNode(vfs, &dir[e].objId);
-		    return 0;
-		}
-	    }
-	}
-
+	found = O2FSLookupEntries(dn, (BDirEntry *)entry->buffer,
+				  entryPerBlock, b * sb->blockSize, fn, name);
 	BufCache_Release(entry);
+	if (found)
+	    return *fn != NULL ? 0 : -EIO;
     }
 
-    return -1;
+    return -ENOENT;
 }
 
 int
@@ -548,19 +1627,294 @@ O2FS_Stat(VNode *fn, struct stat *statinfo)
 }
 
 /**
- * O2FS_Read --
+ * O2FSCopyOut --
  *
- * Read from a VNode.
+ * Copy file data to the caller's buffer, which is a user address for reads 
+ * from user space.
+ */
+static inline int
+O2FSCopyOut(uint8_t *buf, bool user, void *src, uint64_t len)
+{
+    if (!user) {
+	memcpy(buf, src, len);
+	return 0;
+    }
+
+    if (Copy_Out(src, (uintptr_t)buf, len) != 0)
+	return -EFAULT;
+
+    return 0;
+}
+
+/**
+ * O2FSReadCached --
+ *
+ * Read a range of a file through the buffer cache.  The blocks are mapped to 
+ * cache buffers up to O2FS_READ_BATCH at a time, so that all of their reads 
+ * are outstanding together, and then copied straight to the caller.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSReadCached(VNode *fn, uint8_t *buf, uint64_t off, uint64_t len, bool user)
+{
+    uint64_t blksize = fn->vfs->blksize;
+    BufCacheEntry *entries[O2FS_READ_BATCH];
+    uint64_t first, n, i, bOff, bLen;
+    int status = 0;
+
+    while (len > 0 && status == 0) {
+	first = off / blksize;
+	n = (off + len - 1) / blksize - first + 1;
+	if (n > O2FS_READ_BATCH)
+	    n = O2FS_READ_BATCH;
+
+	for (i = 0; i < n; i++) {
+	    status = O2FSResolveBuf(fn, first + i, &entries[i]);
+	    if (status != 0)
+		break;
+	}
+	n = i;
+
+	for (i = 0; i < n; i++) {
+	    bOff = off % blksize;
+	    bLen = blksize - bOff;
+	    if (bLen > len)
+		bLen = len;
+
+	    DLOG(o2fs, "READ %lx %lx %lld\n", buf, entries[i]->buffer, bLen);
+	    if (status == 0)
+		status = O2FSCopyOut(buf, user, entries[i]->buffer + bOff, bLen);
+	    BufCache_Release(entries[i]);
+
+	    buf += bLen;
+	    off += bLen;
+	    len -= bLen;
+	}
+    }
+
+    return status;
+}
+
+/**
+ * O2FSUserPage --
+ *
+ * Checks that a user page is mapped and writable by touching it.  User 
+ * memory is never paged out, so the page stays in place while a read DMAs 
+ * into it.
+ *
+ * @return Direct map address of the page, or 0 if it is not accessible.
+ */
+static uintptr_t
+O2FSUserPage(Thread *cur, uintptr_t va)
+{
+    uint8_t b;
+
+    if (Copy_In(va, &b, 1) != 0 || Copy_Out(&b, va, 1) != 0)
+	return 0;
+
+    return DMPA2VA(PMap_Translate(cur->space, va));
+}
+
+/**
+ * O2FSDirectAppend --
+ *
+ * Add a user page to a direct read, merging it with the previous entry if 
+ * both the disk range and the memory are contiguous.
+ */
+static void
+O2FSDirectAppend(SGArray *sga, void **bufs, uint64_t diskOffset, uintptr_t va)
+{
+    int last = sga->len - 1;
+
+    if (last >= 0 &&
+	sga->entries[last].offset + sga->entries[last].length == diskOffset &&
+	(uintptr_t)bufs[last] + sga->entries[last].length == va) {
+	sga->entries[last].length += PGSIZE;
+	return;
+    }
+
+    bufs[sga->len] = (void *)va;
+    SGArray_Append(sga, diskOffset, PGSIZE);
+}
+
+/**
+ * O2FSDirectWait --
+ *
+ * Wait for the outstanding requests of a direct read.
+ *
+ * @return 0 if they all succeeded, otherwise the first error.
+ */
+static int
+O2FSDirectWait(DiskRequest *reqs, int count, uint64_t *read)
+{
+    int i, r;
+    int status = 0;
+
+    for (i = 0; i < count; i++) {
+	r = Disk_Wait(&reqs[i]);
+	if (r != 0 && status == 0)
+	    status = r < 0 ? r : -EIO;
+	*read += reqs[i].bytes;
+    }
+
+    return status;
+}
+
+/**
+ * O2FSVerifyDirect --
+ *
+ * Verify a block that a direct read placed in user pages against its 
+ * checksum.  The pages were checked by O2FSUserPage when the read was set 
+ * up.
  *
  * @param [in] fn VNode of the file.
- * @param [out] buf Buffer to read into.
- * @param [in] off Offset within the file.
- * @param [in] len Length of the buffer to read.
+ * @param [in] cur Current thread.
+ * @param [in] blkNum Block number within the file.
+ * @param [in] buf Page aligned user address of the block.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSVerifyDirect(VNode *fn, Thread *cur, uint64_t blkNum, uintptr_t buf)
+{
+    uint64_t blksize = fn->vfs->blksize;
+    BufCacheEntry *sumEntry;
+    O2FSHashState st;
+    uint8_t hash[O2FS_HASH_SIZE];
+    uint8_t *sum;
+    uint64_t diskOffset, i;
+    uintptr_t page;
+    int status;
+
+    status = O2FSBlockSum(fn, blkNum, false, &sumEntry, &sum);
+    if (status < 0 || sumEntry == NULL)
+	return status;
+
+    if (!O2FSHashIsZero(sum)) {
+	O2FSHashInit(&st);
+	for (i = 0; i < blksize; i += PGSIZE) {
+	    page = DMPA2VA(PMap_Translate(cur->space, buf + i));
+	    O2FSHashUpdateFast(&st, (void *)page, PGSIZE);
+	}
+	O2FSHashFinal(&st, hash);
+
+	status = O2FSResolveBlock(fn, blkNum, &diskOffset);
+	if (status == 0)
+	    status = O2FSCheckSum(diskOffset, hash, sum);
+    }
+    BufCache_Release(sumEntry);
+
+    return status;
+}
+
+/**
+ * O2FSReadDirect --
+ *
+ * Read whole blocks from the disk straight into user pages, bypassing the 
+ * buffer cache.  Stops at the first block that is cached, since the cache 
+ * may hold data newer than the disk.  Each request's SGArray and buffers 
+ * are built in place in the page that holds the requests, to keep them off 
+ * the stack.
+ *
+ * @param [in] fn VNode of the file.
+ * @param [in] buf Page aligned user address.
+ * @param [in] off Block aligned offset within the file.
+ * @param [in] len Bytes to read, a multiple of the block size.
+ *
+ * @return Number of bytes read, which may be 0, otherwise negative error code.
+ */
+static int
+O2FSReadDirect(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len)
+{
+    uint64_t blksize = fn->vfs->blksize;
+    uint64_t pages = blksize / PGSIZE;
+    uint64_t pos = 0;
+    uint64_t read = 0;
+    uint64_t start, diskOffset, i;
+    uintptr_t va;
+    DiskRequest *reqs, *req;
+    Thread *cur;
+    int nreq = 0;
+    int status = 0;
+    int waitStatus;
+    bool stop = false;
+
+    static_assert(O2FS_DIRECT_REQS * sizeof(DiskRequest) <= PGSIZE,
+		  "Direct read requests must fit in a page");
+
+    // Fall back to the buffer cache if memory is short
+    reqs = (DiskRequest *)PAlloc_AllocPage();
+    if (reqs == NULL)
+	return 0;
+
+    cur = Sched_Current();
+    while (status == 0 && !stop && pos < len) {
+	req = &reqs[nreq];
+	Disk_InitRequest(req, fn->disk, DISKREQ_OP_READ, NULL, NULL, NULL, NULL);
+	start = pos;
+	while (pos < len && req->sga.len + pages <= SGARRAY_MAX_ENTRIES) {
+	    if (O2FSResolveBlock(fn, (off + pos) / blksize, &diskOffset) < 0 ||
+		BufCache_IsCached(fn->disk, diskOffset)) {
+		stop = true;
+		break;
+	    }
+
+	    for (i = 0; i < pages; i++) {
+		va = O2FSUserPage(cur, buf + pos + i * PGSIZE);
+		if (va == 0) {
+		    status = -EFAULT;
+		    break;
+		}
+		O2FSDirectAppend(&req->sga, req->bufs, diskOffset + i * PGSIZE,
+				 va);
+	    }
+	    if (status != 0)
+		break;
+	    pos += blksize;
+	}
+	if (status != 0 || req->sga.len == 0)
+	    break;
+
+	req->buf = req->bufs[0];
+	req->bytes = pos - start;
+	Disk_Submit(req);
+	nreq++;
+
+	if (nreq == O2FS_DIRECT_REQS) {
+	    status = O2FSDirectWait(reqs, nreq, &read);
+	    nreq = 0;
+	}
+    }
+
+    waitStatus = O2FSDirectWait(reqs, nreq, &read);
+    if (status == 0)
+	status = waitStatus;
+
+    // The blocks bypassed the cache so they are verified in place
+    if (O2FSChecksums(fn->vfs)) {
+	for (pos = 0; status == 0 && pos < read; pos += blksize)
+	    status = O2FSVerifyDirect(fn, cur, (off + pos) / blksize,
+				      buf + pos);
+    }
+
+    Thread_Release(cur);
+    PAlloc_Release(reqs);
+
+    return status < 0 ? status : (int)read;
+}
+
+/**
+ * O2FSReadRange --
+ *
+ * Implements O2FS_Read and O2FS_ReadUser.  User reads of at least 
+ * o2fs_directio KB that start on a block boundary in a page aligned buffer 
+ * DMA uncached blocks directly into the user pages and skip read-ahead.
  *
  * @return number of bytes on success, otherwise negative error code.
  */
-int
-O2FS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
+static int
+O2FSReadRange(VNode *fn, uint8_t *buf, uint64_t off, uint64_t len, bool user)
 {
     int status;
     VFS *vfs = fn->vfs;
@@ -568,8 +1922,11 @@ O2FS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
     SuperBlock *sb = sbEntry->buffer;
     BufCacheEntry *fileEntry = (BufCacheEntry *)fn->fsptr;
     BNode *fileBN = fileEntry->buffer;
-    uint64_t blocks = (fileBN->size + sb->blockSize - 1) / sb->blockSize;
+    uint64_t blksize = sb->blockSize;
+    uint64_t blocks = (fileBN->size + blksize - 1) / blksize;
+    uint64_t directMin = SYSCTL_GETINT(o2fs_directio) * 1024;
     uint64_t readBytes = 0;
+    bool direct;
 
     DLOG(o2fs, "Read %lld %d\n", fileBN->size, blocks);
 
@@ -581,52 +1938,181 @@ O2FS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
 	len = fileBN->size - off;
     }
 
-    while (1) {
-	uint64_t b = off / sb->blockSize;
-	uint64_t bOff = off % sb->blockSize;
-	uint64_t bLen;
-	BufCacheEntry *entry;
+    if (len == 0) {
+	return 0;
+    }
 
-	if (bOff + len > sb->blockSize) {
-	    bLen = sb->blockSize - bOff;
-	} else {
-	    bLen = len;
-	}
+    if (fileBN->flags & BNODE_FLAG_INLINE) {
+	status = O2FSCopyOut(buf, user, O2FSInlineData(fileBN) + off, len);
+	return status < 0 ? status : (int)len;
+    }
 
-	status = O2FSResolveBuf(fn, b, &entry);
-	if (status != 0)
-		return status;
+    direct = user && directMin != 0 && len >= directMin &&
+	     (off % blksize) == 0 && ((uintptr_t)buf % PGSIZE) == 0 &&
+	     (blksize % PGSIZE) == 0;
+    if (!direct)
+	O2FSReadAhead(fn, off / blksize, (off + len - 1) / blksize, blocks);
 
-	DLOG(o2fs, "READ %lx %lx %lld\n", buf, entry->buffer, bLen);
-	memcpy(buf, entry->buffer + bOff, bLen);
-	BufCache_Release(entry);
+    while (direct && len >= blksize) {
+	status = O2FSReadDirect(fn, (uintptr_t)buf, off, len - len % blksize);
+	if (status < 0)
+	    return status;
 
-	readBytes += bLen;
-	buf += bLen;
-	off += bLen;
-	len -= bLen;
+	// Read the block that stopped the direct read through the cache
+	if (status == 0) {
+	    status = O2FSReadCached(fn, buf, off, blksize, user);
+	    if (status < 0)
+		return status;
+	    status = blksize;
+	}
 
-	if (len == 0)
-	    break;
+	readBytes += status;
+	buf += status;
+	off += status;
+	len -= status;
+    }
+
+    if (len != 0) {
+	status = O2FSReadCached(fn, buf, off, len, user);
+	if (status < 0)
+	    return status;
+	readBytes += len;
     }
 
     return readBytes;
 }
 
 /**
- * O2FS_Write --
+ * O2FS_Read --
  *
- * Write to a VNode.
+ * Read from a VNode.
  *
  * @param [in] fn VNode of the file.
- * @param [in] buf Buffer to write out.
+ * @param [out] buf Buffer to read into.
  * @param [in] off Offset within the file.
- * @param [in] len Length of the buffer to write.
+ * @param [in] len Length of the buffer to read.
  *
  * @return number of bytes on success, otherwise negative error code.
  */
 int
-O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
+O2FS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
+{
+    return O2FSReadRange(fn, (uint8_t *)buf, off, len, false);
+}
+
+/**
+ * O2FS_ReadUser --
+ *
+ * Read from a VNode into user memory.
+ *
+ * @param [in] fn VNode of the file.
+ * @param [out] buf User address to read into.
+ * @param [in] off Offset within the file.
+ * @param [in] len Length of the buffer to read.
+ *
+ * @return number of bytes on success, otherwise negative error code.
+ */
+int
+O2FS_ReadUser(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len)
+{
+    return O2FSReadRange(fn, (uint8_t *)buf, off, len, true);
+}
+
+/**
+ * O2FSSealVNode --
+ *
+ * Update the checksum of a BNode changed by the current operation in its 
+ * directory entry.  That changes the directory, so the directories above 
+ * are sealed in turn until one is reached whose BNode is unchanged, or the 
+ * root, whose checksum is in the superblock.  A directory whose entries are 
+ * in extents usually stops the walk, since only its checksum block changes.
+ *
+ * @param [in] vn VNode of the file.
+ *
+ * @return 0 on success, otherwise error code.
+ */
+static int
+O2FSSealVNode(VNode *vn)
+{
+    VFS *fs = vn->vfs;
+    BufCacheEntry *sbEntry = (BufCacheEntry *)fs->fsptr;
+    SuperBlock *sb = sbEntry->buffer;
+    uint8_t hash[O2FS_HASH_SIZE];
+    BufCacheEntry *entry;
+    BDirEntry *de;
+    BNode *dirBN;
+    VNode *dn;
+    uint64_t off;
+    int status = 0;
+
+    if (!O2FSChecksums(fs))
+	return 0;
+
+    Mutex_Lock(&sealLock);
+    for (; vn != NULL; vn = dn) {
+	O2FSHashBlock(((BufCacheEntry *)vn->fsptr)->buffer, fs->blksize, hash);
+
+	dn = vn->parent;
+	if (dn == NULL) {
+	    if (memcmp(sb->root.hash, hash, O2FS_HASH_SIZE) != 0) {
+		O2FSJournalAccess(fs, sbEntry);
+		memcpy(sb->root.hash, hash, O2FS_HASH_SIZE);
+		O2FSSuperBlockSum(sb, fs->blksize, hash);
+		memcpy(sb->hash, hash, O2FS_HASH_SIZE);
+		O2FSJournalDirty(fs, sbEntry);
+	    }
+	    break;
+	}
+
+	dirBN = ((BufCacheEntry *)dn->fsptr)->buffer;
+	off = vn->fsval;
+	if (off + sizeof(BDirEntry) > dirBN->size)
+	    break;
+
+	entry = NULL;
+	if (dirBN->flags & BNODE_FLAG_INLINE) {
+	    de = (BDirEntry *)(O2FSInlineData(dirBN) + off);
+	} else {
+	    status = O2FSResolveBuf(dn, off / fs->blksize, &entry);
+	    if (status < 0)
+		break;
+	    de = (BDirEntry *)(entry->buffer + off % fs->blksize);
+	}
+
+	// Stop if nothing changed or the entry was overwritten
+	if (memcmp(de->magic, BDIR_MAGIC, 8) != 0 ||
+	    de->objId.offset != vn->key ||
+	    memcmp(de->objId.hash, hash, O2FS_HASH_SIZE) == 0) {
+	    if (entry != NULL)
+		BufCache_Release(entry);
+	    break;
+	}
+
+	O2FSJournalAccess(fs, entry != NULL ? entry : dn->fsptr);
+	memcpy(de->objId.hash, hash, O2FS_HASH_SIZE);
+	if (entry == NULL) {
+	    O2FSJournalDirty(fs, dn->fsptr);
+	    continue;
+	}
+
+	O2FSJournalDirty(fs, entry);
+	status = O2FSSetBlockSum(dn, off / fs->blksize, entry);
+	BufCache_Release(entry);
+	if (status < 0)
+	    break;
+    }
+    Mutex_Unlock(&sealLock);
+
+    return status;
+}
+
+/**
+ * O2FSWrite --
+ *
+ * Implements O2FS_Write within a journal operation.
+ */
+static int
+O2FSWrite(VNode *fn, void *buf, uint64_t off, uint64_t len)
 {
     int status;
     VFS *vfs = fn->vfs;
@@ -641,6 +2127,28 @@ O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
 
     // XXX: Check permissions
 
+    O2FSJournalAccess(vfs, fileEntry);
+
+    // The index is not maintained, so stop using it once entries change
+    if (fileBN->flags & BNODE_FLAG_DIRINDEX) {
+	fileBN->flags &= ~BNODE_FLAG_DIRINDEX;
+	O2FSJournalDirty(vfs, fileEntry);
+    }
+
+    if (fileBN->flags & BNODE_FLAG_INLINE) {
+	if (off + len <= O2FS_INLINE_MAX(sb->blockSize)) {
+	    memcpy(O2FSInlineData(fileBN) + off, buf, len);
+	    if (fileBN->size < off + len)
+		fileBN->size = off + len;
+	    O2FSJournalDirty(vfs, fileEntry);
+	    return len;
+	}
+
+	status = O2FSPromoteInline(fn);
+	if (status < 0)
+	    return status;
+    }
+
     if (fileBN->size < (off+len)) {
 	status = O2FSGrowVNode(fn, off+len);
 	if (status < 0)
@@ -667,7 +2175,10 @@ O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
 	memcpy(entry->buffer + bOff, buf, bLen);
 
 	BufCache_Write(entry);
+	status = O2FSSetBlockSum(fn, b, entry);
 	BufCache_Release(entry);
+	if (status < 0)
+	    return status;
 
 	readBytes += bLen;
 	buf += bLen;
@@ -681,60 +2192,221 @@ O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
     return readBytes;
 }
 
+/**
+ * O2FS_Write --
+ *
+ * Write to a VNode.  The metadata changed by the write is committed to the 
+ * journal as part of a single transaction.  On file systems with checksums 
+ * each O2FS_WRITE_CHUNK blocks are a separate operation, since every 
+ * extent written may add a checksum block to the transaction.
+ *
+ * @param [in] fn VNode of the file.
+ * @param [in] buf Buffer to write out.
+ * @param [in] off Offset within the file.
+ * @param [in] len Length of the buffer to write.
+ *
+ * @return number of bytes on success, otherwise negative error code.
+ */
+int
+O2FS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
+{
+    VFS *fs = fn->vfs;
+    uint64_t chunk = len;
+    uint64_t written = 0;
+    int status;
+
+    do {
+	if (O2FSChecksums(fs)) {
+	    chunk = O2FS_WRITE_CHUNK * fs->blksize - off % fs->blksize;
+	    if (chunk > len)
+		chunk = len;
+	}
+
+	status = O2FSJournalBegin(fs);
+	if (status < 0)
+	    return status;
+
+	status = O2FSWrite(fn, buf, off, chunk);
+	if (status >= 0) {
+	    int sealStatus = O2FSSealVNode(fn);
+	    if (sealStatus < 0)
+		status = sealStatus;
+	}
+	O2FSJournalEnd(fs);
+	if (status < 0)
+	    return status;
+
+	buf += chunk;
+	off += chunk;
+	len -= chunk;
+	written += chunk;
+    } while (len > 0);
+
+    return written;
+}
+
+/**
+ * O2FS_Flush --
+ *
+ * Commit the journal and write back all dirty blocks of the file system.  
+ * O2FS does not track which cached blocks belong to which file so the whole 
+ * disk is synced.
+ *
+ * @param [in] fn VNode to flush.
+ *
+ * @return 0 on success, otherwise error.
+ */
+int
+O2FS_Flush(VNode *fn)
+{
+    int status;
+
+    status = O2FSJournalSync(fn->vfs);
+    if (status != 0)
+	return status;
+
+    return BufCache_Sync(fn->disk);
+}
+
+/**
+ * O2FSFillDirent --
+ *
+ * Convert a directory entry into a dirent.  The size comes from the BNode, 
+ * since writes do not update the size recorded in the directory entry.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] entry Directory entry.
+ * @param [out] de Dirent to fill in.
+ */
+static void
+O2FSFillDirent(VFS *fs, BDirEntry *entry, struct dirent *de)
+{
+    BufCacheEntry *bnEntry;
+    BNode *bn;
+    uint64_t namlen;
+
+    de->d_ino = entry->objId.offset;
+    de->d_reclen = sizeof(*de);
+    if (entry->flags & BDIR_FLAG_DIR)
+	de->d_type = DT_DIR;
+    else if (entry->flags & BDIR_FLAG_FILE)
+	de->d_type = DT_REG;
+    else
+	de->d_type = DT_UNKNOWN;
+
+    de->d_size = 0;
+    if (BufCache_Read(fs->disk, entry->objId.offset, &bnEntry) == 0) {
+	bn = bnEntry->buffer;
+	if (memcmp(&bn->magic, BNODE_MAGIC, 8) == 0)
+	    de->d_size = bn->size;
+	BufCache_Release(bnEntry);
+    }
+
+    for (namlen = 0; namlen < MAXNAMELEN && entry->name[namlen] != '\0';
+	 namlen++)
+	;
+    memcpy(de->d_name, entry->name, namlen);
+    de->d_name[namlen] = '\0';
+    de->d_namlen = namlen;
+}
+
 /**
  * O2FS_ReadDir --
  *
- * Read a directory entry.
+ * Read directory entries.  Whole directory blocks are walked at a time and 
+ * the entries are converted into a kernel buffer that is copied out once 
+ * per page of dirents.
  *
  * @param [in] fn VNode of the directory.
- * @param [out] buf Buffer to read the directory entry into.
+ * @param [out] buf User buffer to read the directory entries into.
  * @param [in] len Length of the buffer.
  * @param [inout] off Offset to start from and return the next offset.
  *
- * @return 0 on success, otherwise error.
+ * @return Number of entries read, otherwise error.
  */
 int
 O2FS_ReadDir(VNode *fn, void *buf, uint64_t len, uint64_t *off)
 {
-    int count = 0;
-    int status;
+    VFS *fs = fn->vfs;
+    uint64_t blksize = fs->blksize;
     BufCacheEntry *fileEntry = (BufCacheEntry *)fn->fsptr;
     BNode *fileBN = fileEntry->buffer;
-    BDirEntry dirEntry;
-    struct dirent de;
+    uintptr_t ubuf = (uintptr_t)buf;
+    uint64_t batchMax = PGSIZE / sizeof(struct dirent);
+    uint64_t batch = 0;
+    uint64_t bOff, bEnd;
+    BufCacheEntry *entry;
+    BDirEntry *block;
+    struct dirent *des;
+    int count = 0;
+    int status = 0;
 
-    while (len >= sizeof(de)) {
-	if (*off == fileBN->size)
-	    return count;
-	if (*off > fileBN->size)
-	    return -EINVAL;
+    if (*off > fileBN->size || (*off % sizeof(BDirEntry)) != 0)
+	return -EINVAL;
 
-	// XXX: Check offset
+    des = (struct dirent *)PAlloc_AllocPage();
+    if (des == NULL)
+	return -ENOMEM;
 
-	status = O2FS_Read(fn, &dirEntry, *off, sizeof(dirEntry));
-	if (status != sizeof(dirEntry)) {
-	    kprintf("Unexpected error reading directory: %d\n", status);
-	    return -ENOTDIR;
-	}
-	if (strncmp((char *)&dirEntry.magic[0], BDIR_MAGIC, sizeof(dirEntry.magic)) != 0) {
-	    return -ENOTDIR;
+    while (len >= sizeof(struct dirent) && *off < fileBN->size) {
+	if (fileBN->flags & BNODE_FLAG_INLINE) {
+	    entry = NULL;
+	    block = (BDirEntry *)O2FSInlineData(fileBN);
+	    bOff = *off;
+	    bEnd = fileBN->size;
+	} else {
+	    status = O2FSResolveBuf(fn, *off / blksize, &entry);
+	    if (status != 0)
+		break;
+	    block = (BDirEntry *)entry->buffer;
+	    bOff = *off % blksize;
+	    bEnd = blksize;
+	    if (bEnd > fileBN->size - (*off - bOff))
+		bEnd = fileBN->size - (*off - bOff);
 	}
 
-	// XXX: Validation and fill in all fields
-	strcpy(de.d_name, (char *)dirEntry.name);
+	for (; bOff + sizeof(BDirEntry) <= bEnd &&
+	       len >= sizeof(struct dirent); bOff += sizeof(BDirEntry)) {
+	    BDirEntry *de = &block[bOff / sizeof(BDirEntry)];
 
-	status = Copy_Out(&de, (uintptr_t)buf, sizeof(de));
-	if (status != 0)
-	    return status;
+	    if (memcmp(de->magic, BDIR_MAGIC, sizeof(de->magic)) != 0) {
+		status = -ENOTDIR;
+		break;
+	    }
+
+	    O2FSFillDirent(fs, de, &des[batch++]);
+	    *off += sizeof(BDirEntry);
+	    len -= sizeof(struct dirent);
+	    count++;
 
-	*off += sizeof(dirEntry);
-	buf += sizeof(de);
-	len -= sizeof(de);
+	    if (batch == batchMax) {
+		if (Copy_Out(des, ubuf, batch * sizeof(struct dirent)) != 0) {
+		    status = -EFAULT;
+		    break;
+		}
+		ubuf += batch * sizeof(struct dirent);
+		batch = 0;
+	    }
+	}
 
-	count++;
+	if (entry != NULL)
+	    BufCache_Release(entry);
+	if (status != 0)
+	    break;
+	// A truncated entry at the end of the directory
+	if (bOff < bEnd && bOff + sizeof(BDirEntry) > bEnd) {
+	    status = -ENOTDIR;
+	    break;
+	}
     }
 
-    return count;
+    if (status == 0 && batch != 0 &&
+	Copy_Out(des, ubuf, batch * sizeof(struct dirent)) != 0)
+	status = -EFAULT;
+
+    PAlloc_Release(des);
+
+    return status < 0 ? status : count;
 }
 
 //fixed
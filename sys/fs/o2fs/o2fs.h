@@ -1,20 +1,43 @@
 #ifndef __FS_O2FS_H__
 #define __FS_O2FS_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define MAXUSERNAMELEN     32
 #define MAXNAMELEN         255
 
 #define O2FS_VERSION_MAJOR 1
-#define O2FS_VERSION_MINOR 0
+#define O2FS_VERSION_MINOR 3
 
 #define SUPERBLOCK_MAGIC   "SUPRBLOK"
 #define BNODE_MAGIC        "BLOKNODE"
 #define BDIR_MAGIC         "DIRENTRY"
+#define BDIRINDEX_MAGIC    "DIRINDEX"
+#define JOURNAL_MAGIC      "JOURNAL "
+#define JDESC_MAGIC        "JRNLDESC"
+#define JCOMMIT_MAGIC      "JRNLCOMT"
 
 #define O2FS_DIRECT_PTR    64
 #define O2FS_INDIRECT_PTR  64
+#define O2FS_EXTENT_MAX    128
+
+/*
+ * BNode flags
+ *
+ * Version 1.0 BNodes map files through indirect blocks of direct BPtrs.  
+ * Version 1.1 adds extents, runs of contiguous blocks stored in the BNode in 
+ * place of the indirect pointers and terminated by a zero length.  Version 
+ * 1.2 adds inline data: the contents of files and directories of up to 
+ * O2FS_INLINE_MAX bytes are stored in the BNode block after the BNode.
+ *
+ * Directories with BNODE_FLAG_DIRINDEX have a hash index in the blocks after 
+ * their entries.  The index is only a hint; the entries are unchanged so 
+ * file systems that ignore it still work.
+ */
+#define BNODE_FLAG_EXTENTS 0x00000001
+#define BNODE_FLAG_INLINE  0x00000002
+#define BNODE_FLAG_DIRINDEX 0x00000004
 
 typedef struct ObjID {
     uint8_t   hash[32];
@@ -30,6 +53,25 @@ typedef struct BPtr {
     uint64_t  _rsvd1;
 } BPtr;
 
+typedef struct BExtent {
+    uint64_t  device;
+    uint64_t  offset;         // Disk offset of the first block
+    uint64_t  length;         // Length in blocks
+    uint64_t  sums;           // Disk offset of the checksum block or zero
+} BExtent;
+
+/*
+ * SuperBlock features
+ *
+ * Version 1.3 adds feature flags.  File systems with features that the 
+ * kernel does not know are not mounted.  O2FS_FEATURE_JOURNAL means that 
+ * journalSize blocks at journalOffset hold the metadata journal.  
+ * O2FS_FEATURE_CHECKSUM means that blocks are checksummed, see below.
+ */
+#define O2FS_FEATURE_JOURNAL 0x00000001
+#define O2FS_FEATURE_CHECKSUM 0x00000002
+#define O2FS_FEATURE_ALL   (O2FS_FEATURE_JOURNAL | O2FS_FEATURE_CHECKSUM)
+
 #pragma pack(push, 1)
 typedef struct SuperBlock {
     uint8_t   magic[8];
@@ -44,6 +86,8 @@ typedef struct SuperBlock {
     uint64_t  version;
     ObjID     root;
     uint8_t   hash[32];
+    uint64_t  journalOffset;
+    uint64_t  journalSize;    // Size in blocks
 } SuperBlock;
 #pragma pack(pop)
 
@@ -54,16 +98,30 @@ typedef struct BNode {
     uint16_t  versionMinor;
     uint32_t  flags;
     uint64_t  size;
-    BPtr      indirect[O2FS_INDIRECT_PTR];
+    union {
+        BPtr      indirect[O2FS_INDIRECT_PTR];
+        BExtent   extents[O2FS_EXTENT_MAX];
+    };
 } BNode;
 #pragma pack(pop)
 
+#define O2FS_INLINE_MAX(_blksize) ((_blksize) - sizeof(BNode))
+
 #pragma pack(push, 1)
 typedef struct BInd {
     BPtr direct[O2FS_DIRECT_PTR];
 } BInd;
 #pragma pack(pop)
 
+/*
+ * BDirEntry flags
+ *
+ * The type of the object an entry refers to.  Entries written before these 
+ * flags were added have neither set.
+ */
+#define BDIR_FLAG_FILE     0x00000001
+#define BDIR_FLAG_DIR      0x00000002
+
 #pragma pack(push, 1)
 typedef struct BDirEntry {
     uint8_t   magic[8];
@@ -79,4 +137,181 @@ typedef struct BDirEntry {
 } BDirEntry;
 #pragma pack(pop)
 
+/*
+ * Directory Index
+ *
+ * A BDirIndex header followed by an open addressing hash table of BDirSlots 
+ * with linear probing.  The index starts at the first block boundary after 
+ * the directory entries.  A slot holds the hash of a name and the number of 
+ * its entry plus one, or zero if the slot is empty.  Tables are at most half 
+ * full so probes are short and always reach an empty slot.
+ */
+#pragma pack(push, 1)
+typedef struct BDirIndex {
+    uint8_t   magic[8];
+    uint64_t  slots;          // Number of slots, a power of two
+    uint64_t  entries;
+    uint8_t   _rsvd[40];
+} BDirIndex;
+#pragma pack(pop)
+
+typedef struct BDirSlot {
+    uint32_t  hash;
+    uint32_t  entry;
+} BDirSlot;
+
+/*
+ * Journal
+ *
+ * The first block of the journal is a JHeader.  The log follows it and 
+ * always starts at the second block.  Each transaction is a JDesc block 
+ * listing the disk offsets of the blocks it updates, the new contents of 
+ * those blocks in order, and a JCommit block.  The commit block holds a 
+ * checksum of the descriptor and data blocks so a transaction that was only 
+ * partly written is ignored.  Transactions are numbered consecutively 
+ * starting with the sequence number in the header, which is advanced each 
+ * time the log is emptied, so stale transactions are never replayed.
+ */
+#define O2FS_JOURNAL_MIN   256
+
+#pragma pack(push, 1)
+typedef struct JHeader {
+    uint8_t   magic[8];
+    uint64_t  seq;            // Sequence number of the first transaction
+} JHeader;
+
+typedef struct JDesc {
+    uint8_t   magic[8];
+    uint64_t  seq;
+    uint64_t  count;          // Number of data blocks
+    uint64_t  _rsvd0;
+    uint64_t  offsets[];      // Disk offset of each data block
+} JDesc;
+
+typedef struct JCommit {
+    uint8_t   magic[8];
+    uint64_t  seq;
+    uint64_t  count;
+    uint64_t  checksum;
+} JCommit;
+#pragma pack(pop)
+
+/*
+ * Checksums
+ *
+ * With O2FS_FEATURE_CHECKSUM every block that is reached through a pointer 
+ * is checksummed, and the checksum is stored with the pointer:
+ *
+ *  - SuperBlock.hash covers the superblock block, hashed with the field 
+ *    zeroed.
+ *  - ObjID.hash, in the superblock and in directory entries, covers the 
+ *    BNode block.
+ *  - BPtr.hash covers the indirect or data block.
+ *  - BExtent.sums points to a checksum block holding the hash of each block 
+ *    of the extent in order, so extents are at most O2FS_HASH_PER_BLOCK 
+ *    blocks long.  Checksum blocks themselves are not checksummed.
+ *
+ * A hash of all zeros is not checked, since blocks are allocated before 
+ * they are written.  The bitmap and the journal are not covered.  File data 
+ * is not journaled, so after a crash blocks written by the last 
+ * transactions may not match their checksums.
+ *
+ * The hash runs eight independent lanes over 32 byte stripes, lane i taking 
+ * the i-th 32-bit word of each stripe, so that it vectorizes.  Each lane is 
+ * an xxHash32 round.  The lanes are folded together with the length and 
+ * each is finalized into one word of the 32 byte hash.
+ */
+#define O2FS_HASH_SIZE     32
+#define O2FS_HASH_LANES    8
+#define O2FS_HASH_PER_BLOCK(_blksize) ((_blksize) / O2FS_HASH_SIZE)
+
+#define O2FS_HASH_PRIME1   2654435761U
+#define O2FS_HASH_PRIME2   2246822519U
+#define O2FS_HASH_PRIME3   3266489917U
+
+typedef struct O2FSHashState {
+    uint32_t  acc[O2FS_HASH_LANES];
+    uint64_t  len;
+} O2FSHashState;
+
+static inline uint32_t
+O2FSHashRotl(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline void
+O2FSHashInit(O2FSHashState *st)
+{
+    for (int i = 0; i < O2FS_HASH_LANES; i++)
+        st->acc[i] = O2FS_HASH_PRIME1 * (uint32_t)(i + 1);
+    st->len = 0;
+}
+
+/*
+ * Scalar hash of a buffer whose length is a multiple of O2FS_HASH_SIZE.
+ */
+static inline void
+O2FSHashUpdate(O2FSHashState *st, const void *buf, uint64_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint32_t w;
+
+    for (uint64_t off = 0; off < len; off += O2FS_HASH_SIZE) {
+        for (int i = 0; i < O2FS_HASH_LANES; i++) {
+            __builtin_memcpy(&w, p + off + 4 * i, 4);
+            st->acc[i] = O2FSHashRotl(st->acc[i] + w * O2FS_HASH_PRIME2, 13) *
+                         O2FS_HASH_PRIME1;
+        }
+    }
+    st->len += len;
+}
+
+static inline void
+O2FSHashFinal(O2FSHashState *st, uint8_t *hash)
+{
+    uint32_t fold = (uint32_t)st->len ^ (uint32_t)(st->len >> 32);
+    uint32_t h;
+
+    for (int i = 0; i < O2FS_HASH_LANES; i++)
+        fold += O2FSHashRotl(st->acc[i], 4 * i + 1);
+
+    for (int i = 0; i < O2FS_HASH_LANES; i++) {
+        h = st->acc[i] ^ (fold + O2FS_HASH_PRIME3 * (uint32_t)i);
+        h ^= h >> 15;
+        h *= O2FS_HASH_PRIME2;
+        h ^= h >> 13;
+        h *= O2FS_HASH_PRIME3;
+        h ^= h >> 16;
+        __builtin_memcpy(hash + 4 * i, &h, 4);
+    }
+}
+
+static inline bool
+O2FSHashIsZero(const uint8_t *hash)
+{
+    for (int i = 0; i < O2FS_HASH_SIZE; i++) {
+        if (hash[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * FNV-1a hash of a file name.
+ */
+static inline uint32_t
+O2FSDirHash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
 #endif /* __FS_O2FS_H__ */
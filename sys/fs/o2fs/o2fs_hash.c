@@ -0,0 +1,128 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/mp.h>
+#include <sys/spinlock.h>
+#include <sys/sysctl.h>
+
+#include <machine/amd64.h>
+#include <machine/amd64op.h>
+
+#include "o2fs.h"
+
+/*
+ * Block Checksums
+ *
+ * The kernel is built without SSE so the vector version of the hash is 
+ * compiled for SSE2 on its own, which every amd64 processor has.  Each 
+ * 128-bit register holds four lanes, so a 32 byte stripe is two loads, two 
+ * multiplies, two rotates and two more multiplies.  Kernel code does not 
+ * otherwise touch the vector registers and the thread's FPU state is only 
+ * saved on a context switch, so the hash runs in a critical section and 
+ * saves and restores the registers around itself.  AVX2 would need the 
+ * xsave area, which the kernel does not manage, and eight lanes in two SSE 
+ * registers already keep the multiplier busy.
+ *
+ * Buffers shorter than O2FS_HASH_VECMIN are hashed with the scalar version 
+ * in o2fs.h, as are all buffers while the o2fs_hashsimd sysctl is cleared. 
+ * Both versions compute the same hash.
+ */
+
+// Smallest buffer worth saving the FPU state for
+#define O2FS_HASH_VECMIN	512
+
+typedef uint32_t O2FSVec __attribute__((vector_size(16)));
+
+// fxsave area of each CPU, which must be 16 byte aligned
+static uint8_t hashFPU[MAX_CPUS][512] __attribute__((aligned(16)));
+
+/**
+ * O2FSHashUpdateSSE2 --
+ *
+ * SSE2 version of O2FSHashUpdate.  The vectors are kept within this function 
+ * so that none are passed under the kernel's non-SSE calling convention.
+ */
+__attribute__((target("sse2"), noinline))
+static void
+O2FSHashUpdateSSE2(O2FSHashState *st, const uint8_t *p, uint64_t len)
+{
+    const O2FSVec prime1 = { O2FS_HASH_PRIME1, O2FS_HASH_PRIME1,
+			     O2FS_HASH_PRIME1, O2FS_HASH_PRIME1 };
+    const O2FSVec prime2 = { O2FS_HASH_PRIME2, O2FS_HASH_PRIME2,
+			     O2FS_HASH_PRIME2, O2FS_HASH_PRIME2 };
+    O2FSVec acc0, acc1, w0, w1;
+    uint64_t off;
+
+    __builtin_memcpy(&acc0, &st->acc[0], sizeof(acc0));
+    __builtin_memcpy(&acc1, &st->acc[4], sizeof(acc1));
+
+    for (off = 0; off < len; off += O2FS_HASH_SIZE) {
+	__builtin_memcpy(&w0, p + off, sizeof(w0));
+	__builtin_memcpy(&w1, p + off + 16, sizeof(w1));
+
+	acc0 += w0 * prime2;
+	acc1 += w1 * prime2;
+	acc0 = (acc0 << 13) | (acc0 >> 19);
+	acc1 = (acc1 << 13) | (acc1 >> 19);
+	acc0 *= prime1;
+	acc1 *= prime1;
+    }
+
+    __builtin_memcpy(&st->acc[0], &acc0, sizeof(acc0));
+    __builtin_memcpy(&st->acc[4], &acc1, sizeof(acc1));
+}
+
+/**
+ * O2FSHashUpdateFast --
+ *
+ * Add a buffer to a hash using the vector registers when it pays off.
+ *
+ * @param [in] st Hash state.
+ * @param [in] buf Buffer.
+ * @param [in] len Length in bytes, a multiple of O2FS_HASH_SIZE.
+ */
+void
+O2FSHashUpdateFast(O2FSHashState *st, const void *buf, uint64_t len)
+{
+    struct XSAVEArea *fpu;
+
+    ASSERT(len % O2FS_HASH_SIZE == 0);
+
+    if (len < O2FS_HASH_VECMIN || !SYSCTL_GETINT(o2fs_hashsimd)) {
+	O2FSHashUpdate(st, buf, len);
+	return;
+    }
+
+    Critical_Enter();
+    fpu = (struct XSAVEArea *)hashFPU[CPU()];
+    fxsave(fpu);
+    O2FSHashUpdateSSE2(st, (const uint8_t *)buf, len);
+    fxrstor(fpu);
+    Critical_Exit();
+
+    st->len += len;
+}
+
+/**
+ * O2FSHashBlock --
+ *
+ * Hash a buffer.
+ *
+ * @param [in] buf Buffer.
+ * @param [in] len Length in bytes, a multiple of O2FS_HASH_SIZE.
+ * @param [out] hash O2FS_HASH_SIZE byte hash.
+ */
+void
+O2FSHashBlock(const void *buf, uint64_t len, uint8_t *hash)
+{
+    O2FSHashState st;
+
+    O2FSHashInit(&st);
+    O2FSHashUpdateFast(&st, buf, len);
+    O2FSHashFinal(&st, hash);
+}
+
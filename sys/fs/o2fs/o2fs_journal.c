@@ -0,0 +1,679 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/kmem.h>
+#include <sys/ktime.h>
+#include <sys/ktimer.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
+#include <sys/mutex.h>
+#include <sys/cv.h>
+#include <sys/disk.h>
+#include <sys/sga.h>
+#include <sys/bufcache.h>
+#include <sys/vfs.h>
+#include <sys/sysctl.h>
+
+#include <machine/pmap.h>
+
+#include "o2fs.h"
+
+/*
+ * Metadata Journal
+ *
+ * Changes to metadata blocks, the bitmap, BNodes and indirect blocks, are 
+ * written to the journal before they are written in place.  Every file 
+ * system operation that changes metadata is bracketed by O2FSJournalBegin 
+ * and O2FSJournalEnd.  It passes each block to O2FSJournalAccess before it 
+ * first changes it and to O2FSJournalDirty, instead of BufCache_Write, once 
+ * it has.  The blocks changed by all operations since the 
+ * last commit form the running transaction, so the operations of concurrent 
+ * writers are committed together.  The running transaction is committed 
+ * when it is o2fs_commitinterval seconds old, when the next operation might 
+ * not fit in it, or when the file system is flushed.  A commit waits for 
+ * the operations in progress to end and holds off new ones, so every 
+ * operation is entirely in one transaction.
+ *
+ * Blocks in the running transaction are pinned in the buffer cache so that 
+ * the flusher cannot write them in place before they are committed.  A 
+ * block that was committed earlier may still be dirty and is pinned before 
+ * it is changed again, which waits for any write back of the block that is 
+ * in progress, so a write in place only ever sees committed contents.  A 
+ * commit copies the descriptor, the blocks and the commit block into a 
+ * staging buffer and writes them with one sequential disk write followed by 
+ * a cache flush.  The blocks are then unpinned and marked dirty, so they 
+ * are checkpointed lazily by the buffer cache flusher.  Once the log cannot 
+ * hold another full transaction all dirty blocks are synced and the log is 
+ * emptied by advancing the sequence number in the header.
+ *
+ * File data is not journaled.  After a crash, blocks allocated by the last 
+ * transactions may hold stale data.
+ */
+
+// Largest transaction in blocks
+#define O2FS_JOURNAL_TXBLOCKS	256
+// Most blocks one operation changes: bitmap, indirect and checksum blocks,
+// and the BNodes and directory blocks up to the root
+#define O2FS_JOURNAL_OPBLOCKS	96
+
+typedef struct O2FSJournal {
+    Disk		*disk;
+    uint64_t		blksize;
+    uint64_t		offset;		// Disk offset of the header
+    uint64_t		size;		// Journal size in blocks
+    uint64_t		txMax;		// Largest transaction in blocks
+    uint64_t		head;		// Next free log block
+    uint64_t		seq;		// Sequence number of the running transaction
+    XMem		*stage;		// Staging buffer for txMax + 2 blocks
+    // Operations and commits
+    Mutex		mtx;
+    CV			cv;
+    uint64_t		handles;	// Operations in progress
+    uint64_t		reserved;	// Blocks reserved by operations in progress
+    bool		committing;
+    // Running transaction
+    Spinlock		txLock;
+    uint64_t		start;		// Time the first block was added
+    uint64_t		count;
+    BufCacheEntry	*blocks[O2FS_JOURNAL_TXBLOCKS];
+    // Commit thread
+    WaitChannel		wait;
+    volatile bool	pending;
+    volatile bool	timerArmed;
+} O2FSJournal;
+
+/**
+ * O2FSJournalChecksum --
+ *
+ * 64-bit FNV-1a hash of a buffer, computed a word at a time.
+ *
+ * @param [in] buf Buffer.
+ * @param [in] len Length in bytes, a multiple of eight.
+ */
+static uint64_t
+O2FSJournalChecksum(const void *buf, uint64_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t i;
+
+    for (i = 0; i < len / 8; i++) {
+	hash ^= p[i];
+	hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * O2FSJournalStage --
+ *
+ * @return Block of the staging buffer.
+ */
+static inline uint8_t *
+O2FSJournalStage(O2FSJournal *j, uint64_t block)
+{
+    return (uint8_t *)XMem_GetBase(j->stage) + block * j->blksize;
+}
+
+/**
+ * O2FSJournalIO --
+ *
+ * Reads or writes journal blocks through the staging buffer.
+ *
+ * @param [in] j Journal.
+ * @param [in] write True to write the blocks.
+ * @param [in] buf First block of the staging buffer.
+ * @param [in] block First journal block.
+ * @param [in] count Number of blocks.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+O2FSJournalIO(O2FSJournal *j, bool write, uint64_t buf, uint64_t block,
+	      uint64_t count)
+{
+    SGArray sga;
+
+    ASSERT(block + count <= j->size);
+
+    SGArray_Init(&sga);
+    SGArray_Append(&sga, j->offset + block * j->blksize, count * j->blksize);
+
+    if (write)
+	return Disk_Write(j->disk, O2FSJournalStage(j, buf), &sga, NULL, NULL);
+
+    return Disk_Read(j->disk, O2FSJournalStage(j, buf), &sga, NULL, NULL);
+}
+
+/**
+ * O2FSJournalCheckpoint --
+ *
+ * Writes back every dirty block and empties the log.  The caller must hold 
+ * the journal mutex and there must be no pinned blocks, otherwise changes 
+ * committed in earlier transactions could be lost.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+O2FSJournalCheckpoint(O2FSJournal *j)
+{
+    JHeader *hdr = (JHeader *)O2FSJournalStage(j, 0);
+    int status;
+
+    status = BufCache_Sync(j->disk);
+    if (status != 0)
+	return status;
+
+    memset(hdr, 0, j->blksize);
+    memcpy(hdr->magic, JOURNAL_MAGIC, 8);
+    hdr->seq = j->seq;
+
+    status = O2FSJournalIO(j, true, 0, 0, 1);
+    if (status == 0)
+	status = Disk_Flush(j->disk, NULL, NULL, NULL, NULL);
+    if (status != 0)
+	return status;
+
+    j->head = 1;
+    __sync_fetch_and_add(&SYSCTL_GETINT(o2fs_checkpoints), 1);
+
+    return 0;
+}
+
+/**
+ * O2FSJournalCommit --
+ *
+ * Commits the running transaction.  Waits for operations in progress to 
+ * end and keeps new ones from starting until the commit is done.  If the 
+ * write fails the blocks stay in the running transaction.  The caller must 
+ * hold the journal mutex.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+O2FSJournalCommit(O2FSJournal *j)
+{
+    JDesc *desc = (JDesc *)O2FSJournalStage(j, 0);
+    JCommit *commit;
+    uint64_t count, i;
+    int status = 0;
+
+    ASSERT(!j->committing);
+
+    j->committing = true;
+    while (j->handles > 0)
+	CV_Wait(&j->cv, &j->mtx);
+
+    count = j->count;
+    if (count == 0)
+	goto done;
+
+    /*
+     * Only after a failed checkpoint.  The blocks of this transaction are 
+     * pinned so the log cannot be emptied here, O2FSJournalBegin retries the 
+     * checkpoint before the next transaction pins any.
+     */
+    if (j->head + count + 2 > j->size) {
+	status = -ENOSPC;
+	goto done;
+    }
+
+    memset(desc, 0, j->blksize);
+    memcpy(desc->magic, JDESC_MAGIC, 8);
+    desc->seq = j->seq;
+    desc->count = count;
+    for (i = 0; i < count; i++) {
+	desc->offsets[i] = j->blocks[i]->diskOffset;
+	memcpy(O2FSJournalStage(j, i + 1), j->blocks[i]->buffer, j->blksize);
+    }
+
+    commit = (JCommit *)O2FSJournalStage(j, count + 1);
+    memset(commit, 0, j->blksize);
+    memcpy(commit->magic, JCOMMIT_MAGIC, 8);
+    commit->seq = j->seq;
+    commit->count = count;
+    commit->checksum = O2FSJournalChecksum(desc, (count + 1) * j->blksize);
+
+    /*
+     * The commit block is written along with the rest of the transaction. 
+     * If only part of the write reaches the disk the checksum will not match 
+     * and the transaction is ignored during recovery.
+     */
+    status = O2FSJournalIO(j, true, 0, j->head, count + 2);
+    if (status == 0)
+	status = Disk_Flush(j->disk, NULL, NULL, NULL, NULL);
+    if (status != 0) {
+	Alert(o2fs, "Journal commit %lld failed (%d)\n", j->seq, status);
+	goto done;
+    }
+
+    // Committed, so the blocks can be checkpointed by the flusher
+    for (i = 0; i < count; i++) {
+	BufCache_Write(j->blocks[i]);
+	BufCache_Unpin(j->blocks[i]);
+    }
+    j->count = 0;
+    j->head += count + 2;
+    j->seq++;
+
+    __sync_fetch_and_add(&SYSCTL_GETINT(o2fs_commits), 1);
+    __sync_fetch_and_add(&SYSCTL_GETINT(o2fs_journalblocks), count);
+
+    if (j->head + j->txMax + 2 > j->size)
+	status = O2FSJournalCheckpoint(j);
+
+done:
+    j->committing = false;
+    CV_Broadcast(&j->cv);
+
+    return status;
+}
+
+/**
+ * O2FSJournalReplay --
+ *
+ * Writes the blocks of every complete transaction in the log to their 
+ * place on disk through the buffer cache.
+ *
+ * @param [in] j Journal.
+ * @param [out] seq Sequence number of the first transaction not in the log.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+O2FSJournalReplay(O2FSJournal *j, uint64_t *seq)
+{
+    JHeader *hdr = (JHeader *)O2FSJournalStage(j, 0);
+    JDesc *desc = (JDesc *)O2FSJournalStage(j, 0);
+    JCommit *commit;
+    BufCacheEntry *entry;
+    uint64_t pos = 1;
+    uint64_t replayed = 0;
+    uint64_t count, i;
+    int status;
+
+    status = O2FSJournalIO(j, false, 0, 0, 1);
+    if (status != 0)
+	return status;
+    if (memcmp(hdr->magic, JOURNAL_MAGIC, 8) != 0) {
+	Alert(o2fs, "Invalid journal header\n");
+	return -EINVAL;
+    }
+    *seq = hdr->seq;
+
+    while (pos + 2 <= j->size) {
+	status = O2FSJournalIO(j, false, 0, pos, 1);
+	if (status != 0)
+	    return status;
+
+	count = desc->count;
+	if (memcmp(desc->magic, JDESC_MAGIC, 8) != 0 || desc->seq != *seq ||
+	    count > j->txMax || pos + count + 2 > j->size)
+	    break;
+
+	status = O2FSJournalIO(j, false, 1, pos + 1, count + 1);
+	if (status != 0)
+	    return status;
+
+	commit = (JCommit *)O2FSJournalStage(j, count + 1);
+	if (memcmp(commit->magic, JCOMMIT_MAGIC, 8) != 0 ||
+	    commit->seq != *seq || commit->count != count ||
+	    commit->checksum != O2FSJournalChecksum(desc,
+						     (count + 1) * j->blksize))
+	    break;
+
+	for (i = 0; i < count; i++) {
+	    status = BufCache_Alloc(j->disk, desc->offsets[i], &entry);
+	    if (status < 0)
+		return status;
+	    memcpy(entry->buffer, O2FSJournalStage(j, i + 1), j->blksize);
+	    BufCache_Write(entry);
+	    BufCache_Release(entry);
+	}
+
+	pos += count + 2;
+	(*seq)++;
+	replayed++;
+    }
+
+    if (replayed != 0)
+	Log(o2fs, "Replayed %lld journal transactions\n", replayed);
+
+    return 0;
+}
+
+static void
+O2FSJournalTimer(void *arg)
+{
+    O2FSJournal *j = (O2FSJournal *)arg;
+
+    j->timerArmed = false;
+    j->pending = true;
+    WaitChannel_Wake(&j->wait);
+}
+
+/**
+ * O2FSJournalThread --
+ *
+ * Commit thread that wakes up every second and commits the running 
+ * transaction once it is o2fs_commitinterval seconds old.
+ */
+static void
+O2FSJournalThread(void *arg)
+{
+    O2FSJournal *j = (O2FSJournal *)arg;
+    uint64_t now;
+
+    while (1) {
+	if (!j->timerArmed) {
+	    j->timerArmed = true;
+	    KTimer_Release(KTimer_Create(1, O2FSJournalTimer, j));
+	}
+
+	WaitChannel_Lock(&j->wait);
+	if (!j->pending) {
+	    WaitChannel_Sleep(&j->wait);
+	} else {
+	    Spinlock_Unlock(&j->wait.lock);
+	}
+	j->pending = false;
+
+	Mutex_Lock(&j->mtx);
+	now = KTime_GetEpoch();
+	if (!j->committing && j->count != 0 && now >= j->start &&
+	    now - j->start >= SYSCTL_GETINT(o2fs_commitinterval))
+	    O2FSJournalCommit(j);
+	Mutex_Unlock(&j->mtx);
+    }
+}
+
+/**
+ * O2FSJournalOpen --
+ *
+ * Opens the journal of a file system that is being mounted.  Any committed 
+ * transactions are replayed and written back before the log is emptied, so 
+ * this must be called before other metadata is read.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] disk Disk of the file system.
+ * @param [in] sb SuperBlock.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+int
+O2FSJournalOpen(VFS *fs, Disk *disk, SuperBlock *sb)
+{
+    O2FSJournal *j;
+    Thread *thr;
+    uint64_t seq;
+    int status;
+
+    ASSERT(sizeof(O2FSJournal) <= PGSIZE);
+
+    j = (O2FSJournal *)PAlloc_AllocPage();
+    if (j == NULL)
+	return -ENOMEM;
+
+    j->disk = disk;
+    j->blksize = sb->blockSize;
+    j->offset = sb->journalOffset;
+    j->size = sb->journalSize;
+
+    // The log must hold at least two of the largest transactions
+    j->txMax = O2FS_JOURNAL_TXBLOCKS;
+    if (j->txMax > (j->blksize - sizeof(JDesc)) / sizeof(uint64_t))
+	j->txMax = (j->blksize - sizeof(JDesc)) / sizeof(uint64_t);
+    if (j->size < 2 * (O2FS_JOURNAL_OPBLOCKS + 2) + 1) {
+	Alert(o2fs, "Journal of %lld blocks is too small\n", j->size);
+	PAlloc_Release(j);
+	return -EINVAL;
+    }
+    if (j->txMax > (j->size - 1) / 2 - 2)
+	j->txMax = (j->size - 1) / 2 - 2;
+
+    j->stage = XMem_New();
+    if (j->stage == NULL) {
+	PAlloc_Release(j);
+	return -ENOMEM;
+    }
+    if (!XMem_Allocate(j->stage, (j->txMax + 2) * j->blksize)) {
+	XMem_Destroy(j->stage);
+	PAlloc_Release(j);
+	return -ENOMEM;
+    }
+
+    status = O2FSJournalReplay(j, &seq);
+    if (status == 0) {
+	j->seq = seq;
+	status = O2FSJournalCheckpoint(j);
+    }
+    if (status != 0) {
+	XMem_Destroy(j->stage);
+	PAlloc_Release(j);
+	return status;
+    }
+
+    Mutex_Init(&j->mtx, "O2FS Journal Mutex");
+    CV_Init(&j->cv, "O2FS Journal CV");
+    j->handles = 0;
+    j->reserved = 0;
+    j->committing = false;
+    Spinlock_Init(&j->txLock, "O2FS Journal Lock", SPINLOCK_TYPE_NORMAL);
+    j->start = 0;
+    j->count = 0;
+    WaitChannel_Init(&j->wait, "O2FS Journal");
+    j->pending = false;
+    j->timerArmed = false;
+
+    thr = Thread_KThreadCreate(&O2FSJournalThread, j);
+    if (thr == NULL)
+	Panic("O2FS: Cannot create journal thread\n");
+    Sched_SetRunnable(thr);
+
+    fs->journal = j;
+
+    DLOG(o2fs, "Journal %lld blocks @ 0x%llx, seq %lld\n",
+	 j->size, j->offset, j->seq);
+
+    return 0;
+}
+
+/**
+ * O2FSJournalBegin --
+ *
+ * Starts an operation that changes metadata.  Waits for a commit in 
+ * progress, and commits the running transaction first if the operation 
+ * might not fit in it.  Each operation reserves room for the most blocks it 
+ * can change until it ends, so concurrent operations cannot overflow the 
+ * transaction.
+ *
+ * @param [in] fs VFS Instance.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned and the operation must not 
+ * change any metadata.
+ */
+int
+O2FSJournalBegin(VFS *fs)
+{
+    O2FSJournal *j = (O2FSJournal *)fs->journal;
+    int status;
+
+    if (j == NULL)
+	return 0;
+
+    Mutex_Lock(&j->mtx);
+    while (1) {
+	if (j->committing) {
+	    CV_Wait(&j->cv, &j->mtx);
+	    continue;
+	}
+	// Retry a failed checkpoint while no blocks are pinned
+	if (j->count == 0 && j->handles == 0 &&
+	    j->head + j->txMax + 2 > j->size) {
+	    status = O2FSJournalCheckpoint(j);
+	    if (status != 0) {
+		Mutex_Unlock(&j->mtx);
+		return status;
+	    }
+	}
+	if (j->count + j->reserved + O2FS_JOURNAL_OPBLOCKS <= j->txMax)
+	    break;
+
+	status = O2FSJournalCommit(j);
+	if (status != 0) {
+	    Mutex_Unlock(&j->mtx);
+	    return status;
+	}
+    }
+    j->handles++;
+    j->reserved += O2FS_JOURNAL_OPBLOCKS;
+    Mutex_Unlock(&j->mtx);
+
+    return 0;
+}
+
+/**
+ * O2FSJournalAccess --
+ *
+ * Adds a metadata block that is about to change to the running transaction. 
+ * The block is pinned in the buffer cache until the transaction commits.  
+ * This sleeps while the block is being written back, so it must not be 
+ * called with the VFS lock held.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] entry Buffer cache entry of the block.
+ */
+void
+O2FSJournalAccess(VFS *fs, BufCacheEntry *entry)
+{
+    O2FSJournal *j = (O2FSJournal *)fs->journal;
+
+    if (j == NULL)
+	return;
+
+    ASSERT(j->handles > 0);
+
+    if (!BufCache_Pin(entry))
+	return;
+
+    Spinlock_Lock(&j->txLock);
+    ASSERT(j->count < j->txMax);
+    if (j->count == 0)
+	j->start = KTime_GetEpoch();
+    j->blocks[j->count++] = entry;
+    Spinlock_Unlock(&j->txLock);
+}
+
+/**
+ * O2FSJournalWritable --
+ *
+ * Checks whether a metadata block may be changed without calling 
+ * O2FSJournalAccess first, for callers that hold the VFS lock.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] entry Buffer cache entry of the block.
+ *
+ * @return True if the block is in the running transaction and no longer 
+ * being written back.
+ */
+bool
+O2FSJournalWritable(VFS *fs, BufCacheEntry *entry)
+{
+    if (fs->journal == NULL)
+	return true;
+
+    return (entry->flags & (BUFCACHE_FLAG_PINNED | BUFCACHE_FLAG_WRITING)) ==
+	BUFCACHE_FLAG_PINNED;
+}
+
+/**
+ * O2FSJournalDirty --
+ *
+ * Marks a changed metadata block dirty.  With a journal the block must have 
+ * been added to the running transaction by O2FSJournalAccess before it was 
+ * changed, and is marked dirty when the transaction commits.  Without a 
+ * journal the block is simply marked dirty.  This may be called with the 
+ * VFS lock held.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] entry Buffer cache entry of the block.
+ */
+void
+O2FSJournalDirty(VFS *fs, BufCacheEntry *entry)
+{
+    if (fs->journal == NULL) {
+	BufCache_Write(entry);
+	return;
+    }
+
+    ASSERT(entry->flags & BUFCACHE_FLAG_PINNED);
+}
+
+/**
+ * O2FSJournalEnd --
+ *
+ * Ends an operation started with O2FSJournalBegin.
+ *
+ * @param [in] fs VFS Instance.
+ */
+void
+O2FSJournalEnd(VFS *fs)
+{
+    O2FSJournal *j = (O2FSJournal *)fs->journal;
+
+    if (j == NULL)
+	return;
+
+    Mutex_Lock(&j->mtx);
+    ASSERT(j->handles > 0);
+    j->handles--;
+    j->reserved -= O2FS_JOURNAL_OPBLOCKS;
+    if (j->handles == 0 && j->committing)
+	CV_Broadcast(&j->cv);
+    Mutex_Unlock(&j->mtx);
+}
+
+/**
+ * O2FSJournalSync --
+ *
+ * Commits the running transaction and waits for it to reach the disk. 
+ * Callers that arrive while a commit is in progress wait for it and then 
+ * commit whatever has been added since, so concurrent callers share 
+ * commits.
+ *
+ * @param [in] fs VFS Instance.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+int
+O2FSJournalSync(VFS *fs)
+{
+    O2FSJournal *j = (O2FSJournal *)fs->journal;
+    int status;
+
+    if (j == NULL)
+	return 0;
+
+    Mutex_Lock(&j->mtx);
+    while (j->committing)
+	CV_Wait(&j->cv, &j->mtx);
+    status = O2FSJournalCommit(j);
+    Mutex_Unlock(&j->mtx);
+
+    return status;
+}
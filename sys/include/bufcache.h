@@ -4,20 +4,40 @@
 
 #include <sys/queue.h>
 
+#define BUFCACHE_FLAG_VALID	0x0001	/* Buffer contents are valid */
+#define BUFCACHE_FLAG_ERROR	0x0002	/* Read failed */
+#define BUFCACHE_FLAG_LRU	0x0004	/* Entry is on a replacement queue */
+#define BUFCACHE_FLAG_DIRTY	0x0008	/* Entry needs to be written back */
+#define BUFCACHE_FLAG_PREFETCH	0x0010	/* Read-ahead block not yet used */
+#define BUFCACHE_FLAG_AM	0x0020	/* Entry belongs to the 2Q Am queue */
+#define BUFCACHE_FLAG_PINNED	0x0040	/* Entry must not be written back */
+#define BUFCACHE_FLAG_CHECKED	0x0080	/* Contents verified by the file system */
+#define BUFCACHE_FLAG_WRITING	0x0100	/* Write back is reading the buffer */
+
 typedef struct BufCacheEntry {
     Disk				*disk;
     uint64_t				diskOffset;
     uint64_t				refCount;
+    volatile uint64_t			flags;
     void				*buffer;
+    uint64_t				size;
+    uint64_t				dirtyTime;
     TAILQ_ENTRY(BufCacheEntry)		htEntry;
     TAILQ_ENTRY(BufCacheEntry)		lruEntry;
+    TAILQ_ENTRY(BufCacheEntry)		dirtyEntry;
 } BufCacheEntry;
 
 void BufCache_Init();
 int BufCache_Alloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry);
 void BufCache_Release(BufCacheEntry *entry);
 int BufCache_Read(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry);
+void BufCache_Prefetch(Disk *disk, uint64_t diskOffset);
+bool BufCache_IsCached(Disk *disk, uint64_t diskOffset);
 int BufCache_Write(BufCacheEntry *entry);
+bool BufCache_Pin(BufCacheEntry *entry);
+void BufCache_Unpin(BufCacheEntry *entry);
+int BufCache_Sync(Disk *disk);
+int BufCache_SetBlockSize(Disk *disk, uint64_t blockSize);
 
 #endif /* __SYS_BUFCACHE_H__ */
 
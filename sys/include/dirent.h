@@ -8,6 +8,7 @@
 
 struct dirent {
     ino_t	d_ino;
+    uint64_t	d_size;		// File size in bytes
     uint16_t	d_reclen;
     uint8_t	d_type;
     uint8_t	d_namlen;
@@ -3,11 +3,91 @@
 #define __SYS_DISK_H__
 
 #include <sys/queue.h>
+#include <sys/kmem.h>
+#include <sys/diskstat.h>
 #include <sys/sga.h>
+#include <sys/spinlock.h>
 
 typedef void (*DiskCB)(int, void *);
 
 typedef struct Disk Disk;
+
+/*
+ * Controller numbers used to name disks as disk<ctrlNo>.<diskNo>
+ */
+#define DISK_CTRL_IDE		0
+#define DISK_CTRL_AHCI		1
+#define DISK_CTRL_VIRTIO	2
+#define DISK_CTRL_NVME		3
+#define DISK_CTRL_RAMDISK	4
+
+#define DISKREQ_OP_READ		1
+#define DISKREQ_OP_WRITE	2
+#define DISKREQ_OP_FLUSH	3
+
+#define DISKREQ_FLAG_DONE	0x0001	/* Request has completed */
+#define DISKREQ_FLAG_FREE	0x0002	/* Free the request on completion */
+#define DISKREQ_FLAG_QUEUED	0x0004	/* Dispatched by the disk queue */
+
+/*
+ * An asynchronous disk request.  The request is passed to the driver's submit 
+ * routine, which must eventually call Disk_Complete, usually from its 
+ * interrupt handler.  The driver may use the entries field to queue the 
+ * request until then.
+ *
+ * Requests to adjacent disk ranges may be merged by the disk queue, so 
+ * drivers must use bufs rather than buf to find the memory for each SGArray 
+ * entry.  Requests merged into this one are completed along with it.
+ *
+ * A request is close to a kilobyte, so it must not be placed on a kernel 
+ * stack.  Allocate it with DiskRequest_Alloc instead.
+ */
+typedef struct DiskRequest {
+    Disk			*disk;		// Disk
+    int				op;		// DISKREQ_OP_*
+    int				status;		// Completion status
+    volatile uint64_t		flags;		// DISKREQ_FLAG_*
+    void			*buf;		// Buffer
+    SGArray			sga;		// Disk offsets and lengths
+    void			*bufs[SGARRAY_MAX_ENTRIES]; // Buffer per entry
+    DiskCB			cb;		// Completion callback
+    void			*arg;		// Callback argument
+    uint64_t			bytes;		// Bytes before merging
+    uintptr_t			caller;		// Return address of the submitter
+    uint64_t			seq;		// Submission order
+    uint64_t			submitTime;	// Time queued (ns)
+    uint64_t			deadline;	// Dispatch deadline (ns)
+    TAILQ_HEAD(DiskReqList, DiskRequest) merged; // Merged requests
+    TAILQ_ENTRY(DiskRequest)	entries;
+    TAILQ_ENTRY(DiskRequest)	fifoEntries;	// Disk queue FIFO
+} DiskRequest;
+
+DECLARE_SLAB(DiskRequest);
+
+/*
+ * Per-disk request queue.  Requests wait in the queue while the driver has 
+ * disk_qdepth requests outstanding or the queue is plugged.  Waiting 
+ * requests are kept sorted by disk offset for the elevator and in arrival 
+ * order to enforce deadlines.
+ */
+typedef struct DiskQueue {
+    Spinlock			lock;
+    TAILQ_HEAD(DiskSortQueue, DiskRequest) sorted;	// By disk offset
+    TAILQ_HEAD(DiskFIFOQueue, DiskRequest) fifo;	// By arrival
+    uint64_t			nextSeq;
+    uint64_t			flushes;	// Queued flushes
+    uint64_t			barrier;	// Sequence of the oldest flush
+    uint64_t			plugged;	// Dispatch held by Disk_Plug
+    uint64_t			headPos;	// End of the last dispatch
+    // Statistics
+    uint64_t			queued;		// Requests waiting
+    uint64_t			inflight;	// Requests at the driver
+    uint64_t			maxInflight;
+    uint64_t			dispatches;	// Requests sent to the driver
+    uint64_t			merges;
+    uint64_t			expired;	// Dispatched at their deadline
+} DiskQueue;
+
 typedef struct Disk {
     void	*handle;					// Driver handle
     uint64_t	ctrlNo;						// Controller number
@@ -15,18 +95,32 @@ typedef struct Disk {
     uint64_t	sectorSize;					// Sector Size
     uint64_t	sectorCount;					// Sector Count
     uint64_t	diskSize;					// Disk Size in Bytes
+    uint64_t	blockSize;					// Buffer Cache Block Size
     int		(*read)(Disk *, void *, SGArray *, DiskCB, void *);	// Read
     int		(*write)(Disk *, void *, SGArray *, DiskCB, void *);	// Write
     int		(*flush)(Disk *, void *, SGArray *, DiskCB, void *);	// Flush
+    int		(*submit)(Disk *, DiskRequest *);		// Async Request
+    DiskQueue	queue;						// Request Queue
+    DiskStats	*stats;						// I/O Statistics
     LIST_ENTRY(Disk) entries;
 } Disk;
 
+void Disk_Init();
 void Disk_AddDisk(Disk *disk);
 void Disk_RemoveDisk(Disk *disk);
 Disk *Disk_GetByID(uint64_t ctrlNo, uint64_t diskNo);
+Disk *Disk_GetByName(const char *name);
+DiskStats *Disk_GetStats(Disk *disk);
 int Disk_Read(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
 int Disk_Write(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
 int Disk_Flush(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
+void Disk_InitRequest(DiskRequest *req, Disk *disk, int op, void *buf,
+		      SGArray *sga, DiskCB cb, void *arg);
+void Disk_Submit(DiskRequest *req);
+void Disk_Plug(Disk *disk);
+void Disk_Unplug(Disk *disk);
+int Disk_Wait(DiskRequest *req);
+void Disk_Complete(DiskRequest *req, int status);
 
 #endif /* __SYS_DISK_H__ */
 
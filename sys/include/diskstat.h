@@ -0,0 +1,66 @@
+
+#ifndef __SYS_DISKSTAT_H__
+#define __SYS_DISKSTAT_H__
+
+#include <stdint.h>
+
+/*
+ * Disk I/O statistics returned by OSDiskStat.  Latency is measured from
+ * Disk_Submit, or the start of a polled request, until completion.  The
+ * latency histograms are log2 scaled: bucket 0 counts requests that took
+ * under 1us and bucket n those that took [2^(n-1), 2^n) us.  The last bucket
+ * also counts anything slower.
+ */
+
+#define DISKSTAT_OP_READ	0
+#define DISKSTAT_OP_WRITE	1
+#define DISKSTAT_OP_FLUSH	2
+#define DISKSTAT_OP_MAX		3
+
+#define DISKSTAT_HIST_BUCKETS	32
+
+/*
+ * While the disk_trace sysctl is set every completed request is recorded in
+ * a ring of the most recent DISKSTAT_TRACE_ENTRIES requests.  Merged
+ * requests are recorded individually.
+ */
+#define DISKSTAT_TRACE_ENTRIES	64
+
+typedef struct DiskOpStats {
+    uint64_t	ops;			// Requests completed
+    uint64_t	bytes;			// Bytes transferred
+    uint64_t	errors;			// Requests that failed
+    uint64_t	latencyTotal;		// Sum of latencies (ns)
+    uint64_t	latencyMax;		// Highest latency (ns)
+    uint64_t	hist[DISKSTAT_HIST_BUCKETS]; // Latency histogram
+} DiskOpStats;
+
+typedef struct DiskTraceEntry {
+    uint64_t	time;			// Completion time (ns)
+    uint64_t	offset;			// Disk offset
+    uint32_t	length;			// Bytes
+    uint16_t	op;			// DISKSTAT_OP_*
+    int16_t	status;			// Completion status
+    uint64_t	latency;		// ns
+    uint64_t	caller;			// Return address of the submitter
+} DiskTraceEntry;
+
+typedef struct DiskStats {
+    uint64_t	ctrlNo;
+    uint64_t	diskNo;
+    uint64_t	sectorSize;
+    uint64_t	diskSize;
+    // Request queue
+    uint64_t	queued;			// Requests waiting
+    uint64_t	inflight;		// Requests at the driver
+    uint64_t	maxInflight;
+    uint64_t	dispatches;		// Requests sent to the driver
+    uint64_t	merges;
+    uint64_t	expired;		// Dispatched at their deadline
+    DiskOpStats	op[DISKSTAT_OP_MAX];
+    uint64_t	traceNext;		// Requests traced, newest at traceNext-1
+    DiskTraceEntry trace[DISKSTAT_TRACE_ENTRIES];
+} DiskStats;
+
+#endif /* __SYS_DISKSTAT_H__ */
+
@@ -18,6 +18,9 @@ typedef struct Page {
 void PAlloc_Init();
 void PAlloc_AddRegion(uintptr_t start, uintptr_t len);
 void *PAlloc_AllocPage();
+void *PAlloc_AllocContig(uint64_t pages);
+uint64_t PAlloc_FreePages();
+uint64_t PAlloc_TotalPages();
 void PAlloc_Retain(void *pg);
 void PAlloc_Release(void *pg);
 
@@ -29,8 +29,10 @@
 #define PCI_CLASS_BRIDGE	0x06
 #define PCI_CLASS_BUS		0x0C
 
+#define PCI_SCLASS_STORAGE_SCSI	0x00
 #define PCI_SCLASS_STORAGE_IDE	0x01
 #define PCI_SCLASS_STORAGE_SATA	0x06
+#define PCI_SCLASS_STORAGE_NVM	0x08
 
 #define PCI_SCLASS_BRIDGE_HOST	0x00
 #define PCI_SCLASS_BRIDGE_ISA	0x01
@@ -45,10 +47,14 @@
 #define PCIBAR_TYPE_IO		1
 #define PCIBAR_TYPE_MEM		2
 
+#define PCIBAR_MEM_TYPEMASK	0x06
+#define PCIBAR_MEM_32		0x00
+#define PCIBAR_MEM_64		0x04	/* Uses the following BAR as well */
+
 typedef struct PCIBAR
 {
-    uint32_t base;
-    uint32_t size;
+    uint64_t base;
+    uint64_t size;
     uint32_t type;
 } PCIBAR;
 
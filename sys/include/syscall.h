@@ -48,6 +48,7 @@
 #define SYSCALL_FSMOUNT		0x81
 #define SYSCALL_FSUNMOUNT	0x82
 #define SYSCALL_FSINFO		0x83
+#define SYSCALL_DISKSTAT	0x84
 
 uint64_t Syscall_Entry(uint64_t syscall, uint64_t a1, uint64_t a2,
 		       uint64_t a3, uint64_t a4, uint64_t a5);
@@ -23,12 +23,53 @@
 #define SYSCTL_LIST \
     SYSCTL_STR(kern_ostype, SYSCTL_FLAG_RO, "OS Type", "Castor") \
     SYSCTL_INT(kern_hz, SYSCTL_FLAG_RW, "Tick frequency", 100) \
+    SYSCTL_STR(kern_rootdisk, SYSCTL_FLAG_RW, "Root disk (disk<ctrl>.<disk>)", "disk0.0") \
+    SYSCTL_INT(disk_qdepth, SYSCTL_FLAG_RW, "Maximum requests outstanding per disk", 32) \
+    SYSCTL_INT(disk_rddeadline, SYSCTL_FLAG_RW, "Milliseconds a read may wait for the elevator", 250) \
+    SYSCTL_INT(disk_wrdeadline, SYSCTL_FLAG_RW, "Milliseconds a write may wait for the elevator", 2500) \
+    SYSCTL_INT(disk_trace, SYSCTL_FLAG_RW, "Record completed disk requests for iostat", 0) \
+    SYSCTL_INT(disk_reads, SYSCTL_FLAG_RO, "Disk reads completed", 0) \
+    SYSCTL_INT(disk_writes, SYSCTL_FLAG_RO, "Disk writes completed", 0) \
+    SYSCTL_INT(disk_flushes, SYSCTL_FLAG_RO, "Disk flushes completed", 0) \
+    SYSCTL_INT(disk_readbytes, SYSCTL_FLAG_RO, "Bytes read from disks", 0) \
+    SYSCTL_INT(disk_writebytes, SYSCTL_FLAG_RO, "Bytes written to disks", 0) \
+    SYSCTL_INT(disk_errors, SYSCTL_FLAG_RO, "Disk requests that failed", 0) \
+    SYSCTL_INT(disk_ramdisksize, SYSCTL_FLAG_RW, "Size of the scratch RAM disk created at boot (MB)", 0) \
     SYSCTL_INT(time_tzadj, SYSCTL_FLAG_RW, "Time zone offset in seconds", 0) \
     SYSCTL_INT(log_syscall, SYSCTL_FLAG_RW, "Syscall log level", 1) \
     SYSCTL_INT(log_loader, SYSCTL_FLAG_RW, "Loader log level", 1) \
     SYSCTL_INT(log_vfs, SYSCTL_FLAG_RW, "VFS log level", 1) \
     SYSCTL_INT(log_o2fs, SYSCTL_FLAG_RW, "O2FS log level", 0) \
-    SYSCTL_INT(log_ide, SYSCTL_FLAG_RW, "IDE log level", 0)
+    SYSCTL_INT(log_ide, SYSCTL_FLAG_RW, "IDE log level", 0) \
+    SYSCTL_INT(log_bufcache, SYSCTL_FLAG_RW, "Buffer cache log level", 1) \
+    SYSCTL_INT(bufcache_hits, SYSCTL_FLAG_RO, "Buffer cache hits", 0) \
+    SYSCTL_INT(bufcache_misses, SYSCTL_FLAG_RO, "Buffer cache misses", 0) \
+    SYSCTL_INT(bufcache_allocs, SYSCTL_FLAG_RO, "Buffer cache allocations", 0) \
+    SYSCTL_INT(bufcache_writebacks, SYSCTL_FLAG_RO, "Buffer cache blocks written back", 0) \
+    SYSCTL_INT(bufcache_writeios, SYSCTL_FLAG_RO, "Buffer cache write back I/Os", 0) \
+    SYSCTL_INT(bufcache_flushage, SYSCTL_FLAG_RW, "Seconds before a dirty block is written back", 5) \
+    SYSCTL_INT(bufcache_dirtyratio, SYSCTL_FLAG_RW, "Percent of dirty blocks that triggers write back", 25) \
+    SYSCTL_INT(bufcache_size, SYSCTL_FLAG_RO, "Buffer cache size in bytes", 0) \
+    SYSCTL_INT(bufcache_minsize, SYSCTL_FLAG_RW, "Minimum buffer cache size (MB)", 4) \
+    SYSCTL_INT(bufcache_maxsize, SYSCTL_FLAG_RW, "Maximum buffer cache size (MB)", 1024) \
+    SYSCTL_INT(bufcache_minfree, SYSCTL_FLAG_RW, "Percent of memory kept free by shrinking the buffer cache", 10) \
+    SYSCTL_INT(bufcache_raissued, SYSCTL_FLAG_RO, "Read-ahead blocks issued", 0) \
+    SYSCTL_INT(bufcache_rahits, SYSCTL_FLAG_RO, "Read-ahead blocks used", 0) \
+    SYSCTL_INT(bufcache_rawaste, SYSCTL_FLAG_RO, "Read-ahead blocks evicted unused", 0) \
+    SYSCTL_INT(vfs_dcachemax, SYSCTL_FLAG_RW, "Maximum name cache entries allocated at boot", 65536) \
+    SYSCTL_INT(vfs_dcachesize, SYSCTL_FLAG_RO, "Name cache entries", 0) \
+    SYSCTL_INT(vfs_dcachehits, SYSCTL_FLAG_RO, "Name cache hits", 0) \
+    SYSCTL_INT(vfs_dcacheneghits, SYSCTL_FLAG_RO, "Name cache hits on names that do not exist", 0) \
+    SYSCTL_INT(vfs_dcachemisses, SYSCTL_FLAG_RO, "Name cache misses", 0) \
+    SYSCTL_INT(vfs_vnodecache, SYSCTL_FLAG_RW, "Unreferenced VNodes kept cached", 256) \
+    SYSCTL_INT(o2fs_readahead, SYSCTL_FLAG_RW, "Maximum O2FS read-ahead window in blocks", 16) \
+    SYSCTL_INT(o2fs_directio, SYSCTL_FLAG_RW, "Minimum user read in KB that bypasses the buffer cache (0 disables)", 1024) \
+    SYSCTL_INT(o2fs_commitinterval, SYSCTL_FLAG_RW, "Seconds before the O2FS journal commits", 1) \
+    SYSCTL_INT(o2fs_commits, SYSCTL_FLAG_RO, "O2FS journal transactions committed", 0) \
+    SYSCTL_INT(o2fs_journalblocks, SYSCTL_FLAG_RO, "O2FS metadata blocks written to the journal", 0) \
+    SYSCTL_INT(o2fs_checkpoints, SYSCTL_FLAG_RO, "O2FS journal checkpoints", 0) \
+    SYSCTL_INT(o2fs_hashsimd, SYSCTL_FLAG_RW, "Hash O2FS blocks with SSE2", 1) \
+    SYSCTL_INT(o2fs_checksumerrors, SYSCTL_FLAG_RO, "O2FS blocks that failed their checksum", 0)
 
 #define SYSCTL_STR_MAXLENGTH	128
 
@@ -68,6 +109,8 @@ SYSCTL_LIST
 uint64_t SysCtl_GetType(const char *node);
 void *SysCtl_GetObject(const char *node);
 uint64_t SysCtl_SetObject(const char *node, void *obj);
+uint64_t SysCtl_SetString(const char *node, const char *value);
+void SysCtl_BootOptions(const char *cmdline);
 
 #endif /* __SYS_SYSCTL_H__ */
 
@@ -2,6 +2,8 @@
 #ifndef __SYS_VFS_H__
 #define __SYS_VFS_H__
 
+#include <stdbool.h>
+
 #include <sys/kmem.h>
 #include <sys/stat.h>
 
@@ -19,6 +21,9 @@ typedef struct VFS {
     uint64_t		blksize;
     VNode		*root;
     void		*bitmap[16];
+    uint64_t		bitmapHint;	// Search for free blocks from here
+    uint64_t		bitmapFree;	// Free blocks
+    void		*journal;	// Metadata journal or NULL
 } VFS;
 
 typedef struct VNode {
@@ -26,10 +31,21 @@ typedef struct VNode {
     Disk		*disk;
     Spinlock		lock;
     uint64_t		refCount;
+    uint64_t		id;		// Name cache key, see DCache_NewID
+    // VNode Cache
+    uint64_t		key;		// Object within the VFS
+    bool		onLRU;
+    TAILQ_ENTRY(VNode)	hashEntry;
+    TAILQ_ENTRY(VNode)	lruEntry;
     // FS Fields
     void		*fsptr;
     uint64_t		fsval;
     VFS			*vfs;
+    VNode		*parent;	// Directory the object was found in
+    // Read-ahead State
+    uint64_t		raNext;		// Next block of a sequential read
+    uint64_t		raIssued;	// Last block prefetched
+    uint64_t		raWindow;	// Read-ahead window in blocks
 } VNode;
 
 DECLARE_SLAB(VFS);
@@ -45,19 +61,39 @@ typedef struct VFSOp {
     int (*close)(VNode *fn);
     int (*stat)(VNode *fn, struct stat *sb);
     int (*read)(VNode *fn, void *buf, uint64_t off, uint64_t len);
+    int (*readuser)(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len);
     int (*write)(VNode *fn, void *buf, uint64_t off, uint64_t len);
+    int (*flush)(VNode *fn);
     int (*readdir)(VNode *fn, void *buf, uint64_t len, uint64_t *off);
+    int (*reclaim)(VNode *fn);
 } VFSOp;
 
 int VFS_MountRoot(Disk *root);
 VNode *VFS_Lookup(const char *path);
-// XXX: Release/Retain
+void VFS_Retain(VNode *vn);
+bool VFS_TryRetain(VNode *vn, VFS *fs, uint64_t key);
+void VFS_Release(VNode *vn);
+VNode *VFS_FindVNode(VFS *fs, uint64_t key);
+VNode *VFS_AddVNode(VNode *vn);
 int VFS_Stat(const char *path, struct stat *sb);
 int VFS_Open(VNode *fn);
 int VFS_Close(VNode *fn);
 int VFS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len);
+int VFS_ReadUser(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len);
 int VFS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len);
+int VFS_Flush(VNode *fn);
 int VFS_ReadDir(VNode *fn, void *buf, uint64_t len, uint64_t *off);
 
+// Name Cache
+#define DCACHE_MISS		0
+#define DCACHE_HIT		1
+#define DCACHE_NEGATIVE		2
+
+void DCache_Init();
+uint64_t DCache_NewID();
+int DCache_Lookup(VNode *dn, const char *name, VNode **vn);
+void DCache_Enter(VNode *dn, const char *name, VNode *vn);
+void DCache_Invalidate(VNode *dn, const char *name);
+
 #endif /* __SYS_VFS_H__ */
 
@@ -10,26 +10,271 @@
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
+#include <sys/ktime.h>
+#include <sys/ktimer.h>
 #include <sys/spinlock.h>
+#include <sys/semaphore.h>
+#include <sys/sysctl.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
 #include <sys/disk.h>
 #include <sys/bufcache.h>
 #include <errno.h>
 
+#include <machine/amd64.h>
+
+/*
+ * Each disk is cached in blocks of the size used by the file system mounted 
+ * on it, see BufCache_SetBlockSize.  Disks without a file system use 
+ * BLOCKSIZE_DEFAULT.  Every block is backed by physically contiguous pages 
+ * from the direct map so that the cache can grow and shrink without 
+ * remapping memory.
+ */
+#define BLOCKSIZE_DEFAULT	(16*1024)
+#define BLOCKSIZE_MAX		(64*1024)
+#define CACHEMB			(1024*1024)
+
+/*
+ * The cache starts empty and grows on demand while more than twice 
+ * bufcache_minfree percent of memory is free, up to bufcache_maxsize.  The 
+ * flusher thread shrinks it back towards bufcache_minsize when free memory 
+ * falls below bufcache_minfree percent.
+ *
+ * The hash table has two buckets per default sized block that fits in the 
+ * largest cache the machine can hold (rounded up to a power of two) to keep 
+ * the chains short.  Buckets are protected by a fixed set of striped locks 
+ * rather than one lock per bucket to keep the lock debugging list 
+ * manageable.
+ */
+#define HASHLOCKS		64
+
+/*
+ * Replacement uses the 2Q policy.  Blocks enter the A1in FIFO on their first 
+ * reference.  When evicted from A1in their identity is remembered on the 
+ * A1out ghost list, and a block that is referenced again while on A1out is 
+ * brought back into the Am LRU queue.  Scans therefore only cycle through 
+ * A1in and do not displace frequently used blocks such as metadata.  A1in 
+ * is kept to a quarter of the cache entries and A1out to half as many ghosts 
+ * as there are entries.
+ */
+#define CACHEA1IN(_n)		((_n) / 4)
+#define CACHEA1OUT(_n)		((_n) / 2)
+
+/*
+ * Adjacent dirty blocks are coalesced into a single disk write of up to 
+ * FLUSHRUNSIZE bytes through a staging buffer.  The staging buffer, the run 
+ * of entries being written and its SGArray are shared and held by one 
+ * writer at a time through flushSema, which keeps them off the stack.
+ */
+#define FLUSHRUNSIZE		(128*1024)
+#define FLUSHRUNBLOCKS		(FLUSHRUNSIZE / PGSIZE)
+#define FLUSHNOLIMIT		(~0ULL)
+
+/*
+ * Read-ahead blocks are read asynchronously.  Requests are dropped if 
+ * PREFETCHMAX reads are already in flight.
+ */
+#define PREFETCHMAX		64
+
+static_assert(FLUSHRUNSIZE >= 2 * BLOCKSIZE_MAX,
+	      "Flush runs must hold at least two blocks");
+
+typedef struct BufCacheGhost {
+    Disk				*disk;
+    uint64_t				diskOffset;
+    TAILQ_ENTRY(BufCacheGhost)		htEntry;
+    TAILQ_ENTRY(BufCacheGhost)		fifoEntry;
+} BufCacheGhost;
+
+/*
+ * Lock ordering: hash bucket locks are acquired before cacheLock, which 
+ * protects the replacement queues and ghost list, and before dirtyLock, 
+ * which protects the dirty list.  
+ * No two bucket locks are ever held at once.
+ *
+ * Dirty entries hold a reference on behalf of the dirty list so they can 
+ * never be evicted before they are written back.
+ *
+ * An entry taken off the dirty list is marked WRITING until its contents 
+ * have been copied to the staging buffer or written to disk.  Pinning an 
+ * entry waits for this so that the file system journal never modifies a 
+ * block that is still being written back.
+ */
 Spinlock cacheLock;
-XMem *diskBuf;
 
-static TAILQ_HEAD(CacheHashTable, BufCacheEntry) *hashTable;
-static TAILQ_HEAD(LRUCacheList, BufCacheEntry) lruList;
-static uint64_t cacheHit;
-static uint64_t cacheMiss;
-static uint64_t cacheAlloc;
+TAILQ_HEAD(CacheHashTable, BufCacheEntry);
+TAILQ_HEAD(CacheQueue, BufCacheEntry);
+TAILQ_HEAD(GhostQueue, BufCacheGhost);
+static XMem *hashBuf;
+static struct CacheHashTable *hashTable;
+static uint64_t hashMask;
+static Spinlock hashLock[HASHLOCKS];
+static struct CacheQueue freeList;
+static struct CacheQueue a1inList;
+static struct CacheQueue amList;
+static uint64_t a1inCount;
+static uint64_t amCount;
+static uint64_t cacheEntries;
+static uint64_t cacheBytes;
+static struct GhostQueue *ghostTable;
+static uint64_t ghostMask;
+static struct GhostQueue a1outList;
+static uint64_t a1outCount;
+static WaitChannel cacheWait;
 static Slab cacheEntrySlab;
+static Slab cacheGhostSlab;
+
+// 2Q Statistics
+static uint64_t a1inHits;
+static uint64_t amHits;
+static uint64_t ghostHits;
+
+static Spinlock dirtyLock;
+static TAILQ_HEAD(DirtyCacheList, BufCacheEntry) dirtyList;
+static uint64_t dirtyCount;
+static XMem *flushBuf;
+static BufCacheEntry *flushRun[FLUSHRUNBLOCKS];
+static SGArray flushSGA;
+static Semaphore flushSema;
+static WaitChannel flushWait;
+static WaitChannel writeWait;
+static volatile bool flushPending;
+static volatile bool flushTimerArmed;
+
+static volatile uint64_t prefetchInflight;
+
+static void BufCacheFlusher(void *arg);
+static int BufCacheFlush(Disk *disk, uint64_t maxAge, uint64_t target);
 
 DEFINE_SLAB(BufCacheEntry, &cacheEntrySlab);
+DEFINE_SLAB(BufCacheGhost, &cacheGhostSlab);
+
+/**
+ * BufCacheHash --
+ *
+ * Mixes the disk and block number into a hash bucket index.  The block 
+ * number and disk pointer are combined and passed through a 64-bit finalizer 
+ * so that sequential blocks and blocks from different disks spread evenly.
+ *
+ * @param [in] disk Disk object
+ * @param [in] diskOffset Block offset within the disk
+ *
+ * @return Hash bucket index.
+ */
+static inline uint64_t
+BufCacheHash(Disk *disk, uint64_t diskOffset)
+{
+    uint64_t h = (diskOffset / PGSIZE) ^
+		 (((uintptr_t)disk >> 4) * 0x9E3779B97F4A7C15ULL);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h & hashMask;
+}
+
+static inline Spinlock *
+BufCacheBucketLock(uint64_t bucket)
+{
+    return &hashLock[bucket % HASHLOCKS];
+}
+
+/**
+ * BufCacheQueue --
+ *
+ * @return The replacement queue an unreferenced entry belongs on.
+ */
+static inline struct CacheQueue *
+BufCacheQueue(BufCacheEntry *e)
+{
+    if (e->disk == NULL)
+	return &freeList;
+    if (e->flags & BUFCACHE_FLAG_AM)
+	return &amList;
+    return &a1inList;
+}
+
+/**
+ * BufCacheBlockSize --
+ *
+ * @return The size of the blocks cached for a disk.
+ */
+static inline uint64_t
+BufCacheBlockSize(Disk *disk)
+{
+    return disk->blockSize ? disk->blockSize : BLOCKSIZE_DEFAULT;
+}
+
+/**
+ * BufCacheGhostAdd --
+ *
+ * Remembers a block evicted from A1in on the A1out ghost list, forgetting 
+ * the oldest ghosts if the list is full.  The list shrinks along with the 
+ * cache.  The caller must hold cacheLock.
+ */
+static void
+BufCacheGhostAdd(Disk *disk, uint64_t diskOffset)
+{
+    BufCacheGhost *g;
+
+    ASSERT(Spinlock_IsHeld(&cacheLock));
+
+    while (a1outCount != 0 && a1outCount >= CACHEA1OUT(cacheEntries)) {
+	g = TAILQ_FIRST(&a1outList);
+	TAILQ_REMOVE(&a1outList, g, fifoEntry);
+	TAILQ_REMOVE(&ghostTable[BufCacheHash(g->disk, g->diskOffset) &
+				 ghostMask], g, htEntry);
+	a1outCount--;
+	BufCacheGhost_Free(g);
+    }
+
+    if (CACHEA1OUT(cacheEntries) == 0)
+	return;
 
-#define CACHESIZE		(16*1024*1024)
-#define HASHTABLEENTRIES	128
-#define BLOCKSIZE		(16*1024)
+    g = BufCacheGhost_Alloc();
+    if (g == NULL)
+	return;
+
+    g->disk = disk;
+    g->diskOffset = diskOffset;
+    TAILQ_INSERT_TAIL(&a1outList, g, fifoEntry);
+    TAILQ_INSERT_HEAD(&ghostTable[BufCacheHash(disk, diskOffset) &
+				  ghostMask], g, htEntry);
+    a1outCount++;
+}
+
+/**
+ * BufCacheGhostRemove --
+ *
+ * Removes a block from the A1out ghost list.  The caller must hold 
+ * cacheLock.
+ *
+ * @retval true if the block was on the ghost list.
+ */
+static bool
+BufCacheGhostRemove(Disk *disk, uint64_t diskOffset)
+{
+    struct GhostQueue *table;
+    BufCacheGhost *g;
+
+    ASSERT(Spinlock_IsHeld(&cacheLock));
+
+    table = &ghostTable[BufCacheHash(disk, diskOffset) & ghostMask];
+    TAILQ_FOREACH(g, table, htEntry) {
+	if (g->disk == disk && g->diskOffset == diskOffset) {
+	    TAILQ_REMOVE(table, g, htEntry);
+	    TAILQ_REMOVE(&a1outList, g, fifoEntry);
+	    a1outCount--;
+	    BufCacheGhost_Free(g);
+	    return true;
+	}
+    }
+
+    return false;
+}
 
 /**
  * BufCache_Init --
@@ -39,53 +284,95 @@ DEFINE_SLAB(BufCacheEntry, &cacheEntrySlab);
 void
 BufCache_Init()
 {
-    int i;
+    uint64_t i;
+    uint64_t maxBytes, hashEntries;
 
     Spinlock_Init(&cacheLock, "BufCache Lock", SPINLOCK_TYPE_NORMAL);
+    for (i = 0; i < HASHLOCKS; i++) {
+	Spinlock_Init(&hashLock[i], "BufCache Bucket Lock",
+		      SPINLOCK_TYPE_NORMAL);
+    }
+    WaitChannel_Init(&cacheWait, "BufCache Wait");
+    Spinlock_Init(&dirtyLock, "BufCache Dirty Lock", SPINLOCK_TYPE_NORMAL);
+    Semaphore_Init(&flushSema, 1, "BufCache Flush Buffer");
+    WaitChannel_Init(&flushWait, "BufCache Flusher");
+    WaitChannel_Init(&writeWait, "BufCache Write Back");
+    prefetchInflight = 0;
 
-    diskBuf = XMem_New();
-    if (!diskBuf)
+    flushBuf = XMem_New();
+    if (!flushBuf)
         Panic("BufCache: Cannot create XMem region\n");
 
-    if (!XMem_Allocate(diskBuf, CACHESIZE))
+    if (!XMem_Allocate(flushBuf, FLUSHRUNSIZE))
         Panic("BufCache: Cannot back XMem region\n");
 
-    TAILQ_INIT(&lruList);
+    TAILQ_INIT(&freeList);
+    TAILQ_INIT(&a1inList);
+    TAILQ_INIT(&amList);
+    TAILQ_INIT(&a1outList);
+    TAILQ_INIT(&dirtyList);
+    dirtyCount = 0;
 
-    hashTable = PAlloc_AllocPage();
-    if (!hashTable)
+    // Size the hash table for the largest cache that fits in memory
+    maxBytes = SYSCTL_GETINT(bufcache_maxsize) * CACHEMB;
+    if (maxBytes > PAlloc_TotalPages() * PGSIZE)
+	maxBytes = PAlloc_TotalPages() * PGSIZE;
+    hashEntries = 4;
+    while (hashEntries < 2 * maxBytes / BLOCKSIZE_DEFAULT)
+	hashEntries <<= 1;
+    hashMask = hashEntries - 1;
+    ghostMask = (hashEntries / 4) - 1;
+
+    hashBuf = XMem_New();
+    if (!hashBuf)
+	Panic("BufCache: Cannot create hash table XMem region\n");
+    if (!XMem_Allocate(hashBuf, ROUNDUP(hashEntries * sizeof(*hashTable) +
+					 (ghostMask + 1) * sizeof(*ghostTable),
+					 PGSIZE)))
         Panic("BufCache: Cannot allocate hash table\n");
-    for (i = 0; i < HASHTABLEENTRIES; i++) {
+
+    hashTable = (struct CacheHashTable *)XMem_GetBase(hashBuf);
+    for (i = 0; i < hashEntries; i++) {
         TAILQ_INIT(&hashTable[i]);
     }
+    ghostTable = (struct GhostQueue *)&hashTable[hashEntries];
+    for (i = 0; i <= ghostMask; i++) {
+        TAILQ_INIT(&ghostTable[i]);
+    }
 
     Slab_Init(&cacheEntrySlab, "BufCacheEntry Slab", sizeof(BufCacheEntry), 16);
+    Slab_Init(&cacheGhostSlab, "BufCacheGhost Slab", sizeof(BufCacheGhost), 16);
 
-    // Initialize cache
-    uintptr_t bufBase = XMem_GetBase(diskBuf);
-    for (i = 0; i < CACHESIZE/BLOCKSIZE; i++) {
-	BufCacheEntry *e = BufCacheEntry_Alloc();
-	if (!e) {
-	    Panic("BufCache: Cannot allocate cache entry\n");
-	}
+    a1inCount = 0;
+    amCount = 0;
+    a1outCount = 0;
+    cacheEntries = 0;
+    cacheBytes = 0;
 
-	memset(e, 0, sizeof(*e));
-	e->disk = NULL;
-	e->buffer = (void *)(bufBase + BLOCKSIZE * i);
-	TAILQ_INSERT_TAIL(&lruList, e, lruEntry);
-    }
+    SYSCTL_SETINT(bufcache_size, 0);
+    SYSCTL_SETINT(bufcache_hits, 0);
+    SYSCTL_SETINT(bufcache_misses, 0);
+    SYSCTL_SETINT(bufcache_allocs, 0);
+    SYSCTL_SETINT(bufcache_writebacks, 0);
+    SYSCTL_SETINT(bufcache_writeios, 0);
+    SYSCTL_SETINT(bufcache_raissued, 0);
+    SYSCTL_SETINT(bufcache_rahits, 0);
+    SYSCTL_SETINT(bufcache_rawaste, 0);
 
-    cacheHit = 0;
-    cacheMiss = 0;
-    cacheAlloc = 0;
+    Thread *thr = Thread_KThreadCreate(&BufCacheFlusher, NULL);
+    if (thr == NULL)
+	Panic("BufCache: Cannot create flusher thread\n");
+    Sched_SetRunnable(thr);
 }
 
 /**
  * BufCacheLookup --
  *
  * Looks up a buffer cache entry that can be used by BufCache_Alloc or 
- * BufCache_Read to allocate the underlying buffer.
+ * BufCache_Read to allocate the underlying buffer.  The caller must hold the 
+ * bucket lock.
  *
+ * @param [in] bucket Hash bucket index
  * @param [in] disk Disk object
  * @param [in] diskOffset Block offset within the disk
  * @param [out] entry If successful, this contains the buffer cache entry.
@@ -94,19 +381,30 @@ BufCache_Init()
  * @return ENOENT if not present.
  */
 static int
-BufCacheLookup(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
+BufCacheLookup(uint64_t bucket, Disk *disk, uint64_t diskOffset,
+	       BufCacheEntry **entry)
 {
     struct CacheHashTable *table;
     BufCacheEntry *e;
 
+    ASSERT(Spinlock_IsHeld(BufCacheBucketLock(bucket)));
+
     // Check hash table
-    table = &hashTable[diskOffset % HASHTABLEENTRIES];
+    table = &hashTable[bucket];
     TAILQ_FOREACH(e, table, htEntry) {
 	if (e->disk == disk && e->diskOffset == diskOffset) {
 	    e->refCount++;
 	    if (e->refCount == 1) {
-		TAILQ_REMOVE(&lruList, e, lruEntry);
+		Spinlock_Lock(&cacheLock);
+		ASSERT(e->flags & BUFCACHE_FLAG_LRU);
+		TAILQ_REMOVE(BufCacheQueue(e), e, lruEntry);
+		__sync_fetch_and_and(&e->flags, ~BUFCACHE_FLAG_LRU);
+		Spinlock_Unlock(&cacheLock);
 	    }
+	    if (e->flags & BUFCACHE_FLAG_AM)
+		__sync_fetch_and_add(&amHits, 1);
+	    else
+		__sync_fetch_and_add(&a1inHits, 1);
 	    *entry = e;
 	    return 0;
 	}
@@ -117,49 +415,427 @@ BufCacheLookup(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 }
 
 /**
- * BufCacheAlloc --
+ * BufCacheEvict --
+ *
+ * Picks a victim following the 2Q policy and removes it from its queue and 
+ * hash bucket.  Free entries are used first, then the head of A1in if A1in 
+ * is over its target size, and otherwise the least recently used entry on 
+ * Am.  Victims from A1in are remembered on the A1out ghost list.  The 
+ * victim's bucket lock must be acquired before cacheLock, so 
+ * the victim is rechecked once both locks are held and the search restarts 
+ * if another thread grabbed it in the meantime.
+ *
+ * @return An unhashed entry with a reference held, or NULL if all entries 
+ * are in use.
+ */
+static BufCacheEntry *
+BufCacheEvict()
+{
+    BufCacheEntry *e;
+    Spinlock *lock;
+    uint64_t bucket;
+
+    while (1) {
+	Spinlock_Lock(&cacheLock);
+
+	// Unused entries are not hashed and can be taken immediately
+	e = TAILQ_FIRST(&freeList);
+	if (e != NULL) {
+	    TAILQ_REMOVE(&freeList, e, lruEntry);
+	    e->flags = 0;
+	    e->refCount = 1;
+	    Spinlock_Unlock(&cacheLock);
+	    return e;
+	}
+
+	if ((a1inCount > CACHEA1IN(cacheEntries) &&
+	     !TAILQ_EMPTY(&a1inList)) ||
+	    TAILQ_EMPTY(&amList)) {
+	    e = TAILQ_FIRST(&a1inList);
+	} else {
+	    e = TAILQ_FIRST(&amList);
+	}
+	if (e == NULL) {
+	    Spinlock_Unlock(&cacheLock);
+	    return NULL;
+	}
+
+	bucket = BufCacheHash(e->disk, e->diskOffset);
+	Spinlock_Unlock(&cacheLock);
+
+	lock = BufCacheBucketLock(bucket);
+	Spinlock_Lock(lock);
+	Spinlock_Lock(&cacheLock);
+	if (e->refCount != 0 || !(e->flags & BUFCACHE_FLAG_LRU) ||
+	    e->disk == NULL || BufCacheHash(e->disk, e->diskOffset) != bucket) {
+	    // Lost a race, try again
+	    Spinlock_Unlock(&cacheLock);
+	    Spinlock_Unlock(lock);
+	    continue;
+	}
+
+	TAILQ_REMOVE(BufCacheQueue(e), e, lruEntry);
+	TAILQ_REMOVE(&hashTable[bucket], e, htEntry);
+	if (e->flags & BUFCACHE_FLAG_AM) {
+	    amCount--;
+	} else {
+	    a1inCount--;
+	    BufCacheGhostAdd(e->disk, e->diskOffset);
+	}
+	if (e->flags & BUFCACHE_FLAG_PREFETCH)
+	    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_rawaste), 1);
+	e->disk = NULL;
+	e->flags = 0;
+	e->refCount = 1;
+	Spinlock_Unlock(&cacheLock);
+	Spinlock_Unlock(lock);
+
+	return e;
+    }
+}
+
+/**
+ * BufCacheFree --
+ *
+ * Returns an unhashed entry to the free list so that it is the next one 
+ * reused.
+ */
+static void
+BufCacheFree(BufCacheEntry *e)
+{
+    Spinlock_Lock(&cacheLock);
+    e->disk = NULL;
+    e->refCount = 0;
+    e->flags = BUFCACHE_FLAG_LRU;
+    TAILQ_INSERT_HEAD(&freeList, e, lruEntry);
+    Spinlock_Unlock(&cacheLock);
+}
+
+/**
+ * BufCacheCanGrow --
+ *
+ * Decides whether the cache may allocate another block of the given size 
+ * rather than evicting one.  The cache always grows up to bufcache_minsize.  
+ * Beyond that it only grows while more than twice bufcache_minfree percent 
+ * of memory is free, so that the flusher does not immediately shrink it 
+ * again.
+ */
+static bool
+BufCacheCanGrow(uint64_t size)
+{
+    uint64_t bytes = cacheBytes + size;
+    uint64_t reserve;
+
+    if (bytes > SYSCTL_GETINT(bufcache_maxsize) * CACHEMB)
+	return false;
+    if (bytes <= SYSCTL_GETINT(bufcache_minsize) * CACHEMB)
+	return true;
+
+    reserve = PAlloc_TotalPages() * SYSCTL_GETINT(bufcache_minfree) / 100;
+    return PAlloc_FreePages() > 2 * reserve + size / PGSIZE;
+}
+
+/**
+ * BufCacheGrow --
+ *
+ * Allocates a new cache entry and its buffer if the cache is allowed to 
+ * grow.
+ *
+ * @return An unhashed entry with a reference held, or NULL if the cache 
+ * cannot grow.
+ */
+static BufCacheEntry *
+BufCacheGrow(uint64_t size)
+{
+    BufCacheEntry *e;
+    void *buf;
+
+    if (!BufCacheCanGrow(size))
+	return NULL;
+
+    buf = PAlloc_AllocContig(size / PGSIZE);
+    if (buf == NULL)
+	return NULL;
+
+    e = BufCacheEntry_Alloc();
+    if (e == NULL) {
+	for (uint64_t off = 0; off < size; off += PGSIZE)
+	    PAlloc_Release((uint8_t *)buf + off);
+	return NULL;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->buffer = buf;
+    e->size = size;
+    e->refCount = 1;
+
+    Spinlock_Lock(&cacheLock);
+    cacheEntries++;
+    cacheBytes += size;
+    SYSCTL_SETINT(bufcache_size, cacheBytes);
+    Spinlock_Unlock(&cacheLock);
+
+    return e;
+}
+
+/**
+ * BufCacheDestroy --
+ *
+ * Frees an unhashed entry and returns its buffer to the page allocator.
+ */
+static void
+BufCacheDestroy(BufCacheEntry *e)
+{
+    uint64_t off;
+
+    Spinlock_Lock(&cacheLock);
+    cacheEntries--;
+    cacheBytes -= e->size;
+    SYSCTL_SETINT(bufcache_size, cacheBytes);
+    Spinlock_Unlock(&cacheLock);
+
+    for (off = 0; off < e->size; off += PGSIZE)
+	PAlloc_Release((uint8_t *)e->buffer + off);
+    BufCacheEntry_Free(e);
+}
+
+/**
+ * BufCacheResize --
+ *
+ * Replaces the buffer of an unhashed entry with one of a different size.  
+ * This only happens when disks with different block sizes share the cache.
+ *
+ * @return The entry, or NULL if no memory was available in which case the 
+ * entry has been freed.
+ */
+static BufCacheEntry *
+BufCacheResize(BufCacheEntry *e, uint64_t size)
+{
+    uint64_t off;
+    void *buf;
+
+    buf = PAlloc_AllocContig(size / PGSIZE);
+    if (buf == NULL) {
+	BufCacheFree(e);
+	return NULL;
+    }
+
+    for (off = 0; off < e->size; off += PGSIZE)
+	PAlloc_Release((uint8_t *)e->buffer + off);
+
+    Spinlock_Lock(&cacheLock);
+    cacheBytes = cacheBytes - e->size + size;
+    SYSCTL_SETINT(bufcache_size, cacheBytes);
+    Spinlock_Unlock(&cacheLock);
+
+    e->buffer = buf;
+    e->size = size;
+
+    return e;
+}
+
+/**
+ * BufCacheShrink --
+ *
+ * Evicts and frees unreferenced blocks until the cache is no larger than 
+ * target bytes or only referenced and dirty blocks remain.
+ *
+ * @return Number of bytes freed.
+ */
+static uint64_t
+BufCacheShrink(uint64_t target)
+{
+    uint64_t freed = 0;
+    BufCacheEntry *e;
+
+    while (cacheBytes > target) {
+	e = BufCacheEvict();
+	if (e == NULL)
+	    break;
+
+	freed += e->size;
+	BufCacheDestroy(e);
+    }
+
+    return freed;
+}
+
+/**
+ * BufCacheTrim --
+ *
+ * Called periodically by the flusher to shrink the cache when free memory 
+ * drops below bufcache_minfree percent or bufcache_maxsize has been lowered.  
+ * The cache is never shrunk below bufcache_minsize.
+ */
+static void
+BufCacheTrim()
+{
+    uint64_t target = cacheBytes;
+    uint64_t reserve, freePages, freed;
+    uint64_t minBytes = SYSCTL_GETINT(bufcache_minsize) * CACHEMB;
+    uint64_t maxBytes = SYSCTL_GETINT(bufcache_maxsize) * CACHEMB;
+
+    reserve = PAlloc_TotalPages() * SYSCTL_GETINT(bufcache_minfree) / 100;
+    freePages = PAlloc_FreePages();
+    if (freePages < reserve) {
+	uint64_t deficit = (reserve - freePages) * PGSIZE;
+
+	target = (target > deficit) ? target - deficit : 0;
+    }
+    if (target > maxBytes)
+	target = maxBytes;
+    if (target < minBytes)
+	target = minBytes;
+
+    if (target >= cacheBytes)
+	return;
+
+    freed = BufCacheShrink(target);
+    if (freed != 0)
+	DLOG(bufcache, "Shrunk by %lld KB to %lld KB\n", freed / 1024,
+	     cacheBytes / 1024);
+}
+
+/**
+ * BufCacheGet --
  *
- * Allocates a buffer cache entry that can be used by BufCache_Alloc or 
- * BufCache_Read to allocate the underlying buffer..
+ * Finds or creates the buffer cache entry for a block.  Newly created 
+ * entries are hashed before their contents are valid, so that concurrent 
+ * lookups of the same block find them and wait rather than issuing a second 
+ * read.
  *
  * @param [in] disk Disk object
  * @param [in] diskOffset Block offset within the disk
  * @param [out] entry If successful, this contains the buffer cache entry.
  *
- * @retval 0 if successful.
- * @return ENOMEM if there's no buffer cache entries free.
+ * @retval 0 if an existing entry was found.
+ * @retval ENOENT if a new entry was created.
+ * @return -ENOMEM if there's no buffer cache entries free.
  */
 static int
-BufCacheAlloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
+BufCacheGet(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 {
-    struct CacheHashTable *table;
+    uint64_t bucket = BufCacheHash(disk, diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
+    uint64_t size = BufCacheBlockSize(disk);
     BufCacheEntry *e;
 
-    // Allocate from LRU list
-    e = TAILQ_FIRST(&lruList);
+    Spinlock_Lock(lock);
+    if (BufCacheLookup(bucket, disk, diskOffset, entry) == 0) {
+	Spinlock_Unlock(lock);
+	return 0;
+    }
+    Spinlock_Unlock(lock);
+
+    e = NULL;
+    if (TAILQ_EMPTY(&freeList))
+	e = BufCacheGrow(size);
+    if (e == NULL)
+	e = BufCacheEvict();
+    if (e == NULL && dirtyCount != 0) {
+	// Every unreferenced block is dirty, write back the oldest half
+	BufCacheFlush(NULL, FLUSHNOLIMIT, dirtyCount / 2);
+	e = BufCacheEvict();
+    }
+    if (e != NULL && e->size != size)
+	e = BufCacheResize(e, size);
     if (e == NULL) {
 	kprintf("BufCache: No space left!\n");
-	return ENOMEM;
+	*entry = NULL;
+	return -ENOMEM;
+    }
+
+    // Another thread may have inserted the block while the lock was dropped
+    Spinlock_Lock(lock);
+    if (BufCacheLookup(bucket, disk, diskOffset, entry) == 0) {
+	Spinlock_Unlock(lock);
+	BufCacheFree(e);
+	return 0;
     }
-    TAILQ_REMOVE(&lruList, e, lruEntry);
 
-    // Remove from hash table
-    if (e->disk != NULL) {
-	table = &hashTable[e->diskOffset % HASHTABLEENTRIES];
-	TAILQ_REMOVE(table, e, htEntry);
+    // Blocks referenced while on the ghost list go straight to Am
+    Spinlock_Lock(&cacheLock);
+    if (BufCacheGhostRemove(disk, diskOffset)) {
+	e->flags = BUFCACHE_FLAG_AM;
+	amCount++;
+	ghostHits++;
+    } else {
+	a1inCount++;
     }
+    Spinlock_Unlock(&cacheLock);
 
-    // Initialize
     e->disk = disk;
     e->diskOffset = diskOffset;
-    e->refCount = 1;
+    TAILQ_INSERT_HEAD(&hashTable[bucket], e, htEntry);
+    Spinlock_Unlock(lock);
 
-    // Reinsert into hash table
-    table = &hashTable[diskOffset % HASHTABLEENTRIES];
-    TAILQ_INSERT_HEAD(table, e, htEntry);
     *entry = e;
+    return ENOENT;
+}
 
-    return 0;
+/**
+ * BufCacheWait --
+ *
+ * Waits for another thread to finish filling a buffer cache entry.
+ *
+ * @retval 0 if the entry contains valid data.
+ * @return -EIO if the read failed.
+ */
+static int
+BufCacheWait(BufCacheEntry *e)
+{
+    while (1) {
+	WaitChannel_Lock(&cacheWait);
+	if (e->flags & (BUFCACHE_FLAG_VALID | BUFCACHE_FLAG_ERROR)) {
+	    Spinlock_Unlock(&cacheWait.lock);
+	    break;
+	}
+	WaitChannel_Sleep(&cacheWait);
+    }
+
+    return (e->flags & BUFCACHE_FLAG_VALID) ? 0 : -EIO;
+}
+
+/**
+ * BufCacheComplete --
+ *
+ * Marks an entry as filled and wakes up any threads waiting on it.  This may 
+ * be called from interrupt context.
+ */
+static void
+BufCacheComplete(BufCacheEntry *e, int status)
+{
+    if (status == 0) {
+	__sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_VALID);
+    } else {
+	__sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_ERROR);
+    }
+
+    WaitChannel_WakeAll(&cacheWait);
+}
+
+/**
+ * BufCacheFill --
+ *
+ * Reads a block from disk into a newly created entry and wakes up any 
+ * threads waiting for it.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+BufCacheFill(BufCacheEntry *e)
+{
+    int status;
+    SGArray sga;
+
+    SGArray_Init(&sga);
+    SGArray_Append(&sga, e->diskOffset, e->size);
+
+    status = Disk_Read(e->disk, e->buffer, &sga, NULL, NULL);
+    BufCacheComplete(e, status);
+
+    return status;
 }
 
 /**
@@ -179,16 +855,26 @@ BufCache_Alloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 {
     int status;
 
-    Spinlock_Lock(&cacheLock);
+    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_allocs), 1);
 
-    status = BufCacheLookup(disk, diskOffset, entry);
-    if (*entry == NULL) {
-        status = BufCacheAlloc(disk, diskOffset, entry);
+    status = BufCacheGet(disk, diskOffset, entry);
+    if (status == ENOENT) {
+	// The caller will overwrite the block
+	BufCacheComplete(*entry, 0);
+	return 0;
     }
+    if (status == 0) {
+	BufCacheEntry *e = *entry;
 
-    cacheAlloc++;
-
-    Spinlock_Unlock(&cacheLock);
+	/*
+	 * An in flight read must finish first so that it does not overwrite 
+	 * the caller's data.
+	 */
+	if (BufCacheWait(e) != 0) {
+	    __sync_fetch_and_and(&e->flags, ~BUFCACHE_FLAG_ERROR);
+	    __sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_VALID);
+	}
+    }
 
     return status;
 }
@@ -196,28 +882,51 @@ BufCache_Alloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 /**
  * BufCache_Release --
  *
- * Release a buffer cache entry.  If no other references are held the
- * buffer cache entry is placed on the LRU list.
+ * Release a buffer cache entry.  If no other references are held the buffer 
+ * cache entry is placed on its replacement queue.  Entries whose read failed 
+ * are dropped from the cache so the next access retries the read.
  *
  * @param [in] entry Buffer cache entry.
  */
 void
 BufCache_Release(BufCacheEntry *entry)
 {
-    Spinlock_Lock(&cacheLock);
+    uint64_t bucket = BufCacheHash(entry->disk, entry->diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
 
+    Spinlock_Lock(lock);
     entry->refCount--;
     if (entry->refCount == 0) {
-        TAILQ_INSERT_TAIL(&lruList, entry, lruEntry);
-    }
+	if (entry->flags & BUFCACHE_FLAG_ERROR) {
+	    TAILQ_REMOVE(&hashTable[bucket], entry, htEntry);
+	    Spinlock_Lock(&cacheLock);
+	    if (entry->flags & BUFCACHE_FLAG_AM)
+		amCount--;
+	    else
+		a1inCount--;
+	    Spinlock_Unlock(&cacheLock);
+	    Spinlock_Unlock(lock);
+	    BufCacheFree(entry);
+	    return;
+	}
 
-    Spinlock_Unlock(&cacheLock);
+	/*
+	 * Am is kept in LRU order.  A1in is nominally a FIFO, but since 
+	 * referenced entries are not kept on any queue they rejoin at the tail.
+	 */
+	Spinlock_Lock(&cacheLock);
+	__sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_LRU);
+	TAILQ_INSERT_TAIL(BufCacheQueue(entry), entry, lruEntry);
+	Spinlock_Unlock(&cacheLock);
+    }
+    Spinlock_Unlock(lock);
 }
 
 /**
  * BufCache_Read --
  *
- * Read block from disk into the buffer cache.
+ * Read block from disk into the buffer cache.  The disk read is issued 
+ * without holding any cache locks.
  *
  * @param [in] disk Disk object
  * @param [in] diskOffset Block offset within the disk
@@ -229,42 +938,469 @@ int
 BufCache_Read(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 {
     int status;
-    void *buf;
-    SGArray sga;
+    BufCacheEntry *e;
 
-    Spinlock_Lock(&cacheLock);
-    status = BufCacheLookup(disk, diskOffset, entry);
-    if (*entry != NULL) {
-        cacheHit++;
-        Spinlock_Unlock(&cacheLock);
-        return status;
+    status = BufCacheGet(disk, diskOffset, &e);
+    if (status == 0) {
+	__sync_fetch_and_add(&SYSCTL_GETINT(bufcache_hits), 1);
+	if (__sync_fetch_and_and(&e->flags, ~BUFCACHE_FLAG_PREFETCH) &
+	    BUFCACHE_FLAG_PREFETCH)
+	    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_rahits), 1);
+	status = BufCacheWait(e);
+	if (status != 0) {
+	    BufCache_Release(e);
+	    e = NULL;
+	}
+	*entry = e;
+	return status;
     }
-    cacheMiss++;
+    if (status != ENOENT) {
+	*entry = NULL;
+	return status;
+    }
+    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_misses), 1);
 
-    status = BufCacheAlloc(disk, diskOffset, entry);
+    status = BufCacheFill(e);
     if (status != 0) {
-        Spinlock_Unlock(&cacheLock);
-        return status;
+	BufCache_Release(e);
+	e = NULL;
+    }
+
+    *entry = e;
+    return status;
+}
+
+/**
+ * BufCachePrefetchDone --
+ *
+ * Completion callback for read-ahead.  This may be called from interrupt 
+ * context.
+ */
+static void
+BufCachePrefetchDone(int status, void *arg)
+{
+    BufCacheEntry *e = (BufCacheEntry *)arg;
+
+    BufCacheComplete(e, status);
+    __sync_fetch_and_sub(&prefetchInflight, 1);
+    BufCache_Release(e);
+}
+
+/**
+ * BufCache_IsCached --
+ *
+ * Checks whether a block is in the buffer cache, for callers that read the 
+ * disk directly and must not miss newer data in the cache.
+ *
+ * @param [in] disk Disk object
+ * @param [in] diskOffset Block offset within the disk
+ *
+ * @return True if the block is cached.
+ */
+bool
+BufCache_IsCached(Disk *disk, uint64_t diskOffset)
+{
+    uint64_t bucket = BufCacheHash(disk, diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
+    BufCacheEntry *e;
+
+    Spinlock_Lock(lock);
+    TAILQ_FOREACH(e, &hashTable[bucket], htEntry) {
+	if (e->disk == disk && e->diskOffset == diskOffset)
+	    break;
     }
+    Spinlock_Unlock(lock);
+
+    return e != NULL;
+}
 
-    buf = (*entry)->buffer;
+/**
+ * BufCache_Prefetch --
+ *
+ * Starts an asynchronous read of a block into the buffer cache.  This is a 
+ * hint; nothing is done if the block is already cached or too many reads 
+ * are already in flight.
+ *
+ * @param [in] disk Disk object
+ * @param [in] diskOffset Block offset within the disk
+ */
+void
+BufCache_Prefetch(Disk *disk, uint64_t diskOffset)
+{
+    int status;
+    BufCacheEntry *e;
+    SGArray sga;
+
+    if (prefetchInflight >= PREFETCHMAX)
+	return;
+
+    status = BufCacheGet(disk, diskOffset, &e);
+    if (status == 0) {
+	BufCache_Release(e);
+	return;
+    }
+    if (status != ENOENT)
+	return;
+
+    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_raissued), 1);
+    __sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_PREFETCH);
+    __sync_fetch_and_add(&prefetchInflight, 1);
+
+    // The entry's reference is dropped by the completion callback
     SGArray_Init(&sga);
-    SGArray_Append(&sga, diskOffset, BLOCKSIZE);
+    SGArray_Append(&sga, e->diskOffset, e->size);
+    status = Disk_Read(disk, e->buffer, &sga, BufCachePrefetchDone, e);
+    if (status != 0)
+	BufCachePrefetchDone(status, e);
+}
 
-    /*
-     * XXX: Need to avoid holding cacheLock while reading from the disk, but 
-     * need ensure other cores doesn't issue a read to the same block.
-     */
-    status = Disk_Read(disk, buf, &sga, NULL, NULL);
-    Spinlock_Unlock(&cacheLock);
+/**
+ * BufCacheDirtyTarget --
+ *
+ * @return Number of dirty blocks above which the flusher starts writing back 
+ * blocks regardless of their age.
+ */
+static inline uint64_t
+BufCacheDirtyTarget()
+{
+    return cacheEntries * SYSCTL_GETINT(bufcache_dirtyratio) / 100;
+}
+
+/**
+ * BufCacheWakeFlusher --
+ *
+ * Wakes up the flusher thread.  This may be called from a timer callback.
+ */
+static void
+BufCacheWakeFlusher()
+{
+    flushPending = true;
+    WaitChannel_Wake(&flushWait);
+}
+
+static void
+BufCacheFlushTimer(void *arg)
+{
+    flushTimerArmed = false;
+    BufCacheWakeFlusher();
+}
+
+/**
+ * BufCacheClaimDirty --
+ *
+ * Takes a dirty entry off the dirty list and marks it WRITING.  The caller 
+ * inherits the dirty list's reference and must write the block back.  
+ * Pinned entries are left on the list.
+ *
+ * @retval true if the entry was dirty and is now owned by the caller.
+ */
+static bool
+BufCacheClaimDirty(BufCacheEntry *e)
+{
+    bool claimed = false;
+
+    Spinlock_Lock(&dirtyLock);
+    if ((e->flags & (BUFCACHE_FLAG_DIRTY | BUFCACHE_FLAG_PINNED)) ==
+	BUFCACHE_FLAG_DIRTY) {
+	__sync_fetch_and_and(&e->flags, ~BUFCACHE_FLAG_DIRTY);
+	__sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_WRITING);
+	TAILQ_REMOVE(&dirtyList, e, dirtyEntry);
+	dirtyCount--;
+	claimed = true;
+    }
+    Spinlock_Unlock(&dirtyLock);
+
+    return claimed;
+}
+
+/**
+ * BufCacheLookupDirty --
+ *
+ * Looks up a block and claims it if it is dirty.  Used to find neighbours 
+ * that can be coalesced into a single write.
+ *
+ * @return The claimed entry or NULL if the block is not cached or clean.
+ */
+static BufCacheEntry *
+BufCacheLookupDirty(Disk *disk, uint64_t diskOffset)
+{
+    uint64_t bucket = BufCacheHash(disk, diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
+    BufCacheEntry *e;
+
+    Spinlock_Lock(lock);
+    TAILQ_FOREACH(e, &hashTable[bucket], htEntry) {
+	if (e->disk == disk && e->diskOffset == diskOffset) {
+	    if (!BufCacheClaimDirty(e))
+		e = NULL;
+	    break;
+	}
+    }
+    Spinlock_Unlock(lock);
+
+    return e;
+}
+
+/**
+ * BufCacheWriteDone --
+ *
+ * Clears the WRITING flag of claimed entries once their contents are no 
+ * longer needed by the write and wakes up any threads waiting to pin them.
+ */
+static void
+BufCacheWriteDone(BufCacheEntry **run, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	__sync_fetch_and_and(&run[i]->flags, ~BUFCACHE_FLAG_WRITING);
+    }
+
+    WaitChannel_WakeAll(&writeWait);
+}
+
+/**
+ * BufCacheRedirty --
+ *
+ * Puts a claimed entry back on the dirty list after a failed write.  If the 
+ * block was dirtied again while it was being written, the claimed reference 
+ * is simply dropped.
+ */
+static void
+BufCacheRedirty(BufCacheEntry *e)
+{
+    Spinlock_Lock(&dirtyLock);
+    if ((e->flags & BUFCACHE_FLAG_DIRTY) == 0) {
+	__sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_DIRTY);
+	e->dirtyTime = KTime_GetEpoch();
+	TAILQ_INSERT_TAIL(&dirtyList, e, dirtyEntry);
+	dirtyCount++;
+	Spinlock_Unlock(&dirtyLock);
+	return;
+    }
+    Spinlock_Unlock(&dirtyLock);
+
+    BufCache_Release(e);
+}
+
+/**
+ * BufCacheWriteRun --
+ *
+ * Writes the run of claimed entries in flushRun, which cover adjacent 
+ * blocks.  Runs longer than one block are copied into the staging buffer 
+ * and issued as a single disk write.  The caller must hold flushSema.
+ *
+ * @param [in] count Number of entries in the run.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+BufCacheWriteRun(int count)
+{
+    BufCacheEntry **run = flushRun;
+    uint8_t *buf = run[0]->buffer;
+    int i;
+    int status;
+
+    if (count > 1) {
+	buf = (uint8_t *)XMem_GetBase(flushBuf);
+	for (i = 0; i < count; i++) {
+	    memcpy(buf + i * run[0]->size, run[i]->buffer, run[0]->size);
+	}
+	// The staged copy is written so the entries may change from here on
+	BufCacheWriteDone(run, count);
+    }
+
+    SGArray_Init(&flushSGA);
+    SGArray_Append(&flushSGA, run[0]->diskOffset, count * run[0]->size);
+    status = Disk_Write(run[0]->disk, buf, &flushSGA, NULL, NULL);
+    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_writeios), 1);
+
+    if (count == 1)
+	BufCacheWriteDone(run, count);
+
+    if (status != 0) {
+	Log(bufcache, "Write back of %lld blocks at %llx failed (%d)\n",
+	    count, run[0]->diskOffset, status);
+	for (i = 0; i < count; i++) {
+	    BufCacheRedirty(run[i]);
+	}
+	return status;
+    }
+
+    __sync_fetch_and_add(&SYSCTL_GETINT(bufcache_writebacks), count);
+    for (i = 0; i < count; i++) {
+	BufCache_Release(run[i]);
+    }
+
+    return 0;
+}
+
+/**
+ * BufCacheFlushEntry --
+ *
+ * Writes back a claimed entry along with any dirty blocks adjacent to it.  
+ * Writers take turns with the shared run state.
+ *
+ * @param [in] e Claimed dirty entry.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+static int
+BufCacheFlushEntry(BufCacheEntry *e)
+{
+    int n = 0, i, count;
+    uint64_t off;
+    uint64_t size = e->size;
+    int maxRun = FLUSHRUNSIZE / size;
+    BufCacheEntry *p;
+    BufCacheEntry **run = flushRun;
+    int status;
+
+    Semaphore_Acquire(&flushSema);
+
+    // Walk backwards collecting dirty neighbours, then put them in order
+    off = e->diskOffset;
+    while (n < maxRun - 1 && off >= size) {
+	p = BufCacheLookupDirty(e->disk, off - size);
+	if (p == NULL)
+	    break;
+	run[n++] = p;
+	off -= size;
+    }
+    for (i = 0; i < n / 2; i++) {
+	p = run[i];
+	run[i] = run[n - 1 - i];
+	run[n - 1 - i] = p;
+    }
+
+    count = n;
+    run[count++] = e;
+
+    // Walk forwards
+    off = e->diskOffset + size;
+    while (count < maxRun && off < e->disk->diskSize) {
+	p = BufCacheLookupDirty(e->disk, off);
+	if (p == NULL)
+	    break;
+	run[count++] = p;
+	off += size;
+    }
+
+    status = BufCacheWriteRun(count);
+    Semaphore_Release(&flushSema);
 
     return status;
 }
 
+/**
+ * BufCacheFlush --
+ *
+ * Writes back dirty blocks in the order they were first dirtied.  A block 
+ * is written if it has been dirty for at least maxAge seconds or if there 
+ * are more than target dirty blocks in the cache.  Pinned blocks are 
+ * skipped.  Each block is visited at most once per call so that failing 
+ * writes cannot loop forever.
+ *
+ * @param [in] disk Disk to flush or NULL for all disks.
+ * @param [in] maxAge Age in seconds after which a block must be written.
+ * @param [in] target Dirty block count to write back down to.
+ *
+ * @retval 0 if successful
+ * @return Otherwise the last error encountered is returned.
+ */
+static int
+BufCacheFlush(Disk *disk, uint64_t maxAge, uint64_t target)
+{
+    int status = 0;
+    int err;
+    uint64_t budget;
+    uint64_t now = KTime_GetEpoch();
+    BufCacheEntry *e;
+
+    Spinlock_Lock(&dirtyLock);
+    budget = dirtyCount;
+    Spinlock_Unlock(&dirtyLock);
+
+    while (budget-- > 0) {
+	Spinlock_Lock(&dirtyLock);
+	TAILQ_FOREACH(e, &dirtyList, dirtyEntry) {
+	    if (disk != NULL && e->disk != disk)
+		continue;
+	    if (e->flags & BUFCACHE_FLAG_PINNED)
+		continue;
+	    if (dirtyCount > target ||
+		(now >= e->dirtyTime && now - e->dirtyTime >= maxAge))
+		break;
+	    // The list is sorted by age so nothing further qualifies
+	    e = NULL;
+	    break;
+	}
+	if (e == NULL) {
+	    Spinlock_Unlock(&dirtyLock);
+	    break;
+	}
+	__sync_fetch_and_and(&e->flags, ~BUFCACHE_FLAG_DIRTY);
+	__sync_fetch_and_or(&e->flags, BUFCACHE_FLAG_WRITING);
+	TAILQ_REMOVE(&dirtyList, e, dirtyEntry);
+	dirtyCount--;
+	Spinlock_Unlock(&dirtyLock);
+
+	err = BufCacheFlushEntry(e);
+	if (err != 0)
+	    status = err;
+    }
+
+    return status;
+}
+
+/**
+ * BufCacheFlusher --
+ *
+ * Flusher thread that periodically writes back dirty blocks that are older 
+ * than bufcache_flushage seconds.  It is also woken up early when the 
+ * fraction of dirty blocks exceeds bufcache_dirtyratio, in which case it 
+ * writes back blocks until half that many remain dirty.  Every pass also 
+ * shrinks the cache if memory is low.
+ */
+static void
+BufCacheFlusher(void *arg)
+{
+    uint64_t target;
+
+    while (1) {
+	if (!flushTimerArmed) {
+	    flushTimerArmed = true;
+	    KTimer_Release(KTimer_Create(1, BufCacheFlushTimer, NULL));
+	}
+
+	WaitChannel_Lock(&flushWait);
+	if (!flushPending) {
+	    WaitChannel_Sleep(&flushWait);
+	} else {
+	    Spinlock_Unlock(&flushWait.lock);
+	}
+	flushPending = false;
+
+	target = BufCacheDirtyTarget();
+	if (dirtyCount > target)
+	    target = target / 2;
+	else
+	    target = FLUSHNOLIMIT;
+
+	BufCacheFlush(NULL, SYSCTL_GETINT(bufcache_flushage), target);
+	BufCacheTrim();
+    }
+}
+
 /**
  * BufCache_Write --
  *
- * Write a buffer cache entry to disk.
+ * Marks a buffer cache entry dirty.  The block is written back to disk 
+ * asynchronously by the flusher thread, when the cache needs the space, or 
+ * when BufCache_Sync is called.  The caller must hold a reference.
  *
  * @retval 0 if successful
  * @return Otherwise an error code is returned.
@@ -272,22 +1408,238 @@ BufCache_Read(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 int
 BufCache_Write(BufCacheEntry *entry)
 {
-    void *buf = entry->buffer;
-    SGArray sga;
+    uint64_t bucket = BufCacheHash(entry->disk, entry->diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
+    bool wake = false;
 
-    SGArray_Init(&sga);
-    SGArray_Append(&sga, entry->diskOffset, BLOCKSIZE);
+    ASSERT(entry->refCount > 0);
+
+    Spinlock_Lock(lock);
+    Spinlock_Lock(&dirtyLock);
+    if ((entry->flags & BUFCACHE_FLAG_DIRTY) == 0) {
+	__sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_DIRTY);
+	entry->refCount++;
+	entry->dirtyTime = KTime_GetEpoch();
+	TAILQ_INSERT_TAIL(&dirtyList, entry, dirtyEntry);
+	dirtyCount++;
+	wake = (dirtyCount > BufCacheDirtyTarget());
+    }
+    Spinlock_Unlock(&dirtyLock);
+    Spinlock_Unlock(lock);
 
-    return Disk_Write(entry->disk, buf, &sga, NULL, NULL);
+    if (wake)
+	BufCacheWakeFlusher();
+
+    return 0;
+}
+
+/**
+ * BufCache_Pin --
+ *
+ * Pins a buffer cache entry so that it stays in the cache and is not written 
+ * back, even if it is dirty, until BufCache_Unpin is called.  Used by the 
+ * file system journal to keep uncommitted changes off the disk.  If the 
+ * entry is being written back this sleeps until the write no longer uses 
+ * the buffer, so the caller may modify it once this returns.  The pin holds 
+ * a reference of its own.  The caller must hold a reference and must not 
+ * be in a critical section.
+ *
+ * @return True if the entry was pinned, false if it already was.
+ */
+bool
+BufCache_Pin(BufCacheEntry *entry)
+{
+    uint64_t bucket = BufCacheHash(entry->disk, entry->diskOffset);
+    Spinlock *lock = BufCacheBucketLock(bucket);
+    bool pinned = false;
+
+    ASSERT(entry->refCount > 0);
+
+    // Setting the flag under dirtyLock keeps the entry from being claimed
+    Spinlock_Lock(lock);
+    Spinlock_Lock(&dirtyLock);
+    if ((entry->flags & BUFCACHE_FLAG_PINNED) == 0) {
+	__sync_fetch_and_or(&entry->flags, BUFCACHE_FLAG_PINNED);
+	entry->refCount++;
+	pinned = true;
+    }
+    Spinlock_Unlock(&dirtyLock);
+    Spinlock_Unlock(lock);
+
+    while (1) {
+	WaitChannel_Lock(&writeWait);
+	if ((entry->flags & BUFCACHE_FLAG_WRITING) == 0) {
+	    Spinlock_Unlock(&writeWait.lock);
+	    break;
+	}
+	WaitChannel_Sleep(&writeWait);
+    }
+
+    return pinned;
+}
+
+/**
+ * BufCache_Unpin --
+ *
+ * Unpins an entry and drops the pin's reference.  If the entry is dirty it 
+ * is written back as usual from now on.
+ */
+void
+BufCache_Unpin(BufCacheEntry *entry)
+{
+    ASSERT(entry->flags & BUFCACHE_FLAG_PINNED);
+
+    __sync_fetch_and_and(&entry->flags, ~BUFCACHE_FLAG_PINNED);
+    BufCache_Release(entry);
+}
+
+/**
+ * BufCache_Sync --
+ *
+ * Writes back all dirty blocks belonging to a disk, other than pinned ones, 
+ * and flushes the disk's write cache.
+ *
+ * @param [in] disk Disk object or NULL to write back all disks.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
+int
+BufCache_Sync(Disk *disk)
+{
+    int status;
+
+    status = BufCacheFlush(disk, 0, 0);
+    if (status != 0)
+	return status;
+
+    if (disk != NULL)
+	return Disk_Flush(disk, NULL, NULL, NULL, NULL);
+
+    return 0;
+}
+
+/**
+ * BufCache_SetBlockSize --
+ *
+ * Sets the size of the blocks cached for a disk.  This is called by file 
+ * systems at mount time with their block size.  Blocks cached at the old 
+ * size are written back and dropped, so the caller must not hold any 
+ * references to blocks on the disk.
+ *
+ * @param [in] disk Disk object
+ * @param [in] blockSize Block size in bytes, a power of two between the page 
+ * size and 64 KB.
+ *
+ * @retval 0 if successful
+ * @retval -EINVAL if the block size is not supported.
+ * @retval -EBUSY if blocks on the disk are still referenced.
+ * @return Otherwise an error code is returned.
+ */
+int
+BufCache_SetBlockSize(Disk *disk, uint64_t blockSize)
+{
+    int status;
+    uint64_t i;
+    bool busy = false;
+    BufCacheEntry *e, *tmp;
+
+    if (blockSize < PGSIZE || blockSize > BLOCKSIZE_MAX ||
+	(blockSize & (blockSize - 1)) != 0 ||
+	(blockSize % disk->sectorSize) != 0)
+	return -EINVAL;
+
+    if (BufCacheBlockSize(disk) == blockSize) {
+	disk->blockSize = blockSize;
+	return 0;
+    }
+
+    status = BufCacheFlush(disk, 0, 0);
+    if (status != 0)
+	return status;
+
+    for (i = 0; i <= hashMask; i++) {
+	Spinlock *lock = BufCacheBucketLock(i);
+
+	Spinlock_Lock(lock);
+	TAILQ_FOREACH_SAFE(e, &hashTable[i], htEntry, tmp) {
+	    if (e->disk != disk)
+		continue;
+	    if (e->refCount != 0) {
+		busy = true;
+		continue;
+	    }
+
+	    TAILQ_REMOVE(&hashTable[i], e, htEntry);
+	    Spinlock_Lock(&cacheLock);
+	    TAILQ_REMOVE(BufCacheQueue(e), e, lruEntry);
+	    if (e->flags & BUFCACHE_FLAG_AM)
+		amCount--;
+	    else
+		a1inCount--;
+	    e->disk = NULL;
+	    e->flags = BUFCACHE_FLAG_LRU;
+	    TAILQ_INSERT_HEAD(&freeList, e, lruEntry);
+	    Spinlock_Unlock(&cacheLock);
+	}
+	Spinlock_Unlock(lock);
+    }
+
+    if (busy)
+	return -EBUSY;
+
+    disk->blockSize = blockSize;
+
+    return 0;
 }
 
 static void
 Debug_BufCache(int argc, const char *argv[])
 {
-    kprintf("Hits: %lld\n", cacheHit);
-    kprintf("Misses: %lld\n", cacheMiss);
-    kprintf("Allocations: %lld\n", cacheAlloc);
+    uint64_t i;
+    uint64_t used = 0, longest = 0;
+
+    for (i = 0; i <= hashMask; i++) {
+	BufCacheEntry *e;
+	uint64_t len = 0;
+
+	TAILQ_FOREACH(e, &hashTable[i], htEntry) {
+	    len++;
+	}
+	if (len != 0)
+	    used++;
+	if (len > longest)
+	    longest = len;
+    }
+
+    kprintf("Hits: %lld (A1in %lld, Am %lld)\n", SYSCTL_GETINT(bufcache_hits),
+	    a1inHits, amHits);
+    kprintf("Misses: %lld (%lld ghost hits promoted to Am)\n",
+	    SYSCTL_GETINT(bufcache_misses), ghostHits);
+    kprintf("Allocations: %lld\n", SYSCTL_GETINT(bufcache_allocs));
+    kprintf("Size: %lld KB in %lld blocks\n", cacheBytes / 1024, cacheEntries);
+    kprintf("Queues: A1in %lld/%lld, Am %lld, A1out %lld/%lld ghosts\n",
+	    a1inCount, CACHEA1IN(cacheEntries), amCount, a1outCount,
+	    CACHEA1OUT(cacheEntries));
+    kprintf("Read-ahead: %lld issued, %lld used, %lld evicted unused\n",
+	    SYSCTL_GETINT(bufcache_raissued), SYSCTL_GETINT(bufcache_rahits),
+	    SYSCTL_GETINT(bufcache_rawaste));
+    kprintf("Dirty: %lld\n", dirtyCount);
+    kprintf("Write backs: %lld blocks in %lld writes\n",
+	    SYSCTL_GETINT(bufcache_writebacks), SYSCTL_GETINT(bufcache_writeios));
+    kprintf("Buckets: %lld/%lld used, longest chain %lld\n",
+	    used, hashMask + 1, longest);
 }
 
 REGISTER_DBGCMD(diskcache, "Display disk cache statistics", Debug_BufCache);
 
+static void
+Debug_Sync(int argc, const char *argv[])
+{
+    int status = BufCache_Sync(NULL);
+
+    kprintf("Sync %s (%d)\n", status == 0 ? "complete" : "failed", status);
+}
+
+REGISTER_DBGCMD(sync, "Write back all dirty disk blocks", Debug_Sync);
+
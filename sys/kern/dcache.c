@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2013-2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/kmem.h>
+#include <sys/spinlock.h>
+#include <sys/sysctl.h>
+#include <sys/disk.h>
+#include <sys/vfs.h>
+
+#include <machine/pmap.h>
+
+/*
+ * Name Cache
+ *
+ * Caches the result of looking up a name in a directory, including names
+ * that do not exist, so that VFS_Lookup only calls into the file system the
+ * first time it resolves a path.  Entries are keyed on the directory's VNode
+ * id and the name.  Invalidating a whole directory gives its VNode a new id,
+ * which orphans all of its entries at once until the clock reclaims them.
+ *
+ * Entries do not hold a reference to their VNode, which would pin it and its
+ * metadata in memory, but also record the VNode cache key of the object.  A
+ * hit checks that the VNode still has that key once it is retained, and
+ * falls back to the VNode cache if the VNode was reclaimed.  Names are
+ * assumed to refer to objects in the directory's VFS.
+ *
+ * Lookups do not take a lock.  Each bucket has a sequence count that writers
+ * make odd while they change the bucket's chain, and readers retry if it
+ * changed while they walked the chain.  Entries live in a single array and
+ * are only ever reused as entries, so a reader racing with a writer never
+ * follows a pointer outside of the array, and the chain walk is bounded in
+ * case an entry moved to another chain under it.  Writers serialize on
+ * dcacheLock and replace entries using a clock.
+ *
+ * The table is sized at boot from physical memory, one entry for every
+ * DCACHE_PAGESPERENTRY pages, up to vfs_dcachemax entries.
+ */
+#define DCACHE_NAMELEN		24	// Longer names are not cached
+#define DCACHE_PAGESPERENTRY	8
+#define DCACHE_MINENTRIES	1024
+#define DCACHE_MAXCHAIN		64
+#define DCACHE_RETRIES		8
+
+typedef struct DCacheEntry DCacheEntry;
+struct DCacheEntry {
+    DCacheEntry * volatile	next;
+    uint64_t			parent;		// Directory VNode id, 0 if free
+    VNode			*vnode;		// NULL for a negative entry
+    uint64_t			key;		// VNode cache key of vnode
+    uint32_t			hash;
+    uint16_t			len;
+    volatile uint16_t		referenced;	// Clock bit
+    char			name[DCACHE_NAMELEN];
+};
+
+typedef struct DCacheBucket {
+    volatile uint64_t		seq;
+    DCacheEntry * volatile	head;
+} DCacheBucket;
+
+static_assert(sizeof(DCacheEntry) == 64, "DCacheEntry must be 64 bytes");
+
+static Spinlock dcacheLock;
+static DCacheEntry *dcacheEntries;
+static DCacheBucket *dcacheBuckets;
+static uint64_t dcacheEntryCount;
+static uint64_t dcacheMask;
+static uint64_t dcacheHand;
+static uint64_t dcacheNextID;
+
+#define DCACHE_BARRIER()	asm volatile("" ::: "memory")
+
+/**
+ * DCache_Init --
+ *
+ * Allocate the name cache.  The VFS works without it if memory is short.
+ */
+void
+DCache_Init()
+{
+    uint64_t entries, buckets, pages;
+
+    Spinlock_Init(&dcacheLock, "DCache Lock", SPINLOCK_TYPE_NORMAL);
+
+    entries = PAlloc_TotalPages() / DCACHE_PAGESPERENTRY;
+    if (entries > (uint64_t)SYSCTL_GETINT(vfs_dcachemax))
+	entries = SYSCTL_GETINT(vfs_dcachemax);
+    if (entries < DCACHE_MINENTRIES)
+	entries = DCACHE_MINENTRIES;
+
+    // Power of two buckets with chains of one or two entries
+    buckets = 1;
+    while (buckets * 2 <= entries)
+	buckets *= 2;
+
+    pages = ROUNDUP(entries * sizeof(DCacheEntry), PGSIZE) / PGSIZE;
+    dcacheEntries = (DCacheEntry *)PAlloc_AllocContig(pages);
+    if (dcacheEntries == NULL) {
+	Alert(vfs, "Name cache disabled, cannot allocate %lld entries\n",
+	      entries);
+	return;
+    }
+
+    pages = ROUNDUP(buckets * sizeof(DCacheBucket), PGSIZE) / PGSIZE;
+    dcacheBuckets = (DCacheBucket *)PAlloc_AllocContig(pages);
+    if (dcacheBuckets == NULL) {
+	Alert(vfs, "Name cache disabled, cannot allocate %lld buckets\n",
+	      buckets);
+	dcacheEntries = NULL;
+	return;
+    }
+
+    memset(dcacheEntries, 0, entries * sizeof(DCacheEntry));
+    memset(dcacheBuckets, 0, buckets * sizeof(DCacheBucket));
+    dcacheEntryCount = entries;
+    dcacheMask = buckets - 1;
+    dcacheHand = 0;
+
+    SYSCTL_SETINT(vfs_dcachesize, entries);
+}
+
+/**
+ * DCache_NewID --
+ *
+ * @return A VNode id that has never been used, file systems must assign one
+ * to every VNode they create.
+ */
+uint64_t
+DCache_NewID()
+{
+    return __sync_add_and_fetch(&dcacheNextID, 1);
+}
+
+/**
+ * DCacheHash --
+ *
+ * FNV-1a hash of the name mixed with the directory id.
+ */
+static uint32_t
+DCacheHash(uint64_t parent, const char *name, uint64_t len)
+{
+    uint64_t i;
+    uint32_t hash = 2166136261U;
+
+    for (i = 0; i < len; i++) {
+	hash ^= (uint8_t)name[i];
+	hash *= 16777619U;
+    }
+
+    return hash ^ (uint32_t)((parent * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline DCacheBucket *
+DCacheBucketOf(uint32_t hash)
+{
+    return &dcacheBuckets[hash & dcacheMask];
+}
+
+static inline bool
+DCacheMatch(DCacheEntry *e, uint64_t parent, uint32_t hash,
+	    const char *name, uint64_t len)
+{
+    return e->hash == hash && e->parent == parent && e->len == len &&
+	   memcmp(e->name, name, len) == 0;
+}
+
+/**
+ * DCacheUnlink --
+ *
+ * Remove an entry from its chain.  The caller must hold dcacheLock.
+ */
+static void
+DCacheUnlink(DCacheEntry *e)
+{
+    DCacheBucket *b = DCacheBucketOf(e->hash);
+    DCacheEntry * volatile *prev;
+
+    ASSERT(Spinlock_IsHeld(&dcacheLock));
+
+    for (prev = &b->head; *prev != NULL; prev = &(*prev)->next) {
+	if (*prev == e) {
+	    b->seq++;
+	    DCACHE_BARRIER();
+	    *prev = e->next;
+	    DCACHE_BARRIER();
+	    b->seq++;
+	    break;
+	}
+    }
+
+    e->vnode = NULL;
+    e->parent = 0;
+}
+
+/**
+ * DCacheRetain --
+ *
+ * Get a reference to the VNode of an entry.  VFS_TryRetain fails if the
+ * recorded VNode was reclaimed, even if it was reused for another object.
+ *
+ * @param [in] vn VNode recorded in the entry.
+ * @param [in] fs VFS of the directory.
+ * @param [in] key VNode cache key recorded in the entry.
+ *
+ * @return VNode with a reference held, or NULL if it is no longer cached.
+ */
+static VNode *
+DCacheRetain(VNode *vn, VFS *fs, uint64_t key)
+{
+    if (VFS_TryRetain(vn, fs, key))
+	return vn;
+
+    // Unreferenced VNodes may still be on the VNode cache's LRU
+    return VFS_FindVNode(fs, key);
+}
+
+/**
+ * DCacheVictim --
+ *
+ * Advance the clock hand to an entry that is free or has not been used since
+ * the hand last passed it.  The caller must hold dcacheLock.
+ */
+static DCacheEntry *
+DCacheVictim()
+{
+    DCacheEntry *e;
+
+    while (1) {
+	e = &dcacheEntries[dcacheHand];
+	dcacheHand = (dcacheHand + 1) % dcacheEntryCount;
+
+	if (e->parent == 0)
+	    return e;
+	if (!e->referenced) {
+	    DCacheUnlink(e);
+	    return e;
+	}
+	e->referenced = 0;
+    }
+}
+
+/**
+ * DCache_Lookup --
+ *
+ * Lookup a name in the cache without taking any locks.
+ *
+ * @param [in] dn Directory VNode.
+ * @param [in] name Name to lookup.
+ * @param [out] vn VNode of the name, with a reference held for the caller.
+ *
+ * @retval DCACHE_HIT The name was found and vn is set.
+ * @retval DCACHE_NEGATIVE The name is known not to exist.
+ * @retval DCACHE_MISS The name must be looked up in the file system.
+ */
+int
+DCache_Lookup(VNode *dn, const char *name, VNode **vn)
+{
+    uint64_t parent = dn->id;
+    uint64_t len = strlen(name);
+    uint64_t seq, steps, key;
+    uint32_t hash;
+    int tries;
+    DCacheBucket *b;
+    DCacheEntry *e;
+    VNode *found;
+
+    if (dcacheEntries == NULL || len > DCACHE_NAMELEN)
+	return DCACHE_MISS;
+
+    hash = DCacheHash(parent, name, len);
+    b = DCacheBucketOf(hash);
+
+    for (tries = 0; tries < DCACHE_RETRIES; tries++) {
+	seq = b->seq;
+	if (seq & 1)
+	    continue;
+	DCACHE_BARRIER();
+
+	found = NULL;
+	steps = 0;
+	for (e = b->head; e != NULL && steps < DCACHE_MAXCHAIN; e = e->next) {
+	    if (DCacheMatch(e, parent, hash, name, len)) {
+		found = e->vnode;
+		key = e->key;
+		break;
+	    }
+	    steps++;
+	}
+
+	DCACHE_BARRIER();
+	if (b->seq != seq)
+	    continue;
+
+	if (e == NULL || steps == DCACHE_MAXCHAIN)
+	    break;
+
+	e->referenced = 1;
+	if (found == NULL) {
+	    __sync_fetch_and_add(&SYSCTL_GETINT(vfs_dcacheneghits), 1);
+	    return DCACHE_NEGATIVE;
+	}
+
+	found = DCacheRetain(found, dn->vfs, key);
+	if (found == NULL)
+	    break;
+
+	__sync_fetch_and_add(&SYSCTL_GETINT(vfs_dcachehits), 1);
+	*vn = found;
+	return DCACHE_HIT;
+    }
+
+    __sync_fetch_and_add(&SYSCTL_GETINT(vfs_dcachemisses), 1);
+    return DCACHE_MISS;
+}
+
+/**
+ * DCache_Enter --
+ *
+ * Add the result of a file system lookup to the cache, replacing any
+ * existing entry for the name.
+ *
+ * @param [in] dn Directory VNode.
+ * @param [in] name Name that was looked up.
+ * @param [in] vn VNode of the name or NULL if the name does not exist.
+ */
+void
+DCache_Enter(VNode *dn, const char *name, VNode *vn)
+{
+    uint64_t parent = dn->id;
+    uint64_t len = strlen(name);
+    uint32_t hash;
+    DCacheBucket *b;
+    DCacheEntry *e;
+
+    if (dcacheEntries == NULL || len > DCACHE_NAMELEN)
+	return;
+
+    hash = DCacheHash(parent, name, len);
+    b = DCacheBucketOf(hash);
+
+    Spinlock_Lock(&dcacheLock);
+
+    for (e = b->head; e != NULL; e = e->next) {
+	if (DCacheMatch(e, parent, hash, name, len)) {
+	    DCacheUnlink(e);
+	    break;
+	}
+    }
+    if (e == NULL)
+	e = DCacheVictim();
+
+    // Fill the entry before it becomes visible to readers
+    e->parent = parent;
+    e->vnode = vn;
+    e->key = vn != NULL ? vn->key : 0;
+    e->hash = hash;
+    e->len = len;
+    e->referenced = 1;
+    memcpy(e->name, name, len);
+
+    b->seq++;
+    DCACHE_BARRIER();
+    e->next = b->head;
+    b->head = e;
+    DCACHE_BARRIER();
+    b->seq++;
+
+    Spinlock_Unlock(&dcacheLock);
+}
+
+/**
+ * DCache_Invalidate --
+ *
+ * Invalidate cached names in a directory.  Must be called whenever a file
+ * system creates, removes or renames a name.
+ *
+ * @param [in] dn Directory VNode.
+ * @param [in] name Name to invalidate, or NULL to invalidate the whole
+ * directory.
+ */
+void
+DCache_Invalidate(VNode *dn, const char *name)
+{
+    uint64_t parent = dn->id;
+    uint64_t len;
+    uint32_t hash;
+    DCacheEntry *e;
+
+    if (name == NULL) {
+	dn->id = DCache_NewID();
+	return;
+    }
+
+    len = strlen(name);
+    if (dcacheEntries == NULL || len > DCACHE_NAMELEN)
+	return;
+
+    hash = DCacheHash(parent, name, len);
+
+    Spinlock_Lock(&dcacheLock);
+    for (e = DCacheBucketOf(hash)->head; e != NULL; e = e->next) {
+	if (DCacheMatch(e, parent, hash, name, len)) {
+	    DCacheUnlink(e);
+	    break;
+	}
+    }
+    Spinlock_Unlock(&dcacheLock);
+}
+
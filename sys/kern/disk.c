@@ -5,19 +5,95 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
+#include <sys/kmem.h>
+#include <sys/ktime.h>
 #include <sys/queue.h>
 #include <sys/sga.h>
 #include <sys/disk.h>
 #include <sys/spinlock.h>
+#include <sys/sysctl.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
+#include <errno.h>
 
 LIST_HEAD(DiskList, Disk) diskList = LIST_HEAD_INITIALIZER(diskList);
 
+/*
+ * Requests to disks whose driver has no submit routine are serviced 
+ * synchronously by the disk I/O thread.  Threads waiting for requests 
+ * without a callback sleep on diskWait.
+ */
+static Slab diskReqSlab;
+static Spinlock diskQueueLock;
+static TAILQ_HEAD(DiskWorkQueue, DiskRequest) diskQueue;
+static WaitChannel diskQueueWait;
+static WaitChannel diskWait;
+
+DEFINE_SLAB(DiskRequest, &diskReqSlab);
+
+/*
+ * Submitted requests pass through a per-disk queue that holds them while the 
+ * driver already has disk_qdepth requests outstanding, or one for drivers 
+ * serviced by the disk I/O thread.  A request that starts where a waiting 
+ * request of the same type ends is appended to it, so sequential read-ahead 
+ * and write-back reach the driver as one multi-entry request.  Waiting 
+ * requests are dispatched in ascending disk order (C-LOOK) unless the 
+ * oldest has passed its deadline.  Flushes are never reordered with the 
+ * requests around them.
+ */
+#define DISK_MAXMERGE		(1024*1024)
+
+/*
+ * Every completed request is accounted in its disk's DiskStats, which sits 
+ * in a page of its own as disks are embedded in their driver's structures.  
+ * The totals across all disks are kept in the disk_* sysctls.
+ */
+
+static void DiskWorker(void *arg);
+static void DiskDispatch(Disk *disk, bool force);
+static void DiskFinish(DiskRequest *req, int status);
+
+/**
+ * Disk_Init --
+ *
+ * Initialize the block layer and start the disk I/O thread.
+ */
+void
+Disk_Init()
+{
+    Slab_Init(&diskReqSlab, "DiskRequest Slab", sizeof(DiskRequest), 16);
+    Spinlock_Init(&diskQueueLock, "Disk Queue Lock", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&diskQueue);
+    WaitChannel_Init(&diskQueueWait, "Disk Queue");
+    WaitChannel_Init(&diskWait, "Disk Request");
+
+    Thread *thr = Thread_KThreadCreate(&DiskWorker, NULL);
+    if (thr == NULL)
+	Panic("Disk: Cannot create I/O thread\n");
+    Sched_SetRunnable(thr);
+
+    ASSERT(sizeof(DiskStats) <= PGSIZE);
+}
+
 void
 Disk_AddDisk(Disk *disk)
 {
+    DiskQueue *q = &disk->queue;
+
+    memset(q, 0, sizeof(*q));
+    Spinlock_Init(&q->lock, "Disk Queue Lock", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&q->sorted);
+    TAILQ_INIT(&q->fifo);
+
+    disk->stats = (DiskStats *)PAlloc_AllocPage();
+    if (disk->stats == NULL)
+	Panic("Disk: Cannot allocate statistics\n");
+    memset(disk->stats, 0, sizeof(DiskStats));
+
     LIST_INSERT_HEAD(&diskList, disk, entries);
 }
 
@@ -40,32 +116,791 @@ Disk_GetByID(uint64_t ctrlNo, uint64_t diskNo)
     return NULL;
 }
 
+/**
+ * Disk_GetByName --
+ *
+ * Looks up a disk by its name, disk<ctrlNo>.<diskNo>, as printed by the disks 
+ * debugger command.
+ *
+ * @return Disk or NULL if the name is invalid or the disk does not exist.
+ */
+Disk *
+Disk_GetByName(const char *name)
+{
+    uint64_t ctrlNo = 0, diskNo = 0;
+    const char *p;
+
+    if (strncmp(name, "disk", 4) != 0)
+	return NULL;
+
+    p = name + 4;
+    if (*p < '0' || *p > '9')
+	return NULL;
+    while (*p >= '0' && *p <= '9')
+	ctrlNo = ctrlNo * 10 + (*p++ - '0');
+
+    if (*p++ != '.')
+	return NULL;
+    if (*p < '0' || *p > '9')
+	return NULL;
+    while (*p >= '0' && *p <= '9')
+	diskNo = diskNo * 10 + (*p++ - '0');
+
+    if (*p != '\0')
+	return NULL;
+
+    return Disk_GetByID(ctrlNo, diskNo);
+}
+
+/**
+ * Disk_GetStats --
+ *
+ * Returns a disk's statistics after updating the snapshot of its request 
+ * queue.  Counters are updated as requests complete so readers may see them 
+ * change while copying.
+ *
+ * @param [in] disk Disk object
+ */
+DiskStats *
+Disk_GetStats(Disk *disk)
+{
+    DiskQueue *q = &disk->queue;
+    DiskStats *st = disk->stats;
+
+    Spinlock_Lock(&q->lock);
+    st->ctrlNo = disk->ctrlNo;
+    st->diskNo = disk->diskNo;
+    st->sectorSize = disk->sectorSize;
+    st->diskSize = disk->diskSize;
+    st->queued = q->queued;
+    st->inflight = q->inflight;
+    st->maxInflight = q->maxInflight;
+    st->dispatches = q->dispatches;
+    st->merges = q->merges;
+    st->expired = q->expired;
+    Spinlock_Unlock(&q->lock);
+
+    return st;
+}
+
+/**
+ * DiskAccount --
+ *
+ * Accounts a completed request in its disk's statistics and the trace ring.  
+ * The caller must hold the queue lock.
+ *
+ * @param [in] req Completed request.
+ * @param [in] status Completion status.
+ * @param [in] now Completion time (ns).
+ */
+static void
+DiskAccount(DiskRequest *req, int status, uint64_t now)
+{
+    DiskStats *st = req->disk->stats;
+    DiskOpStats *os;
+    DiskTraceEntry *te;
+    uint64_t latency = now - req->submitTime;
+    uint64_t us = latency / 1000;
+    int bucket;
+
+    // DISKREQ_OP_* start at one
+    os = &st->op[req->op - DISKREQ_OP_READ];
+    os->ops++;
+    os->bytes += req->bytes;
+    os->latencyTotal += latency;
+    if (latency > os->latencyMax)
+	os->latencyMax = latency;
+
+    bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= DISKSTAT_HIST_BUCKETS)
+	bucket = DISKSTAT_HIST_BUCKETS - 1;
+    os->hist[bucket]++;
+
+    switch (req->op) {
+	case DISKREQ_OP_READ:
+	    __sync_fetch_and_add(&SYSCTL_GETINT(disk_reads), 1);
+	    __sync_fetch_and_add(&SYSCTL_GETINT(disk_readbytes), req->bytes);
+	    break;
+	case DISKREQ_OP_WRITE:
+	    __sync_fetch_and_add(&SYSCTL_GETINT(disk_writes), 1);
+	    __sync_fetch_and_add(&SYSCTL_GETINT(disk_writebytes), req->bytes);
+	    break;
+	case DISKREQ_OP_FLUSH:
+	    __sync_fetch_and_add(&SYSCTL_GETINT(disk_flushes), 1);
+	    break;
+    }
+    if (status != 0) {
+	os->errors++;
+	__sync_fetch_and_add(&SYSCTL_GETINT(disk_errors), 1);
+    }
+
+    if (SYSCTL_GETINT(disk_trace) == 0)
+	return;
+
+    te = &st->trace[st->traceNext++ % DISKSTAT_TRACE_ENTRIES];
+    te->time = now;
+    te->offset = req->sga.len != 0 ? req->sga.entries[0].offset : 0;
+    te->length = req->bytes;
+    te->op = req->op - DISKREQ_OP_READ;
+    te->status = status;
+    te->latency = latency;
+    te->caller = req->caller;
+}
+
+/**
+ * DiskCall --
+ *
+ * Performs a request synchronously using the driver's polled routines.
+ */
+static int
+DiskCall(Disk *disk, int op, void *buf, SGArray *sga)
+{
+    switch (op) {
+	case DISKREQ_OP_READ:
+	    return disk->read(disk, buf, sga, NULL, NULL);
+	case DISKREQ_OP_WRITE:
+	    return disk->write(disk, buf, sga, NULL, NULL);
+	case DISKREQ_OP_FLUSH:
+	    return disk->flush(disk, buf, sga, NULL, NULL);
+	default:
+	    return -EINVAL;
+    }
+}
+
+/**
+ * DiskCallRequest --
+ *
+ * Performs a request for the disk I/O thread.  The polled routines read 
+ * every entry into one contiguous buffer, but merged and direct requests 
+ * have a buffer per entry, so each entry is passed to the driver 
+ * separately.
+ */
+static int
+DiskCallRequest(DiskRequest *req)
+{
+    SGArray sga;
+    int i, status;
+
+    if (req->sga.len <= 1)
+	return DiskCall(req->disk, req->op, req->buf, &req->sga);
+
+    for (i = 0; i < req->sga.len; i++) {
+	SGArray_Init(&sga);
+	SGArray_Append(&sga, req->sga.entries[i].offset,
+		       req->sga.entries[i].length);
+	status = DiskCall(req->disk, req->op, req->bufs[i], &sga);
+	if (status != 0)
+	    return status;
+    }
+
+    return 0;
+}
+
+/**
+ * Disk_InitRequest --
+ *
+ * Initialize a disk request.
+ *
+ * @param [in] req Request to initialize.
+ * @param [in] disk Disk object
+ * @param [in] op One of DISKREQ_OP_READ, DISKREQ_OP_WRITE or DISKREQ_OP_FLUSH.
+ * @param [in] buf Buffer to read into or write from.
+ * @param [in] sga Disk offsets and lengths or NULL for a flush.
+ * @param [in] cb Completion callback or NULL to use Disk_Wait.
+ * @param [in] arg Callback argument.
+ */
+void
+Disk_InitRequest(DiskRequest *req, Disk *disk, int op, void *buf,
+		 SGArray *sga, DiskCB cb, void *arg)
+{
+    uint8_t *p = (uint8_t *)buf;
+    int i;
+
+    req->caller = (uintptr_t)__builtin_return_address(0);
+    req->disk = disk;
+    req->op = op;
+    req->status = 0;
+    req->flags = 0;
+    req->buf = buf;
+    if (sga != NULL)
+	memcpy(&req->sga, sga, sizeof(*sga));
+    else
+	SGArray_Init(&req->sga);
+    req->bytes = 0;
+    for (i = 0; i < req->sga.len; i++) {
+	req->bufs[i] = p;
+	p += req->sga.entries[i].length;
+	req->bytes += req->sga.entries[i].length;
+    }
+    req->cb = cb;
+    req->arg = arg;
+    TAILQ_INIT(&req->merged);
+}
+
+/**
+ * DiskQueueMerge --
+ *
+ * Appends a request to a waiting request of the same type that ends where 
+ * it begins.  The caller must hold the queue lock.
+ *
+ * @retval true if the request was merged and will complete with the other.
+ */
+static bool
+DiskQueueMerge(Disk *disk, DiskRequest *req)
+{
+    DiskQueue *q = &disk->queue;
+    DiskRequest *r;
+    SGEntry *last;
+    uint64_t start, bytes;
+    int i;
+
+    if (req->op == DISKREQ_OP_FLUSH || req->sga.len == 0 || q->flushes != 0)
+	return false;
+
+    // A request the driver would reject must not fail its neighbour
+    bytes = 0;
+    for (i = 0; i < req->sga.len; i++) {
+	SGEntry *e = &req->sga.entries[i];
+
+	if (e->offset + e->length > disk->diskSize)
+	    return false;
+	bytes += e->length;
+    }
+
+    start = req->sga.entries[0].offset;
+    TAILQ_FOREACH_REVERSE(r, &q->sorted, DiskSortQueue, entries) {
+	if (r->op != req->op || r->sga.len == 0)
+	    continue;
+
+	last = &r->sga.entries[r->sga.len - 1];
+	if (last->offset + last->length == start)
+	    break;
+    }
+    if (r == NULL || r->sga.len + req->sga.len > SGARRAY_MAX_ENTRIES)
+	return false;
+
+    for (i = 0; i < r->sga.len; i++)
+	bytes += r->sga.entries[i].length;
+    if (bytes > DISK_MAXMERGE)
+	return false;
+
+    for (i = 0; i < req->sga.len; i++) {
+	SGEntry *e = &req->sga.entries[i];
+
+	last = &r->sga.entries[r->sga.len - 1];
+	if (last->offset + last->length == e->offset &&
+	    (uint8_t *)r->bufs[r->sga.len - 1] + last->length == req->bufs[i]) {
+	    // The buffers are adjacent as well
+	    last->length += e->length;
+	} else {
+	    r->sga.entries[r->sga.len] = *e;
+	    r->bufs[r->sga.len] = req->bufs[i];
+	    r->sga.len++;
+	}
+    }
+
+    TAILQ_INSERT_TAIL(&r->merged, req, entries);
+    q->merges++;
+
+    return true;
+}
+
+/**
+ * DiskQueueInsert --
+ *
+ * Adds a request to the queue.  The caller must hold the queue lock.
+ */
+static void
+DiskQueueInsert(DiskQueue *q, DiskRequest *req)
+{
+    DiskRequest *r;
+
+    TAILQ_INSERT_TAIL(&q->fifo, req, fifoEntries);
+    q->queued++;
+
+    if (req->op == DISKREQ_OP_FLUSH) {
+	if (q->flushes++ == 0)
+	    q->barrier = req->seq;
+	return;
+    }
+
+    // Requests usually arrive in ascending order so search from the end
+    TAILQ_FOREACH_REVERSE(r, &q->sorted, DiskSortQueue, entries) {
+	if (r->sga.len == 0 || req->sga.len == 0 ||
+	    r->sga.entries[0].offset <= req->sga.entries[0].offset)
+	    break;
+    }
+    if (r == NULL)
+	TAILQ_INSERT_HEAD(&q->sorted, req, entries);
+    else
+	TAILQ_INSERT_AFTER(&q->sorted, r, req, entries);
+}
+
+/**
+ * DiskQueueRemove --
+ *
+ * Removes a request from the queue.  The caller must hold the queue lock.
+ */
+static void
+DiskQueueRemove(DiskQueue *q, DiskRequest *req)
+{
+    DiskRequest *r;
+
+    TAILQ_REMOVE(&q->fifo, req, fifoEntries);
+    q->queued--;
+
+    if (req->op != DISKREQ_OP_FLUSH) {
+	TAILQ_REMOVE(&q->sorted, req, entries);
+	return;
+    }
+
+    q->flushes--;
+    TAILQ_FOREACH(r, &q->fifo, fifoEntries) {
+	if (r->op == DISKREQ_OP_FLUSH) {
+	    q->barrier = r->seq;
+	    break;
+	}
+    }
+}
+
+/**
+ * DiskQueueNext --
+ *
+ * Selects the next request to dispatch.  The oldest request goes first if 
+ * it is a flush or has passed its deadline, otherwise the elevator picks 
+ * the next request above the last dispatched offset and wraps around to the 
+ * lowest.  Requests queued after a flush wait until it is dispatched.  The 
+ * caller must hold the queue lock.
+ *
+ * @return Request or NULL if the queue is empty.
+ */
+static DiskRequest *
+DiskQueueNext(DiskQueue *q, uint64_t now)
+{
+    DiskRequest *req = TAILQ_FIRST(&q->fifo);
+    DiskRequest *r;
+
+    if (req == NULL)
+	return NULL;
+
+    if (req->op == DISKREQ_OP_FLUSH)
+	return req;
+    if (now >= req->deadline) {
+	q->expired++;
+	return req;
+    }
+
+    TAILQ_FOREACH(r, &q->sorted, entries) {
+	if (q->flushes != 0 && r->seq > q->barrier)
+	    continue;
+	if (r->sga.len == 0 || r->sga.entries[0].offset >= q->headPos)
+	    return r;
+    }
+
+    // The oldest request precedes any flush so this finds one
+    TAILQ_FOREACH(r, &q->sorted, entries) {
+	if (q->flushes == 0 || r->seq < q->barrier)
+	    return r;
+    }
+
+    return req;
+}
+
+/**
+ * DiskIssue --
+ *
+ * Passes a dispatched request to the driver, or to the disk I/O thread for 
+ * drivers without a submit routine.
+ */
+static void
+DiskIssue(DiskRequest *req)
+{
+    Disk *disk = req->disk;
+    int status;
+
+    if (disk->submit != NULL) {
+	status = disk->submit(disk, req);
+	if (status != 0)
+	    Disk_Complete(req, status);
+	return;
+    }
+
+    Spinlock_Lock(&diskQueueLock);
+    TAILQ_INSERT_TAIL(&diskQueue, req, entries);
+    Spinlock_Unlock(&diskQueueLock);
+
+    WaitChannel_Wake(&diskQueueWait);
+}
+
+/**
+ * DiskDispatch --
+ *
+ * Dispatches waiting requests until the driver has its maximum number of 
+ * requests outstanding.  Requests are handed to the driver without the 
+ * queue lock held since drivers may complete them immediately.
+ *
+ * @param [in] disk Disk object
+ * @param [in] force Dispatch even if the queue is plugged.
+ */
+static void
+DiskDispatch(Disk *disk, bool force)
+{
+    DiskQueue *q = &disk->queue;
+    struct DiskReqList issue;
+    DiskRequest *req;
+    uint64_t depth, now;
+
+    if (q->queued == 0)
+	return;
+
+    depth = 1;
+    if (disk->submit != NULL && SYSCTL_GETINT(disk_qdepth) > 1)
+	depth = SYSCTL_GETINT(disk_qdepth);
+    now = KTime_GetEpochNS();
+
+    TAILQ_INIT(&issue);
+
+    Spinlock_Lock(&q->lock);
+    while ((q->plugged == 0 || force) && q->inflight < depth) {
+	req = DiskQueueNext(q, now);
+	if (req == NULL)
+	    break;
+
+	DiskQueueRemove(q, req);
+	q->inflight++;
+	q->dispatches++;
+	if (q->inflight > q->maxInflight)
+	    q->maxInflight = q->inflight;
+	if (req->sga.len != 0) {
+	    SGEntry *last = &req->sga.entries[req->sga.len - 1];
+	    q->headPos = last->offset + last->length;
+	}
+
+	TAILQ_INSERT_TAIL(&issue, req, entries);
+    }
+    Spinlock_Unlock(&q->lock);
+
+    while ((req = TAILQ_FIRST(&issue)) != NULL) {
+	TAILQ_REMOVE(&issue, req, entries);
+	DiskIssue(req);
+    }
+}
+
+/**
+ * Disk_Submit --
+ *
+ * Submit a request and return without waiting for it.  Completion is 
+ * reported through the request's callback, which may run in interrupt 
+ * context and must not sleep, or through Disk_Wait if there is no callback.  
+ * Drivers without a submit routine are serviced by the disk I/O thread.
+ *
+ * @param [in] req Initialized request.
+ */
+void
+Disk_Submit(DiskRequest *req)
+{
+    Disk *disk = req->disk;
+    DiskQueue *q = &disk->queue;
+    uint64_t deadline;
+
+    if (req->op == DISKREQ_OP_READ)
+	deadline = SYSCTL_GETINT(disk_rddeadline);
+    else
+	deadline = SYSCTL_GETINT(disk_wrdeadline);
+
+    req->flags |= DISKREQ_FLAG_QUEUED;
+    req->submitTime = KTime_GetEpochNS();
+    req->deadline = req->submitTime + deadline * 1000000ULL;
+
+    Spinlock_Lock(&q->lock);
+    req->seq = q->nextSeq++;
+    if (!DiskQueueMerge(disk, req))
+	DiskQueueInsert(q, req);
+    Spinlock_Unlock(&q->lock);
+
+    // Waiters may hold the plug themselves
+    DiskDispatch(disk, req->cb == NULL);
+}
+
+/**
+ * Disk_Plug --
+ *
+ * Holds back dispatching asynchronous requests so that a burst of them, such 
+ * as read-ahead, can be merged.  Requests that are waited for are still 
+ * dispatched.  Plugs nest.
+ *
+ * @param [in] disk Disk object
+ */
+void
+Disk_Plug(Disk *disk)
+{
+    Spinlock_Lock(&disk->queue.lock);
+    disk->queue.plugged++;
+    Spinlock_Unlock(&disk->queue.lock);
+}
+
+/**
+ * Disk_Unplug --
+ *
+ * Releases a plug and dispatches the requests queued while it was held.
+ *
+ * @param [in] disk Disk object
+ */
+void
+Disk_Unplug(Disk *disk)
+{
+    Spinlock_Lock(&disk->queue.lock);
+    ASSERT(disk->queue.plugged > 0);
+    disk->queue.plugged--;
+    Spinlock_Unlock(&disk->queue.lock);
+
+    DiskDispatch(disk, false);
+}
+
+/**
+ * Disk_Wait --
+ *
+ * Wait for a request submitted without a callback to complete.
+ *
+ * @retval 0 if successful
+ * @return Otherwise the request's error code is returned.
+ */
+int
+Disk_Wait(DiskRequest *req)
+{
+    ASSERT(req->cb == NULL);
+
+    while (1) {
+	WaitChannel_Lock(&diskWait);
+	if (req->flags & DISKREQ_FLAG_DONE) {
+	    Spinlock_Unlock(&diskWait.lock);
+	    break;
+	}
+	WaitChannel_Sleep(&diskWait);
+    }
+
+    return req->status;
+}
+
+/**
+ * Disk_Complete --
+ *
+ * Called by drivers, typically from their interrupt handler, when a request 
+ * finishes.  Requests merged into it complete with the same status.  The 
+ * request is not touched after its callback is called, so the callback may 
+ * free or reuse it.
+ *
+ * @param [in] req Completed request.
+ * @param [in] status 0 if successful, otherwise an error code.
+ */
+void
+Disk_Complete(DiskRequest *req, int status)
+{
+    Disk *disk = req->disk;
+    DiskQueue *q = &disk->queue;
+    struct DiskReqList merged;
+    DiskRequest *r;
+    uint64_t now;
+
+    if ((req->flags & DISKREQ_FLAG_QUEUED) == 0) {
+	DiskFinish(req, status);
+	return;
+    }
+
+    TAILQ_INIT(&merged);
+    TAILQ_CONCAT(&merged, &req->merged, entries);
+    TAILQ_INSERT_HEAD(&merged, req, entries);
+
+    now = KTime_GetEpochNS();
+    Spinlock_Lock(&q->lock);
+    q->inflight--;
+    TAILQ_FOREACH(r, &merged, entries)
+	DiskAccount(r, status, now);
+    Spinlock_Unlock(&q->lock);
+
+    while ((r = TAILQ_FIRST(&merged)) != NULL) {
+	TAILQ_REMOVE(&merged, r, entries);
+	DiskFinish(r, status);
+    }
+
+    DiskDispatch(disk, false);
+}
+
+/**
+ * DiskFinish --
+ *
+ * Reports the completion of a single request to its submitter.
+ */
+static void
+DiskFinish(DiskRequest *req, int status)
+{
+    DiskCB cb = req->cb;
+    void *arg = req->arg;
+    uint64_t flags = req->flags;
+
+    req->status = status;
+
+    if (cb != NULL) {
+	cb(status, arg);
+	if (flags & DISKREQ_FLAG_FREE)
+	    DiskRequest_Free(req);
+	return;
+    }
+
+    __sync_fetch_and_or(&req->flags, DISKREQ_FLAG_DONE);
+    WaitChannel_WakeAll(&diskWait);
+}
+
+/**
+ * DiskWorker --
+ *
+ * Disk I/O thread that services requests for drivers without a submit 
+ * routine.
+ */
+static void
+DiskWorker(void *arg)
+{
+    DiskRequest *req;
+
+    while (1) {
+	WaitChannel_Lock(&diskQueueWait);
+	if (TAILQ_EMPTY(&diskQueue)) {
+	    WaitChannel_Sleep(&diskQueueWait);
+	    continue;
+	}
+	Spinlock_Unlock(&diskQueueWait.lock);
+
+	Spinlock_Lock(&diskQueueLock);
+	req = TAILQ_FIRST(&diskQueue);
+	TAILQ_REMOVE(&diskQueue, req, entries);
+	Spinlock_Unlock(&diskQueueLock);
+
+	Disk_Complete(req, DiskCallRequest(req));
+    }
+}
+
+/**
+ * DiskIO --
+ *
+ * Common implementation of Disk_Read, Disk_Write and Disk_Flush.  Requests 
+ * with a callback are submitted asynchronously.  Synchronous requests are 
+ * submitted and waited on when the driver supports it and the caller can 
+ * sleep, otherwise the driver's polled routines are called directly.  The 
+ * request is allocated from the slab in every case.
+ *
+ * @param [in] caller Return address of the caller for the trace ring.
+ *
+ * @retval 0 if successful or an asynchronous request was submitted.
+ * @return Otherwise an error code is returned and the callback is not called.
+ */
+static int
+DiskIO(Disk *disk, int op, void *buf, SGArray *sga, DiskCB cb, void *arg,
+       uintptr_t caller)
+{
+    DiskRequest *r;
+    int status;
+
+    r = DiskRequest_Alloc();
+    if (r == NULL)
+	return -ENOMEM;
+
+    Disk_InitRequest(r, disk, op, buf, sga, cb, arg);
+    r->caller = caller;
+
+    if (cb != NULL) {
+	r->flags = DISKREQ_FLAG_FREE;
+	Disk_Submit(r);
+	return 0;
+    }
+
+    if (disk->submit == NULL || Critical_Level() != 0) {
+	r->submitTime = KTime_GetEpochNS();
+	status = DiskCall(disk, op, buf, sga);
+
+	Spinlock_Lock(&disk->queue.lock);
+	DiskAccount(r, status, KTime_GetEpochNS());
+	Spinlock_Unlock(&disk->queue.lock);
+    } else {
+	Disk_Submit(r);
+	status = Disk_Wait(r);
+    }
+
+    DiskRequest_Free(r);
+
+    return status;
+}
+
+/**
+ * Disk_Read --
+ *
+ * Read from a disk.  If a callback is given the read is asynchronous and the 
+ * callback is called with the status when it completes.
+ *
+ * @param [in] disk Disk object
+ * @param [in] buf Buffer to read into.
+ * @param [in] sga Disk offsets and lengths to read.
+ * @param [in] cb Completion callback or NULL to wait for the read.
+ * @param [in] arg Callback argument.
+ *
+ * @retval 0 if successful
+ * @return Otherwise an error code is returned.
+ */
 int
 Disk_Read(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
 {
-    return disk->read(disk, buf, sga, cb, arg);
+    return DiskIO(disk, DISKREQ_OP_READ, buf, sga, cb, arg,
+		  (uintptr_t)__builtin_return_address(0));
 }
 
+/**
+ * Disk_Write --
+ *
+ * Write to a disk.  See Disk_Read.
+ */
 int
 Disk_Write(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
 {
-    return disk->write(disk, buf, sga, cb, arg);
+    return DiskIO(disk, DISKREQ_OP_WRITE, buf, sga, cb, arg,
+		  (uintptr_t)__builtin_return_address(0));
 }
 
+/**
+ * Disk_Flush --
+ *
+ * Flush a disk's write cache.  See Disk_Read.
+ */
 int
 Disk_Flush(Disk *disk, void *buf, SGArray *sga, DiskCB cb, void *arg)
 {
-    return disk->flush(disk, buf, sga, cb, arg);
+    return DiskIO(disk, DISKREQ_OP_FLUSH, buf, sga, cb, arg,
+		  (uintptr_t)__builtin_return_address(0));
 }
 
 static void
 Debug_Disks(int argc, const char *argv[])
 {
+    static const char *opNames[DISKSTAT_OP_MAX] = { "read", "write", "flush" };
     Disk *d;
+    int i;
 
     LIST_FOREACH(d, &diskList, entries) {
+	DiskQueue *q = &d->queue;
+
 	kprintf("disk%lld.%lld: %lld Sectors\n",
 		d->ctrlNo, d->diskNo, d->sectorCount);
+	kprintf("    queued %lld, inflight %lld (max %lld), "
+		"dispatches %lld, merges %lld, expired %lld\n",
+		q->queued, q->inflight, q->maxInflight,
+		q->dispatches, q->merges, q->expired);
+	for (i = 0; i < DISKSTAT_OP_MAX; i++) {
+	    DiskOpStats *os = &d->stats->op[i];
+
+	    kprintf("    %-5s %lld ops, %lld bytes, %lld errors, "
+		    "latency avg %lldus, max %lldus\n",
+		    opNames[i], os->ops, os->bytes, os->errors,
+		    os->ops ? os->latencyTotal / os->ops / 1000 : 0,
+		    os->latencyMax / 1000);
+	}
     }
 }
 
@@ -224,6 +224,7 @@ Loader_LoadInit()
     Loader_Load(thr, initvn, pg, 1024);
 
     VFS_Close(initvn);
+    VFS_Release(initvn);
 
     Log(loader, "Jumping to userspace\n");
 
@@ -42,6 +42,8 @@ typedef struct PageInfo
 XMem *pageInfoXMem;
 PageInfo *pageInfoTable;
 uint64_t pageInfoLength;
+uint64_t pageInfoPages;
+static uint64_t contigRover;
 LIST_HEAD(FreeListHead, FreePage) freeList;
 
 /*
@@ -58,6 +60,8 @@ PAlloc_Init()
     LIST_INIT(&freeList);
     pageInfoXMem = NULL;
     pageInfoTable = NULL;
+    pageInfoPages = 0;
+    contigRover = 0;
 }
 
 /**
@@ -127,6 +131,7 @@ PAlloc_AddRegion(uintptr_t start, uintptr_t len)
 	for (i = 0; i < (pageInfoLength / PGSIZE); i++) {
 	    pageInfoTable[i + (base / PGSIZE)].refCount = 1;
 	}
+	pageInfoPages = end / PGSIZE;
     } else {
 	/*
 	 * Only the first call to AddRegion should occur before the XMem region 
@@ -143,10 +148,17 @@ PAlloc_AddRegion(uintptr_t start, uintptr_t len)
 	if (!XMem_Allocate(pageInfoXMem, newLength))
 	    Panic("Cannot allocate XMem region!");
 
+	// Holes between regions are never free
+	for (i = pageInfoPages; i < (base / PGSIZE); i++) {
+	    pageInfoTable[i].refCount = 1;
+	}
+
 	// Initialize new pages
 	for (i = (base / PGSIZE); i < (end / PGSIZE); i++) {
 	    pageInfoTable[i].refCount = 0;
 	}
+	if (pageInfoPages < end / PGSIZE)
+	    pageInfoPages = end / PGSIZE;
     }
 
     Spinlock_Lock(&pallocLock);
@@ -212,6 +224,98 @@ PAlloc_AllocPage()
     return (void *)pg;
 }
 
+/**
+ * PAlloc_AllocContig --
+ *
+ * Allocate a physically contiguous run of pages and return its address in 
+ * the Kernel's ident mapped memory region.  The run is aligned to its size 
+ * rounded up to a power of two.  Runs are found by scanning the PageInfo 
+ * table starting where the last search left off, so this is considerably 
+ * more expensive than PAlloc_AllocPage and should only be used for buffers 
+ * that are allocated infrequently.  Each page is released individually with 
+ * PAlloc_Release.
+ *
+ * @param [in] pages Number of pages.
+ *
+ * @retval NULL if no contiguous run is available.
+ * @return Address of the first page.
+ */
+void *
+PAlloc_AllocContig(uint64_t pages)
+{
+    uint64_t i, start, scanned;
+    uint64_t align = 1;
+    FreePage *pg;
+
+    ASSERT(pages > 0);
+
+    while (align < pages)
+	align <<= 1;
+
+    Spinlock_Lock(&pallocLock);
+    if (freePages < pages || pageInfoPages < align) {
+	Spinlock_Unlock(&pallocLock);
+	return NULL;
+    }
+
+    start = ROUNDUP(contigRover, align);
+    for (scanned = 0; scanned < pageInfoPages; scanned += align) {
+	if (start + pages > pageInfoPages)
+	    start = 0;
+
+	for (i = 0; i < pages; i++) {
+	    if (pageInfoTable[start + i].refCount != 0)
+		break;
+	}
+	if (i == pages)
+	    break;
+
+	start += align;
+    }
+    if (scanned >= pageInfoPages) {
+	Spinlock_Unlock(&pallocLock);
+	return NULL;
+    }
+
+    for (i = 0; i < pages; i++) {
+	pg = (FreePage *)DMPA2VA((start + i) * PGSIZE);
+	ASSERT(pg->magic == FREEPAGE_MAGIC_FREE);
+	LIST_REMOVE(pg, entries);
+	pg->magic = FREEPAGE_MAGIC_INUSE;
+	pageInfoTable[start + i].refCount = 1;
+    }
+    freePages -= pages;
+    contigRover = start + pages;
+    Spinlock_Unlock(&pallocLock);
+
+    pg = (FreePage *)DMPA2VA(start * PGSIZE);
+    memset(pg, 0, pages * PGSIZE);
+
+    return (void *)pg;
+}
+
+/**
+ * PAlloc_FreePages --
+ *
+ * @return Number of free physical pages.
+ */
+uint64_t
+PAlloc_FreePages()
+{
+    return freePages;
+}
+
+/**
+ * PAlloc_TotalPages --
+ *
+ * @return Number of physical pages managed by the page allocator.
+ */
+uint64_t
+PAlloc_TotalPages()
+{
+    return totalPages;
+}
+
 /**
  * PAllocFreePage --
  *
@@ -126,6 +126,11 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
 
     /* XXXFILLMEIN: Load the ELF headers into the page. */
         file = VFS_Lookup(path);
+        if (file == NULL) {
+            PAlloc_Release(pg);
+            PAlloc_Release(arg);
+            return SYSCALL_PACK(ENOENT, 0);
+        }
         VFS_Open(file);
         VFS_Read(file, pg, 0, 1024);
     //end of first fill me in
@@ -134,6 +139,7 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
 
     if (!Loader_CheckHeader(pg)) {
 	VFS_Close(file);
+	VFS_Release(file);
 	PAlloc_Release(pg);
 	PAlloc_Release(arg);
 	return SYSCALL_PACK(EINVAL, 0);
@@ -153,6 +159,8 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
     Handle_Add(proc, handle);
 
     Loader_Load(thr, file, pg, 1024);
+    VFS_Close(file);
+    VFS_Release(file);
 
     /* Initialize the trap frame for entering into the process. */
     Thread_SetupUThread(thr, proc->entrypoint, MEM_USERSPACE_STKTOP - PGSIZE);
@@ -710,6 +718,25 @@ Syscall_FSInfo(uint64_t user_fsinfo, uint64_t max)
     return SYSCALL_PACK(ENOSYS, 0);
 }
 
+uint64_t
+Syscall_DiskStat(uint64_t ctrlNo, uint64_t diskNo, uint64_t user_stat)
+{
+    int status;
+    Disk *disk;
+
+    disk = Disk_GetByID(ctrlNo, diskNo);
+    if (disk == NULL) {
+	return ENOENT;
+    }
+
+    status = Copy_Out(Disk_GetStats(disk), user_stat, sizeof(DiskStats));
+    if (status != 0) {
+	return status;
+    }
+
+    return 0;
+}
+
 uint64_t
 Syscall_Entry(uint64_t syscall, uint64_t a1, uint64_t a2,
 	      uint64_t a3, uint64_t a4, uint64_t a5)
@@ -774,6 +801,8 @@ Syscall_Entry(uint64_t syscall, uint64_t a1, uint64_t a2,
 	    return Syscall_FSUnmount(a1);
 	case SYSCALL_FSINFO:
 	    return Syscall_FSInfo(a1, a2);
+	case SYSCALL_DISKSTAT:
+	    return Syscall_DiskStat(a1, a2, a3);
 	default:
 	    return SYSCALL_PACK(ENOSYS, 0);
     }
@@ -107,6 +107,83 @@ SysCtl_SetObject(const char *node, void *obj)
     return 0;
 }
 
+/**
+ * SysCtl_SetString --
+ *
+ * Sets a read-write sysctl from its string representation.
+ *
+ * @retval 0 if successful
+ * @return ENOENT, EACCES or EINVAL
+ */
+uint64_t
+SysCtl_SetString(const char *node, const char *value)
+{
+    int i = SysCtl_Lookup(node);
+    if (i == -1) {
+	return ENOENT;
+    }
+
+    if (SYSCTLTable[i].flags == SYSCTL_FLAG_RO) {
+	return EACCES;
+    }
+
+    switch (SYSCTLTable[i].type) {
+	case SYSCTL_TYPE_STR: {
+	    SysCtlString *val = (SysCtlString *)SYSCTLTable[i].node;
+	    strncpy(&val->value[0], value, SYSCTL_STR_MAXLENGTH - 1);
+	    val->value[SYSCTL_STR_MAXLENGTH - 1] = '\0';
+	    break;
+	}
+	case SYSCTL_TYPE_INT: {
+	    SysCtlInt *val = (SysCtlInt *)SYSCTLTable[i].node;
+	    val->value = Debug_StrToInt(value);
+	    break;
+	}
+	case SYSCTL_TYPE_BOOL: {
+	    SysCtlBool *val = (SysCtlBool *)SYSCTLTable[i].node;
+	    if (strcmp(value, "0") == 0) {
+		val->value = false;
+	    } else if (strcmp(value, "1") == 0) {
+		val->value = true;
+	    } else {
+		return EINVAL;
+	    }
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+/**
+ * SysCtl_BootOptions --
+ *
+ * Parses the kernel command line passed by the boot loader.  Every 
+ * NODE=VALUE option sets the corresponding sysctl, e.g. 
+ * kern_rootdisk=disk1.0 to boot from the first AHCI disk.
+ */
+void
+SysCtl_BootOptions(const char *cmdline)
+{
+    char buf[256];
+    char *opt, *value, *last;
+
+    strncpy(buf, cmdline, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (opt = strtok_r(buf, " \t", &last);
+	 opt != NULL;
+	 opt = strtok_r(NULL, " \t", &last)) {
+	value = strchr(opt, '=');
+	if (value == NULL)
+	    continue;
+	*value++ = '\0';
+
+	if (SysCtl_SetString(opt, value) != 0)
+	    kprintf("Ignoring boot option %s\n", opt);
+    }
+}
+
 void
 Debug_SysCtl(int argc, const char *argv[])
 {
@@ -155,33 +232,13 @@ Debug_SysCtl(int argc, const char *argv[])
     }
 
     if (argc == 3) {
-	if (SYSCTLTable[i].flags == SYSCTL_FLAG_RO) {
-	    kprintf("Sysctl node is read-only!\n");
-	    return;
-	}
-
-	switch (SYSCTLTable[i].type) {
-	    case SYSCTL_TYPE_STR: {
-		SysCtlString *val = (SysCtlString *)SYSCTLTable[i].node;
-		strncpy(&val->value[0], argv[2], SYSCTL_STR_MAXLENGTH);
+	switch (SysCtl_SetString(argv[1], argv[2])) {
+	    case EACCES:
+		kprintf("Sysctl node is read-only!\n");
 		break;
-	    }
-	    case SYSCTL_TYPE_INT: {
-		SysCtlInt *val = (SysCtlInt *)SYSCTLTable[i].node;
-		val->value = Debug_StrToInt(argv[2]);
+	    case EINVAL:
+		kprintf("Invalid value!\n");
 		break;
-	    }
-	    case SYSCTL_TYPE_BOOL: {
-		SysCtlBool *val = (SysCtlBool *)SYSCTLTable[i].node;
-		if (strcmp(argv[2], "0") == 0) {
-		    val->value = false;
-		} else if (strcmp(argv[2], "1") == 0) {
-		    val->value = true;
-		} else {
-		    kprintf("Invalid value!\n");
-		}
-		break;
-	    }
 	}
     }
 }
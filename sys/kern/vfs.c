@@ -11,6 +11,7 @@
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
 #include <sys/spinlock.h>
+#include <sys/sysctl.h>
 #include <sys/disk.h>
 #include <sys/vfs.h>
 #include <sys/handle.h>
@@ -27,6 +28,29 @@ static Slab vnodeSlab;
 DEFINE_SLAB(VFS, &vfsSlab);
 DEFINE_SLAB(VNode, &vnodeSlab);
 
+/*
+ * VNode Cache
+ *
+ * File systems look for an existing VNode with VFS_FindVNode before creating
+ * one and register new VNodes with VFS_AddVNode, keyed on an object id within
+ * the VFS (the BNode offset for O2FS), so that every open of a file shares a
+ * single VNode.  When the last reference is released the VNode stays in the
+ * table on an LRU list, keeping its metadata resident for the next lookup,
+ * until more than vfs_vnodecache VNodes are unreferenced and the file system
+ * reclaims the least recently used one.
+ *
+ * The name cache takes references to VNodes without holding vnodeLock, so a
+ * VNode is only given its first reference by VFS_AddVNode, under the lock and
+ * after its identity is set.  A VNode that is being created or reclaimed has
+ * no references and cannot be retained.
+ */
+#define VNODE_HASHSIZE		256
+
+static Spinlock vnodeLock;
+static TAILQ_HEAD(VNodeHashTable, VNode) vnodeHash[VNODE_HASHSIZE];
+static TAILQ_HEAD(VNodeLRU, VNode) vnodeLRU;
+static uint64_t vnodeLRUCount;
+
 /**
  * VFS_MountRoot --
  *
@@ -42,6 +66,14 @@ VFS_MountRoot(Disk *rootDisk)
     Slab_Init(&vfsSlab, "VFS Slab", sizeof(VFS), 16);
     Slab_Init(&vnodeSlab, "VNode Slab", sizeof(VNode), 16);
 
+    Spinlock_Init(&vnodeLock, "VNode Cache Lock", SPINLOCK_TYPE_NORMAL);
+    for (int i = 0; i < VNODE_HASHSIZE; i++)
+	TAILQ_INIT(&vnodeHash[i]);
+    TAILQ_INIT(&vnodeLRU);
+    vnodeLRUCount = 0;
+
+    DCache_Init();
+
     rootFS = O2FS_Mount(rootDisk);
     if (!rootFS)
 	return -1;
@@ -53,11 +85,202 @@ VFS_MountRoot(Disk *rootDisk)
     return 0;
 }
 
+static inline uint64_t
+VNodeHash(VFS *fs, uint64_t key)
+{
+    return (((uintptr_t)fs ^ key) * 0x9E3779B97F4A7C15ULL) >> 56;
+}
+
+/**
+ * VNodeRetainLocked --
+ *
+ * Take a reference to a VNode in the table, removing it from the LRU if it
+ * was unreferenced.
+ */
+static void
+VNodeRetainLocked(VNode *vn)
+{
+    ASSERT(Spinlock_IsHeld(&vnodeLock));
+
+    if (vn->onLRU) {
+	TAILQ_REMOVE(&vnodeLRU, vn, lruEntry);
+	vn->onLRU = false;
+	vnodeLRUCount--;
+    }
+    __sync_fetch_and_add(&vn->refCount, 1);
+}
+
+/**
+ * VFS_FindVNode --
+ *
+ * Lookup a VNode in the VNode cache.
+ *
+ * @param [in] fs VFS Instance.
+ * @param [in] key Object id within the VFS.
+ *
+ * @return VNode with a reference held for the caller or NULL if not cached.
+ */
+VNode *
+VFS_FindVNode(VFS *fs, uint64_t key)
+{
+    VNode *vn;
+
+    Spinlock_Lock(&vnodeLock);
+    TAILQ_FOREACH(vn, &vnodeHash[VNodeHash(fs, key)], hashEntry) {
+	if (vn->vfs == fs && vn->key == key) {
+	    VNodeRetainLocked(vn);
+	    break;
+	}
+    }
+    Spinlock_Unlock(&vnodeLock);
+
+    return vn;
+}
+
+/**
+ * VFS_AddVNode --
+ *
+ * Add a newly created VNode to the VNode cache.  The vfs, key and id fields 
+ * must be set and the reference count must be zero.  The VNode is published 
+ * with one reference for the caller.  If another thread added a VNode for 
+ * the same object first, that VNode is retained and returned instead and the 
+ * caller must reclaim its own, which nobody else can have retained.
+ *
+ * @param [in] vn VNode to add.
+ *
+ * @return The VNode to use.
+ */
+VNode *
+VFS_AddVNode(VNode *vn)
+{
+    uint64_t bucket = VNodeHash(vn->vfs, vn->key);
+    VNode *other;
+
+    ASSERT(vn->refCount == 0);
+
+    vn->onLRU = false;
+
+    Spinlock_Lock(&vnodeLock);
+    TAILQ_FOREACH(other, &vnodeHash[bucket], hashEntry) {
+	if (other->vfs == vn->vfs && other->key == vn->key) {
+	    VNodeRetainLocked(other);
+	    Spinlock_Unlock(&vnodeLock);
+	    return other;
+	}
+    }
+    // The identity must be visible before VFS_TryRetain can succeed
+    __sync_synchronize();
+    vn->refCount = 1;
+    TAILQ_INSERT_HEAD(&vnodeHash[bucket], vn, hashEntry);
+    Spinlock_Unlock(&vnodeLock);
+
+    return vn;
+}
+
+/**
+ * VFS_Retain --
+ *
+ * Take another reference to a VNode the caller already holds a reference to.
+ */
+void
+VFS_Retain(VNode *vn)
+{
+    ASSERT(vn->refCount != 0);
+    __sync_fetch_and_add(&vn->refCount, 1);
+}
+
+/**
+ * VFS_TryRetain --
+ *
+ * Take a reference to a VNode that may have been released concurrently, as 
+ * the lockless name cache lookup does.  VNodes come from a slab so the memory 
+ * is always a VNode even after it is reclaimed, but it may have been reused 
+ * for another object.  Once the reference is taken the VNode cannot be 
+ * reclaimed, so its identity is checked then.
+ *
+ * @param [in] vn VNode that was recorded for the object.
+ * @param [in] fs VFS Instance of the object.
+ * @param [in] key Object id within the VFS.
+ *
+ * @return True if a reference was taken, false if the VNode is unreferenced 
+ * or now belongs to another object.
+ */
+bool
+VFS_TryRetain(VNode *vn, VFS *fs, uint64_t key)
+{
+    uint64_t ref;
+
+    do {
+	ref = vn->refCount;
+	if (ref == 0)
+	    return false;
+    } while (!__sync_bool_compare_and_swap(&vn->refCount, ref, ref + 1));
+
+    // The compare and swap orders these loads after the reference was taken
+    if (vn->vfs == fs && vn->key == key)
+	return true;
+
+    VFS_Release(vn);
+    return false;
+}
+
+/**
+ * VFS_Release --
+ *
+ * Drop a reference to a VNode.  Unreferenced VNodes are kept on the LRU and 
+ * the least recently used are reclaimed once there are more than 
+ * vfs_vnodecache of them.  The last reference is dropped under vnodeLock so 
+ * that the VNode cannot be found, released and reclaimed by another thread 
+ * before it is put on the LRU.
+ */
+void
+VFS_Release(VNode *vn)
+{
+    VNode *victim;
+    uint64_t ref;
+
+    ASSERT(vn->refCount != 0);
+
+    do {
+	ref = vn->refCount;
+	if (ref == 1)
+	    break;
+    } while (!__sync_bool_compare_and_swap(&vn->refCount, ref, ref - 1));
+    if (ref != 1)
+	return;
+
+    Spinlock_Lock(&vnodeLock);
+    // VFS_TryRetain may have taken a reference since
+    if (__sync_fetch_and_sub(&vn->refCount, 1) == 1) {
+	ASSERT(!vn->onLRU);
+	TAILQ_INSERT_TAIL(&vnodeLRU, vn, lruEntry);
+	vn->onLRU = true;
+	vnodeLRUCount++;
+    }
+
+    while (vnodeLRUCount > (uint64_t)SYSCTL_GETINT(vfs_vnodecache)) {
+	victim = TAILQ_FIRST(&vnodeLRU);
+	TAILQ_REMOVE(&vnodeLRU, victim, lruEntry);
+	TAILQ_REMOVE(&vnodeHash[VNodeHash(victim->vfs, victim->key)],
+		     victim, hashEntry);
+	victim->onLRU = false;
+	vnodeLRUCount--;
+
+	Spinlock_Unlock(&vnodeLock);
+	victim->op->reclaim(victim);
+	Spinlock_Lock(&vnodeLock);
+    }
+    Spinlock_Unlock(&vnodeLock);
+}
+
 /**
  * VFS_Lookup --
  *
  * Lookup a VNode by a path.  This function recursively searches the directory 
- * heirarchy until the given path is found otherwise returns NULL if not found.
+ * heirarchy until the given path is found otherwise returns NULL if not found.  
+ * Each component is first looked up in the name cache, and the file system's 
+ * answer, including that a name does not exist, is added to the cache.  The 
+ * caller must release the VNode with VFS_Release.
  */
 VNode *
 VFS_Lookup(const char *path)
@@ -86,8 +309,8 @@ VFS_Lookup(const char *path)
 	    // Handle root and trailing slash
 	    return curNode;
 	}
-	if (len > 256) {
-	    // Release
+	if (len >= sizeof(curName)) {
+	    VFS_Release(curNode);
 	    return NULL;
 	}
 
@@ -96,13 +319,23 @@ VFS_Lookup(const char *path)
 
 	oldNode = curNode;
 	curNode = NULL;
-	status = oldNode->op->lookup(oldNode, &curNode, curName);
-	if (status < 0) {
-	    // Release
+	status = DCache_Lookup(oldNode, curName, &curNode);
+	if (status == DCACHE_NEGATIVE) {
+	    VFS_Release(oldNode);
 	    return NULL;
 	}
+	if (status == DCACHE_MISS) {
+	    status = oldNode->op->lookup(oldNode, &curNode, curName);
+	    if (status < 0 || curNode == NULL) {
+		if (status == -ENOENT)
+		    DCache_Enter(oldNode, curName, NULL);
+		VFS_Release(oldNode);
+		return NULL;
+	    }
+	    DCache_Enter(oldNode, curName, curNode);
+	}
 
-	// Release oldNode
+	VFS_Release(oldNode);
 
 	if (*end == '\0') {
 	    Log(vfs, "%s %lx\n", path, curNode);
@@ -129,7 +362,7 @@ VFS_Stat(const char *path, struct stat *sb)
 
     vn->op->stat(vn, sb);
 
-    // Release
+    VFS_Release(vn);
 
     return 0;
 }
@@ -182,6 +415,24 @@ VFS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
     return fn->op->read(fn, buf, off, len);
 }
 
+/**
+ * VFS_ReadUser --
+ *
+ * Read from a vnode directly into user memory.
+ *
+ * @param [in] fn VNode to read from.
+ * @param [in] buf User address to write the data to.
+ * @param [in] off File offset in bytes.
+ * @param [in] len Length to read in bytes.
+ *
+ * @return Return status
+ */
+int
+VFS_ReadUser(VNode *fn, uintptr_t buf, uint64_t off, uint64_t len)
+{
+    return fn->op->readuser(fn, buf, off, len);
+}
+
 /**
  * VFS_Write --
  *
@@ -197,7 +448,27 @@ VFS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
 int
 VFS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
 {
-    return fn->op->write(fn, buf, off, len);
+    int status = fn->op->write(fn, buf, off, len);
+
+    // Writing a directory may change any of its names
+    DCache_Invalidate(fn, NULL);
+
+    return status;
+}
+
+/**
+ * VFS_Flush --
+ *
+ * Write back any cached modifications to a vnode to stable storage.
+ *
+ * @param [in] fn VNode to flush.
+ *
+ * @return Return status
+ */
+int
+VFS_Flush(VNode *fn)
+{
+    return fn->op->flush(fn);
 }
 
 /**
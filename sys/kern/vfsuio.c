@@ -17,9 +17,7 @@ VFSUIO_Read(Handle *handle, void *buf, uint64_t len, uint64_t off)
 {
     ASSERT(handle->type == HANDLE_TYPE_FILE);
 
-    // XXX: Need to pin memory
-
-    return VFS_Read(handle->vnode, buf, len, off);
+    return VFS_ReadUser(handle->vnode, (uintptr_t)buf, len, off);
 }
 
 static int
@@ -36,7 +34,8 @@ static int
 VFSUIO_Flush(Handle *handle)
 {
     ASSERT(handle->type == HANDLE_TYPE_FILE);
-    return -EINVAL;
+
+    return VFS_Flush(handle->vnode);
 }
 
 static int
@@ -47,6 +46,7 @@ VFSUIO_Close(Handle *handle)
     ASSERT(handle->type == HANDLE_TYPE_FILE);
 
     status = VFS_Close(handle->vnode);
+    VFS_Release(handle->vnode);
     Handle_Free(handle);
 
     return status;
@@ -70,7 +70,7 @@ VFSUIO_Open(const char *path, Handle **handle)
 
     status = VFS_Open(vn);
     if (status != 0) {
-	// XXX: Release VNode
+	VFS_Release(vn);
 	Handle_Free(hdl);
 	return status;
     }
@@ -21,6 +21,12 @@ main(int argc, const char *argv[])
 	}
     }
 
+    int status = OSFlush(fd);
+    if (status < 0) {
+	printf("Flush Error: %x\n", -status);
+	return 1;
+    }
+
     printf("Success!\n");
 
     return 0;
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Castor Only
+#include <syscall.h>
+#include <sys/sysctl.h>
+
+#define BLKSIZE (16384)
+#define BLKS (33)
+
+#define DIRECTSIZE (1024 * 1024)
+
+#define DATAFILE ("/tests/o2fsdata")
+#define DIRECTFILE ("/boot/kernel")
+#define CORRUPTFILE ("/tests/o2fscorrupt")
+#define SOURCEFILE ("/tests/o2fstest")
+
+char inbuf[BLKSIZE];
+char outbuf[BLKSIZE];
+
+// User reads DMA into the pages of this buffer
+char directbuf[DIRECTSIZE] __attribute__((aligned(4096)));
+
+// Offset of the blocks SyncTest appended
+uint64_t dataBase;
+
+int64_t
+GetCounter(const char *node)
+{
+    SysCtlInt scInt;
+
+    if (OSSysCtl(node, &scInt, NULL) != 0) {
+	printf("OSSysCtl: cannot read %s\n", node);
+	OSExit(1);
+    }
+
+    return scInt.value;
+}
+
+void
+SetCounter(const char *node, int64_t value)
+{
+    SysCtlInt scInt;
+
+    scInt.value = value;
+    if (OSSysCtl(node, NULL, &scInt) != 0) {
+	printf("OSSysCtl: cannot set %s\n", node);
+	OSExit(1);
+    }
+}
+
+void
+FillBlock(int i)
+{
+    for (int j = 0; j < BLKSIZE; j++)
+	inbuf[j] = (char)(i * 31 + j);
+}
+
+/*
+ * Append blocks to a file, sync them and read them back.  Growing the file 
+ * changes its BNode, extents and the bitmap, so the sync must commit at 
+ * least one journal transaction.  The file grows on every run.
+ */
+void
+SyncTest()
+{
+    struct stat sb;
+    int64_t commits;
+    int64_t errors;
+    uint64_t fd;
+    int status;
+
+    printf("Sync Test\n");
+
+    status = OSStat(DATAFILE, &sb);
+    if (status < 0) {
+	printf("OSStat: error %x for file %s\n", -status, DATAFILE);
+	OSExit(1);
+    }
+    dataBase = sb.st_size;
+
+    fd = OSOpen(DATAFILE, 0);
+    if ((int64_t)fd < 0) {
+	printf("OSOpen: error for file %s\n", DATAFILE);
+	OSExit(1);
+    }
+
+    commits = GetCounter("o2fs_commits");
+    errors = GetCounter("o2fs_checksumerrors");
+
+    for (int i = 0; i < BLKS; i++) {
+	FillBlock(i);
+	status = OSWrite(fd, inbuf, dataBase + i * BLKSIZE, BLKSIZE);
+	if (status != BLKSIZE) {
+	    printf("OSWrite: error %x at block %d\n", -status, i);
+	    OSExit(1);
+	}
+    }
+
+    status = OSFlush(fd);
+    if (status < 0) {
+	printf("OSFlush: error %x\n", -status);
+	OSExit(1);
+    }
+
+    if (GetCounter("o2fs_commits") == commits) {
+	printf("OSFlush: no journal transaction was committed\n");
+	OSExit(1);
+    }
+
+    for (int i = 0; i < BLKS; i++) {
+	FillBlock(i);
+	status = OSRead(fd, outbuf, dataBase + i * BLKSIZE, BLKSIZE);
+	if (status != BLKSIZE) {
+	    printf("OSRead: error %x at block %d\n", -status, i);
+	    OSExit(1);
+	}
+	if (memcmp(inbuf, outbuf, BLKSIZE) != 0) {
+	    printf("Read the wrong data back at block %d\n", i);
+	    OSExit(1);
+	}
+    }
+
+    if (GetCounter("o2fs_checksumerrors") != errors) {
+	printf("OSRead: checksum errors on %s\n", DATAFILE);
+	OSExit(1);
+    }
+
+    OSClose(fd);
+}
+
+/*
+ * newfs_o2fs flips a byte in the first block of o2fscorrupt, a copy of this 
+ * program, after checksumming it.  Reading it must fail with EIO, unless the 
+ * boot disk was built without checksums and the copy is left intact.
+ */
+void
+CorruptTest()
+{
+    int64_t errors;
+    uint64_t fd, srcfd;
+    int status;
+
+    printf("Corrupt Test\n");
+
+    fd = OSOpen(CORRUPTFILE, 0);
+    srcfd = OSOpen(SOURCEFILE, 0);
+    if ((int64_t)fd < 0 || (int64_t)srcfd < 0) {
+	printf("OSOpen: error for file %s or %s\n", CORRUPTFILE, SOURCEFILE);
+	OSExit(1);
+    }
+
+    errors = GetCounter("o2fs_checksumerrors");
+
+    for (uint64_t off = 0; ; off += BLKSIZE) {
+	status = OSRead(fd, outbuf, off, BLKSIZE);
+	if (status == -EIO) {
+	    if (GetCounter("o2fs_checksumerrors") == errors) {
+		printf("OSRead: EIO without a checksum error\n");
+		OSExit(1);
+	    }
+	    break;
+	}
+	if (status < 0) {
+	    printf("OSRead: error %x at offset %lu\n", -status,
+		   (unsigned long)off);
+	    OSExit(1);
+	}
+	if (status == 0) {
+	    printf("Checksums are disabled, skipped\n");
+	    break;
+	}
+	if (OSRead(srcfd, inbuf, off, BLKSIZE) != status ||
+	    memcmp(inbuf, outbuf, status) != 0) {
+	    printf("OSRead: corrupted data returned at offset %lu\n",
+		   (unsigned long)off);
+	    OSExit(1);
+	}
+    }
+
+    OSClose(srcfd);
+    OSClose(fd);
+}
+
+/*
+ * Read the kernel image with one large read, which DMAs straight into the 
+ * pages of directbuf, and compare it with block sized reads through the 
+ * buffer cache.  The loader reads the kernel without the buffer cache, so 
+ * none of its blocks are cached yet.
+ */
+void
+DirectTest()
+{
+    struct stat sb;
+    int64_t directio;
+    uint64_t fd, len;
+    int status;
+
+    printf("Direct Test\n");
+
+    status = OSStat(DIRECTFILE, &sb);
+    if (status < 0) {
+	printf("OSStat: error %x for file %s\n", -status, DIRECTFILE);
+	OSExit(1);
+    }
+
+    len = sb.st_size < DIRECTSIZE ? sb.st_size : DIRECTSIZE;
+    len -= len % BLKSIZE;
+    if (len < 2 * BLKSIZE) {
+	printf("%s is too small, skipped\n", DIRECTFILE);
+	return;
+    }
+
+    fd = OSOpen(DIRECTFILE, 0);
+    if ((int64_t)fd < 0) {
+	printf("OSOpen: error for file %s\n", DIRECTFILE);
+	OSExit(1);
+    }
+
+    directio = GetCounter("o2fs_directio");
+    SetCounter("o2fs_directio", 2 * BLKSIZE / 1024);
+    status = OSRead(fd, directbuf, 0, len);
+    SetCounter("o2fs_directio", directio);
+    if (status != len) {
+	printf("OSRead: error %x for a direct read\n", -status);
+	OSExit(1);
+    }
+
+    for (uint64_t off = 0; off < len; off += BLKSIZE) {
+	status = OSRead(fd, outbuf, off, BLKSIZE);
+	if (status != BLKSIZE) {
+	    printf("OSRead: error %x at offset %lu\n", -status,
+		   (unsigned long)off);
+	    OSExit(1);
+	}
+	if (memcmp(directbuf + off, outbuf, BLKSIZE) != 0) {
+	    printf("Direct read returned the wrong data at offset %lu\n",
+		   (unsigned long)off);
+	    OSExit(1);
+	}
+    }
+
+    OSClose(fd);
+}
+
+int
+main(int argc, const char *argv[])
+{
+    printf("O2FS Test\n");
+
+    SyncTest();
+    DirectTest();
+    CorruptTest();
+
+    printf("Success!\n");
+
+    return 0;
+}
+